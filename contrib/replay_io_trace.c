@@ -0,0 +1,312 @@
+/*
+ * replay_io_trace.c --- replay an I/O trace written by the test I/O manager
+ *
+ * A trace is recorded by running a program which uses the test I/O
+ * manager with TEST_IO_TRACE set to the prefix of the trace files; each
+ * I/O channel, e.g. the filesystem and an external journal, is traced
+ * to its own file, "<prefix>.<pid>.<n>".  This program reissues the
+ * recorded reads, writes and flushes against a sparse file or a scratch
+ * device, with up to queue_depth requests in flight, and reports the
+ * latency and throughput it observed.  Since the trace does not
+ * contain any data, writes are filled with a fixed pattern; never
+ * replay a trace against a device whose contents matter.
+ *
+ * Build it from the top of a configured build tree with:
+ *
+ *	cc -O2 -I lib -I $(top_srcdir)/lib -o replay_io_trace \
+ *		$(top_srcdir)/contrib/replay_io_trace.c -lpthread
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "ext2fs/ext2_types.h"
+#include "ext2fs/io_trace.h"
+
+#define MAX_QUEUE_DEPTH	256
+
+static struct io_trace_record *records;
+static unsigned long num_records;
+static unsigned long *latency;		/* Replayed latency of each record */
+static unsigned long max_length;
+static int fd;
+static int read_only;
+
+/* State shared by the workers, protected by lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static unsigned long next_record;
+static int in_flight;
+static int barrier;
+static int io_errors;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c] [-r] [-q queue_depth] "
+		"trace_file target\n", prog);
+	exit(1);
+}
+
+static unsigned long long get_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return ((unsigned long long) tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+static void read_trace(const char *name)
+{
+	struct io_trace_header	hdr;
+	struct stat		st;
+	FILE			*f;
+	unsigned long		i;
+
+	f = fopen(name, "r");
+	if (!f) {
+		perror(name);
+		exit(1);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, IO_TRACE_MAGIC, IO_TRACE_MAGIC_LEN) ||
+	    hdr.version != IO_TRACE_VERSION ||
+	    hdr.record_size != sizeof(struct io_trace_record)) {
+		fprintf(stderr, "%s: not a supported I/O trace\n", name);
+		exit(1);
+	}
+	if (fstat(fileno(f), &st) < 0) {
+		perror(name);
+		exit(1);
+	}
+	num_records = (st.st_size - sizeof(hdr)) / hdr.record_size;
+	records = malloc((num_records + 1) * sizeof(*records));
+	latency = calloc(num_records + 1, sizeof(*latency));
+	if (!records || !latency) {
+		fprintf(stderr, "Couldn't allocate memory for %lu records\n",
+			num_records);
+		exit(1);
+	}
+	num_records = fread(records, sizeof(*records), num_records, f);
+	fclose(f);
+
+	for (i = 0; i < num_records; i++)
+		if (records[i].length > max_length)
+			max_length = records[i].length;
+}
+
+static void do_io(struct io_trace_record *rec, char *buf)
+{
+	ssize_t	actual = 0;
+
+	switch (rec->op) {
+	case IO_TRACE_OP_READ:
+		actual = pread(fd, buf, rec->length, rec->offset);
+		break;
+	case IO_TRACE_OP_WRITE:
+		if (read_only)
+			return;
+		actual = pwrite(fd, buf, rec->length, rec->offset);
+		break;
+	case IO_TRACE_OP_FLUSH:
+		if (!read_only && fsync(fd) < 0)
+			actual = -1;
+		break;
+	}
+	if (actual < 0) {
+		pthread_mutex_lock(&lock);
+		io_errors++;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/*
+ * Each worker keeps one request in flight.  A flush waits for all of
+ * the requests issued before it and holds back those issued after it,
+ * as a flush through the I/O manager would.
+ */
+static void *worker(void *arg)
+{
+	struct io_trace_record	*rec;
+	unsigned long		idx;
+	unsigned long long	start;
+	char			*buf;
+
+	buf = malloc(max_length ? max_length : 1);
+	if (!buf) {
+		fprintf(stderr, "Couldn't allocate I/O buffer\n");
+		exit(1);
+	}
+	memset(buf, 0xA5, max_length);
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (barrier)
+			pthread_cond_wait(&cond, &lock);
+		if (next_record >= num_records)
+			break;
+		idx = next_record++;
+		rec = &records[idx];
+		if (rec->op == IO_TRACE_OP_FLUSH) {
+			barrier = 1;
+			while (in_flight)
+				pthread_cond_wait(&cond, &lock);
+		} else
+			in_flight++;
+		pthread_mutex_unlock(&lock);
+
+		start = get_time();
+		do_io(rec, buf);
+		latency[idx] = get_time() - start;
+
+		pthread_mutex_lock(&lock);
+		if (rec->op == IO_TRACE_OP_FLUSH)
+			barrier = 0;
+		else
+			in_flight--;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+	free(buf);
+	return NULL;
+}
+
+static int ulong_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a;
+	unsigned long y = *(const unsigned long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(const char *desc, int op, unsigned long long elapsed,
+		   int recorded)
+{
+	unsigned long	*lat, n = 0, i;
+	unsigned long long bytes = 0, total = 0;
+	double		secs = elapsed / 1000000.0;
+
+	lat = malloc((num_records + 1) * sizeof(*lat));
+	if (!lat)
+		return;
+	for (i = 0; i < num_records; i++) {
+		if (records[i].op != op)
+			continue;
+		lat[n] = recorded ? records[i].latency : latency[i];
+		total += lat[n++];
+		bytes += records[i].length;
+	}
+	if (n == 0) {
+		free(lat);
+		return;
+	}
+	qsort(lat, n, sizeof(*lat), ulong_cmp);
+	printf("%-7s %9lu ops %12llu bytes", desc, n, bytes);
+	if (secs > 0)
+		printf(" %9.2f MB/s %9.0f IOPS",
+		       bytes / secs / (1024 * 1024), n / secs);
+	printf("\n        latency usec: avg %llu min %lu p50 %lu p99 %lu "
+	       "max %lu\n", total / n, lat[0], lat[n / 2],
+	       lat[(n * 99) / 100], lat[n - 1]);
+	free(lat);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t		threads[MAX_QUEUE_DEPTH];
+	unsigned long long	start, elapsed, recorded, size = 0;
+	unsigned long		i;
+	int			c, queue_depth = 1, create = 0;
+	int			flags;
+	struct stat		st;
+
+	while ((c = getopt(argc, argv, "cq:r")) != EOF) {
+		switch (c) {
+		case 'c':
+			create++;
+			break;
+		case 'q':
+			queue_depth = strtoul(optarg, NULL, 0);
+			if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH) {
+				fprintf(stderr, "Invalid queue depth: %s\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'r':
+			read_only++;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2)
+		usage(argv[0]);
+
+	read_trace(argv[optind]);
+
+	flags = (read_only && !create) ? O_RDONLY : O_RDWR;
+	if (create)
+		flags |= O_CREAT;
+	fd = open(argv[optind + 1], flags, 0600);
+	if (fd < 0) {
+		perror(argv[optind + 1]);
+		exit(1);
+	}
+	/* Make sure reads past the end of a new sparse file see zeros */
+	if (create) {
+		for (i = 0; i < num_records; i++)
+			if (records[i].offset + records[i].length > size)
+				size = records[i].offset + records[i].length;
+		if (fstat(fd, &st) == 0 && st.st_size < (off_t) size &&
+		    ftruncate(fd, size) < 0) {
+			perror("ftruncate");
+			exit(1);
+		}
+	}
+
+	start = get_time();
+	for (i = 0; i < (unsigned long) queue_depth; i++)
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			fprintf(stderr, "Couldn't create worker thread\n");
+			exit(1);
+		}
+	for (i = 0; i < (unsigned long) queue_depth; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = get_time() - start;
+	close(fd);
+
+	recorded = num_records ? records[num_records - 1].time +
+		records[num_records - 1].latency : 0;
+	printf("Replayed %lu requests in %.3f seconds, queue depth %d "
+	       "(recorded run took %.3f seconds)\n", num_records,
+	       elapsed / 1000000.0, queue_depth, recorded / 1000000.0);
+	report("read", IO_TRACE_OP_READ, elapsed, 0);
+	if (!read_only) {
+		report("write", IO_TRACE_OP_WRITE, elapsed, 0);
+		report("flush", IO_TRACE_OP_FLUSH, elapsed, 0);
+	}
+	printf("As recorded:\n");
+	report("read", IO_TRACE_OP_READ, recorded, 1);
+	report("write", IO_TRACE_OP_WRITE, recorded, 1);
+	report("flush", IO_TRACE_OP_FLUSH, recorded, 1);
+	if (io_errors)
+		printf("%d requests failed\n", io_errors);
+	return io_errors ? 1 : 0;
+}
@@ -131,7 +131,7 @@ void do_open_filesys(int argc, char **argv)
 	char	*data_filename = 0;
 
 	reset_getopt();
-	while ((c = getopt (argc, argv, "iwfecb:s:d:D")) != EOF) {
+	while ((c = getopt (argc, argv, "iwfecb:s:d:DL")) != EOF) {
 		switch (c) {
 		case 'i':
 			open_flags |= EXT2_FLAG_IMAGE_FILE;
@@ -154,6 +154,9 @@ void do_open_filesys(int argc, char **argv)
 		case 'D':
 			open_flags |= EXT2_FLAG_DIRECT_IO;
 			break;
+		case 'L':
+			open_flags |= EXT2_FLAG_LAZY_BITMAPS;
+			break;
 		case 'b':
 			blocksize = parse_ulong(optarg, argv[0],
 						"block size", &err);
@@ -182,7 +185,7 @@ void do_open_filesys(int argc, char **argv)
 
 print_usage:
 	fprintf(stderr, "%s: Usage: open [-s superblock] [-b blocksize] "
-		"[-c] [-w] <device>\n", argv[0]);
+		"[-c] [-w] [-L] <device>\n", argv[0]);
 }
 
 void do_lcd(int argc, char **argv)
@@ -383,6 +386,26 @@ print_usage:
 	fprintf(stderr, "%s: Usage: show_super [-h]\n", argv[0]);
 }
 
+void do_show_io_stats(int argc, char *argv[])
+{
+	io_stats	stats = 0;
+	FILE		*out;
+
+	if (common_args_process(argc, argv, 1, 1, "show_io_stats",
+				"", 0))
+		return;
+	if (check_fs_open(argv[0]))
+		return;
+	if (!current_fs->io->manager->get_stats) {
+		com_err(argv[0], 0, "I/O statistics are not available");
+		return;
+	}
+	current_fs->io->manager->get_stats(current_fs->io, &stats);
+	out = open_pager();
+	io_stats_print(out, "", stats, NULL, 1);
+	close_pager(out);
+}
+
 void do_dirty_filesys(int argc EXT2FS_ATTR((unused)),
 		      char **argv EXT2FS_ATTR((unused)))
 {
@@ -2142,7 +2165,7 @@ int main(int argc, char **argv)
 {
 	int		retval;
 	int		sci_idx;
-	const char	*usage = "Usage: %s [-b blocksize] [-s superblock] [-f cmd_file] [-R request] [-V] [[-w] [-c] device]";
+	const char	*usage = "Usage: %s [-b blocksize] [-s superblock] [-f cmd_file] [-R request] [-V] [[-w] [-c] [-L] device]";
 	int		c;
 	int		open_flags = EXT2_FLAG_SOFTSUPP_FEATURES;
 	char		*request = 0;
@@ -2160,7 +2183,7 @@ int main(int argc, char **argv)
 	fprintf (stderr, "%s %s (%s)\n", debug_prog_name,
 		 E2FSPROGS_VERSION, E2FSPROGS_DATE);
 
-	while ((c = getopt (argc, argv, "iwcR:f:b:s:Vd:D")) != EOF) {
+	while ((c = getopt (argc, argv, "iwcR:f:b:s:Vd:DL")) != EOF) {
 		switch (c) {
 		case 'R':
 			request = optarg;
@@ -2180,6 +2203,9 @@ int main(int argc, char **argv)
 		case 'D':
 			open_flags |= EXT2_FLAG_DIRECT_IO;
 			break;
+		case 'L':
+			open_flags |= EXT2_FLAG_LAZY_BITMAPS;
+			break;
 		case 'b':
 			blocksize = parse_ulong(optarg, argv[0],
 						"block size", 0);
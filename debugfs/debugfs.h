@@ -93,6 +93,7 @@ extern void do_close_filesys(int argc, char **argv);
 extern void do_lcd(int argc, char **argv);
 extern void do_init_filesys(int argc, char **argv);
 extern void do_show_super_stats(int argc, char **argv);
+extern void do_show_io_stats(int argc, char **argv);
 extern void do_kill_file(int argc, char **argv);
 extern void do_rm(int argc, char **argv);
 extern void do_link(int argc, char **argv);
@@ -56,10 +56,13 @@ void do_icheck(int argc, char **argv)
 {
 	struct block_walk_struct bw;
 	struct block_info	*binfo;
-	int			i;
+	int			i, j, num;
 	ext2_inode_scan		scan = 0;
 	ext2_ino_t		ino;
-	struct ext2_inode	inode;
+	struct ext2_inode	*inode;
+	const char		*inodes;
+	int			inode_size;
+	blk_t			blk;
 	errcode_t		retval;
 	char			*block_buf;
 
@@ -90,6 +93,7 @@ void do_icheck(int argc, char **argv)
 	}
 
 	bw.num_blocks = bw.blocks_left = argc-1;
+	inode_size = EXT2_INODE_SIZE(current_fs->super);
 
 	retval = ext2fs_open_inode_scan(current_fs, 0, &scan);
 	if (retval) {
@@ -97,56 +101,51 @@ void do_icheck(int argc, char **argv)
 		goto error_out;
 	}
 
-	do {
-		retval = ext2fs_get_next_inode(scan, &ino, &inode);
-	} while (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE);
-	if (retval) {
-		com_err("icheck", retval, "while starting inode scan");
-		goto error_out;
-	}
-
-	while (ino) {
-		if (!inode.i_links_count)
-			goto next;
-
-		bw.inode = ino;
-
-		if (inode.i_file_acl) {
-			icheck_proc(current_fs, &inode.i_file_acl, 0,
-				    0, 0, &bw);
-			if (bw.blocks_left == 0)
-				break;
-		}
-
-		if (!ext2fs_inode_has_valid_blocks(&inode))
-			goto next;
-		/*
-		 * To handle filesystems touched by 0.3c extfs; can be
-		 * removed later.
-		 */
-		if (inode.i_dtime)
-			goto next;
-
-		retval = ext2fs_block_iterate2(current_fs, ino,
-					       BLOCK_FLAG_READ_ONLY, block_buf,
-					       icheck_proc, &bw);
+	/*
+	 * Walk the inode tables a block at a time, looking at the
+	 * inodes in place in the scan buffer
+	 */
+	while (bw.blocks_left) {
+		retval = ext2fs_get_next_inode_batch(scan, &ino, &inodes,
+						     &num);
+		if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+			continue;
 		if (retval) {
 			com_err("icheck", retval,
-				"while calling ext2fs_block_iterate");
-			goto next;
+				"while doing inode scan");
+			goto error_out;
 		}
-
-		if (bw.blocks_left == 0)
+		if (!num)
 			break;
+		for (j = 0; j < num && bw.blocks_left; j++, ino++) {
+			inode = (struct ext2_inode *) (inodes + j * inode_size);
+			if (!inode->i_links_count)
+				continue;
+
+			bw.inode = ino;
+
+			if (inode->i_file_acl) {
+				blk = inode->i_file_acl;
+				icheck_proc(current_fs, &blk, 0, 0, 0, &bw);
+			}
+			if (!bw.blocks_left)
+				break;
 
-	next:
-		do {
-			retval = ext2fs_get_next_inode(scan, &ino, &inode);
-		} while (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE);
-		if (retval) {
-			com_err("icheck", retval,
-				"while doing inode scan");
-			goto error_out;
+			if (!ext2fs_inode_has_valid_blocks(inode))
+				continue;
+			/*
+			 * To handle filesystems touched by 0.3c extfs;
+			 * can be removed later.
+			 */
+			if (inode->i_dtime)
+				continue;
+
+			retval = ext2fs_block_iterate2(current_fs, ino,
+						BLOCK_FLAG_READ_ONLY, block_buf,
+						icheck_proc, &bw);
+			if (retval)
+				com_err("icheck", retval,
+					"while calling ext2fs_block_iterate");
 		}
 	}
 
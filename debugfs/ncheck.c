@@ -56,7 +56,7 @@ void do_ncheck(int argc, char **argv)
 	int			i;
 	ext2_inode_scan		scan = 0;
 	ext2_ino_t		ino;
-	struct ext2_inode	inode;
+	const struct ext2_inode	*inode;
 	errcode_t		retval;
 	char			*tmp;
 
@@ -92,7 +92,7 @@ void do_ncheck(int argc, char **argv)
 	}
 
 	do {
-		retval = ext2fs_get_next_inode(scan, &ino, &inode);
+		retval = ext2fs_get_next_inode_ptr(scan, &ino, &inode);
 	} while (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE);
 	if (retval) {
 		com_err("ncheck", retval, "while starting inode scan");
@@ -101,16 +101,16 @@ void do_ncheck(int argc, char **argv)
 
 	printf("Inode\tPathname\n");
 	while (ino) {
-		if (!inode.i_links_count)
+		if (!inode->i_links_count)
 			goto next;
 		/*
 		 * To handle filesystems touched by 0.3c extfs; can be
 		 * removed later.
 		 */
-		if (inode.i_dtime)
+		if (inode->i_dtime)
 			goto next;
 		/* Ignore anything that isn't a directory */
-		if (!LINUX_S_ISDIR(inode.i_mode))
+		if (!LINUX_S_ISDIR(inode->i_mode))
 			goto next;
 
 		iw.position = 0;
@@ -136,7 +136,7 @@ void do_ncheck(int argc, char **argv)
 
 	next:
 		do {
-			retval = ext2fs_get_next_inode(scan, &ino, &inode);
+			retval = ext2fs_get_next_inode_ptr(scan, &ino, &inode);
 		} while (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE);
 
 		if (retval) {
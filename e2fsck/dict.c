@@ -979,6 +979,73 @@ static void dnode_free(dnode_t *node, void *context EXT2FS_ATTR((unused)))
     free(node);
 }
 
+void dnode_pool_init(dnode_pool_t *pool)
+{
+    pool->dict_chunks = NULL;
+    pool->dict_free_nodes = NULL;
+    pool->dict_chunk_used = DNODE_POOL_CHUNK;
+}
+
+dnode_t *dnode_pool_alloc(void *arg)
+{
+    dnode_pool_t *pool = arg;
+    dnode_pool_chunk_t *chunk;
+    dnode_t *node = pool->dict_free_nodes;
+
+    if (node) {
+	pool->dict_free_nodes = node->left;
+	return node;
+    }
+    if (pool->dict_chunk_used == DNODE_POOL_CHUNK) {
+	chunk = malloc(sizeof *chunk);
+	if (!chunk)
+	    return NULL;
+	chunk->dict_next_chunk = pool->dict_chunks;
+	pool->dict_chunks = chunk;
+	pool->dict_chunk_used = 0;
+    }
+    return &pool->dict_chunks->dict_nodes[pool->dict_chunk_used++];
+}
+
+void dnode_pool_release(dnode_t *node, void *arg)
+{
+    dnode_pool_t *pool = arg;
+
+    node->left = pool->dict_free_nodes;
+    pool->dict_free_nodes = node;
+}
+
+/*
+ * Take back every node handed out by the pool.  One chunk is kept, so
+ * that a pool which is reset after each use seldom calls malloc.
+ */
+
+void dnode_pool_reset(dnode_pool_t *pool)
+{
+    dnode_pool_chunk_t *chunk, *next;
+
+    if (!pool->dict_chunks)
+	return;
+    for (chunk = pool->dict_chunks->dict_next_chunk; chunk; chunk = next) {
+	next = chunk->dict_next_chunk;
+	free(chunk);
+    }
+    pool->dict_chunks->dict_next_chunk = NULL;
+    pool->dict_free_nodes = NULL;
+    pool->dict_chunk_used = 0;
+}
+
+void dnode_pool_free(dnode_pool_t *pool)
+{
+    dnode_pool_chunk_t *chunk, *next;
+
+    for (chunk = pool->dict_chunks; chunk; chunk = next) {
+	next = chunk->dict_next_chunk;
+	free(chunk);
+    }
+    dnode_pool_init(pool);
+}
+
 dnode_t *dnode_create(void *data)
 {
     dnode_t *new = malloc(sizeof *new);
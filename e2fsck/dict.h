@@ -77,6 +77,27 @@ typedef struct dict_t {
 
 typedef void (*dnode_process_t)(dict_t *, dnode_t *, void *);
 
+/*
+ * A node pool hands out dnodes from large chunks, for use as a
+ * dictionary's allocator via dict_set_allocator(dict, dnode_pool_alloc,
+ * dnode_pool_release, pool).  Released nodes are kept for reuse, and
+ * dnode_pool_reset() takes back every node at once, so a dictionary
+ * which is thrown away as a whole need not free its nodes one by one.
+ */
+
+#define DNODE_POOL_CHUNK 256
+
+typedef struct dnode_pool_chunk_t {
+    struct dnode_pool_chunk_t *dict_next_chunk;
+    dnode_t dict_nodes[DNODE_POOL_CHUNK];
+} dnode_pool_chunk_t;
+
+typedef struct dnode_pool_t {
+    dnode_pool_chunk_t *dict_chunks;
+    dnode_t *dict_free_nodes;
+    int dict_chunk_used;
+} dnode_pool_t;
+
 typedef struct dict_load_t {
 #if defined(DICT_IMPLEMENTATION) || !defined(KAZLIB_OPAQUE_DEBUG)
     dict_t *dict_dictptr;
@@ -123,6 +144,11 @@ extern void dict_load_begin(dict_load_t *, dict_t *);
 extern void dict_load_next(dict_load_t *, dnode_t *, const void *);
 extern void dict_load_end(dict_load_t *);
 extern void dict_merge(dict_t *, dict_t *);
+extern void dnode_pool_init(dnode_pool_t *);
+extern dnode_t *dnode_pool_alloc(void *);
+extern void dnode_pool_release(dnode_t *, void *);
+extern void dnode_pool_reset(dnode_pool_t *);
+extern void dnode_pool_free(dnode_pool_t *);
 
 #if defined(DICT_IMPLEMENTATION) || !defined(KAZLIB_OPAQUE_DEBUG)
 #ifdef KAZLIB_SIDEEFFECT_DEBUG
@@ -19,6 +19,7 @@ struct dir_info_db {
 	int		size;
 	struct dir_info *array;
 	struct dir_info *last_lookup;
+	struct dir_index index;
 	char		*tdb_fn;
 	TDB_CONTEXT	*tdb;
 };
@@ -101,6 +102,85 @@ static void setup_db(e2fsck_t ctx)
 				       "directory map");
 }
 
+#define INDEX_INO(array, rec_size, i) \
+	(*(ext2_ino_t *) ((char *) (array) + (size_t) (i) * (rec_size)))
+
+/*
+ * (Re)build the bucket index for an array.  If there is no memory for
+ * it, lookups fall back to a binary search of the whole array.
+ */
+static void build_dir_index(e2fsck_t ctx, struct dir_index *idx,
+			    void *array, size_t rec_size, int count)
+{
+	ext2_ino_t	max_ino = ctx->fs->super->s_inodes_count;
+	ext2_ino_t	b;
+	int		i;
+
+	e2fsck_dir_index_free(idx);
+	idx->valid = 1;
+	if (count < 2)
+		return;
+	while ((max_ino >> idx->shift) >= (ext2_ino_t) count)
+		idx->shift++;
+	idx->nbuckets = (max_ino >> idx->shift) + 1;
+	if (ext2fs_get_array(idx->nbuckets + 1, sizeof(int), &idx->first))
+		return;
+	for (b = 0, i = 0; b < idx->nbuckets; b++) {
+		while (i < count &&
+		       (INDEX_INO(array, rec_size, i) >> idx->shift) < b)
+			i++;
+		idx->first[b] = i;
+	}
+	idx->first[idx->nbuckets] = count;
+}
+
+/*
+ * Find the record for an inode in an array of records sorted by inode
+ * number.  The index is rebuilt first if the array has changed since
+ * it was last used.
+ */
+void *e2fsck_dir_index_find(e2fsck_t ctx, struct dir_index *idx,
+			    void *array, size_t rec_size, int count,
+			    ext2_ino_t ino)
+{
+	ext2_ino_t	b;
+	int		low, high, mid;
+
+	if (!array || !count)
+		return 0;
+	if (!idx->valid)
+		build_dir_index(ctx, idx, array, rec_size, count);
+
+	low = 0;
+	high = count;
+	if (idx->first) {
+		b = ino >> idx->shift;
+		if (b >= idx->nbuckets)
+			return 0;
+		low = idx->first[b];
+		high = idx->first[b + 1];
+	}
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (INDEX_INO(array, rec_size, mid) == ino)
+			return (char *) array + (size_t) mid * rec_size;
+		if (INDEX_INO(array, rec_size, mid) < ino)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return 0;
+}
+
+void e2fsck_dir_index_free(struct dir_index *idx)
+{
+	if (idx->first)
+		ext2fs_free_mem(&idx->first);
+	idx->nbuckets = 0;
+	idx->shift = 0;
+	idx->valid = 0;
+}
+
 /*
  * This subroutine is called during pass1 to create a directory info
  * entry.  During pass1, the passed-in parent is 0; it will get filled
@@ -166,6 +246,8 @@ void e2fsck_add_dir_info(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent)
 	dir->ino = ino;
 	dir->dotdot = parent;
 	dir->parent = parent;
+	db->last_lookup = 0;
+	db->index.valid = 0;
 }
 
 /*
@@ -175,7 +257,6 @@ void e2fsck_add_dir_info(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent)
 static struct dir_info *e2fsck_get_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 {
 	struct dir_info_db	*db = ctx->dir_info;
-	int			low, high, mid;
 	struct dir_info_ent	*buf;
 	static struct dir_info	ret_dir_info;
 
@@ -214,43 +295,15 @@ static struct dir_info *e2fsck_get_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 	if (db->last_lookup && db->last_lookup->ino == ino)
 		return db->last_lookup;
 
-	low = 0;
-	high = ctx->dir_info->count-1;
-	if (ino == ctx->dir_info->array[low].ino) {
-#ifdef DIRINFO_DEBUG
-		printf("(%d,%d,%d)\n", ino,
-		       ctx->dir_info->array[low].dotdot,
-		       ctx->dir_info->array[low].parent);
-#endif
-		return &ctx->dir_info->array[low];
-	}
-	if (ino == ctx->dir_info->array[high].ino) {
+	db->last_lookup = e2fsck_dir_index_find(ctx, &db->index, db->array,
+						sizeof(struct dir_info),
+						db->count, ino);
 #ifdef DIRINFO_DEBUG
-		printf("(%d,%d,%d)\n", ino,
-		       ctx->dir_info->array[high].dotdot,
-		       ctx->dir_info->array[high].parent);
+	if (db->last_lookup)
+		printf("(%d,%d,%d)\n", ino, db->last_lookup->dotdot,
+		       db->last_lookup->parent);
 #endif
-		return &ctx->dir_info->array[high];
-	}
-
-	while (low < high) {
-		mid = (low+high)/2;
-		if (mid == low || mid == high)
-			break;
-		if (ino == ctx->dir_info->array[mid].ino) {
-#ifdef DIRINFO_DEBUG
-			printf("(%d,%d,%d)\n", ino,
-			       ctx->dir_info->array[mid].dotdot,
-			       ctx->dir_info->array[mid].parent);
-#endif
-			return &ctx->dir_info->array[mid];
-		}
-		if (ino < ctx->dir_info->array[mid].ino)
-			high = mid;
-		else
-			low = mid;
-	}
-	return 0;
+	return db->last_lookup;
 }
 
 static void e2fsck_put_dir_info(e2fsck_t ctx, struct dir_info *dir)
@@ -295,6 +348,7 @@ void e2fsck_free_dir_info(e2fsck_t ctx)
 		}
 		if (ctx->dir_info->array)
 			ext2fs_free_mem(&ctx->dir_info->array);
+		e2fsck_dir_index_free(&ctx->dir_info->index);
 		ctx->dir_info->array = 0;
 		ctx->dir_info->size = 0;
 		ctx->dir_info->count = 0;
@@ -16,7 +16,7 @@
 void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino, int num_blocks)
 {
 	struct dx_dir_info *dir;
-	int		i, j;
+	int		i, j, size;
 	errcode_t	retval;
 	unsigned long	old_size;
 
@@ -34,14 +34,13 @@ void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino, int num_blocks)
 
 	if (ctx->dx_dir_info_count >= ctx->dx_dir_info_size) {
 		old_size = ctx->dx_dir_info_size * sizeof(struct dx_dir_info);
-		ctx->dx_dir_info_size += 10;
-		retval = ext2fs_resize_mem(old_size, ctx->dx_dir_info_size *
+		size = ctx->dx_dir_info_size + ctx->dx_dir_info_size / 2;
+		retval = ext2fs_resize_mem(old_size, size *
 					   sizeof(struct dx_dir_info),
 					   &ctx->dx_dir_info);
-		if (retval) {
-			ctx->dx_dir_info_size -= 10;
+		if (retval)
 			return;
-		}
+		ctx->dx_dir_info_size = size;
 	}
 
 	/*
@@ -71,6 +70,7 @@ void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino, int num_blocks)
 	dir->dx_block = e2fsck_allocate_memory(ctx, num_blocks
 				       * sizeof (struct dx_dirblock_info),
 				       "dx_block info array");
+	ctx->dx_dir_index.valid = 0;
 
 }
 
@@ -80,29 +80,10 @@ void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino, int num_blocks)
  */
 struct dx_dir_info *e2fsck_get_dx_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 {
-	int	low, high, mid;
-
-	low = 0;
-	high = ctx->dx_dir_info_count-1;
-	if (!ctx->dx_dir_info)
-		return 0;
-	if (ino == ctx->dx_dir_info[low].ino)
-		return &ctx->dx_dir_info[low];
-	if  (ino == ctx->dx_dir_info[high].ino)
-		return &ctx->dx_dir_info[high];
-
-	while (low < high) {
-		mid = (low+high)/2;
-		if (mid == low || mid == high)
-			break;
-		if (ino == ctx->dx_dir_info[mid].ino)
-			return &ctx->dx_dir_info[mid];
-		if (ino < ctx->dx_dir_info[mid].ino)
-			high = mid;
-		else
-			low = mid;
-	}
-	return 0;
+	return e2fsck_dir_index_find(ctx, &ctx->dx_dir_index,
+				     ctx->dx_dir_info,
+				     sizeof(struct dx_dir_info),
+				     ctx->dx_dir_info_count, ino);
 }
 
 /*
@@ -126,6 +107,7 @@ void e2fsck_free_dx_dir_info(e2fsck_t ctx)
 	}
 	ctx->dx_dir_info_size = 0;
 	ctx->dx_dir_info_count = 0;
+	e2fsck_dir_index_free(&ctx->dx_dir_index);
 }
 
 /*
@@ -55,6 +55,8 @@ errcode_t e2fsck_reset_context(e2fsck_t ctx)
 {
 	int	i;
 
+	e2fsck_pass1_threads_stop(ctx);
+	e2fsck_pass2_threads_stop(ctx);
 	ctx->flags &= E2F_RESET_FLAGS;
 	ctx->lost_and_found = 0;
 	ctx->bad_lost_and_found = 0;
@@ -107,6 +109,7 @@ errcode_t e2fsck_reset_context(e2fsck_t ctx)
 		ext2fs_free_block_bitmap(ctx->block_ea_map);
 		ctx->block_ea_map = 0;
 	}
+	e2fsck_owner_log_free(ctx);
 	if (ctx->inode_bb_map) {
 		ext2fs_free_inode_bitmap(ctx->inode_bb_map);
 		ctx->inode_bb_map = 0;
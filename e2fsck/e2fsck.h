@@ -103,6 +103,29 @@ struct dx_dir_info {
 	struct dx_dirblock_info	*dx_block; 	/* Array of size numblocks */
 };
 
+/*
+ * What a pass 2 worker thread found out about a clean directory block
+ */
+struct e2fsck_dir_block_check {
+	int			no_dups;	/* no duplicate live names */
+	int			hash_version;	/* of hash[], or -1 */
+	ext2_dirhash_t		*hash;		/* of each entry, in order */
+};
+
+/*
+ * An index over an array of records which is sorted by inode number,
+ * and whose records start with the inode number.  The inode numbers
+ * are divided into buckets of 2^shift inodes, with about as many
+ * buckets as records, and first[b] is the first record in bucket b;
+ * so a lookup only has to search the one or two records in a bucket.
+ */
+struct dir_index {
+	int		*first;		/* nbuckets+1 entries */
+	ext2_ino_t	nbuckets;
+	int		shift;
+	int		valid;		/* index matches the array */
+};
+
 #define DX_DIRBLOCK_ROOT	1
 #define DX_DIRBLOCK_LEAF	2
 #define DX_DIRBLOCK_NODE	3
@@ -135,8 +158,7 @@ struct resource_track {
 	struct timeval user_start;
 	struct timeval system_start;
 	void	*brk_start;
-	unsigned long long bytes_read;
-	unsigned long long bytes_written;
+	struct struct_io_stats io_start;
 };
 #endif
 
@@ -248,6 +270,7 @@ struct e2fsck_struct {
 #endif
 	ext2fs_block_bitmap block_dup_map; /* Blks referenced more than once */
 	ext2fs_block_bitmap block_ea_map; /* Blocks which are used by EA's */
+	struct block_owner_log *owner_log; /* Which inodes claimed which blocks */
 
 	/*
 	 * Inode count arrays
@@ -295,6 +318,7 @@ struct e2fsck_struct {
 	int		dx_dir_info_count;
 	int		dx_dir_info_size;
 	struct dx_dir_info *dx_dir_info;
+	struct dir_index dx_dir_index;
 
 	/*
 	 * Directories to hash
@@ -307,6 +331,17 @@ struct e2fsck_struct {
 	int process_inode_size;
 	int inode_buffer_blocks;
 	unsigned int htree_slack_percentage;
+	int num_threads;	/* -E threads=N */
+
+	/*
+	 * Threads walking block maps ahead of pass 1
+	 */
+	struct e2fsck_pass1_threads *pass1_threads;
+
+	/*
+	 * Threads looking over directory blocks ahead of pass 2
+	 */
+	struct e2fsck_pass2_threads *pass2_threads;
 
 	/*
 	 * ext3 journal support
@@ -417,6 +452,10 @@ extern int e2fsck_dir_info_get_parent(e2fsck_t ctx, ext2_ino_t ino,
 				      ext2_ino_t *parent);
 extern int e2fsck_dir_info_get_dotdot(e2fsck_t ctx, ext2_ino_t ino,
 				      ext2_ino_t *dotdot);
+extern void *e2fsck_dir_index_find(e2fsck_t ctx, struct dir_index *idx,
+				   void *array, size_t rec_size, int count,
+				   ext2_ino_t ino);
+extern void e2fsck_dir_index_free(struct dir_index *idx);
 
 /* dx_dirinfo.c */
 extern void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino, int num_blocks);
@@ -462,10 +501,34 @@ extern void e2fsck_clear_inode(e2fsck_t ctx, ext2_ino_t ino,
 			       struct ext2_inode *inode, int restart_flag,
 			       const char *source);
 
+/* pass1_threads.c */
+extern void e2fsck_pass1_threads_start(e2fsck_t ctx);
+extern void e2fsck_pass1_threads_group(e2fsck_t ctx, dgrp_t group);
+extern int e2fsck_pass1_threads_claim(e2fsck_t ctx, ext2_ino_t ino,
+				      struct ext2_inode *inode,
+				      blk64_t *num_blocks,
+				      e2_blkcnt_t *last_block,
+				      int *fragmented);
+extern void e2fsck_pass1_threads_stop(e2fsck_t ctx);
+
+/* pass1b.c */
+extern void e2fsck_owner_log_init(e2fsck_t ctx);
+extern void e2fsck_owner_log_add(e2fsck_t ctx, ext2_ino_t ino, blk_t blk);
+extern void e2fsck_owner_log_add_run(e2fsck_t ctx, ext2_ino_t ino, blk_t blk,
+				     blk_t num);
+extern void e2fsck_owner_log_free(e2fsck_t ctx);
+
 /* pass2.c */
 extern int e2fsck_process_bad_inode(e2fsck_t ctx, ext2_ino_t dir,
 				    ext2_ino_t ino, char *buf);
 
+/* pass2_threads.c */
+extern void e2fsck_pass2_threads_start(e2fsck_t ctx);
+extern void e2fsck_pass2_threads_block(e2fsck_t ctx, ext2_ino_t pos);
+extern struct e2fsck_dir_block_check *
+	e2fsck_pass2_threads_check(e2fsck_t ctx, blk_t blk, const char *buf);
+extern void e2fsck_pass2_threads_stop(e2fsck_t ctx);
+
 /* pass3.c */
 extern int e2fsck_reconnect_file(e2fsck_t ctx, ext2_ino_t inode);
 extern errcode_t e2fsck_expand_directory(e2fsck_t ctx, ext2_ino_t dir,
@@ -504,12 +567,24 @@ extern void *e2fsck_allocate_memory(e2fsck_t ctx, unsigned int size,
 extern int ask(e2fsck_t ctx, const char * string, int def);
 extern int ask_yn(const char * string, int def);
 extern void fatal_error(e2fsck_t ctx, const char * fmt_string);
+extern void e2fsck_bitmap_error(ext2_filsys fs, errcode_t error,
+				const char *description);
 extern void e2fsck_read_bitmaps(e2fsck_t ctx);
 extern void e2fsck_write_bitmaps(e2fsck_t ctx);
+extern errcode_t e2fsck_allocate_inode_bitmap(ext2_filsys fs,
+					      const char *descr, int deftype,
+					      const char *name,
+					      ext2fs_inode_bitmap *ret);
+extern errcode_t e2fsck_allocate_block_bitmap(ext2_filsys fs,
+					      const char *descr, int deftype,
+					      const char *name,
+					      ext2fs_block_bitmap *ret);
 extern void preenhalt(e2fsck_t ctx);
 extern char *string_copy(e2fsck_t ctx, const char *str, int len);
 extern errcode_t e2fsck_zero_blocks(ext2_filsys fs, blk_t blk, int num,
 				    blk_t *ret_blk, int *ret_count);
+extern errcode_t e2fsck_open_worker_fs(e2fsck_t ctx, ext2_filsys *ret_fs);
+extern void e2fsck_close_worker_fs(ext2_filsys *fs);
 extern int fs_proc_check(const char *fs_name);
 extern int check_for_modules(const char *fs_name);
 #ifdef RESOURCE_TRACK
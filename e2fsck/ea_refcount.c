@@ -10,6 +10,7 @@
 #endif
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #ifdef TEST_PROGRAM
 #undef ENABLE_NLS
@@ -22,6 +23,16 @@
  * reference counts.  Once the refcount has dropped to zero, it is
  * removed from the array to save memory space.  Once the EA block is
  * checked, its bit is set in the block_ea_map bitmap.
+ *
+ * Pass 1 finds EA blocks in inode order, which need not be block
+ * order, so once there are many of them inserting into the sorted
+ * array gets expensive.  When the array has REFCOUNT_HASH_MIN entries
+ * and needs to grow, it is turned into an open-addressed hash table
+ * keyed by block number (block 0 is never an EA block, so it marks an
+ * empty slot).  Entries whose count drops to zero stay in the table
+ * until it is next resized.  ea_refcount_intr_begin() sorts the live
+ * entries back into an array, so that iteration is still in block
+ * order.
  */
 struct ea_refcount_el {
 	blk_t	ea_blk;
@@ -33,8 +44,11 @@ struct ea_refcount {
 	blk_t		size;
 	blk_t		cursor;
 	struct ea_refcount_el	*list;
+	int		hashed;
 };
 
+#define REFCOUNT_HASH_MIN	4096
+
 void ea_refcount_free(ext2_refcount_t refcount)
 {
 	if (!refcount)
@@ -105,6 +119,126 @@ static void refcount_collapse(ext2_refcount_t refcount)
 }
 
 
+static blk_t refcount_hash(blk_t blk, blk_t size)
+{
+	blk_t	h = blk * 2654435761U;
+
+	return (h ^ (h >> 16)) & (size - 1);
+}
+
+/*
+ * refcount_rehash() --- move the entries with a non-zero count into a
+ * 	new hash table of new_size slots, which must be a power of two.
+ */
+static errcode_t refcount_rehash(ext2_refcount_t refcount, blk_t new_size)
+{
+	struct ea_refcount_el	*list, *el;
+	errcode_t		retval;
+	blk_t			i, n, h;
+
+	retval = ext2fs_get_array(new_size, sizeof(struct ea_refcount_el),
+				  &list);
+	if (retval)
+		return retval;
+	memset(list, 0, (size_t) new_size * sizeof(struct ea_refcount_el));
+
+	n = refcount->hashed ? refcount->size : refcount->count;
+	refcount->count = 0;
+	for (i = 0, el = refcount->list; i < n; i++, el++) {
+		if (!el->ea_blk || !el->ea_count)
+			continue;
+		h = refcount_hash(el->ea_blk, new_size);
+		while (list[h].ea_blk)
+			h = (h + 1) & (new_size - 1);
+		list[h] = *el;
+		refcount->count++;
+	}
+#ifdef DEBUG
+	printf("Rehashing refcount into %u entries, %u used\n",
+	       new_size, refcount->count);
+#endif
+	ext2fs_free_mem(&refcount->list);
+	refcount->list = list;
+	refcount->size = new_size;
+	refcount->hashed = 1;
+	return 0;
+}
+
+/*
+ * get_refcount_hash() --- the hashed version of get_refcount_el()
+ */
+static struct ea_refcount_el *get_refcount_hash(ext2_refcount_t refcount,
+						blk_t blk, int create)
+{
+	struct ea_refcount_el	*list;
+	blk_t			h;
+
+retry:
+	list = refcount->list;
+	h = refcount_hash(blk, refcount->size);
+	while (list[h].ea_blk) {
+		if (list[h].ea_blk == blk)
+			return &list[h];
+		h = (h + 1) & (refcount->size - 1);
+	}
+	if (!create)
+		return 0;
+	/* Keep the table at most three quarters full */
+	if ((refcount->count + 1) * 4 > refcount->size * 3) {
+		if (refcount_rehash(refcount, refcount->size * 2))
+			return 0;
+		goto retry;
+	}
+	refcount->count++;
+	list[h].ea_blk = blk;
+	list[h].ea_count = 0;
+	return &list[h];
+}
+
+/*
+ * refcount_hash_convert() --- turn the sorted list into a hash table
+ */
+static errcode_t refcount_hash_convert(ext2_refcount_t refcount)
+{
+	blk_t	size = 1;
+
+	while (size < refcount->count * 2)
+		size <<= 1;
+	return refcount_rehash(refcount, size);
+}
+
+static int refcount_el_cmp(const void *a, const void *b)
+{
+	const struct ea_refcount_el *el_a = a;
+	const struct ea_refcount_el *el_b = b;
+
+	if (el_a->ea_blk < el_b->ea_blk)
+		return -1;
+	return el_a->ea_blk > el_b->ea_blk;
+}
+
+/*
+ * refcount_hash_sort() --- turn the hash table back into a sorted list
+ * 	of its entries with a non-zero count.
+ */
+static void refcount_hash_sort(ext2_refcount_t refcount)
+{
+	struct ea_refcount_el	*list = refcount->list;
+	blk_t			i, j;
+
+	for (i = 0, j = 0; i < refcount->size; i++) {
+		if (list[i].ea_blk && list[i].ea_count) {
+			if (i != j)
+				list[j] = list[i];
+			j++;
+		}
+	}
+	qsort(list, j, sizeof(struct ea_refcount_el), refcount_el_cmp);
+	refcount->count = j;
+	refcount->cursor = 0;
+	refcount->hashed = 0;
+}
+
 /*
  * insert_refcount_el() --- Insert a new entry into the sorted list at a
  * 	specified position.
@@ -160,6 +294,8 @@ static struct ea_refcount_el *get_refcount_el(ext2_refcount_t refcount,
 
 	if (!refcount || !refcount->list)
 		return 0;
+	if (refcount->hashed)
+		return get_refcount_hash(refcount, blk, create);
 retry:
 	low = 0;
 	high = (int) refcount->count-1;
@@ -167,6 +303,12 @@ retry:
 		       (blk > refcount->list[high].ea_blk))) {
 		if (refcount->count >= refcount->size)
 			refcount_collapse(refcount);
+		if (refcount->count >= REFCOUNT_HASH_MIN &&
+		    refcount->count >= refcount->size) {
+			if (refcount_hash_convert(refcount))
+				return 0;
+			return get_refcount_hash(refcount, blk, create);
+		}
 
 		return insert_refcount_el(refcount, blk,
 					  (unsigned) refcount->count);
@@ -225,6 +367,12 @@ retry:
 			refcount_collapse(refcount);
 			if (refcount->count < refcount->size)
 				goto retry;
+			if (refcount->count >= REFCOUNT_HASH_MIN) {
+				if (refcount_hash_convert(refcount))
+					return 0;
+				return get_refcount_hash(refcount, blk,
+							 create);
+			}
 		}
 		return insert_refcount_el(refcount, blk, low);
 	}
@@ -298,6 +446,8 @@ blk_t ext2fs_get_refcount_size(ext2_refcount_t refcount)
 
 void ea_refcount_intr_begin(ext2_refcount_t refcount)
 {
+	if (refcount->hashed)
+		refcount_hash_sort(refcount);
 	refcount->cursor = 0;
 }
 
@@ -333,6 +483,18 @@ errcode_t ea_refcount_validate(ext2_refcount_t refcount, FILE *out)
 		fprintf(out, "%s: count > size\n", bad);
 		return EXT2_ET_INVALID_ARGUMENT;
 	}
+	if (refcount->hashed) {
+		for (i=0; i < refcount->size; i++) {
+			if (refcount->list[i].ea_blk &&
+			    get_refcount_hash(refcount, refcount->list[i].ea_blk,
+					      0) != &refcount->list[i]) {
+				fprintf(out, "%s: list[%d].blk=%u not found\n",
+					bad, i, refcount->list[i].ea_blk);
+				ret = EXT2_ET_INVALID_ARGUMENT;
+			}
+		}
+		return ret;
+	}
 	for (i=1; i < refcount->count; i++) {
 		if (refcount->list[i-1].ea_blk >= refcount->list[i].ea_blk) {
 			fprintf(out, "%s: list[%d].blk=%u, list[%d].blk=%u\n",
@@ -354,6 +516,7 @@ errcode_t ea_refcount_validate(ext2_refcount_t refcount, FILE *out)
 #define BCODE_VALIDATE	7
 #define BCODE_LIST	8
 #define BCODE_COLLAPSE 9
+#define BCODE_RANDOM	10
 
 int bcode_program[] = {
 	BCODE_CREATE, 5,
@@ -387,9 +550,90 @@ int bcode_program[] = {
 	BCODE_LIST,
 	BCODE_VALIDATE,
 	BCODE_FREE,
+	BCODE_RANDOM, 20000,
 	BCODE_END
 };
 
+/*
+ * Apply increments, decrements and stores to num random blocks in
+ * random order, which makes the refcount switch to a hash table, and
+ * check the result against a plain array of counts.
+ */
+static void random_test(int num)
+{
+	ext2_refcount_t refcount;
+	blk_t		*blks, blk, prev = 0;
+	int		*counts, i, j, arg, live = 0, problem = 0;
+	errcode_t	retval;
+
+	blks = malloc(num * sizeof(blk_t));
+	counts = calloc(num, sizeof(int));
+	if (!blks || !counts) {
+		fprintf(stderr, "Couldn't allocate test arrays\n");
+		exit(1);
+	}
+	for (i = 0; i < num; i++)
+		blks[i] = 1 + (blk_t) i * 7;
+	retval = ea_refcount_create(0, &refcount);
+	if (retval) {
+		com_err("ea_refcount_create", retval, "");
+		exit(1);
+	}
+	for (i = 0; i < num * 4; i++) {
+		j = random() % num;
+		switch (random() % 4) {
+		case 0:
+			if (counts[j]) {
+				ea_refcount_decrement(refcount, blks[j], &arg);
+				counts[j]--;
+				break;
+			}
+			/* fall through */
+		case 1:
+		case 2:
+			ea_refcount_increment(refcount, blks[j], &arg);
+			counts[j]++;
+			break;
+		case 3:
+			arg = random() % 3;
+			ea_refcount_store(refcount, blks[j], arg);
+			counts[j] = arg;
+			break;
+		}
+	}
+	for (i = 0; i < num; i++) {
+		ea_refcount_fetch(refcount, blks[i], &arg);
+		if (arg != counts[i]) {
+			printf("Random blk %u: expected %d, got %d\n",
+			       blks[i], counts[i], arg);
+			problem++;
+		}
+		if (counts[i])
+			live++;
+	}
+	if (ea_refcount_validate(refcount, stdout))
+		problem++;
+	ea_refcount_intr_begin(refcount);
+	while ((blk = ea_refcount_intr_next(refcount, &arg)) != 0) {
+		if (blk <= prev || arg != counts[(blk - 1) / 7]) {
+			printf("Random list: blk %u (count %d) after %u\n",
+			       blk, arg, prev);
+			problem++;
+		}
+		prev = blk;
+		live--;
+	}
+	if (live)
+		problem++;
+	printf("Random refcount test with %d blocks: %s\n", num,
+	       problem ? "FAILED" : "OK");
+	ea_refcount_free(refcount);
+	free(blks);
+	free(counts);
+	if (problem)
+		exit(1);
+}
+
 int main(int argc, char **argv)
 {
 	int	i = 0;
@@ -479,6 +723,9 @@ int main(int argc, char **argv)
 		case BCODE_COLLAPSE:
 			refcount_collapse(refcount);
 			break;
+		case BCODE_RANDOM:
+			random_test(bcode_program[i++]);
+			break;
 		}
 
 	}
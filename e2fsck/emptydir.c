@@ -53,13 +53,16 @@ empty_dir_info init_empty_dir(e2fsck_t ctx)
 	if (retval)
 		goto errout;
 
-	retval = ext2fs_allocate_block_bitmap(ctx->fs, _("empty dirblocks"),
+	retval = e2fsck_allocate_block_bitmap(ctx->fs, _("empty dirblocks"),
+					      EXT2FS_BMAP64_RBTREE,
+					      "empty_dir_blocks",
 					      &edi->empty_dir_blocks);
 	if (retval)
 		goto errout;
 
-	retval = ext2fs_allocate_inode_bitmap(ctx->fs, _("empty dir map"),
-					      &edi->dir_map);
+	retval = e2fsck_allocate_inode_bitmap(ctx->fs, _("empty dir map"),
+					      EXT2FS_BMAP64_RBTREE,
+					      "empty_dir_map", &edi->dir_map);
 	if (retval)
 		goto errout;
 
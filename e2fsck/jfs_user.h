@@ -14,37 +14,56 @@
  */
 #include "e2fsck.h"
 
+struct kdev_s {
+	e2fsck_t	k_ctx;
+	int		k_dev;
+	/* Dirty buffers waiting for sync_blockdev(), see brelse() */
+	struct buffer_head **k_queue;
+	int		k_queued;
+	/* Journal blocks read by one request, see do_readahead() */
+	char		*k_buf;
+	blk_t		k_buf_start;
+	int		k_buf_count;
+};
+
+#define K_DEV_FS	1
+#define K_DEV_JOURNAL	2
+
+typedef struct kdev_s *kdev_t;
+
 struct buffer_head {
 	e2fsck_t	b_ctx;
 	io_channel 	b_io;
+	kdev_t		b_dev;
 	int	 	b_size;
 	blk_t	 	b_blocknr;
 	int	 	b_dirty;
 	int	 	b_uptodate;
 	int	 	b_err;
+	int		b_seq;		/* position in b_dev->k_queue */
 	char		b_data[1024];
 };
 
+/* A run of journal blocks which are contiguous on disk */
+struct journal_extent {
+	blk_t		je_lblk;
+	blk_t		je_pblk;
+	blk_t		je_len;
+};
+
 struct inode {
 	e2fsck_t	i_ctx;
 	ext2_ino_t	i_ino;
 	struct ext2_inode i_ext2;
+	/* The journal's block map, read when the journal is loaded */
+	struct journal_extent *i_map;
+	int		i_map_count;
 };
 
-struct kdev_s {
-	e2fsck_t	k_ctx;
-	int		k_dev;
-};
-
-#define K_DEV_FS	1
-#define K_DEV_JOURNAL	2
-
-typedef struct kdev_s *kdev_t;
 
 #define lock_buffer(bh) do {} while(0)
 #define unlock_buffer(bh) do {} while(0)
-#define buffer_req(bh) 1
-#define do_readahead(journal, start) do {} while(0)
+#define buffer_req(bh) 0
 
 extern e2fsck_t e2fsck_global_ctx;  /* Try your very best not to use this! */
 
@@ -121,6 +140,7 @@ _INLINE_ size_t journal_tag_bytes(journal_t *journal)
  * Kernel compatibility functions are defined in journal.c
  */
 int journal_bmap(journal_t *journal, blk_t block, unsigned long *phys);
+void do_readahead(journal_t *journal, unsigned int start);
 struct buffer_head *getblk(kdev_t ctx, blk_t blocknr, int blocksize);
 void sync_blockdev(kdev_t kdev);
 void ll_rw_block(int rw, int dummy, struct buffer_head *bh[]);
@@ -43,6 +43,37 @@ static int bh_count = 0;
  * to use the recovery.c file virtually unchanged from the kernel, so we
  * don't have to do much to keep kernel and user recovery in sync.
  */
+
+static void journal_free_map(struct inode *inode)
+{
+	if (inode->i_map)
+		ext2fs_free_mem(&inode->i_map);
+	inode->i_map_count = 0;
+}
+
+/*
+ * Find the extent of the journal inode's block map which holds a
+ * logical block, or return NULL if the map does not cover it.
+ */
+static struct journal_extent *journal_find_extent(struct inode *inode,
+						  blk_t block)
+{
+	struct journal_extent *ext;
+	int	low = 0, high = inode->i_map_count - 1, mid;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		ext = &inode->i_map[mid];
+		if (block < ext->je_lblk)
+			high = mid - 1;
+		else if (block >= ext->je_lblk + ext->je_len)
+			low = mid + 1;
+		else
+			return ext;
+	}
+	return NULL;
+}
+
 int journal_bmap(journal_t *journal, blk_t block, unsigned long *phys)
 {
 #ifdef USE_INODE_IO
@@ -50,6 +81,7 @@ int journal_bmap(journal_t *journal, blk_t block, unsigned long *phys)
 	return 0;
 #else
 	struct inode 	*inode = journal->j_inode;
+	struct journal_extent *ext;
 	errcode_t	retval;
 	blk_t		pblk;
 
@@ -58,6 +90,12 @@ int journal_bmap(journal_t *journal, blk_t block, unsigned long *phys)
 		return 0;
 	}
 
+	ext = journal_find_extent(inode, block);
+	if (ext) {
+		*phys = ext->je_pblk + (block - ext->je_lblk);
+		return 0;
+	}
+
 	retval= ext2fs_bmap(inode->i_ctx->fs, inode->i_ino,
 			    &inode->i_ext2, NULL, 0, block, &pblk);
 	*phys = pblk;
@@ -65,6 +103,66 @@ int journal_bmap(journal_t *journal, blk_t block, unsigned long *phys)
 #endif
 }
 
+/*
+ * The scan and revoke passes of recovery read the log one block at a
+ * time, in order.  jread() calls this before it reads a block which
+ * is not already in memory: read the rest of the extent holding the
+ * block, up to READAHEAD_BYTES, in a single request, and keep it so
+ * that ll_rw_block() can copy the following blocks out of it.
+ */
+#define READAHEAD_BYTES		(1024 * 1024)
+
+static int journal_buf_holds(kdev_t kdev, blk_t blk)
+{
+	return (kdev->k_buf_count && blk >= kdev->k_buf_start &&
+		blk - kdev->k_buf_start < (blk_t) kdev->k_buf_count);
+}
+
+void do_readahead(journal_t *journal, unsigned int start)
+{
+	kdev_t		kdev = journal->j_dev;
+	struct inode	*inode = journal->j_inode;
+	struct journal_extent *ext;
+	errcode_t	retval;
+	blk_t		pblk, count, max;
+
+	if (start >= journal->j_maxlen)
+		return;
+	count = journal->j_maxlen - start;
+	if (inode) {
+		ext = journal_find_extent(inode, start);
+		if (!ext)
+			return;
+		pblk = ext->je_pblk + (start - ext->je_lblk);
+		if (count > ext->je_lblk + ext->je_len - start)
+			count = ext->je_lblk + ext->je_len - start;
+	} else
+		pblk = start;
+	if (journal_buf_holds(kdev, pblk))
+		return;
+
+	max = READAHEAD_BYTES / journal->j_blocksize;
+	if (count > max)
+		count = max;
+	if (count < 2)
+		return;
+	if (!kdev->k_buf &&
+	    ext2fs_get_array(max, journal->j_blocksize, &kdev->k_buf)) {
+		kdev->k_buf = 0;
+		return;
+	}
+
+	jfs_debug(3, "reading ahead blocks %lu-%lu\n", (unsigned long) pblk,
+		  (unsigned long) pblk + count - 1);
+	kdev->k_buf_count = 0;
+	retval = io_channel_read_blk(kdev->k_ctx->journal_io, pblk, count,
+				     kdev->k_buf);
+	if (retval)
+		return;		/* the block will be read on its own */
+	kdev->k_buf_start = pblk;
+	kdev->k_buf_count = count;
+}
+
 struct buffer_head *getblk(kdev_t kdev, blk_t blocknr, int blocksize)
 {
 	struct buffer_head *bh;
@@ -83,6 +181,7 @@ struct buffer_head *getblk(kdev_t kdev, blk_t blocknr, int blocksize)
 		  (unsigned long) blocknr, blocksize, bh_count);
 
 	bh->b_ctx = kdev->k_ctx;
+	bh->b_dev = kdev;
 	if (kdev->k_dev == K_DEV_FS)
 		bh->b_io = kdev->k_ctx->fs->io;
 	else
@@ -93,13 +192,129 @@ struct buffer_head *getblk(kdev_t kdev, blk_t blocknr, int blocksize)
 	return bh;
 }
 
+/*
+ * Journal replay copies each block of each transaction into a new
+ * buffer and releases it, in log order.  Instead of writing the
+ * filesystem blocks one at a time as they are released, brelse()
+ * queues them.  The queue is written when it fills up or when
+ * sync_blockdev() is called: sorted by block number, with only the
+ * last version of a block which was logged more than once, and with
+ * runs of adjacent blocks written by a single request.
+ */
+#define WRITE_QUEUE_MAX		8192	/* buffers */
+#define WRITE_RUN_MAX		256	/* blocks per write request */
+
+static void mark_buffer_clean(struct buffer_head * bh);
+
+static EXT2_QSORT_TYPE bh_cmp(const void *a, const void *b)
+{
+	const struct buffer_head *bha = *(const struct buffer_head **) a;
+	const struct buffer_head *bhb = *(const struct buffer_head **) b;
+
+	if (bha->b_blocknr != bhb->b_blocknr)
+		return bha->b_blocknr < bhb->b_blocknr ? -1 : 1;
+	return bha->b_seq - bhb->b_seq;
+}
+
+static void write_run(kdev_t kdev, blk_t start, int count, char *buf)
+{
+	errcode_t	retval;
+
+	jfs_debug(3, "writing blocks %lu-%lu\n", (unsigned long) start,
+		  (unsigned long) start + count - 1);
+	retval = io_channel_write_blk(kdev->k_ctx->fs->io, start, count, buf);
+	if (retval)
+		com_err(kdev->k_ctx->device_name, retval,
+			"while writing blocks %lu to %lu\n",
+			(unsigned long) start,
+			(unsigned long) start + count - 1);
+}
+
+static void write_queue(kdev_t kdev)
+{
+	struct buffer_head *bh;
+	int		blocksize = kdev->k_ctx->fs->blocksize;
+	int		i, count = 0;
+	blk_t		start = 0;
+	char		*buf = 0;
+
+	if (!kdev->k_queued)
+		return;
+	qsort(kdev->k_queue, kdev->k_queued, sizeof(struct buffer_head *),
+	      bh_cmp);
+	if (ext2fs_get_array(WRITE_RUN_MAX, blocksize, &buf))
+		buf = 0;
+
+	for (i = 0; i < kdev->k_queued; i++) {
+		bh = kdev->k_queue[i];
+		if (i + 1 < kdev->k_queued &&
+		    kdev->k_queue[i + 1]->b_blocknr == bh->b_blocknr) {
+			/* Overwritten by a later transaction */
+			mark_buffer_clean(bh);
+			brelse(bh);
+			continue;
+		}
+		if (!buf) {
+			/*
+			 * A failed write leaves bh dirty; it has been
+			 * reported, so don't let brelse() queue it again
+			 */
+			ll_rw_block(WRITE, 1, &bh);
+			mark_buffer_clean(bh);
+			brelse(bh);
+			continue;
+		}
+		if (count && (bh->b_blocknr != start + count ||
+			      count == WRITE_RUN_MAX)) {
+			write_run(kdev, start, count, buf);
+			count = 0;
+		}
+		if (!count)
+			start = bh->b_blocknr;
+		memcpy(buf + count++ * blocksize, bh->b_data, blocksize);
+		mark_buffer_clean(bh);
+		brelse(bh);
+	}
+	if (count)
+		write_run(kdev, start, count, buf);
+	if (buf)
+		ext2fs_free_mem(&buf);
+	kdev->k_queued = 0;
+}
+
+/*
+ * Returns 0 if the buffer has been queued
+ */
+static int queue_write(struct buffer_head *bh)
+{
+	kdev_t	kdev = bh->b_dev;
+
+	if (!kdev->k_queue &&
+	    ext2fs_get_array(WRITE_QUEUE_MAX, sizeof(struct buffer_head *),
+			     &kdev->k_queue))
+		return 1;
+	if (kdev->k_queued >= WRITE_QUEUE_MAX)
+		write_queue(kdev);
+	bh->b_seq = kdev->k_queued;
+	kdev->k_queue[kdev->k_queued++] = bh;
+	return 0;
+}
+
+static void free_queue(kdev_t kdev)
+{
+	write_queue(kdev);
+	if (kdev->k_queue)
+		ext2fs_free_mem(&kdev->k_queue);
+}
+
 void sync_blockdev(kdev_t kdev)
 {
 	io_channel	io;
 
-	if (kdev->k_dev == K_DEV_FS)
+	if (kdev->k_dev == K_DEV_FS) {
+		write_queue(kdev);
 		io = kdev->k_ctx->fs->io;
-	else
+	} else
 		io = kdev->k_ctx->journal_io;
 
 	io_channel_flush(io);
@@ -112,7 +327,13 @@ void ll_rw_block(int rw, int nr, struct buffer_head *bhp[])
 
 	for (; nr > 0; --nr) {
 		bh = *bhp++;
-		if (rw == READ && !bh->b_uptodate) {
+		if (rw == READ && !bh->b_uptodate &&
+		    journal_buf_holds(bh->b_dev, bh->b_blocknr)) {
+			memcpy(bh->b_data, bh->b_dev->k_buf +
+			       (bh->b_blocknr - bh->b_dev->k_buf_start) *
+			       bh->b_size, bh->b_size);
+			bh->b_uptodate = 1;
+		} else if (rw == READ && !bh->b_uptodate) {
 			jfs_debug(3, "reading block %lu/%p\n",
 				  (unsigned long) bh->b_blocknr, (void *) bh);
 			retval = io_channel_read_blk(bh->b_io,
@@ -129,6 +350,8 @@ void ll_rw_block(int rw, int nr, struct buffer_head *bhp[])
 		} else if (rw == WRITE && bh->b_dirty) {
 			jfs_debug(3, "writing block %lu/%p\n",
 				  (unsigned long) bh->b_blocknr, (void *) bh);
+			if (journal_buf_holds(bh->b_dev, bh->b_blocknr))
+				bh->b_dev->k_buf_count = 0;
 			retval = io_channel_write_blk(bh->b_io,
 						      bh->b_blocknr,
 						      1, bh->b_data);
@@ -161,6 +384,9 @@ static void mark_buffer_clean(struct buffer_head * bh)
 
 void brelse(struct buffer_head *bh)
 {
+	if (bh->b_dirty && bh->b_dev->k_dev == K_DEV_FS &&
+	    queue_write(bh) == 0)
+		return;
 	if (bh->b_dirty)
 		ll_rw_block(WRITE, 1, &bh);
 	jfs_debug(3, "freeing block %lu/%p (total %d)\n",
@@ -200,8 +426,50 @@ static void e2fsck_clear_recover(e2fsck_t ctx, int error)
  */
 struct process_block_struct {
 	e2_blkcnt_t	last_block;
+	struct inode	*inode;
+	int		map_size;
 };
 
+/*
+ * Add a block to the journal inode's block map, extending the last
+ * extent if the block follows it on disk.  If memory runs out the
+ * map is dropped, and journal_bmap() uses ext2fs_bmap() instead.
+ */
+static void journal_map_block(struct process_block_struct *p,
+			      blk_t lblk, blk_t pblk)
+{
+	struct inode	*inode = p->inode;
+	struct journal_extent *ext;
+	int		size;
+
+	if (p->map_size < 0)
+		return;
+	if (inode->i_map_count) {
+		ext = &inode->i_map[inode->i_map_count - 1];
+		if (lblk == ext->je_lblk + ext->je_len &&
+		    pblk == ext->je_pblk + ext->je_len) {
+			ext->je_len++;
+			return;
+		}
+	}
+	if (inode->i_map_count >= p->map_size) {
+		size = p->map_size ? p->map_size * 2 : 16;
+		if (ext2fs_resize_mem(p->map_size *
+				      sizeof(struct journal_extent),
+				      size * sizeof(struct journal_extent),
+				      &inode->i_map)) {
+			journal_free_map(inode);
+			p->map_size = -1;
+			return;
+		}
+		p->map_size = size;
+	}
+	ext = &inode->i_map[inode->i_map_count++];
+	ext->je_lblk = lblk;
+	ext->je_pblk = pblk;
+	ext->je_len = 1;
+}
+
 static int process_journal_block(ext2_filsys fs,
 				 blk_t	*block_nr,
 				 e2_blkcnt_t blockcnt,
@@ -218,8 +486,10 @@ static int process_journal_block(ext2_filsys fs,
 	    blk >= fs->super->s_blocks_count)
 		return BLOCK_ABORT;
 
-	if (blockcnt >= 0)
+	if (blockcnt >= 0) {
 		p->last_block = blockcnt;
+		journal_map_block(p, blockcnt, blk);
+	}
 	return 0;
 }
 
@@ -307,6 +577,9 @@ static errcode_t e2fsck_get_journal(e2fsck_t ctx, journal_t **ret_journal)
 			goto try_backup_journal;
 		}
 		pb.last_block = -1;
+		pb.inode = j_inode;
+		pb.map_size = 0;
+		journal_free_map(j_inode);
 		retval = ext2fs_block_iterate2(ctx->fs, j_inode->i_ino,
 					       BLOCK_FLAG_HOLE, 0,
 					       process_journal_block, &pb);
@@ -435,8 +708,10 @@ errout:
 	e2fsck_use_inode_shortcuts(ctx, 0);
 	if (dev_fs)
 		ext2fs_free_mem(&dev_fs);
-	if (j_inode)
+	if (j_inode) {
+		journal_free_map(j_inode);
 		ext2fs_free_mem(&j_inode);
+	}
 	if (journal)
 		ext2fs_free_mem(&journal);
 	return retval;
@@ -657,6 +932,10 @@ static void e2fsck_journal_release(e2fsck_t ctx, journal_t *journal,
 {
 	journal_superblock_t *jsb;
 
+	/* Replayed blocks must be on disk before the journal is reset */
+	if (journal->j_fs_dev)
+		free_queue(journal->j_fs_dev);
+
 	if (drop)
 		mark_buffer_clean(journal->j_sb_buffer);
 	else if (!(ctx->options & E2F_OPT_READONLY)) {
@@ -675,9 +954,13 @@ static void e2fsck_journal_release(e2fsck_t ctx, journal_t *journal,
 	}
 
 #ifndef USE_INODE_IO
-	if (journal->j_inode)
+	if (journal->j_inode) {
+		journal_free_map(journal->j_inode);
 		ext2fs_free_mem(&journal->j_inode);
+	}
 #endif
+	if (journal->j_dev && journal->j_dev->k_buf)
+		ext2fs_free_mem(&journal->j_dev->k_buf);
 	if (journal->j_fs_dev)
 		ext2fs_free_mem(&journal->j_fs_dev);
 	ext2fs_free_mem(&journal);
@@ -908,6 +1191,7 @@ int e2fsck_run_ext3_journal(e2fsck_t ctx)
 		fatal_error(ctx, 0);
 	}
 	ctx->fs->priv_data = ctx;
+	ctx->fs->bitmap_error = e2fsck_bitmap_error;
 	ctx->fs->now = ctx->now;
 	ctx->fs->flags |= EXT2_FLAG_MASTER_SB_ONLY;
 	ctx->fs->super->s_kbytes_written += kbytes_written;
@@ -83,7 +83,7 @@ static void adjust_extattr_refcount(e2fsck_t ctx, ext2_refcount_t refcount,
 
 struct process_block_struct {
 	ext2_ino_t	ino;
-	unsigned	is_dir:1, is_reg:1, clear:1, suppress:1,
+	unsigned	is_dir:1, is_reg:1, clear:1, suppress:1, incomplete:1,
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 			fragmented:1, compressed:1, bbcheck:1, snapfile:1;
 #else
@@ -521,11 +521,12 @@ static void check_is_really_dir(e2fsck_t ctx, struct problem_context *pctx,
 extern void e2fsck_setup_tdb_icount(e2fsck_t ctx, int flags,
 				    ext2_icount_t *ret)
 {
-	unsigned int		threshold;
+	unsigned int		threshold, mem_limit;
+	unsigned long long	mem_needed;
 	ext2_ino_t		num_dirs;
 	errcode_t		retval;
 	char			*tdb_dir;
-	int			enable;
+	int			enable, fullmap;
 
 	*ret = 0;
 
@@ -533,15 +534,44 @@ extern void e2fsck_setup_tdb_icount(e2fsck_t ctx, int flags,
 			   &tdb_dir);
 	profile_get_uint(ctx->profile, "scratch_files",
 			 "numdirs_threshold", 0, 0, &threshold);
+	profile_get_uint(ctx->profile, "scratch_files",
+			 "icount_memory_limit", 0, 0, &mem_limit);
 	profile_get_boolean(ctx->profile, "scratch_files",
 			    "icount", 0, 1, &enable);
+	profile_get_boolean(ctx->profile, "options", "icount_fullmap",
+			    0, 1, &fullmap);
 
 	retval = ext2fs_get_num_dirs(ctx->fs, &num_dirs);
 	if (retval)
 		num_dirs = 1024;	/* Guess */
 
-	if (!enable || !tdb_dir || access(tdb_dir, W_OK) ||
-	    (threshold && num_dirs <= threshold))
+	if (!enable || !tdb_dir || access(tdb_dir, W_OK))
+		return;
+
+	/*
+	 * If an in-memory icount would probably need more than
+	 * icount_memory_limit megabytes, keep the counts in a mapped
+	 * scratch file instead; it is much faster than tdb.  Pass 2
+	 * uses the full map, which is two bytes per inode; otherwise
+	 * the sorted list starts with an entry for each directory and
+	 * one in fifty other inodes.
+	 */
+	if (mem_limit) {
+		if (fullmap && (flags & EXT2_ICOUNT_OPT_INCREMENT))
+			mem_needed = 2ULL * ctx->fs->super->s_inodes_count;
+		else
+			mem_needed = 8ULL * (num_dirs +
+					     ctx->fs->super->s_inodes_count / 50);
+		if (mem_needed > (unsigned long long) mem_limit << 20) {
+			retval = ext2fs_create_icount_mmap(ctx->fs, tdb_dir,
+							   flags, ret);
+			if (!retval)
+				return;
+			*ret = 0;
+		}
+	}
+
+	if (threshold && num_dirs <= threshold)
 		return;
 
 	retval = ext2fs_create_icount_tdb(ctx->fs, tdb_dir, flags, ret);
@@ -549,7 +579,7 @@ extern void e2fsck_setup_tdb_icount(e2fsck_t ctx, int flags,
 		*ret = 0;
 }
 
-void e2fsck_pass1(e2fsck_t ctx)
+static void e2fsck_pass1_run(e2fsck_t ctx)
 {
 	int	i;
 	__u64	max_sizes;
@@ -603,42 +633,50 @@ void e2fsck_pass1(e2fsck_t ctx)
 	/*
 	 * Allocate bitmaps structures
 	 */
-	pctx.errcode = ext2fs_allocate_inode_bitmap(fs, _("in-use inode map"),
-					      &ctx->inode_used_map);
+	pctx.errcode = e2fsck_allocate_inode_bitmap(fs, _("in-use inode map"),
+					EXT2FS_BMAP64_BITARRAY,
+					"inode_used_map", &ctx->inode_used_map);
 	if (pctx.errcode) {
 		pctx.num = 1;
 		fix_problem(ctx, PR_1_ALLOCATE_IBITMAP_ERROR, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
 		return;
 	}
-	pctx.errcode = ext2fs_allocate_inode_bitmap(fs,
-				_("directory inode map"), &ctx->inode_dir_map);
+	pctx.errcode = e2fsck_allocate_inode_bitmap(fs,
+				_("directory inode map"),
+				EXT2FS_BMAP64_BITARRAY, "inode_dir_map",
+				&ctx->inode_dir_map);
 	if (pctx.errcode) {
 		pctx.num = 2;
 		fix_problem(ctx, PR_1_ALLOCATE_IBITMAP_ERROR, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
 		return;
 	}
-	pctx.errcode = ext2fs_allocate_inode_bitmap(fs,
-			_("regular file inode map"), &ctx->inode_reg_map);
+	pctx.errcode = e2fsck_allocate_inode_bitmap(fs,
+			_("regular file inode map"), EXT2FS_BMAP64_BITARRAY,
+			"inode_reg_map", &ctx->inode_reg_map);
 	if (pctx.errcode) {
 		pctx.num = 6;
 		fix_problem(ctx, PR_1_ALLOCATE_IBITMAP_ERROR, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
 		return;
 	}
-	pctx.errcode = ext2fs_allocate_block_bitmap(fs, _("in-use block map"),
-					      &ctx->block_found_map);
+	pctx.errcode = e2fsck_allocate_block_bitmap(fs, _("in-use block map"),
+					EXT2FS_BMAP64_BITARRAY,
+					"block_found_map",
+					&ctx->block_found_map);
 	if (pctx.errcode) {
 		pctx.num = 1;
 		fix_problem(ctx, PR_1_ALLOCATE_BBITMAP_ERROR, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
 		return;
 	}
+	e2fsck_owner_log_init(ctx);
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 	if (sb->s_feature_compat & EXT2_FEATURE_COMPAT_EXCLUDE_BITMAP)
-		pctx.errcode = ext2fs_allocate_block_bitmap(fs,
+		pctx.errcode = e2fsck_allocate_block_bitmap(fs,
 				_("excluded block map"),
+				EXT2FS_BMAP64_BITARRAY, "block_excluded_map",
 				&ctx->block_excluded_map);
 	if (pctx.errcode) {
 		pctx.num = 1;
@@ -704,11 +742,14 @@ void e2fsck_pass1(e2fsck_t ctx)
 		ext2fs_free_mem(&inode);
 		return;
 	}
-	ext2fs_inode_scan_flags(scan, EXT2_SF_SKIP_MISSING_ITABLE, 0);
+	ext2fs_inode_scan_flags(scan, EXT2_SF_SKIP_MISSING_ITABLE |
+				EXT2_SF_READAHEAD, 0);
 	ctx->stashed_inode = inode;
 	scan_struct.ctx = ctx;
 	scan_struct.block_buf = block_buf;
 	ext2fs_set_inode_callback(scan, scan_callback, &scan_struct);
+	e2fsck_pass1_threads_start(ctx);
+	e2fsck_pass1_threads_group(ctx, 0);
 	if (ctx->progress)
 		if ((ctx->progress)(ctx, 1, 0, ctx->fs->group_desc_count))
 			return;
@@ -1119,6 +1160,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 	}
 	process_inodes(ctx, block_buf);
 	ext2fs_close_inode_scan(scan);
+	e2fsck_pass1_threads_stop(ctx);
 
 	/*
 	 * If any extended attribute blocks' reference counts need to
@@ -1215,6 +1257,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 	ext2fs_free_mem(&inodes_to_process);
 endit:
 	e2fsck_use_inode_shortcuts(ctx, 0);
+	e2fsck_owner_log_free(ctx);
 
 	ext2fs_free_mem(&block_buf);
 	ext2fs_free_mem(&inode);
@@ -1222,6 +1265,17 @@ endit:
 	print_resource_track(ctx, _("Pass 1"), &rtrack, ctx->fs->io);
 }
 
+void e2fsck_pass1(e2fsck_t ctx)
+{
+	e2fsck_pass1_run(ctx);
+	/*
+	 * The scan stops the worker threads as soon as it is done with
+	 * the inode tables; this catches the early returns when it is
+	 * aborted or restarted.
+	 */
+	e2fsck_pass1_threads_stop(ctx);
+}
+
 /*
  * When the inode_scan routines call this callback at the end of the
  * glock group, call process_inodes.
@@ -1237,6 +1291,7 @@ static errcode_t scan_callback(ext2_filsys fs,
 	ctx = scan_struct->ctx;
 
 	process_inodes((e2fsck_t) fs->priv_data, scan_struct->block_buf);
+	e2fsck_pass1_threads_group(ctx, group + 1);
 
 	if (ctx->progress)
 		if ((ctx->progress)(ctx, 1, group+1,
@@ -1319,8 +1374,9 @@ static void mark_inode_bad(e2fsck_t ctx, ino_t ino)
 	if (!ctx->inode_bad_map) {
 		clear_problem_context(&pctx);
 
-		pctx.errcode = ext2fs_allocate_inode_bitmap(ctx->fs,
-			    _("bad inode map"), &ctx->inode_bad_map);
+		pctx.errcode = e2fsck_allocate_inode_bitmap(ctx->fs,
+			    _("bad inode map"), EXT2FS_BMAP64_ROARING,
+			    "inode_bad_map", &ctx->inode_bad_map);
 		if (pctx.errcode) {
 			pctx.num = 3;
 			fix_problem(ctx, PR_1_ALLOCATE_IBITMAP_ERROR, &pctx);
@@ -1341,9 +1397,10 @@ static void alloc_bb_map(e2fsck_t ctx)
 	struct		problem_context pctx;
 
 	clear_problem_context(&pctx);
-	pctx.errcode = ext2fs_allocate_inode_bitmap(ctx->fs,
+	pctx.errcode = e2fsck_allocate_inode_bitmap(ctx->fs,
 					      _("inode in bad block map"),
-					      &ctx->inode_bb_map);
+					      EXT2FS_BMAP64_ROARING,
+					      "inode_bb_map", &ctx->inode_bb_map);
 	if (pctx.errcode) {
 		pctx.num = 4;
 		fix_problem(ctx, PR_1_ALLOCATE_IBITMAP_ERROR, &pctx);
@@ -1361,8 +1418,10 @@ static void alloc_imagic_map(e2fsck_t ctx)
 	struct		problem_context pctx;
 
 	clear_problem_context(&pctx);
-	pctx.errcode = ext2fs_allocate_inode_bitmap(ctx->fs,
+	pctx.errcode = e2fsck_allocate_inode_bitmap(ctx->fs,
 					      _("imagic inode map"),
+					      EXT2FS_BMAP64_ROARING,
+					      "inode_imagic_map",
 					      &ctx->inode_imagic_map);
 	if (pctx.errcode) {
 		pctx.num = 5;
@@ -1380,16 +1439,19 @@ static void alloc_imagic_map(e2fsck_t ctx)
  * WARNING: Assumes checks have already been done to make sure block
  * is valid.  This is true in both process_block and process_bad_block.
  */
-static _INLINE_ void mark_block_used(e2fsck_t ctx, blk_t block)
+static _INLINE_ void mark_block_used(e2fsck_t ctx, ext2_ino_t ino,
+				     blk_t block)
 {
 	struct		problem_context pctx;
 
 	clear_problem_context(&pctx);
+	e2fsck_owner_log_add(ctx, ino, block);
 
 	if (ext2fs_fast_test_block_bitmap(ctx->block_found_map, block)) {
 		if (!ctx->block_dup_map) {
-			pctx.errcode = ext2fs_allocate_block_bitmap(ctx->fs,
+			pctx.errcode = e2fsck_allocate_block_bitmap(ctx->fs,
 			      _("multiply claimed block map"),
+			      EXT2FS_BMAP64_RBTREE, "block_dup_map",
 			      &ctx->block_dup_map);
 			if (pctx.errcode) {
 				pctx.num = 3;
@@ -1488,8 +1550,10 @@ static int check_ext_attr(e2fsck_t ctx, struct problem_context *pctx,
 
 	/* If ea bitmap hasn't been allocated, create it */
 	if (!ctx->block_ea_map) {
-		pctx->errcode = ext2fs_allocate_block_bitmap(fs,
+		pctx->errcode = e2fsck_allocate_block_bitmap(fs,
 						      _("ext attr block map"),
+						      EXT2FS_BMAP64_RBTREE,
+						      "block_ea_map",
 						      &ctx->block_ea_map);
 		if (pctx->errcode) {
 			pctx->num = 2;
@@ -1517,6 +1581,7 @@ static int check_ext_attr(e2fsck_t ctx, struct problem_context *pctx,
 
 	/* Have we seen this EA block before? */
 	if (ext2fs_fast_test_block_bitmap(ctx->block_ea_map, blk)) {
+		e2fsck_owner_log_add(ctx, ino, blk);
 		if (ea_refcount_decrement(ctx->refcount, blk, 0) == 0)
 			return 1;
 		/* Ooops, this EA was referenced more than it stated */
@@ -1624,7 +1689,7 @@ static int check_ext_attr(e2fsck_t ctx, struct problem_context *pctx,
 	count = header->h_refcount - 1;
 	if (count)
 		ea_refcount_store(ctx->refcount, blk, count);
-	mark_block_used(ctx, blk);
+	mark_block_used(ctx, ino, blk);
 	ext2fs_fast_mark_block_bitmap(ctx->block_ea_map, blk);
 	return 1;
 
@@ -1769,6 +1834,7 @@ static void scan_extent_node(e2fsck_t ctx, struct problem_context *pctx,
 
 		if (problem) {
 		report_problem:
+			pb->incomplete = 1;
 			pctx->blk = extent.e_pblk;
 			pctx->blk2 = extent.e_lblk;
 			pctx->num = extent.e_len;
@@ -1812,7 +1878,7 @@ static void scan_extent_node(e2fsck_t ctx, struct problem_context *pctx,
 				pctx->str = "EXT2_EXTENT_UP";
 				return;
 			}
-			mark_block_used(ctx, blk);
+			mark_block_used(ctx, pb->ino, blk);
 			pb->num_blocks++;
 			goto next;
 		}
@@ -1851,7 +1917,7 @@ static void scan_extent_node(e2fsck_t ctx, struct problem_context *pctx,
 		for (blk = extent.e_pblk, blockcnt = extent.e_lblk, i = 0;
 		     i < extent.e_len;
 		     blk++, blockcnt++, i++) {
-			mark_block_used(ctx, blk);
+			mark_block_used(ctx, pb->ino, blk);
 
 			if (is_dir) {
 				pctx->errcode = ext2fs_add_dir_block(ctx->fs->dblist, pctx->ino, blk, blockcnt);
@@ -1941,6 +2007,7 @@ static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 	int		bad_size = 0;
 	int		dirty_inode = 0;
 	int		extent_fs;
+	int		fragmented;
 	__u64		size;
 
 	pb.ino = ino;
@@ -1948,7 +2015,7 @@ static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 	pb.last_block = -1;
 	pb.last_db_block = -1;
 	pb.num_illegal_blocks = 0;
-	pb.suppress = 0; pb.clear = 0;
+	pb.suppress = 0; pb.clear = 0; pb.incomplete = 0;
 	pb.fragmented = 0;
 	pb.compressed = 0;
 	pb.previous_block = 0;
@@ -1995,7 +2062,11 @@ static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 	}
 
 	if (ext2fs_inode_has_valid_blocks(inode)) {
-		if (extent_fs && (inode->i_flags & EXT4_EXTENTS_FL))
+		if (pb.is_reg &&
+		    e2fsck_pass1_threads_claim(ctx, ino, inode, &pb.num_blocks,
+					       &pb.last_block, &fragmented))
+			pb.fragmented = fragmented;
+		else if (extent_fs && (inode->i_flags & EXT4_EXTENTS_FL))
 			check_blocks_extents(ctx, pctx, &pb);
 		else
 			pctx->errcode = ext2fs_block_iterate2(fs, ino,
@@ -2008,6 +2079,13 @@ static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 		goto out;
 	if (pctx->errcode)
 		fix_problem(ctx, PR_1_BLOCK_ITERATE, pctx);
+	/*
+	 * If some of the inode's blocks were not accounted for, pass
+	 * 1B may still find duplicates among them
+	 */
+	if (pb.num_illegal_blocks || pb.incomplete || pb.clear ||
+	    pctx->errcode)
+		e2fsck_owner_log_add(ctx, ino, 0);
 
 	if (pb.fragmented && pb.num_blocks < fs->super->s_blocks_per_group) {
 		if (LINUX_S_ISDIR(inode->i_mode))
@@ -2324,9 +2402,9 @@ static int process_block(ext2_filsys fs,
 		 * by mark_table_blocks()).
 		 */
 		if (blockcnt == BLOCK_COUNT_DIND)
-			mark_block_used(ctx, blk);
+			mark_block_used(ctx, p->ino, blk);
 	} else
-		mark_block_used(ctx, blk);
+		mark_block_used(ctx, p->ino, blk);
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 	/* mark snapshot file blocks excluded */
 	if (p->snapfile && ctx->block_excluded_map)
@@ -2419,7 +2497,7 @@ static int process_bad_block(ext2_filsys fs,
 			if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
 				return BLOCK_ABORT;
 		} else
-			mark_block_used(ctx, blk);
+			mark_block_used(ctx, EXT2_BAD_INO, blk);
 		return 0;
 	}
 #if 0
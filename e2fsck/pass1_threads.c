@@ -0,0 +1,609 @@
+/*
+ * pass1_threads.c --- walk the block maps of regular files on worker
+ *	threads, ahead of pass 1
+ *
+ * Pass 1 checks one inode at a time, and on a large filesystem most
+ * of that time goes into reading and walking the indirect blocks and
+ * extent trees of the regular files.  With "-E threads=N", N worker
+ * threads take turns claiming the next block group ahead of the inode
+ * scan.  A worker reads the group's inode table through its own I/O
+ * channel, and walks the block map of each regular file in it,
+ * checking it for everything check_blocks() would complain about.  If
+ * it finds nothing wrong, it keeps the inode's block map, reduced to
+ * runs of blocks, together with the counts check_blocks() needs; if
+ * it finds anything at all, it drops the inode.  Each worker has its
+ * own filesystem handle, and writes only to the group it claimed.
+ *
+ * The main thread still scans every inode, in order, and still does
+ * all of the checking of the inode itself.  When check_blocks() gets
+ * to a regular file, it first waits for the group to be walked, then
+ * looks for the worker's result.  It uses it only if the inode is
+ * unchanged since the worker read it, and none of its blocks has been
+ * claimed yet; its runs are then marked in block_found_map, which
+ * merges the worker's blocks in inode order.  In every other case,
+ * check_blocks() walks the inode itself, so every problem, including
+ * every duplicate block, is found and reported by the main thread in
+ * the same order as with one thread.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "e2fsck.h"
+
+#ifdef HAVE_PTHREAD
+
+#define P1T_WINDOW_GROUPS	4	/* groups per thread ahead of the scan */
+#define P1T_READ_BLOCKS		64	/* inode table blocks per read */
+#define P1T_MAX_RUN		(1U << 30)
+
+/* Group states */
+#define P1T_FREE	0	/* not claimed yet */
+#define P1T_BUSY	1	/* being walked by a worker */
+#define P1T_DONE	2	/* walked */
+
+struct p1t_run {
+	blk_t		blk;
+	blk_t		num;
+};
+
+/*
+ * A regular file with nothing wrong with its block map
+ */
+struct p1t_inode {
+	ext2_ino_t	ino;
+	__u16		i_mode;
+	__u32		i_flags;
+	__u32		i_block[EXT2_N_BLOCKS];
+	int		fragmented;
+	int		depth;		/* of the extent tree, or -1 */
+	blk64_t		num_blocks;
+	e2_blkcnt_t	last_block;
+	unsigned long	run;		/* first run in the group's list */
+	unsigned long	num_runs;
+};
+
+struct p1t_group {
+	int		state;
+	blk_t		itable;		/* first inode table block */
+	blk_t		nblocks;	/* inode table blocks in use */
+	struct p1t_inode *inodes;	/* sorted by inode number */
+	unsigned long	count, size;
+	struct p1t_run	*runs;
+	unsigned long	run_count, run_size;
+};
+
+struct p1t_worker {
+	struct e2fsck_pass1_threads *pt;
+	pthread_t	thread;
+	ext2_filsys	fs;		/* private handle */
+	char		*itable_buf;
+	char		*block_buf;
+	struct p1t_group *grp;		/* group being walked */
+	struct p1t_inode *cur;		/* inode being walked */
+	ext2_ino_t	ino;
+	struct ext2_inode inode;
+	blk64_t		previous_block;
+	int		bad;
+};
+
+struct e2fsck_pass1_threads {
+	pthread_mutex_t	lock;
+	pthread_cond_t	work;		/* the scan has moved on */
+	pthread_cond_t	done;		/* a group has been walked */
+	struct p1t_worker *workers;
+	int		num_workers;
+	int		stop;
+	dgrp_t		next_group;	/* first group not yet claimed */
+	dgrp_t		scan_group;	/* group the scan has reached */
+	dgrp_t		free_group;	/* groups before it are freed */
+	dgrp_t		window;		/* how far ahead of the scan to go */
+	dgrp_t		num_groups;
+	struct p1t_group *groups;
+	struct p1t_group *cur;		/* the scan's group, if walked */
+	__u32		inodes_per_group;
+	ext2_ino_t	first_ino;
+	blk64_t		max_blocks;
+	int		extent_fs;
+};
+
+/*
+ * The inode being walked is the only one a worker reads
+ */
+static errcode_t p1t_read_inode(ext2_filsys fs, ext2_ino_t ino,
+				struct ext2_inode *inode)
+{
+	struct p1t_worker *w = (struct p1t_worker *) fs->priv_data;
+
+	if (ino != w->ino)
+		return EXT2_ET_BAD_INODE_NUM;
+	*inode = w->inode;
+	return 0;
+}
+
+static int p1t_add_run(struct p1t_worker *w, blk_t blk, blk_t num)
+{
+	struct p1t_group *grp = w->grp;
+	struct p1t_run	*run;
+	unsigned long	new_size;
+
+	if (w->cur->num_runs) {
+		run = &grp->runs[grp->run_count - 1];
+		if (run->blk + run->num == blk &&
+		    run->num <= P1T_MAX_RUN - num) {
+			run->num += num;
+			return 0;
+		}
+	}
+	if (grp->run_count >= grp->run_size) {
+		new_size = grp->run_size ? grp->run_size * 2 : 1024;
+		if (ext2fs_resize_mem(grp->run_size * sizeof(struct p1t_run),
+				      new_size * sizeof(struct p1t_run),
+				      &grp->runs))
+			return 1;
+		grp->run_size = new_size;
+	}
+	run = &grp->runs[grp->run_count++];
+	run->blk = blk;
+	run->num = num;
+	w->cur->num_runs++;
+	return 0;
+}
+
+/*
+ * This follows process_block() for a regular file
+ */
+static int p1t_block(ext2_filsys fs, blk_t *block_nr, e2_blkcnt_t blockcnt,
+		     blk_t ref_block EXT2FS_ATTR((unused)),
+		     int ref_offset EXT2FS_ATTR((unused)), void *priv_data)
+{
+	struct p1t_worker *w = (struct p1t_worker *) priv_data;
+	blk_t	blk = *block_nr;
+
+	if (blk == 0)
+		return 0;
+	if (w->previous_block && w->previous_block + 1 != blk)
+		w->cur->fragmented = 1;
+	w->previous_block = blk;
+
+	/* check_blocks() may have counted an EA block first */
+	if (w->cur->num_blocks + 2 >= w->pt->max_blocks ||
+	    blk < fs->super->s_first_data_block ||
+	    blk >= fs->super->s_blocks_count ||
+	    p1t_add_run(w, blk, 1)) {
+		w->bad = 1;
+		return BLOCK_ABORT;
+	}
+	w->cur->num_blocks++;
+	if (blockcnt >= 0)
+		w->cur->last_block = blockcnt;
+	return 0;
+}
+
+/*
+ * This follows scan_extent_node() for a regular file.  It returns
+ * nonzero if scan_extent_node() would find a problem.
+ */
+static int p1t_extent_node(struct p1t_worker *w, ext2_extent_handle_t ehandle,
+			   blk64_t start_block)
+{
+	struct ext2_super_block	*sb = w->fs->super;
+	struct p1t_inode	*cur = w->cur;
+	struct ext2fs_extent	extent;
+	struct ext2_extent_info	info;
+	errcode_t		retval;
+	blk_t			blk;
+
+	if (ext2fs_extent_get_info(ehandle, &info))
+		return 1;
+	retval = ext2fs_extent_get(ehandle, EXT2_EXTENT_FIRST_SIB, &extent);
+	while (!retval && info.num_entries-- > 0) {
+		if (extent.e_pblk == 0 ||
+		    extent.e_pblk < sb->s_first_data_block ||
+		    extent.e_pblk >= sb->s_blocks_count ||
+		    extent.e_lblk < start_block)
+			return 1;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF)) {
+			blk = extent.e_pblk;
+			if (ext2fs_extent_get(ehandle, EXT2_EXTENT_DOWN,
+					      &extent) ||
+			    p1t_extent_node(w, ehandle, extent.e_lblk) ||
+			    ext2fs_extent_get(ehandle, EXT2_EXTENT_UP,
+					      &extent) ||
+			    p1t_add_run(w, blk, 1))
+				return 1;
+			cur->num_blocks++;
+		} else {
+			if (extent.e_pblk + extent.e_len > sb->s_blocks_count)
+				return 1;
+			if (w->previous_block &&
+			    w->previous_block + 1 != extent.e_pblk)
+				cur->fragmented = 1;
+			if (extent.e_len &&
+			    p1t_add_run(w, extent.e_pblk, extent.e_len))
+				return 1;
+			cur->num_blocks += extent.e_len;
+			w->previous_block = extent.e_pblk + extent.e_len - 1;
+			start_block = cur->last_block =
+				extent.e_lblk + extent.e_len - 1;
+		}
+		retval = ext2fs_extent_get(ehandle, EXT2_EXTENT_NEXT_SIB,
+					   &extent);
+	}
+	return retval && retval != EXT2_ET_EXTENT_NO_NEXT;
+}
+
+static void p1t_walk_inode(struct p1t_worker *w, ext2_ino_t ino,
+			   struct ext2_inode *raw)
+{
+	struct e2fsck_pass1_threads *pt = w->pt;
+	struct p1t_group	*grp = w->grp;
+	struct ext2_inode	*inode = &w->inode;
+	struct p1t_inode	*cur;
+	ext2_extent_handle_t	ehandle;
+	struct ext2_extent_info	info;
+	unsigned long		new_size;
+
+#ifdef WORDS_BIGENDIAN
+	ext2fs_swap_inode(w->fs, inode, raw, 0);
+#else
+	*inode = *raw;
+#endif
+	if (ino < pt->first_ino || !inode->i_links_count ||
+	    !LINUX_S_ISREG(inode->i_mode) || !inode->i_blocks ||
+	    (inode->i_flags & EXT2_COMPRBLK_FL) ||
+	    ((inode->i_flags & EXT4_EXTENTS_FL) && !pt->extent_fs))
+		return;
+#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
+	if (inode->i_flags & EXT4_SNAPFILE_FL)
+		return;
+#endif
+	if (grp->count >= grp->size) {
+		new_size = grp->size ? grp->size * 2 : 256;
+		if (ext2fs_resize_mem(grp->size * sizeof(struct p1t_inode),
+				      new_size * sizeof(struct p1t_inode),
+				      &grp->inodes))
+			return;
+		grp->size = new_size;
+	}
+	cur = &grp->inodes[grp->count];
+	cur->ino = ino;
+	cur->i_mode = inode->i_mode;
+	cur->i_flags = inode->i_flags;
+	memcpy(cur->i_block, inode->i_block, sizeof(cur->i_block));
+	cur->fragmented = 0;
+	cur->depth = -1;
+	cur->num_blocks = 0;
+	cur->last_block = -1;
+	cur->run = grp->run_count;
+	cur->num_runs = 0;
+
+	w->cur = cur;
+	w->ino = ino;
+	w->previous_block = 0;
+	w->bad = 0;
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		if (ext2fs_extent_open2(w->fs, ino, inode, &ehandle)) {
+			w->bad = 1;
+		} else {
+			if (ext2fs_extent_get_info(ehandle, &info) == 0)
+				cur->depth = info.max_depth;
+			w->bad = p1t_extent_node(w, ehandle, 0);
+			ext2fs_extent_free(ehandle);
+		}
+	} else if (ext2fs_block_iterate2(w->fs, ino, BLOCK_FLAG_READ_ONLY,
+					 w->block_buf, p1t_block, w))
+		w->bad = 1;
+
+	if (w->bad)
+		grp->run_count = cur->run;
+	else
+		grp->count++;
+}
+
+static int p1t_stopped(struct e2fsck_pass1_threads *pt)
+{
+	int	stop;
+
+	pthread_mutex_lock(&pt->lock);
+	stop = pt->stop;
+	pthread_mutex_unlock(&pt->lock);
+	return stop;
+}
+
+static void p1t_walk_group(struct p1t_worker *w, dgrp_t group)
+{
+	struct e2fsck_pass1_threads *pt = w->pt;
+	struct p1t_group *grp = &pt->groups[group];
+	ext2_filsys	fs = w->fs;
+	unsigned int	inode_size = EXT2_INODE_SIZE(fs->super);
+	unsigned int	i, num;
+	ext2_ino_t	ino = group * pt->inodes_per_group + 1;
+	blk_t		blk, count;
+
+	w->grp = grp;
+	for (blk = 0; blk < grp->nblocks; blk += count) {
+		count = grp->nblocks - blk;
+		if (count > P1T_READ_BLOCKS)
+			count = P1T_READ_BLOCKS;
+		if (p1t_stopped(pt) ||
+		    io_channel_read_blk(fs->io, grp->itable + blk, count,
+					w->itable_buf))
+			return;
+		num = count * (fs->blocksize / inode_size);
+		for (i = 0; i < num; i++, ino++)
+			p1t_walk_inode(w, ino, (struct ext2_inode *)
+				       (w->itable_buf + i * inode_size));
+	}
+}
+
+static void *p1t_thread(void *arg)
+{
+	struct p1t_worker *w = arg;
+	struct e2fsck_pass1_threads *pt = w->pt;
+	dgrp_t	g;
+
+	w->fs->read_inode = p1t_read_inode;
+	w->fs->priv_data = w;
+	pthread_mutex_lock(&pt->lock);
+	while (!pt->stop && pt->next_group < pt->num_groups) {
+		if (pt->next_group >= pt->scan_group + pt->window) {
+			pthread_cond_wait(&pt->work, &pt->lock);
+			continue;
+		}
+		g = pt->next_group++;
+		pt->groups[g].state = P1T_BUSY;
+		pthread_mutex_unlock(&pt->lock);
+
+		p1t_walk_group(w, g);
+
+		pthread_mutex_lock(&pt->lock);
+		pt->groups[g].state = P1T_DONE;
+		pthread_cond_broadcast(&pt->done);
+	}
+	pthread_mutex_unlock(&pt->lock);
+	return 0;
+}
+
+static void p1t_free_group(struct p1t_group *grp)
+{
+	if (grp->inodes)
+		ext2fs_free_mem(&grp->inodes);
+	if (grp->runs)
+		ext2fs_free_mem(&grp->runs);
+	grp->count = grp->size = 0;
+	grp->run_count = grp->run_size = 0;
+}
+
+/*
+ * Start the worker threads for pass 1.  Failure is not an error; it
+ * only means that pass 1 runs without help.
+ */
+void e2fsck_pass1_threads_start(e2fsck_t ctx)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct e2fsck_pass1_threads *pt;
+	struct p1t_worker *w;
+	dgrp_t		g;
+	__u32		inodes;
+	int		csum_flag, i;
+
+	if (ctx->num_threads < 2 || ctx->pass1_threads ||
+	    fs->io->manager != unix_io_manager ||
+	    (fs->flags & EXT2_FLAG_IMAGE_FILE) ||
+	    (fs->super->s_creator_os == EXT2_OS_HURD) ||
+	    (ctx->options & E2F_OPT_FRAGCHECK))
+		return;
+
+	pt = e2fsck_allocate_memory(ctx, sizeof(struct e2fsck_pass1_threads),
+				    "pass 1 thread state");
+	pt->groups = e2fsck_allocate_memory(ctx, fs->group_desc_count *
+					    sizeof(struct p1t_group),
+					    "pass 1 thread group table");
+	pt->workers = e2fsck_allocate_memory(ctx, ctx->num_threads *
+					     sizeof(struct p1t_worker),
+					     "pass 1 threads");
+
+	csum_flag = EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
+	for (g = 0; g < fs->group_desc_count; g++) {
+		inodes = fs->super->s_inodes_per_group;
+		if (csum_flag) {
+			if (fs->group_desc[g].bg_flags & EXT2_BG_INODE_UNINIT)
+				inodes = 0;
+			else if (fs->group_desc[g].bg_itable_unused < inodes)
+				inodes -= fs->group_desc[g].bg_itable_unused;
+		}
+		pt->groups[g].itable = fs->group_desc[g].bg_inode_table;
+		if (!pt->groups[g].itable)
+			inodes = 0;
+		pt->groups[g].nblocks = (inodes * EXT2_INODE_SIZE(fs->super) +
+					 fs->blocksize - 1) / fs->blocksize;
+	}
+	pt->num_groups = fs->group_desc_count;
+	pt->window = P1T_WINDOW_GROUPS * ctx->num_threads;
+	pt->inodes_per_group = fs->super->s_inodes_per_group;
+	pt->first_ino = EXT2_FIRST_INODE(fs->super);
+	pt->max_blocks = 1 << (31 - fs->super->s_log_block_size);
+	pt->extent_fs = (fs->super->s_feature_incompat &
+			 EXT3_FEATURE_INCOMPAT_EXTENTS);
+	pthread_mutex_init(&pt->lock, NULL);
+	pthread_cond_init(&pt->work, NULL);
+	pthread_cond_init(&pt->done, NULL);
+	ctx->pass1_threads = pt;
+
+	for (i = 0; i < ctx->num_threads; i++) {
+		w = &pt->workers[pt->num_workers];
+		w->pt = pt;
+		if (ext2fs_get_array(P1T_READ_BLOCKS, fs->blocksize,
+				     &w->itable_buf))
+			break;
+		if (ext2fs_get_array(3, fs->blocksize, &w->block_buf) ||
+		    e2fsck_open_worker_fs(ctx, &w->fs) ||
+		    pthread_create(&w->thread, NULL, p1t_thread, w)) {
+			e2fsck_close_worker_fs(&w->fs);
+			if (w->block_buf)
+				ext2fs_free_mem(&w->block_buf);
+			ext2fs_free_mem(&w->itable_buf);
+			break;
+		}
+		pt->num_workers++;
+	}
+	if (!pt->num_workers)
+		e2fsck_pass1_threads_stop(ctx);
+}
+
+/*
+ * The scan has reached a group: free what the workers found in the
+ * groups before it, and wait until this one has been walked.  The
+ * workers claim the groups in order, and never run more than a window
+ * ahead of the scan, so one of them is walking this group, or is
+ * about to claim it.
+ */
+void e2fsck_pass1_threads_group(e2fsck_t ctx, dgrp_t group)
+{
+	struct e2fsck_pass1_threads *pt = ctx->pass1_threads;
+
+	if (!pt || group >= pt->num_groups)
+		return;
+	pthread_mutex_lock(&pt->lock);
+	for (; pt->free_group < group; pt->free_group++)
+		p1t_free_group(&pt->groups[pt->free_group]);
+	pt->scan_group = group;
+	pthread_cond_broadcast(&pt->work);
+	while (pt->groups[group].state != P1T_DONE)
+		pthread_cond_wait(&pt->done, &pt->lock);
+	pt->cur = &pt->groups[group];
+	pthread_mutex_unlock(&pt->lock);
+}
+
+/*
+ * Called by check_blocks() for a regular file.  If a worker walked the
+ * inode's block map, found nothing wrong with it, and none of its
+ * blocks have been claimed since, mark them in block_found_map, add
+ * the worker's counts, and return 1.  Otherwise, return 0, and leave
+ * the walk to the caller.
+ */
+int e2fsck_pass1_threads_claim(e2fsck_t ctx, ext2_ino_t ino,
+			       struct ext2_inode *inode,
+			       blk64_t *num_blocks, e2_blkcnt_t *last_block,
+			       int *fragmented)
+{
+	struct e2fsck_pass1_threads *pt = ctx->pass1_threads;
+	struct p1t_group *grp;
+	struct p1t_inode *p = 0;
+	struct p1t_run	*run;
+	unsigned long	low, high, mid, i;
+
+	if (!pt || !pt->cur)
+		return 0;
+	grp = pt->cur;
+	low = 0;
+	high = grp->count;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (grp->inodes[mid].ino == ino) {
+			p = &grp->inodes[mid];
+			break;
+		}
+		if (grp->inodes[mid].ino < ino)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (!p || p->i_mode != inode->i_mode ||
+	    p->i_flags != inode->i_flags ||
+	    memcmp(p->i_block, inode->i_block, sizeof(p->i_block)))
+		return 0;
+
+	run = grp->runs + p->run;
+	for (i = 0; i < p->num_runs; i++) {
+		if (!ext2fs_fast_test_block_bitmap_range(ctx->block_found_map,
+							 run[i].blk,
+							 run[i].num))
+			break;
+		ext2fs_fast_mark_block_bitmap_range(ctx->block_found_map,
+						    run[i].blk, run[i].num);
+	}
+	if (i < p->num_runs) {
+		while (i-- > 0)
+			ext2fs_fast_unmark_block_bitmap_range(
+				ctx->block_found_map, run[i].blk, run[i].num);
+		return 0;
+	}
+	for (i = 0; i < p->num_runs; i++)
+		e2fsck_owner_log_add_run(ctx, ino, run[i].blk, run[i].num);
+
+	if (p->depth >= 0)
+		ctx->extent_depth_count[(p->depth < MAX_EXTENT_DEPTH_COUNT) ?
+					p->depth :
+					MAX_EXTENT_DEPTH_COUNT - 1]++;
+	*num_blocks += p->num_blocks;
+	*last_block = p->last_block;
+	*fragmented = p->fragmented;
+	return 1;
+}
+
+void e2fsck_pass1_threads_stop(e2fsck_t ctx)
+{
+	struct e2fsck_pass1_threads *pt = ctx->pass1_threads;
+	struct p1t_worker *w;
+	dgrp_t	g;
+	int	i;
+
+	if (!pt)
+		return;
+	pthread_mutex_lock(&pt->lock);
+	pt->stop = 1;
+	pthread_cond_broadcast(&pt->work);
+	pthread_mutex_unlock(&pt->lock);
+	for (i = 0, w = pt->workers; i < pt->num_workers; i++, w++) {
+		pthread_join(w->thread, NULL);
+		e2fsck_close_worker_fs(&w->fs);
+		ext2fs_free_mem(&w->block_buf);
+		ext2fs_free_mem(&w->itable_buf);
+	}
+	pthread_mutex_destroy(&pt->lock);
+	pthread_cond_destroy(&pt->work);
+	pthread_cond_destroy(&pt->done);
+
+	for (g = pt->free_group; g < pt->num_groups; g++)
+		p1t_free_group(&pt->groups[g]);
+	ext2fs_free_mem(&pt->workers);
+	ext2fs_free_mem(&pt->groups);
+	ext2fs_free_mem(&ctx->pass1_threads);
+}
+
+#else /* !HAVE_PTHREAD */
+
+void e2fsck_pass1_threads_start(e2fsck_t ctx EXT2FS_ATTR((unused)))
+{
+}
+
+void e2fsck_pass1_threads_group(e2fsck_t ctx EXT2FS_ATTR((unused)),
+				dgrp_t group EXT2FS_ATTR((unused)))
+{
+}
+
+int e2fsck_pass1_threads_claim(e2fsck_t ctx EXT2FS_ATTR((unused)),
+			       ext2_ino_t ino EXT2FS_ATTR((unused)),
+			       struct ext2_inode *inode EXT2FS_ATTR((unused)),
+			       blk64_t *num_blocks EXT2FS_ATTR((unused)),
+			       e2_blkcnt_t *last_block EXT2FS_ATTR((unused)),
+			       int *fragmented EXT2FS_ATTR((unused)))
+{
+	return 0;
+}
+
+void e2fsck_pass1_threads_stop(e2fsck_t ctx EXT2FS_ATTR((unused)))
+{
+}
+
+#endif /* HAVE_PTHREAD */
@@ -7,7 +7,8 @@
  *
  * Pass1B scans the data blocks of all the inodes again, generating a
  * complete list of duplicate blocks and which inodes have claimed
- * them.
+ * them.  If pass 1 kept a log of which inodes claimed which blocks,
+ * only the inodes which claimed a duplicate block are scanned.
  *
  * Pass1C does a tree-traversal of the filesystem, to determine the
  * parent directories of these inodes.  This step is necessary so that
@@ -99,9 +100,156 @@ static int dup_inode_count = 0;
 static int dup_inode_founddir = 0;
 
 static dict_t blk_dict, ino_dict;
+static dnode_pool_t dup_pool;	/* nodes for both dictionaries */
 
 static ext2fs_inode_bitmap inode_dup_map;
 
+/*
+ * Pass 1 logs the runs of blocks claimed by each inode, so that pass
+ * 1B can find the owners of the multiply-claimed blocks without
+ * rereading every inode.  A run of no blocks marks an inode whose
+ * blocks pass 1 could not fully account for; pass 1B always looks at
+ * those.  If the log grows past its limit it is dropped, and pass 1B
+ * falls back to scanning the whole inode table.
+ */
+struct owner_run {
+	blk_t		blk;
+	blk_t		num;
+	ext2_ino_t	ino;
+};
+
+struct block_owner_log {
+	struct owner_run *runs;
+	unsigned long	count, size;
+	unsigned long	max;		/* limit on size */
+};
+
+void e2fsck_owner_log_init(e2fsck_t ctx)
+{
+	struct block_owner_log *log;
+	int	limit;
+
+	e2fsck_owner_log_free(ctx);
+	profile_get_integer(ctx->profile, "options", "owner_log_limit",
+			    0, 64, &limit);
+	if (limit <= 0)
+		return;
+	if (ext2fs_get_mem(sizeof(struct block_owner_log), &log))
+		return;
+	memset(log, 0, sizeof(struct block_owner_log));
+	log->max = ((unsigned long) limit << 20) / sizeof(struct owner_run);
+	ctx->owner_log = log;
+}
+
+/*
+ * Record that inode ino claimed block blk, or with blk == 0, that
+ * pass 1B must look at the inode in any case
+ */
+void e2fsck_owner_log_add(e2fsck_t ctx, ext2_ino_t ino, blk_t blk)
+{
+	e2fsck_owner_log_add_run(ctx, ino, blk, blk ? 1 : 0);
+}
+
+/*
+ * Record that inode ino claimed the num blocks starting at blk
+ */
+void e2fsck_owner_log_add_run(e2fsck_t ctx, ext2_ino_t ino, blk_t blk,
+			      blk_t num)
+{
+	struct block_owner_log *log = ctx->owner_log;
+	struct owner_run *run;
+	unsigned long	new_size;
+
+	/* The reserved inodes are always looked at */
+	if (!log || ino < EXT2_FIRST_INODE(ctx->fs->super))
+		return;
+	if (log->count && num) {
+		run = &log->runs[log->count - 1];
+		if (run->ino == ino && run->num && run->blk + run->num == blk) {
+			run->num += num;
+			return;
+		}
+	}
+	if (log->count >= log->size) {
+		new_size = log->size ? log->size * 2 : 1024;
+		if (new_size > log->max)
+			new_size = log->max;
+		if (log->count >= new_size ||
+		    ext2fs_resize_mem(log->size * sizeof(struct owner_run),
+				      new_size * sizeof(struct owner_run),
+				      &log->runs)) {
+			e2fsck_owner_log_free(ctx);
+			return;
+		}
+		log->size = new_size;
+	}
+	run = &log->runs[log->count++];
+	run->blk = blk;
+	run->num = num;
+	run->ino = ino;
+}
+
+void e2fsck_owner_log_free(e2fsck_t ctx)
+{
+	struct block_owner_log *log = ctx->owner_log;
+
+	if (!log)
+		return;
+	if (log->runs)
+		ext2fs_free_mem(&log->runs);
+	ext2fs_free_mem(&ctx->owner_log);
+}
+
+static EXT2_QSORT_TYPE ino_cmp(const void *a, const void *b)
+{
+	const ext2_ino_t *ia = (const ext2_ino_t *) a;
+	const ext2_ino_t *ib = (const ext2_ino_t *) b;
+
+	if (*ia < *ib)
+		return -1;
+	return *ia > *ib;
+}
+
+/*
+ * Return the sorted list of inodes which pass 1B has to look at: those
+ * which claimed a multiply-claimed block, those pass 1 marked, and the
+ * reserved inodes, some of whose blocks pass 1 accounts for as
+ * filesystem metadata.
+ */
+static errcode_t owner_log_inodes(e2fsck_t ctx, ext2_ino_t **ret_list,
+				  unsigned long *ret_num)
+{
+	struct block_owner_log *log = ctx->owner_log;
+	struct owner_run *run;
+	ext2_ino_t	*list, ino, first_ino;
+	unsigned long	i, num = 0;
+	errcode_t	retval;
+
+	*ret_list = 0;
+	*ret_num = 0;
+	first_ino = EXT2_FIRST_INODE(ctx->fs->super);
+	retval = ext2fs_get_array(log->count + first_ino, sizeof(ext2_ino_t),
+				  &list);
+	if (retval)
+		return retval;
+	for (ino = 1; ino < first_ino; ino++)
+		list[num++] = ino;
+	for (i = 0, run = log->runs; i < log->count; i++, run++) {
+		if (run->num &&
+		    ext2fs_test_block_bitmap_range(ctx->block_dup_map,
+						   run->blk, run->num))
+			continue;
+		list[num++] = run->ino;
+	}
+	qsort(list, num, sizeof(ext2_ino_t), ino_cmp);
+	for (i = 1, ino = 1; i < num; i++)
+		if (list[i] != list[ino - 1])
+			list[ino++] = list[i];
+	*ret_list = list;
+	*ret_num = num ? ino : 0;
+	return 0;
+}
+
 static int dict_int_cmp(const void *a, const void *b)
 {
 	intptr_t	ia, ib;
@@ -167,7 +315,7 @@ static void add_dupe(e2fsck_t ctx, ext2_ino_t ino, blk_t blk,
 }
 
 /*
- * Free a duplicate inode record
+ * Free a duplicate inode record; the node itself belongs to dup_pool
  */
 static void inode_dnode_free(dnode_t *node,
 			     void *context EXT2FS_ATTR((unused)))
@@ -181,11 +329,10 @@ static void inode_dnode_free(dnode_t *node,
 		free(p);
 	}
 	free(di);
-	free(node);
 }
 
 /*
- * Free a duplicate block record
+ * Free a duplicate block record; the node itself belongs to dup_pool
  */
 static void block_dnode_free(dnode_t *node,
 			     void *context EXT2FS_ATTR((unused)))
@@ -199,7 +346,6 @@ static void block_dnode_free(dnode_t *node,
 		free(p);
 	}
 	free(db);
-	free(node);
 }
 
 
@@ -216,8 +362,9 @@ void e2fsck_pass1_dupblocks(e2fsck_t ctx, char *block_buf)
 
 	clear_problem_context(&pctx);
 
-	pctx.errcode = ext2fs_allocate_inode_bitmap(fs,
-		      _("multiply claimed inode map"), &inode_dup_map);
+	pctx.errcode = e2fsck_allocate_inode_bitmap(fs,
+		      _("multiply claimed inode map"), EXT2FS_BMAP64_RBTREE,
+		      "inode_dup_map", &inode_dup_map);
 	if (pctx.errcode) {
 		fix_problem(ctx, PR_1B_ALLOCATE_IBITMAP_ERROR, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
@@ -226,8 +373,11 @@ void e2fsck_pass1_dupblocks(e2fsck_t ctx, char *block_buf)
 
 	dict_init(&ino_dict, DICTCOUNT_T_MAX, dict_int_cmp);
 	dict_init(&blk_dict, DICTCOUNT_T_MAX, dict_int_cmp);
-	dict_set_allocator(&ino_dict, NULL, inode_dnode_free, NULL);
-	dict_set_allocator(&blk_dict, NULL, block_dnode_free, NULL);
+	dnode_pool_init(&dup_pool);
+	dict_set_allocator(&ino_dict, dnode_pool_alloc, inode_dnode_free,
+			   &dup_pool);
+	dict_set_allocator(&blk_dict, dnode_pool_alloc, block_dnode_free,
+			   &dup_pool);
 
 	init_resource_track(&rtrack, ctx->fs->io);
 	pass1b(ctx, block_buf);
@@ -247,6 +397,7 @@ void e2fsck_pass1_dupblocks(e2fsck_t ctx, char *block_buf)
 	 */
 	dict_free_nodes(&ino_dict);
 	dict_free_nodes(&blk_dict);
+	dnode_pool_free(&dup_pool);
 	ext2fs_free_inode_bitmap(inode_dup_map);
 }
 
@@ -261,11 +412,83 @@ struct process_block_struct {
 	struct problem_context *pctx;
 };
 
+/*
+ * Look for duplicate blocks among those claimed by one inode
+ */
+static void pass1b_inode(e2fsck_t ctx, ext2_ino_t ino,
+			 struct ext2_inode *inode,
+			 struct process_block_struct *pb, char *block_buf)
+{
+	ext2_filsys fs = ctx->fs;
+	struct problem_context *pctx = pb->pctx;
+	blk_t	blk;
+
+	pctx->ino = ctx->stashed_ino = ino;
+	if ((ino != EXT2_BAD_INO) &&
+	    !ext2fs_test_inode_bitmap(ctx->inode_used_map, ino))
+		return;
+
+	pb->ino = ino;
+	pb->dup_blocks = 0;
+	pb->inode = ctx->stashed_inode = inode;
+
+	if (ext2fs_inode_has_valid_blocks(inode) ||
+	    (ino == EXT2_BAD_INO))
+		pctx->errcode = ext2fs_block_iterate2(fs, ino,
+				     BLOCK_FLAG_READ_ONLY, block_buf,
+				     process_pass1b_block, pb);
+	if (inode->i_file_acl) {
+		blk = inode->i_file_acl;
+		process_pass1b_block(fs, &blk,
+				     BLOCK_COUNT_EXTATTR, 0, 0, pb);
+	}
+	if (pb->dup_blocks) {
+		end_problem_latch(ctx, PR_LATCH_DBLOCK);
+		if (ino >= EXT2_FIRST_INODE(fs->super) ||
+		    ino == EXT2_ROOT_INO)
+			dup_inode_count++;
+	}
+	if (pctx->errcode)
+		fix_problem(ctx, PR_1B_BLOCK_ITERATE, pctx);
+}
+
+/*
+ * Visit just the inodes which pass 1 logged as owners of duplicate
+ * blocks, in inode order, as the inode scan would
+ */
+static void pass1b_owners(e2fsck_t ctx, char *block_buf,
+			  struct process_block_struct *pb)
+{
+	struct problem_context *pctx = pb->pctx;
+	struct ext2_inode inode;
+	ext2_ino_t	*list;
+	unsigned long	i, num;
+
+	pctx->errcode = owner_log_inodes(ctx, &list, &num);
+	e2fsck_owner_log_free(ctx);
+	if (pctx->errcode) {
+		fix_problem(ctx, PR_1B_ISCAN_ERROR, pctx);
+		ctx->flags |= E2F_FLAG_ABORT;
+		return;
+	}
+	for (i = 0; i < num; i++) {
+		ctx->stashed_ino = 0;
+		pctx->errcode = ext2fs_read_inode(ctx->fs, list[i], &inode);
+		if (pctx->errcode) {
+			fix_problem(ctx, PR_1B_ISCAN_ERROR, pctx);
+			ctx->flags |= E2F_FLAG_ABORT;
+			break;
+		}
+		pass1b_inode(ctx, list[i], &inode, pb, block_buf);
+	}
+	ext2fs_free_mem(&list);
+}
+
 static void pass1b(e2fsck_t ctx, char *block_buf)
 {
 	ext2_filsys fs = ctx->fs;
 	ext2_ino_t ino;
-	struct ext2_inode inode;
+	const struct ext2_inode *inode;
 	ext2_inode_scan	scan;
 	struct process_block_struct pb;
 	struct problem_context pctx;
@@ -274,6 +497,15 @@ static void pass1b(e2fsck_t ctx, char *block_buf)
 
 	if (!(ctx->options & E2F_OPT_PREEN))
 		fix_problem(ctx, PR_1B_PASS_HEADER, &pctx);
+	pb.ctx = ctx;
+	pb.pctx = &pctx;
+	pctx.str = "pass1b";
+	if (ctx->owner_log) {
+		pass1b_owners(ctx, block_buf, &pb);
+		e2fsck_use_inode_shortcuts(ctx, 0);
+		return;
+	}
+
 	pctx.errcode = ext2fs_open_inode_scan(fs, ctx->inode_buffer_blocks,
 					      &scan);
 	if (pctx.errcode) {
@@ -281,12 +513,13 @@ static void pass1b(e2fsck_t ctx, char *block_buf)
 		ctx->flags |= E2F_FLAG_ABORT;
 		return;
 	}
-	ctx->stashed_inode = &inode;
-	pb.ctx = ctx;
-	pb.pctx = &pctx;
-	pctx.str = "pass1b";
+	ext2fs_inode_scan_flags(scan, EXT2_SF_READAHEAD, 0);
 	while (1) {
-		pctx.errcode = ext2fs_get_next_inode(scan, &ino, &inode);
+		/*
+		 * The inodes are only read here, so look at them in
+		 * place in the scan buffer rather than copying them.
+		 */
+		pctx.errcode = ext2fs_get_next_inode_ptr(scan, &ino, &inode);
 		if (pctx.errcode == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
 			continue;
 		if (pctx.errcode) {
@@ -296,31 +529,8 @@ static void pass1b(e2fsck_t ctx, char *block_buf)
 		}
 		if (!ino)
 			break;
-		pctx.ino = ctx->stashed_ino = ino;
-		if ((ino != EXT2_BAD_INO) &&
-		    !ext2fs_test_inode_bitmap(ctx->inode_used_map, ino))
-			continue;
-
-		pb.ino = ino;
-		pb.dup_blocks = 0;
-		pb.inode = &inode;
-
-		if (ext2fs_inode_has_valid_blocks(&inode) ||
-		    (ino == EXT2_BAD_INO))
-			pctx.errcode = ext2fs_block_iterate2(fs, ino,
-					     BLOCK_FLAG_READ_ONLY, block_buf,
-					     process_pass1b_block, &pb);
-		if (inode.i_file_acl)
-			process_pass1b_block(fs, &inode.i_file_acl,
-					     BLOCK_COUNT_EXTATTR, 0, 0, &pb);
-		if (pb.dup_blocks) {
-			end_problem_latch(ctx, PR_LATCH_DBLOCK);
-			if (ino >= EXT2_FIRST_INODE(fs->super) ||
-			    ino == EXT2_ROOT_INO)
-				dup_inode_count++;
-		}
-		if (pctx.errcode)
-			fix_problem(ctx, PR_1B_BLOCK_ITERATE, &pctx);
+		pass1b_inode(ctx, ino, (struct ext2_inode *) inode, &pb,
+			     block_buf);
 	}
 	ext2fs_close_inode_scan(scan);
 	e2fsck_use_inode_shortcuts(ctx, 0);
@@ -71,11 +71,20 @@ static int htree_depth(struct dx_dir_info *dx_dir,
 		       struct dx_dirblock_info *dx_db);
 static EXT2_QSORT_TYPE special_dir_block_cmp(const void *a, const void *b);
 
+/*
+ * How many directory blocks, in dblist order, pass 2 tries to keep
+ * reading ahead of the block it is checking
+ */
+#define DIR_READAHEAD_BLOCKS	256
+
 struct check_dir_struct {
 	char *buf;
 	struct problem_context	pctx;
 	int	count, max;
 	e2fsck_t ctx;
+	dnode_pool_t	de_pool;	/* nodes for each block's de_dict */
+	ext2_ino_t	list_pos;	/* dblist index of the current block */
+	ext2_ino_t	ra_next;	/* first index not yet read ahead */
 };
 
 void e2fsck_pass2(e2fsck_t ctx)
@@ -94,6 +103,7 @@ void e2fsck_pass2(e2fsck_t ctx)
 	int			i, depth;
 	problem_t		code;
 	int			bad_dir;
+	int			fullmap;
 
 	init_resource_track(&rtrack, ctx->fs->io);
 	clear_problem_context(&cd.pctx);
@@ -107,13 +117,15 @@ void e2fsck_pass2(e2fsck_t ctx)
 
 	e2fsck_setup_tdb_icount(ctx, EXT2_ICOUNT_OPT_INCREMENT,
 				&ctx->inode_count);
+	profile_get_boolean(ctx->profile, "options", "icount_fullmap",
+			    0, 1, &fullmap);
 	if (ctx->inode_count)
 		cd.pctx.errcode = 0;
 	else
 		cd.pctx.errcode = ext2fs_create_icount2(fs,
-						EXT2_ICOUNT_OPT_INCREMENT,
-						0, ctx->inode_link_info,
-						&ctx->inode_count);
+				EXT2_ICOUNT_OPT_INCREMENT |
+				(fullmap ? EXT2_ICOUNT_OPT_FULLMAP : 0),
+				0, ctx->inode_link_info, &ctx->inode_count);
 	if (cd.pctx.errcode) {
 		fix_problem(ctx, PR_2_ALLOCATE_ICOUNT, &cd.pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
@@ -133,6 +145,9 @@ void e2fsck_pass2(e2fsck_t ctx)
 	cd.ctx = ctx;
 	cd.count = 1;
 	cd.max = ext2fs_dblist_count(fs->dblist);
+	cd.list_pos = 0;
+	cd.ra_next = 0;
+	dnode_pool_init(&cd.de_pool);
 
 	if (ctx->progress)
 		(void) (ctx->progress)(ctx, 2, 0, cd.max);
@@ -140,8 +155,11 @@ void e2fsck_pass2(e2fsck_t ctx)
 	if (fs->super->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)
 		ext2fs_dblist_sort(fs->dblist, special_dir_block_cmp);
 
+	e2fsck_pass2_threads_start(ctx);
 	cd.pctx.errcode = ext2fs_dblist_iterate(fs->dblist, check_dir_block,
 						&cd);
+	e2fsck_pass2_threads_stop(ctx);
+	dnode_pool_free(&cd.de_pool);
 	if (ctx->flags & E2F_FLAG_SIGNAL_MASK || ctx->flags & E2F_FLAG_RESTART)
 		return;
 
@@ -726,7 +744,9 @@ static int check_dir_block(ext2_filsys fs,
 	struct ext2_dx_countlimit *limit;
 	static dict_t de_dict;
 	struct problem_context	pctx;
+	struct e2fsck_dir_block_check *check;
 	int	dups_found = 0;
+	int	num = 0;
 	int	ret;
 
 	cd = (struct check_dir_struct *) priv_data;
@@ -739,6 +759,22 @@ static int check_dir_block(ext2_filsys fs,
 	if (ctx->progress && (ctx->progress)(ctx, 2, cd->count++, cd->max))
 		return DIRENT_ABORT;
 
+	/*
+	 * Keep the next few directory blocks being read in the
+	 * background while this one is checked.  The list is in
+	 * block order, so adjacent blocks become single reads.
+	 */
+	if (cd->ra_next < cd->list_pos + DIR_READAHEAD_BLOCKS / 2) {
+		if (ext2fs_dblist_readahead(fs->dblist, cd->ra_next,
+					    cd->list_pos + DIR_READAHEAD_BLOCKS -
+					    cd->ra_next))
+			cd->ra_next = ~0U;	/* not supported; stop trying */
+		else
+			cd->ra_next = cd->list_pos + DIR_READAHEAD_BLOCKS;
+	}
+	e2fsck_pass2_threads_block(ctx, cd->list_pos);
+	cd->list_pos++;
+
 	/*
 	 * Make sure the inode is still in use (could have been
 	 * deleted in the duplicate/bad blocks pass.
@@ -784,7 +820,9 @@ static int check_dir_block(ext2_filsys fs,
 			return DIRENT_ABORT;
 		}
 		memset(buf, 0, fs->blocksize);
-	}
+		check = 0;
+	} else
+		check = e2fsck_pass2_threads_check(ctx, block_nr, buf);
 #ifdef ENABLE_HTREE
 	dx_dir = e2fsck_get_dx_dir_info(ctx, ino);
 	if (dx_dir && dx_dir->numblocks) {
@@ -835,7 +873,15 @@ static int check_dir_block(ext2_filsys fs,
 out_htree:
 #endif /* ENABLE_HTREE */
 
+	/*
+	 * The names in this block are checked for duplicates with a
+	 * dictionary whose nodes all come from cd->de_pool, and are
+	 * given back in one go when we are done with the block.
+	 */
+	dnode_pool_reset(&cd->de_pool);
 	dict_init(&de_dict, DICTCOUNT_T_MAX, dict_de_cmp);
+	dict_set_allocator(&de_dict, dnode_pool_alloc, dnode_pool_release,
+			   &cd->de_pool);
 	prev = 0;
 	do {
 		int group;
@@ -1040,9 +1086,14 @@ out_htree:
 
 #ifdef ENABLE_HTREE
 		if (dx_db) {
-			ext2fs_dirhash(dx_dir->hashversion, dirent->name,
-				       (dirent->name_len & 0xFF),
-				       fs->super->s_hash_seed, &hash, 0);
+			if (check && check->hash_version == dx_dir->hashversion)
+				hash = check->hash[num];
+			else
+				ext2fs_dirhash(dx_dir->hashversion,
+					       dirent->name,
+					       (dirent->name_len & 0xFF),
+					       fs->super->s_hash_seed,
+					       &hash, 0);
 			if (hash < dx_db->min_hash)
 				dx_db->min_hash = hash;
 			if (hash > dx_db->max_hash)
@@ -1081,7 +1132,7 @@ out_htree:
 			}
 		}
 
-		if (dups_found) {
+		if (dups_found || (check && check->no_dups)) {
 			;
 		} else if (dict_lookup(&de_dict, dirent)) {
 			clear_problem_context(&pctx);
@@ -1107,6 +1158,7 @@ out_htree:
 			(void) ext2fs_get_rec_len(fs, dirent, &rec_len);
 		offset += rec_len;
 		dot_state++;
+		num++;
 	} while (offset < fs->blocksize);
 #if 0
 	printf("\n");
@@ -1140,11 +1192,11 @@ out_htree:
 		}
 		ext2fs_mark_changed(fs);
 	}
-	dict_free_nodes(&de_dict);
+	dnode_pool_reset(&cd->de_pool);
 	return 0;
 abort_free_dict:
 	ctx->flags |= E2F_FLAG_ABORT;
-	dict_free_nodes(&de_dict);
+	dnode_pool_reset(&cd->de_pool);
 	return DIRENT_ABORT;
 }
 
@@ -0,0 +1,382 @@
+/*
+ * pass2_threads.c --- look over directory blocks on worker threads,
+ *	ahead of pass 2
+ *
+ * Pass 2 checks the directory blocks one at a time, in dblist order.
+ * With "-E threads=N", N worker threads take turns claiming the next
+ * entry of the dblist, up to a window ahead of the block pass 2 is
+ * checking.  A worker reads the block through its own I/O channel,
+ * and looks for anything in it which check_dir_block() would have to
+ * fix itself: a bad record or name length, a '/' or NUL in a name, or
+ * a bad '.' or '..' entry.  If there is none, the block is clean, and
+ * the worker goes on to hash every name, if the block belongs to an
+ * indexed directory, and to look for two live entries with the same
+ * name.
+ *
+ * check_dir_block() still reads every block, and makes every check
+ * and every fix, in dblist order.  It only uses a worker's result if
+ * the block it read is the one the worker looked at, byte for byte;
+ * it then takes the hashes from the worker, and does not look for
+ * duplicate names if the worker found none.  In a clean block,
+ * check_dir_block() may clear entries or fix their file types, but
+ * never changes their names or lengths, so both stay right.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "e2fsck.h"
+
+#ifdef HAVE_PTHREAD
+
+#define P2T_WINDOW_BLOCKS	64	/* blocks per thread ahead of pass 2 */
+#define P2T_MAX_WINDOW		1024
+
+struct p2t_slot {
+	int		done;		/* the worker has finished */
+	int		clean;		/* nothing for pass 2 to fix */
+	blk_t		blk;
+	char		*buf;
+	struct e2fsck_dir_block_check check;
+};
+
+struct p2t_worker {
+	struct e2fsck_pass2_threads *pt;
+	pthread_t	thread;
+	ext2_filsys	fs;		/* private handle */
+	struct ext2_dir_entry **names;	/* live entries, to be sorted */
+};
+
+struct e2fsck_pass2_threads {
+	pthread_mutex_t	lock;
+	pthread_cond_t	work;		/* pass 2 has moved on */
+	pthread_cond_t	done;		/* a block has been looked at */
+	struct p2t_worker *workers;
+	int		num_workers;
+	int		stop;
+	ext2_dblist	dblist;
+	ext2_ino_t	count;		/* entries in the dblist */
+	ext2_ino_t	next;		/* first entry not yet claimed */
+	ext2_ino_t	pos;		/* entry pass 2 has reached */
+	ext2_ino_t	open;		/* first entry without a hash version */
+	ext2_ino_t	window;		/* entry i uses slots[i % window] */
+	struct p2t_slot	*slots;
+};
+
+/*
+ * The version to hash the names of a directory block with, as far as
+ * pass 2 knows it now, or -1.  The root block of an indexed directory,
+ * which sets the version, is hashed by pass 2 itself.
+ */
+static int p2t_hash_version(e2fsck_t ctx, struct ext2_db_entry *db)
+{
+#ifdef ENABLE_HTREE
+	struct dx_dir_info	*dx_dir;
+
+	if (db->blockcnt == 0)
+		return -1;
+	dx_dir = e2fsck_get_dx_dir_info(ctx, db->ino);
+	if (dx_dir && dx_dir->numblocks)
+		return dx_dir->hashversion;
+#endif
+	return -1;
+}
+
+/*
+ * Same order as dict_de_cmp() in pass2.c, on names without NULs
+ */
+static EXT2_QSORT_TYPE p2t_name_cmp(const void *a, const void *b)
+{
+	const struct ext2_dir_entry *de_a, *de_b;
+	int	a_len, b_len;
+
+	de_a = *(const struct ext2_dir_entry * const *) a;
+	a_len = de_a->name_len & 0xFF;
+	de_b = *(const struct ext2_dir_entry * const *) b;
+	b_len = de_b->name_len & 0xFF;
+
+	if (a_len != b_len)
+		return (a_len - b_len);
+	return memcmp(de_a->name, de_b->name, a_len);
+}
+
+/*
+ * Would check_dot() or check_dotdot() leave this entry alone?
+ */
+static int p2t_dot_ok(struct ext2_dir_entry *dirent, int num,
+		      unsigned int rec_len, ext2_ino_t ino)
+{
+	if (num == 0)
+		return (dirent->inode == ino &&
+			(dirent->name_len & 0xFF) == 1 &&
+			dirent->name[0] == '.' && dirent->name[1] == '\0' &&
+			rec_len <= 24);
+	return (dirent->inode &&
+		(dirent->name_len & 0xFF) == 2 &&
+		dirent->name[0] == '.' && dirent->name[1] == '.' &&
+		dirent->name[2] == '\0');
+}
+
+static void p2t_check_block(struct p2t_worker *w, struct p2t_slot *slot,
+			    ext2_ino_t ino, e2_blkcnt_t blockcnt)
+{
+	ext2_filsys	fs = w->fs;
+	struct e2fsck_dir_block_check *check = &slot->check;
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset, rec_len, name_len, i;
+	int		num, num_names = 0;
+
+	slot->clean = 0;
+	if (!slot->blk || ext2fs_read_dir_block(fs, slot->blk, slot->buf))
+		return;
+	for (offset = 0, num = 0; offset < fs->blocksize;
+	     offset += rec_len, num++) {
+		dirent = (struct ext2_dir_entry *) (slot->buf + offset);
+		(void) ext2fs_get_rec_len(fs, dirent, &rec_len);
+		name_len = dirent->name_len & 0xFF;
+		if (((offset + rec_len) > fs->blocksize) ||
+		    (rec_len < 12) || ((rec_len % 4) != 0) ||
+		    ((name_len + 8) > rec_len))
+			return;
+		for (i = 0; i < name_len; i++)
+			if (dirent->name[i] == '/' || dirent->name[i] == '\0')
+				return;
+		if (blockcnt == 0 && num < 2 &&
+		    !p2t_dot_ok(dirent, num, rec_len, ino))
+			return;
+		if (check->hash_version >= 0 &&
+		    ext2fs_dirhash(check->hash_version, dirent->name,
+				   name_len, fs->super->s_hash_seed,
+				   &check->hash[num], 0))
+			check->hash_version = -1;
+		if (dirent->inode)
+			w->names[num_names++] = dirent;
+	}
+
+	qsort(w->names, num_names, sizeof(struct ext2_dir_entry *),
+	      p2t_name_cmp);
+	check->no_dups = 1;
+	for (i = 1; i < (unsigned int) num_names; i++)
+		if (p2t_name_cmp(&w->names[i - 1], &w->names[i]) == 0) {
+			check->no_dups = 0;
+			break;
+		}
+	slot->clean = 1;
+}
+
+static void *p2t_thread(void *arg)
+{
+	struct p2t_worker *w = arg;
+	struct e2fsck_pass2_threads *pt = w->pt;
+	struct ext2_db_entry *db;
+	struct p2t_slot	*slot;
+	ext2_ino_t	ino;
+	e2_blkcnt_t	blockcnt;
+
+	pthread_mutex_lock(&pt->lock);
+	while (!pt->stop && pt->next < pt->count) {
+		if (pt->next >= pt->pos + pt->window) {
+			pthread_cond_wait(&pt->work, &pt->lock);
+			continue;
+		}
+		slot = &pt->slots[pt->next % pt->window];
+		(void) ext2fs_dblist_get_entry(pt->dblist, pt->next++, &db);
+		slot->done = 0;
+		slot->blk = db->blk;
+		ino = db->ino;
+		blockcnt = db->blockcnt;
+		pthread_mutex_unlock(&pt->lock);
+
+		p2t_check_block(w, slot, ino, blockcnt);
+
+		pthread_mutex_lock(&pt->lock);
+		slot->done = 1;
+		pthread_cond_broadcast(&pt->done);
+	}
+	pthread_mutex_unlock(&pt->lock);
+	return 0;
+}
+
+/*
+ * Start the worker threads for pass 2, once the dblist is in its
+ * final order.  Failure is not an error; it only means that pass 2
+ * runs without help.
+ */
+void e2fsck_pass2_threads_start(e2fsck_t ctx)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct e2fsck_pass2_threads *pt;
+	struct p2t_worker *w;
+	struct p2t_slot	*slot;
+	ext2_ino_t	i;
+	int		max_names = fs->blocksize / 12;
+
+	if (ctx->num_threads < 2 || ctx->pass2_threads ||
+	    fs->io->manager != unix_io_manager ||
+	    (fs->flags & EXT2_FLAG_IMAGE_FILE) ||
+	    !ext2fs_dblist_count(fs->dblist))
+		return;
+
+	pt = e2fsck_allocate_memory(ctx, sizeof(struct e2fsck_pass2_threads),
+				    "pass 2 thread state");
+	pt->dblist = fs->dblist;
+	pt->count = ext2fs_dblist_count(fs->dblist);
+	pt->window = P2T_WINDOW_BLOCKS * ctx->num_threads;
+	if (pt->window > P2T_MAX_WINDOW)
+		pt->window = P2T_MAX_WINDOW;
+	pt->slots = e2fsck_allocate_memory(ctx, pt->window *
+					   sizeof(struct p2t_slot),
+					   "pass 2 thread slots");
+	pt->workers = e2fsck_allocate_memory(ctx, ctx->num_threads *
+					     sizeof(struct p2t_worker),
+					     "pass 2 threads");
+	pthread_mutex_init(&pt->lock, NULL);
+	pthread_cond_init(&pt->work, NULL);
+	pthread_cond_init(&pt->done, NULL);
+	ctx->pass2_threads = pt;
+
+	for (i = 0, slot = pt->slots; i < pt->window; i++, slot++) {
+		if (ext2fs_get_mem(fs->blocksize, &slot->buf) ||
+		    ext2fs_get_array(max_names, sizeof(ext2_dirhash_t),
+				     &slot->check.hash)) {
+			e2fsck_pass2_threads_stop(ctx);
+			return;
+		}
+	}
+	e2fsck_pass2_threads_block(ctx, 0);
+
+	for (i = 0; i < (ext2_ino_t) ctx->num_threads; i++) {
+		w = &pt->workers[pt->num_workers];
+		w->pt = pt;
+		if (ext2fs_get_array(max_names,
+				     sizeof(struct ext2_dir_entry *),
+				     &w->names))
+			break;
+		if (e2fsck_open_worker_fs(ctx, &w->fs) ||
+		    pthread_create(&w->thread, NULL, p2t_thread, w)) {
+			e2fsck_close_worker_fs(&w->fs);
+			ext2fs_free_mem(&w->names);
+			break;
+		}
+		pt->num_workers++;
+	}
+	if (!pt->num_workers)
+		e2fsck_pass2_threads_stop(ctx);
+}
+
+/*
+ * Pass 2 has reached entry pos of the dblist: let the workers have the
+ * slots of the entries before it, give the entries entering the window
+ * their hash versions, and wait until this one has been looked at.
+ * The workers claim the entries in order, and never go more than a
+ * window ahead, so one of them has this entry, or is about to claim it.
+ */
+void e2fsck_pass2_threads_block(e2fsck_t ctx, ext2_ino_t pos)
+{
+	struct e2fsck_pass2_threads *pt = ctx->pass2_threads;
+	struct ext2_db_entry *db;
+
+	if (!pt || pos >= pt->count)
+		return;
+	pthread_mutex_lock(&pt->lock);
+	for (; pt->open < pos + pt->window && pt->open < pt->count;
+	     pt->open++) {
+		(void) ext2fs_dblist_get_entry(pt->dblist, pt->open, &db);
+		pt->slots[pt->open % pt->window].check.hash_version =
+			p2t_hash_version(ctx, db);
+	}
+	pt->pos = pos;
+	pthread_cond_broadcast(&pt->work);
+	while (pt->num_workers &&
+	       (pt->next <= pos || !pt->slots[pos % pt->window].done))
+		pthread_cond_wait(&pt->done, &pt->lock);
+	pthread_mutex_unlock(&pt->lock);
+}
+
+/*
+ * Called by check_dir_block() with the block it has just read.  If a
+ * worker found the same block clean, return what it found out about
+ * it; otherwise return 0.
+ */
+struct e2fsck_dir_block_check *e2fsck_pass2_threads_check(e2fsck_t ctx,
+							  blk_t blk,
+							  const char *buf)
+{
+	struct e2fsck_pass2_threads *pt = ctx->pass2_threads;
+	struct p2t_slot	*slot;
+
+	if (!pt || !pt->num_workers || pt->pos >= pt->count)
+		return 0;
+	slot = &pt->slots[pt->pos % pt->window];
+	if (!slot->done || !slot->clean || slot->blk != blk ||
+	    memcmp(slot->buf, buf, ctx->fs->blocksize))
+		return 0;
+	return &slot->check;
+}
+
+void e2fsck_pass2_threads_stop(e2fsck_t ctx)
+{
+	struct e2fsck_pass2_threads *pt = ctx->pass2_threads;
+	struct p2t_worker *w;
+	struct p2t_slot	*slot;
+	ext2_ino_t	i;
+	int		j;
+
+	if (!pt)
+		return;
+	pthread_mutex_lock(&pt->lock);
+	pt->stop = 1;
+	pthread_cond_broadcast(&pt->work);
+	pthread_mutex_unlock(&pt->lock);
+	for (j = 0, w = pt->workers; j < pt->num_workers; j++, w++) {
+		pthread_join(w->thread, NULL);
+		e2fsck_close_worker_fs(&w->fs);
+		ext2fs_free_mem(&w->names);
+	}
+	pthread_mutex_destroy(&pt->lock);
+	pthread_cond_destroy(&pt->work);
+	pthread_cond_destroy(&pt->done);
+
+	for (i = 0, slot = pt->slots; i < pt->window; i++, slot++) {
+		if (slot->buf)
+			ext2fs_free_mem(&slot->buf);
+		if (slot->check.hash)
+			ext2fs_free_mem(&slot->check.hash);
+	}
+	ext2fs_free_mem(&pt->slots);
+	ext2fs_free_mem(&pt->workers);
+	ext2fs_free_mem(&ctx->pass2_threads);
+}
+
+#else /* !HAVE_PTHREAD */
+
+void e2fsck_pass2_threads_start(e2fsck_t ctx EXT2FS_ATTR((unused)))
+{
+}
+
+void e2fsck_pass2_threads_block(e2fsck_t ctx EXT2FS_ATTR((unused)),
+				ext2_ino_t pos EXT2FS_ATTR((unused)))
+{
+}
+
+struct e2fsck_dir_block_check *e2fsck_pass2_threads_check(
+	e2fsck_t ctx EXT2FS_ATTR((unused)),
+	blk_t blk EXT2FS_ATTR((unused)),
+	const char *buf EXT2FS_ATTR((unused)))
+{
+	return 0;
+}
+
+void e2fsck_pass2_threads_stop(e2fsck_t ctx EXT2FS_ATTR((unused)))
+{
+}
+
+#endif /* HAVE_PTHREAD */
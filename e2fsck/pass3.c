@@ -73,14 +73,26 @@ void e2fsck_pass3(e2fsck_t ctx)
 	/*
 	 * Allocate some bitmaps to do loop detection.
 	 */
-	pctx.errcode = ext2fs_allocate_inode_bitmap(fs, _("inode done bitmap"),
-						    &inode_done_map);
+	pctx.errcode = e2fsck_allocate_inode_bitmap(fs, _("inode done bitmap"),
+					EXT2FS_BMAP64_BITARRAY,
+					"inode_done_map", &inode_done_map);
 	if (pctx.errcode) {
 		pctx.num = 2;
 		fix_problem(ctx, PR_3_ALLOCATE_IBITMAP_ERROR, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
 		goto abort_exit;
 	}
+	pctx.errcode = e2fsck_allocate_inode_bitmap(fs,
+					_("inode loop detection bitmap"),
+					EXT2FS_BMAP64_RBTREE,
+					"inode_loop_detect",
+					&inode_loop_detect);
+	if (pctx.errcode) {
+		pctx.num = 1;
+		fix_problem(ctx, PR_3_ALLOCATE_IBITMAP_ERROR, &pctx);
+		ctx->flags |= E2F_FLAG_ABORT;
+		goto abort_exit;
+	}
 	print_resource_track(ctx, _("Peak memory"), &ctx->global_rtrack, NULL);
 
 	check_root(ctx);
@@ -240,6 +252,38 @@ static void check_root(e2fsck_t ctx)
 	ext2fs_mark_ib_dirty(fs);
 }
 
+static int unlink_loop_proc(ext2_ino_t dir EXT2FS_ATTR((unused)),
+			    int entry,
+			    struct ext2_dir_entry *dirent,
+			    int offset EXT2FS_ATTR((unused)),
+			    int blocksize EXT2FS_ATTR((unused)),
+			    char *buf EXT2FS_ATTR((unused)),
+			    void *priv_data)
+{
+	ext2_ino_t	*ino = (ext2_ino_t *) priv_data;
+
+	if (entry == DIRENT_DOT_FILE || entry == DIRENT_DOT_DOT_FILE ||
+	    dirent->inode != *ino)
+		return 0;
+	dirent->inode = 0;
+	*ino = 0;
+	return DIRENT_CHANGED | DIRENT_ABORT;
+}
+
+/*
+ * Remove the entry for a directory from its parent in a loop.
+ */
+static void unlink_loop_entry(e2fsck_t ctx, ext2_ino_t parent,
+			      ext2_ino_t ino)
+{
+	ext2_ino_t	target = ino;
+
+	if (ext2fs_dir_iterate2(ctx->fs, parent, 0, 0, unlink_loop_proc,
+				&target) || target)
+		return;
+	e2fsck_adjust_inode_count(ctx, ino, -1);
+}
+
 /*
  * This subroutine is responsible for making sure that a particular
  * directory is connected to the root; if it isn't we trace it up as
@@ -248,88 +292,71 @@ static void check_root(e2fsck_t ctx)
  * a loop, we treat that as a disconnected directory and offer to
  * reparent it to lost+found.
  *
- * However, loop detection is expensive, because for very large
- * filesystems, the inode_loop_detect bitmap is huge, and clearing it
- * is non-trivial.  Loops in filesystems are also a rare error case,
- * and we shouldn't optimize for error cases.  So we try two passes of
- * the algorithm.  The first time, we ignore loop detection and merely
- * increment a counter; if the counter exceeds some extreme threshold,
- * then we try again with the loop detection bitmap enabled.
+ * The walk up the tree stops at the first directory which is already
+ * marked done.  The directories on the way are marked in
+ * inode_loop_detect, so that coming back to one of them means that we
+ * have found a loop.  Once the top of the walk has been dealt with,
+ * the path is walked a second time, moving each directory from
+ * inode_loop_detect to inode_done_map.  Since every directory is on
+ * exactly one such path, pass 3 visits each directory at most twice,
+ * and inode_loop_detect is empty again between calls.
  */
 static int check_directory(e2fsck_t ctx, ext2_ino_t dir,
 			   struct problem_context *pctx)
 {
 	ext2_filsys 	fs = ctx->fs;
 	ext2_ino_t	ino = dir, parent;
-	int		loop_pass = 0, parent_count = 0;
+	int		no_dirinfo = 0;
 
-	while (1) {
-		/*
-		 * Mark this inode as being "done"; by the time we
-		 * return from this function, the inode we either be
-		 * verified as being connected to the directory tree,
-		 * or we will have offered to reconnect this to
-		 * lost+found.
-		 *
-		 * If it was marked done already, then we've reached a
-		 * parent we've already checked.
-		 */
-	  	if (ext2fs_mark_inode_bitmap(inode_done_map, ino))
-			break;
+	while (!ext2fs_test_inode_bitmap(inode_done_map, ino)) {
+		ext2fs_mark_inode_bitmap(inode_loop_detect, ino);
 
 		if (e2fsck_dir_info_get_parent(ctx, ino, &parent)) {
 			fix_problem(ctx, PR_3_NO_DIRINFO, pctx);
-			return 0;
+			no_dirinfo = 1;
+			break;
 		}
 
 		/*
-		 * If this directory doesn't have a parent, or we've
-		 * seen the parent once already, then offer to
-		 * reparent it to lost+found
+		 * If this directory doesn't have a parent, or the
+		 * parent is already on our path, then offer to
+		 * reparent it to lost+found.  In the second case, the
+		 * entry in the parent has to go as well, or the
+		 * directory would end up with two links.
 		 */
 		if (!parent ||
-		    (loop_pass &&
-		     (ext2fs_test_inode_bitmap(inode_loop_detect,
-					       parent)))) {
+		    ext2fs_test_inode_bitmap(inode_loop_detect, parent)) {
 			pctx->ino = ino;
 			if (fix_problem(ctx, PR_3_UNCONNECTED_DIR, pctx)) {
 				if (e2fsck_reconnect_file(ctx, pctx->ino))
 					ext2fs_unmark_valid(fs);
 				else {
+					if (parent)
+						unlink_loop_entry(ctx, parent,
+								  ino);
 					fix_dotdot(ctx, pctx->ino,
 						   ctx->lost_and_found);
-					parent = ctx->lost_and_found;
 				}
 			}
 			break;
 		}
 		ino = parent;
-		if (loop_pass) {
-			ext2fs_mark_inode_bitmap(inode_loop_detect, ino);
-		} else if (parent_count++ > 2048) {
-			/*
-			 * If we've run into a path depth that's
-			 * greater than 2048, try again with the inode
-			 * loop bitmap turned on and start from the
-			 * top.
-			 */
-			loop_pass = 1;
-			if (inode_loop_detect)
-				ext2fs_clear_inode_bitmap(inode_loop_detect);
-			else {
-				pctx->errcode = ext2fs_allocate_inode_bitmap(fs, _("inode loop detection bitmap"), &inode_loop_detect);
-				if (pctx->errcode) {
-					pctx->num = 1;
-					fix_problem(ctx,
-				    PR_3_ALLOCATE_IBITMAP_ERROR, pctx);
-					ctx->flags |= E2F_FLAG_ABORT;
-					return -1;
-				}
-			}
-			ino = dir;
-		}
 	}
 
+	/*
+	 * Everything on the path is now either connected, or as
+	 * connected as the user wanted it to be.
+	 */
+	for (ino = dir; ext2fs_test_inode_bitmap(inode_loop_detect, ino); ) {
+		ext2fs_unmark_inode_bitmap(inode_loop_detect, ino);
+		ext2fs_mark_inode_bitmap(inode_done_map, ino);
+		if (e2fsck_dir_info_get_parent(ctx, ino, &ino) || !ino)
+			break;
+	}
+
+	if (no_dirinfo)
+		return 0;
+
 	/*
 	 * Make sure that .. and the parent directory are the same;
 	 * offer to fix it if not.
@@ -127,6 +127,21 @@ static void print_bitmap_problem(e2fsck_t ctx, int problem,
 	pctx->ino = pctx->ino2 = 0;
 }
 
+/*
+ * Return true if the first num bits of two buffers are the same
+ */
+static int bits_equal(const unsigned char *b1, const unsigned char *b2,
+		      unsigned int num)
+{
+	unsigned int	nbytes = num >> 3;
+
+	if (memcmp(b1, b2, nbytes))
+		return 0;
+	if (num & 7)
+		return !((b1[nbytes] ^ b2[nbytes]) & ((1 << (num & 7)) - 1));
+	return 1;
+}
+
 static void check_block_bitmaps(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
@@ -142,10 +157,16 @@ static void check_block_bitmaps(e2fsck_t ctx)
 	errcode_t	retval;
 	int		csum_flag;
 	int		skip_group = 0;
+	unsigned char	*cmp_buf;
+	unsigned int	cmp_size;
+	blk_t		num, used;
 
 	clear_problem_context(&pctx);
 	free_array = (int *) e2fsck_allocate_memory(ctx,
 	    fs->group_desc_count * sizeof(int), "free block count array");
+	cmp_size = (fs->super->s_blocks_per_group + 7) >> 3;
+	cmp_buf = (unsigned char *) e2fsck_allocate_memory(ctx,
+	    2 * cmp_size, "block bitmap comparison buffer");
 
 	if ((fs->super->s_first_data_block <
 	     ext2fs_get_block_bitmap_start(ctx->block_found_map)) ||
@@ -189,6 +210,29 @@ redo_counts:
 	for (i = fs->super->s_first_data_block;
 	     i < fs->super->s_blocks_count;
 	     i++) {
+		/*
+		 * Usually the two bitmaps agree on a whole group; then
+		 * its free blocks can be counted a word at a time.
+		 */
+		if (blocks == 0 && !skip_group) {
+			num = fs->super->s_blocks_per_group;
+			if (num > fs->super->s_blocks_count - i)
+				num = fs->super->s_blocks_count - i;
+			if (!ext2fs_get_block_bitmap_range(ctx->block_found_map,
+							   i, num, cmp_buf) &&
+			    !ext2fs_get_block_bitmap_range(fs->block_map, i,
+						num, cmp_buf + cmp_size) &&
+			    bits_equal(cmp_buf, cmp_buf + cmp_size, num) &&
+			    !ext2fs_count_used_range(fs->block_map, i,
+						     i + num - 1, &used)) {
+				group_free = num - used;
+				free_blocks += num - used;
+				blocks = num;
+				i += num - 1;
+				goto next_group;
+			}
+		}
+
 		actual = ext2fs_fast_test_block_bitmap(ctx->block_found_map, i);
 
 		if (skip_group) {
@@ -274,6 +318,7 @@ redo_counts:
 			free_blocks++;
 		}
 		blocks ++;
+	next_group:
 		if ((blocks == fs->super->s_blocks_per_group) ||
 		    (i == fs->super->s_blocks_count-1)) {
 			free_array[group] = group_free;
@@ -353,6 +398,7 @@ redo_counts:
 	}
 errout:
 	ext2fs_free_mem(&free_array);
+	ext2fs_free_mem(&cmp_buf);
 }
 
 #define blk64_t blk_t
@@ -508,10 +554,16 @@ static void check_inode_bitmaps(e2fsck_t ctx)
 	int		problem, save_problem, fixit, had_problem;
 	int		csum_flag;
 	int		skip_group = 0;
+	unsigned char	*cmp_buf;
+	unsigned int	cmp_size, j;
+	ext2_ino_t	num, used;
 
 	clear_problem_context(&pctx);
 	free_array = (int *) e2fsck_allocate_memory(ctx,
 	    fs->group_desc_count * sizeof(int), "free inode count array");
+	cmp_size = (fs->super->s_inodes_per_group + 7) >> 3;
+	cmp_buf = (unsigned char *) e2fsck_allocate_memory(ctx,
+	    3 * cmp_size, "inode bitmap comparison buffer");
 
 	dir_array = (int *) e2fsck_allocate_memory(ctx,
 	   fs->group_desc_count * sizeof(int), "directory count array");
@@ -555,6 +607,38 @@ redo_counts:
 
 	/* Protect loop from wrap-around if inodes_count is maxed */
 	for (i = 1; i <= fs->super->s_inodes_count && i > 0; i++) {
+		/*
+		 * As for blocks, a group on which both bitmaps agree is
+		 * counted a word at a time; its directories are the
+		 * in-use inodes which are also in inode_dir_map.
+		 */
+		if (inodes == 0 && !skip_group) {
+			num = fs->super->s_inodes_per_group;
+			if (num > fs->super->s_inodes_count - i + 1)
+				num = fs->super->s_inodes_count - i + 1;
+			if (!ext2fs_get_inode_bitmap_range(ctx->inode_used_map,
+							   i, num, cmp_buf) &&
+			    !ext2fs_get_inode_bitmap_range(fs->inode_map, i,
+						num, cmp_buf + cmp_size) &&
+			    bits_equal(cmp_buf, cmp_buf + cmp_size, num) &&
+			    !ext2fs_get_inode_bitmap_range(ctx->inode_dir_map,
+						i, num, cmp_buf + 2 * cmp_size) &&
+			    !ext2fs_count_used_range(fs->inode_map, i,
+						     i + num - 1, &used)) {
+				for (j = 0; j < (num + 7) >> 3; j++)
+					cmp_buf[j] &= cmp_buf[2 * cmp_size + j];
+				if (num & 7)
+					cmp_buf[num >> 3] &= (1 << (num & 7)) - 1;
+				dirs_count = ext2fs_bitcount(cmp_buf,
+							     (num + 7) >> 3);
+				group_free = num - used;
+				free_inodes += num - used;
+				inodes = num;
+				i += num - 1;
+				goto next_group;
+			}
+		}
+
 		actual = ext2fs_fast_test_inode_bitmap(ctx->inode_used_map, i);
 		if (skip_group)
 			bitmap = 0;
@@ -614,6 +698,7 @@ do_counts:
 			free_inodes++;
 		}
 		inodes++;
+next_group:
 		if ((inodes == fs->super->s_inodes_per_group) ||
 		    (i == fs->super->s_inodes_count)) {
 			free_array[group] = group_free;
@@ -707,6 +792,7 @@ do_counts:
 errout:
 	ext2fs_free_mem(&free_array);
 	ext2fs_free_mem(&dir_array);
+	ext2fs_free_mem(&cmp_buf);
 }
 
 static void check_inode_end(e2fsck_t ctx)
@@ -48,6 +48,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "e2fsck.h"
 #include "problem.h"
 
@@ -85,11 +88,9 @@ static int fill_dir_block(ext2_filsys fs,
 			  void *priv_data)
 {
 	struct fill_dir_struct	*fd = (struct fill_dir_struct *) priv_data;
-	struct hash_entry 	*new_array, *ent;
 	struct ext2_dir_entry 	*dirent;
 	char			*dir;
-	unsigned int		offset, dir_offset, rec_len;
-	int			hash_alg;
+	unsigned int		offset;
 
 	if (blockcnt < 0)
 		return 0;
@@ -109,11 +110,26 @@ static int fill_dir_block(ext2_filsys fs,
 		if (fd->err)
 			return BLOCK_ABORT;
 	}
+	return 0;
+}
+
+/*
+ * Index the entries of one directory block which has been read into
+ * memory.  This does not do any I/O, and may be called from a worker
+ * thread.
+ */
+static int index_dir_block(ext2_filsys fs, struct fill_dir_struct *fd,
+			   char *dir)
+{
+	struct hash_entry 	*new_array, *ent;
+	struct ext2_dir_entry 	*dirent;
+	unsigned int		dir_offset, rec_len;
+	int			hash_alg;
+
 	hash_alg = fs->super->s_def_hash_version;
 	if ((hash_alg <= EXT2_HASH_TEA) &&
 	    (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
 		hash_alg += 3;
-	/* While the directory block is "hot", index it. */
 	dir_offset = 0;
 	while (dir_offset < fs->blocksize) {
 		dirent = (struct ext2_dir_entry *) (dir + dir_offset);
@@ -394,6 +410,18 @@ static int duplicate_search_and_fix(e2fsck_t ctx, ext2_filsys fs,
 }
 
 
+static void get_slack_percentage(e2fsck_t ctx)
+{
+	if (ctx->htree_slack_percentage == 255) {
+		profile_get_uint(ctx->profile, "options",
+				 "indexed_dir_slack_percentage",
+				 0, 20,
+				 &ctx->htree_slack_percentage);
+		if (ctx->htree_slack_percentage > 100)
+			ctx->htree_slack_percentage = 20;
+	}
+}
+
 static errcode_t copy_dir_entries(e2fsck_t ctx,
 				  struct fill_dir_struct *fd,
 				  struct out_dir *outdir)
@@ -408,14 +436,7 @@ static errcode_t copy_dir_entries(e2fsck_t ctx,
 	ext2_dirhash_t		prev_hash;
 	int			offset, slack;
 
-	if (ctx->htree_slack_percentage == 255) {
-		profile_get_uint(ctx->profile, "options",
-				 "indexed_dir_slack_percentage",
-				 0, 20,
-				 &ctx->htree_slack_percentage);
-		if (ctx->htree_slack_percentage > 100)
-			ctx->htree_slack_percentage = 20;
-	}
+	get_slack_percentage(ctx);
 
 	outdir->max = 0;
 	retval = alloc_size_dir(fs, outdir,
@@ -699,134 +720,434 @@ static errcode_t write_directory(e2fsck_t ctx, ext2_filsys fs,
 	return 0;
 }
 
-errcode_t e2fsck_rehash_dir(e2fsck_t ctx, ext2_ino_t ino)
-{
-	ext2_filsys 		fs = ctx->fs;
-	errcode_t		retval;
-	struct ext2_inode 	inode;
-	char			*dir_buf = 0;
+/*
+ * The state of one directory being rebuilt.  The directory is read
+ * and written by the main thread; in between, rehash_sort() may run
+ * in a worker thread.
+ */
+struct rehash_dir {
+	ext2_ino_t		ino;
+	struct ext2_inode	inode;
+	char			*dir_buf;
 	struct fill_dir_struct	fd;
 	struct out_dir		outdir;
+	errcode_t		retval;
+	int			built;	/* outdir is ready to be written */
+	int			state;	/* RH_* */
+#ifdef RESOURCE_TRACK
+	float			read_time, sort_time;
+#endif
+};
 
-	outdir.max = outdir.num = 0;
-	outdir.buf = 0;
-	outdir.hashes = 0;
-	e2fsck_read_inode(ctx, ino, &inode, "rehash_dir");
+#define RH_FREE		0
+#define RH_QUEUED	1	/* waiting for a worker */
+#define RH_BUSY		2	/* being sorted by a worker */
+#define RH_DONE		3	/* ready to be written */
+
+#ifdef RESOURCE_TRACK
+static float time_since(struct timeval *start)
+{
+	struct timeval	now;
 
-	retval = ENOMEM;
-	fd.harray = 0;
-	dir_buf = malloc(inode.i_size);
-	if (!dir_buf)
-		goto errout;
-
-	fd.max_array = inode.i_size / 32;
-	fd.num_array = 0;
-	fd.harray = malloc(fd.max_array * sizeof(struct hash_entry));
-	if (!fd.harray)
-		goto errout;
-
-	fd.ctx = ctx;
-	fd.buf = dir_buf;
-	fd.inode = &inode;
-	fd.err = 0;
-	fd.dir_size = 0;
-	fd.compress = 0;
+	gettimeofday(&now, 0);
+	return ((now.tv_sec - start->tv_sec) +
+		((float) (now.tv_usec - start->tv_usec)) / 1000000);
+}
+#endif
+
+/*
+ * Sort the entries by hash, or by inode number.  In a directory which
+ * is not indexed, '.' and '..' stay in front.
+ */
+static void sort_dir(struct fill_dir_struct *fd, int by_ino)
+{
+	struct hash_entry	*base = fd->harray;
+	int			num = fd->num_array;
+
+	if (fd->compress) {
+		base += 2;
+		num -= 2;
+	}
+	if (num > 1)
+		qsort(base, num, sizeof(struct hash_entry),
+		      by_ino ? ino_cmp : hash_cmp);
+}
+
+/*
+ * Return true if duplicate_search_and_fix() would find anything to
+ * ask about.  The entries must already be sorted.
+ */
+static int has_duplicates(struct fill_dir_struct *fd)
+{
+	struct hash_entry 	*ent, *prev;
+	int			i;
+
+	for (i=1; i < fd->num_array; i++) {
+		ent = fd->harray + i;
+		prev = ent - 1;
+		if (ent->dir->inode &&
+		    ((ent->dir->name_len & 0xFF) ==
+		     (prev->dir->name_len & 0xFF)) &&
+		    !strncmp(ent->dir->name, prev->dir->name,
+			     ent->dir->name_len & 0xFF))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Read the entire directory into memory.
+ */
+static errcode_t rehash_read(e2fsck_t ctx, struct rehash_dir *rd)
+{
+	ext2_filsys 		fs = ctx->fs;
+	struct fill_dir_struct	*fd = &rd->fd;
+	struct ext2_dir_entry	*dirent;
+	unsigned int		offset;
+	errcode_t		retval;
+#ifdef RESOURCE_TRACK
+	struct timeval		start;
+
+	gettimeofday(&start, 0);
+#endif
+	e2fsck_read_inode(ctx, rd->ino, &rd->inode, "rehash_dir");
+
+	rd->dir_buf = malloc(rd->inode.i_size);
+	if (!rd->dir_buf)
+		return ENOMEM;
+
+	fd->max_array = rd->inode.i_size / 32;
+	fd->num_array = 0;
+	fd->harray = malloc(fd->max_array * sizeof(struct hash_entry));
+	if (!fd->harray)
+		return ENOMEM;
+
+	fd->ctx = ctx;
+	fd->buf = rd->dir_buf;
+	fd->inode = &rd->inode;
+	fd->err = 0;
+	fd->dir_size = 0;
+	fd->compress = 0;
 	if (!(fs->super->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) ||
-	    (inode.i_size / fs->blocksize) < 2)
-		fd.compress = 1;
-	fd.parent = 0;
+	    (rd->inode.i_size / fs->blocksize) < 2)
+		fd->compress = 1;
+	fd->parent = 0;
+
+	/* Blocks which are not mapped at all are indexed as empty */
+	for (offset = 0; offset + fs->blocksize <= rd->inode.i_size;
+	     offset += fs->blocksize) {
+		dirent = (struct ext2_dir_entry *) (rd->dir_buf + offset);
+		dirent->inode = 0;
+		dirent->name_len = 0;
+		(void) ext2fs_set_rec_len(fs, fs->blocksize, dirent);
+	}
+
+	retval = ext2fs_block_iterate2(fs, rd->ino, 0, 0,
+				       fill_dir_block, fd);
+	if (fd->err)
+		retval = fd->err;
+#ifdef RESOURCE_TRACK
+	rd->read_time = time_since(&start);
+#endif
+	return retval;
+}
+
+/*
+ * Index and sort the entries of a directory which has been read, and
+ * if there are no duplicate names to ask about, build the new
+ * directory in memory as well.  This does not do any I/O, or ask any
+ * questions, so it may be called from a worker thread.
+ */
+static void rehash_sort(e2fsck_t ctx, struct rehash_dir *rd)
+{
+	ext2_filsys 		fs = ctx->fs;
+	struct fill_dir_struct	*fd = &rd->fd;
+	unsigned int		offset;
+#ifdef RESOURCE_TRACK
+	struct timeval		start;
+
+	gettimeofday(&start, 0);
+#endif
 
 retry_nohash:
-	/* Read in the entire directory into memory */
-	retval = ext2fs_block_iterate2(fs, ino, 0, 0,
-				       fill_dir_block, &fd);
-	if (fd.err) {
-		retval = fd.err;
-		goto errout;
+	for (offset = 0; offset + fs->blocksize <= rd->inode.i_size;
+	     offset += fs->blocksize) {
+		if (index_dir_block(fs, fd, rd->dir_buf + offset)) {
+			rd->retval = fd->err;
+			goto out;
+		}
 	}
 
-	/* 
+	/*
 	 * If the entries read are less than a block, then don't index
 	 * the directory
 	 */
-	if (!fd.compress && (fd.dir_size < (fs->blocksize - 24))) {
-		fd.compress = 1;
-		fd.dir_size = 0;
-		fd.num_array = 0;
+	if (!fd->compress && (fd->dir_size < (fs->blocksize - 24))) {
+		fd->compress = 1;
+		fd->dir_size = 0;
+		fd->num_array = 0;
 		goto retry_nohash;
 	}
 
 #if 0
 	printf("%d entries (%d bytes) found in inode %d\n",
-	       fd.num_array, fd.dir_size, ino);
+	       fd->num_array, fd->dir_size, rd->ino);
 #endif
 
-	/* Sort the list */
-resort:
-	if (fd.compress)
-		qsort(fd.harray+2, fd.num_array-2, sizeof(struct hash_entry),
-		      hash_cmp);
-	else
-		qsort(fd.harray, fd.num_array, sizeof(struct hash_entry),
-		      hash_cmp);
-
-	/*
-	 * Look for duplicates
-	 */
-	if (duplicate_search_and_fix(ctx, fs, ino, &fd))
-		goto resort;
-
-	if (ctx->options & E2F_OPT_NO) {
-		retval = 0;
-		goto errout;
-	}
+	sort_dir(fd, 0);
+	if (has_duplicates(fd) || (ctx->options & E2F_OPT_NO))
+		goto out;
 
 	/* Sort non-hashed directories by inode number */
-	if (fd.compress)
-		qsort(fd.harray+2, fd.num_array-2,
-		      sizeof(struct hash_entry), ino_cmp);
+	if (fd->compress)
+		sort_dir(fd, 1);
 
 	/*
 	 * Copy the directory entries.  In a htree directory these
 	 * will become the leaf nodes.
 	 */
-	retval = copy_dir_entries(ctx, &fd, &outdir);
-	if (retval)
-		goto errout;
-
-	free(dir_buf); dir_buf = 0;
+	rd->retval = copy_dir_entries(ctx, fd, &rd->outdir);
+	if (rd->retval)
+		goto out;
 
-	if (!fd.compress) {
+	if (!fd->compress) {
 		/* Calculate the interior nodes */
-		retval = calculate_tree(fs, &outdir, ino, fd.parent);
+		rd->retval = calculate_tree(fs, &rd->outdir, rd->ino,
+					    fd->parent);
+		if (rd->retval)
+			goto out;
+	}
+	rd->built = 1;
+out:
+#ifdef RESOURCE_TRACK
+	rd->sort_time = time_since(&start);
+#endif
+	return;
+}
+
+/*
+ * Fix any duplicate names, finish building the new directory if
+ * rehash_sort() had to stop, and write it out.
+ */
+static errcode_t rehash_write(e2fsck_t ctx, struct rehash_dir *rd)
+{
+	ext2_filsys 		fs = ctx->fs;
+	struct fill_dir_struct	*fd = &rd->fd;
+	errcode_t		retval;
+
+	if (rd->retval)
+		return rd->retval;
+
+	if (!rd->built) {
+		/*
+		 * Look for duplicates
+		 */
+		while (duplicate_search_and_fix(ctx, fs, rd->ino, fd))
+			sort_dir(fd, 0);
+
+		if (ctx->options & E2F_OPT_NO)
+			return 0;
+
+		/* Sort non-hashed directories by inode number */
+		if (fd->compress)
+			sort_dir(fd, 1);
+
+		retval = copy_dir_entries(ctx, fd, &rd->outdir);
 		if (retval)
-			goto errout;
+			return retval;
+
+		if (!fd->compress) {
+			retval = calculate_tree(fs, &rd->outdir, rd->ino,
+						fd->parent);
+			if (retval)
+				return retval;
+		}
 	}
 
-	retval = write_directory(ctx, fs, &outdir, ino, fd.compress);
-	if (retval)
-		goto errout;
+	free(rd->dir_buf);
+	rd->dir_buf = 0;
 
-errout:
-	free(dir_buf);
-	free(fd.harray);
+	return write_directory(ctx, fs, &rd->outdir, rd->ino,
+			       fd->compress);
+}
+
+static void rehash_free(struct rehash_dir *rd)
+{
+	free(rd->dir_buf);
+	free(rd->fd.harray);
+	free_out_dir(&rd->outdir);
+	memset(rd, 0, sizeof(struct rehash_dir));
+}
 
-	free_out_dir(&outdir);
+errcode_t e2fsck_rehash_dir(e2fsck_t ctx, ext2_ino_t ino)
+{
+	struct rehash_dir	rd;
+	errcode_t		retval;
+
+	memset(&rd, 0, sizeof(rd));
+	rd.ino = ino;
+	retval = rehash_read(ctx, &rd);
+	if (!retval) {
+		rehash_sort(ctx, &rd);
+		retval = rehash_write(ctx, &rd);
+	}
+	rehash_free(&rd);
 	return retval;
 }
 
+#ifdef HAVE_PTHREAD
+/*
+ * With "-E threads=N", the directories are indexed, sorted and built
+ * by a pool of worker threads, while the main thread reads the
+ * directories ahead of them, and writes out the results in order.
+ * The main thread is the only one which does any I/O, allocates
+ * blocks, or asks questions, so the output is the same as with one
+ * thread.
+ */
+#define RH_DIRS_PER_THREAD	4	/* directories in flight per thread */
+
+struct rehash_pool {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;	/* a directory has been queued */
+	pthread_cond_t		done;	/* a directory has been sorted */
+	pthread_t		*threads;
+	int			num_threads;
+	int			stop;
+	e2fsck_t		ctx;
+	struct rehash_dir	*dirs;
+	int			num_dirs;
+	struct rehash_dir	**queue;	/* num_dirs entries */
+	int			queue_head, queue_tail;
+};
+
+static void rehash_pool_stop(struct rehash_pool *pool);
+
+static void *rehash_thread(void *arg)
+{
+	struct rehash_pool	*pool = arg;
+	struct rehash_dir	*rd;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		if (pool->queue_head == pool->queue_tail) {
+			if (pool->stop)
+				break;
+			pthread_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+		rd = pool->queue[pool->queue_head++ % pool->num_dirs];
+		rd->state = RH_BUSY;
+		pthread_mutex_unlock(&pool->lock);
+
+		rehash_sort(pool->ctx, rd);
+
+		pthread_mutex_lock(&pool->lock);
+		rd->state = RH_DONE;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+static struct rehash_pool *rehash_pool_start(e2fsck_t ctx)
+{
+	struct rehash_pool	*pool;
+	int			i;
+
+	if (ctx->num_threads < 2)
+		return 0;
+
+	/* Read the profile before anyone else can look at it */
+	get_slack_percentage(ctx);
+
+	pool = e2fsck_allocate_memory(ctx, sizeof(struct rehash_pool),
+				      "rehash thread pool");
+	pool->threads = e2fsck_allocate_memory(ctx, ctx->num_threads *
+					       sizeof(pthread_t),
+					       "rehash threads");
+	pool->num_dirs = ctx->num_threads * RH_DIRS_PER_THREAD;
+	pool->dirs = e2fsck_allocate_memory(ctx, pool->num_dirs *
+					    sizeof(struct rehash_dir),
+					    "rehash directories");
+	pool->queue = e2fsck_allocate_memory(ctx, pool->num_dirs *
+					     sizeof(struct rehash_dir *),
+					     "rehash queue");
+	pool->ctx = ctx;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < ctx->num_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, rehash_thread,
+				   pool))
+			break;
+		pool->num_threads++;
+	}
+	if (!pool->num_threads) {
+		rehash_pool_stop(pool);
+		return 0;
+	}
+	return pool;
+}
+
+static void rehash_pool_queue(struct rehash_pool *pool,
+			      struct rehash_dir *rd)
+{
+	pthread_mutex_lock(&pool->lock);
+	rd->state = RH_QUEUED;
+	pool->queue[pool->queue_tail++ % pool->num_dirs] = rd;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void rehash_pool_wait(struct rehash_pool *pool,
+			     struct rehash_dir *rd)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (rd->state != RH_DONE)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void rehash_pool_stop(struct rehash_pool *pool)
+{
+	int	i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+
+	ext2fs_free_mem(&pool->threads);
+	ext2fs_free_mem(&pool->queue);
+	ext2fs_free_mem(&pool->dirs);
+	ext2fs_free_mem(&pool);
+}
+#endif /* HAVE_PTHREAD */
+
 void e2fsck_rehash_directories(e2fsck_t ctx)
 {
 	struct problem_context	pctx;
 #ifdef RESOURCE_TRACK
 	struct resource_track	rtrack;
+	struct timeval		start;
+#endif
+#ifdef HAVE_PTHREAD
+	struct rehash_pool	*pool = 0;
 #endif
 	struct dir_info		*dir;
 	ext2_u32_iterate 	iter;
 	struct dir_info_iter *	dirinfo_iter = 0;
+	struct rehash_dir	one_dir, *dirs, *rd;
 	ext2_ino_t		ino;
 	errcode_t		retval;
 	int			cur, max, all_dirs, dir_index, first = 1;
+	int			num_dirs, next_read, next_write, more;
 
 	init_resource_track(&rtrack, ctx->fs->io);
 #ifdef EXT2FS_SNAPSHOT_HAS_SNAPSHOT
@@ -862,35 +1183,97 @@ void e2fsck_rehash_directories(e2fsck_t ctx)
 		}
 		max = ext2fs_u32_list_count(ctx->dirs_to_hash);
 	}
+
+	memset(&one_dir, 0, sizeof(one_dir));
+	dirs = &one_dir;
+	num_dirs = 1;
+#ifdef HAVE_PTHREAD
+	pool = rehash_pool_start(ctx);
+	if (pool) {
+		dirs = pool->dirs;
+		num_dirs = pool->num_dirs;
+	}
+#endif
+	next_read = next_write = 0;
+	more = 1;
 	while (1) {
-		if (all_dirs) {
-			if ((dir = e2fsck_dir_info_iter(ctx,
-							dirinfo_iter)) == 0)
-				break;
-			ino = dir->ino;
-		} else {
-			if (!ext2fs_u32_list_iterate(iter, &ino))
-				break;
-		}
-		if (ino == ctx->lost_and_found)
-			continue;
-		pctx.dir = ino;
-		if (first) {
-			fix_problem(ctx, PR_3A_PASS_HEADER, &pctx);
-			first = 0;
+		/*
+		 * Read as many directories as there is room for, and
+		 * hand them to the workers
+		 */
+		while (more && next_read - next_write < num_dirs) {
+			if (all_dirs) {
+				if ((dir = e2fsck_dir_info_iter(ctx,
+							dirinfo_iter)) == 0) {
+					more = 0;
+					break;
+				}
+				ino = dir->ino;
+			} else {
+				if (!ext2fs_u32_list_iterate(iter, &ino)) {
+					more = 0;
+					break;
+				}
+			}
+			if (ino == ctx->lost_and_found)
+				continue;
+			if (first) {
+				pctx.dir = ino;
+				fix_problem(ctx, PR_3A_PASS_HEADER, &pctx);
+				first = 0;
+			}
+			rd = &dirs[next_read++ % num_dirs];
+			rd->ino = ino;
+			rd->retval = rehash_read(ctx, rd);
+#ifdef HAVE_PTHREAD
+			if (pool && !rd->retval) {
+				rehash_pool_queue(pool, rd);
+				continue;
+			}
+#endif
+			if (!rd->retval)
+				rehash_sort(ctx, rd);
+			rd->state = RH_DONE;
 		}
+		if (next_write == next_read)
+			break;
+
+		/* Write them out in order */
+		rd = &dirs[next_write++ % num_dirs];
+#ifdef HAVE_PTHREAD
+		if (pool)
+			rehash_pool_wait(pool, rd);
+#endif
+#ifdef RESOURCE_TRACK
+		gettimeofday(&start, 0);
+#endif
+		pctx.dir = rd->ino;
 #if 0
 		fix_problem(ctx, PR_3A_OPTIMIZE_DIR, &pctx);
 #endif
-		pctx.errcode = e2fsck_rehash_dir(ctx, ino);
+		pctx.errcode = rehash_write(ctx, rd);
 		if (pctx.errcode) {
 			end_problem_latch(ctx, PR_LATCH_OPTIMIZE_DIR);
 			fix_problem(ctx, PR_3A_OPTIMIZE_DIR_ERR, &pctx);
 		}
+#ifdef RESOURCE_TRACK
+		if (ctx->options & E2F_OPT_TIME2) {
+			e2fsck_clear_progbar(ctx);
+			printf(_("Directory %u: %d entries, read %5.3fs, "
+				 "sort %5.3fs, write %5.3fs\n"),
+			       rd->ino, rd->fd.num_array, rd->read_time,
+			       rd->sort_time, time_since(&start));
+		}
+#endif
 		if (ctx->progress && !ctx->progress_fd)
 			e2fsck_simple_progress(ctx, "Rebuilding directory",
-			       100.0 * (float) (++cur) / (float) max, ino);
+			       100.0 * (float) (++cur) / (float) max, rd->ino);
+		rehash_free(rd);
 	}
+#ifdef HAVE_PTHREAD
+	if (pool)
+		rehash_pool_stop(pool);
+#endif
 	end_problem_latch(ctx, PR_LATCH_OPTIMIZE_DIR);
 	if (all_dirs)
 		e2fsck_dir_info_iter_end(ctx, dirinfo_iter);
@@ -570,7 +570,7 @@ static void signal_cancel(int sig EXT2FS_ATTR((unused)))
 static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 {
 	char	*buf, *token, *next, *p, *arg;
-	int	ea_ver;
+	int	ea_ver, threads;
 	int	extended_usage = 0;
 
 	buf = string_copy(ctx, opts, 0);
@@ -609,6 +609,19 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 				continue;
 			}
 			ctx->options |= E2F_OPT_JOURNAL_ONLY;
+		} else if (strcmp(token, "threads") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			threads = strtoul(arg, &p, 0);
+			if (*p || threads < 1 || threads > 1024) {
+				fprintf(stderr,
+					_("Invalid number of threads.\n"));
+				extended_usage++;
+				continue;
+			}
+			ctx->num_threads = threads;
 		} else {
 			fprintf(stderr, _("Unknown extended option: %s\n"),
 				token);
@@ -625,6 +638,7 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 		fputs(("\tea_ver=<ea_version (1 or 2)>\n"), stderr);
 		fputs(("\tfragcheck\n"), stderr);
 		fputs(("\tjournal_only\n"), stderr);
+		fputs(("\tthreads=<number of worker threads>\n"), stderr);
 		fputc('\n', stderr);
 		exit(1);
 	}
@@ -1049,7 +1063,8 @@ int main (int argc, char *argv[])
 	ctx->superblock = ctx->use_superblock;
 restart:
 #ifdef CONFIG_TESTIO_DEBUG
-	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
+	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK") ||
+	    getenv("TEST_IO_TRACE")) {
 		io_ptr = test_io_manager;
 		test_io_backing_manager = unix_io_manager;
 	} else
@@ -1197,6 +1212,7 @@ failure:
 
 	ctx->fs = fs;
 	fs->priv_data = ctx;
+	fs->bitmap_error = e2fsck_bitmap_error;
 	fs->now = ctx->now;
 	sb = fs->super;
 	if (sb->s_rev_level > E2FSCK_CURRENT_REV) {
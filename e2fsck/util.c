@@ -59,6 +59,19 @@ void fatal_error(e2fsck_t ctx, const char *msg)
 	exit(FSCK_ERROR);
 }
 
+/*
+ * Called by the library when it could not change a bit in one of our
+ * bitmaps; the bitmap is now wrong, so we can't go on.
+ */
+void e2fsck_bitmap_error(ext2_filsys fs, errcode_t error,
+			 const char *description)
+{
+	e2fsck_t ctx = (e2fsck_t) fs->priv_data;
+
+	com_err(ctx->program_name, error, _("while updating %s"), description);
+	fatal_error(ctx, 0);
+}
+
 void *e2fsck_allocate_memory(e2fsck_t ctx, unsigned int size,
 			     const char *description)
 {
@@ -251,6 +264,63 @@ void e2fsck_write_bitmaps(e2fsck_t ctx)
 	}
 }
 
+/*
+ * e2fsck's private bitmaps are allocated with a backend suited to how
+ * each one is used: a bit array for the dense maps which are tested
+ * for every block or inode, such as block_found_map, and a tree for
+ * the sparse ones, such as block_dup_map.  The choice can be
+ * overridden per bitmap in the [bitmaps] section of e2fsck.conf,
+ * e.g. "block_found_map = rbtree".
+ */
+static int e2fsck_bitmap_type(ext2_filsys fs, int deftype, const char *name)
+{
+	e2fsck_t	ctx = (e2fsck_t) fs->priv_data;
+	char		*type_str = 0;
+	int		type = deftype;
+
+	if (!ctx || !name)
+		return deftype;
+	profile_get_string(ctx->profile, "bitmaps", name, 0, 0, &type_str);
+	if (type_str) {
+		if (strcasecmp(type_str, "bitarray") == 0)
+			type = EXT2FS_BMAP64_BITARRAY;
+		else if (strcasecmp(type_str, "rbtree") == 0)
+			type = EXT2FS_BMAP64_RBTREE;
+		else if (strcasecmp(type_str, "roaring") == 0)
+			type = EXT2FS_BMAP64_ROARING;
+		free(type_str);
+	}
+	return type;
+}
+
+errcode_t e2fsck_allocate_inode_bitmap(ext2_filsys fs, const char *descr,
+				       int deftype, const char *name,
+				       ext2fs_inode_bitmap *ret)
+{
+	errcode_t	retval;
+	int		save_type;
+
+	save_type = fs->default_bitmap_type;
+	fs->default_bitmap_type = e2fsck_bitmap_type(fs, deftype, name);
+	retval = ext2fs_allocate_inode_bitmap(fs, descr, ret);
+	fs->default_bitmap_type = save_type;
+	return retval;
+}
+
+errcode_t e2fsck_allocate_block_bitmap(ext2_filsys fs, const char *descr,
+				       int deftype, const char *name,
+				       ext2fs_block_bitmap *ret)
+{
+	errcode_t	retval;
+	int		save_type;
+
+	save_type = fs->default_bitmap_type;
+	fs->default_bitmap_type = e2fsck_bitmap_type(fs, deftype, name);
+	retval = ext2fs_allocate_block_bitmap(fs, descr, ret);
+	fs->default_bitmap_type = save_type;
+	return retval;
+}
+
 void preenhalt(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
@@ -290,14 +360,9 @@ void init_resource_track(struct resource_track *track, io_channel channel)
 	track->user_start.tv_sec = track->user_start.tv_usec = 0;
 	track->system_start.tv_sec = track->system_start.tv_usec = 0;
 #endif
-	track->bytes_read = 0;
-	track->bytes_written = 0;
 	if (channel && channel->manager && channel->manager->get_stats)
 		channel->manager->get_stats(channel, &io_start);
-	if (io_start) {
-		track->bytes_read = io_start->bytes_read;
-		track->bytes_written = io_start->bytes_written;
-	}
+	io_stats_copy(&track->io_start, io_start);
 }
 
 #ifdef __GNUC__
@@ -368,14 +433,27 @@ void print_resource_track(e2fsck_t ctx, const char *desc,
 
 		channel->manager->get_stats(channel, &delta);
 		if (delta) {
-			bytes_read = delta->bytes_read - track->bytes_read;
+			bytes_read = delta->bytes_read -
+				track->io_start.bytes_read;
 			bytes_written = delta->bytes_written -
-				track->bytes_written;
+				track->io_start.bytes_written;
 		}
 		printf("I/O read: %lluMB, write: %lluMB, rate: %.2fMB/s\n",
 		       mbytes(bytes_read), mbytes(bytes_written),
 		       (double)mbytes(bytes_read + bytes_written) /
 		       timeval_subtract(&time_end, &track->time_start));
+		/*
+		 * The latency histograms are only shown in the
+		 * summary for the whole run, to keep -tt readable.
+		 */
+		if (delta && delta->num_fields >= IO_STATS_FIELDS) {
+			char prefix[64];
+
+			snprintf(prefix, sizeof(prefix), "%s%s",
+				 desc ? desc : "", desc ? ": " : "");
+			io_stats_print(stdout, prefix, delta,
+				       &track->io_start, desc == NULL);
+		}
 	}
 }
 #endif /* RESOURCE_TRACK */
@@ -608,6 +686,61 @@ errcode_t e2fsck_zero_blocks(ext2_filsys fs, blk_t blk, int num,
  * Check to see if a filesystem is in /proc/filesystems.
  * Returns 1 if found, 0 if not
  */
+/*
+ * Give a worker thread a filesystem handle of its own.  It has a copy
+ * of the superblock and its own I/O channel, and nothing else: no
+ * group descriptors, bitmaps or inode cache.  This is enough to read
+ * directory blocks, and to run the block iterator and the extent
+ * functions on an inode supplied through the read_inode hook.
+ */
+errcode_t e2fsck_open_worker_fs(e2fsck_t ctx, ext2_filsys *ret_fs)
+{
+	ext2_filsys	fs = ctx->fs, wfs;
+	errcode_t	retval;
+
+	retval = ext2fs_get_mem(sizeof(struct struct_ext2_filsys), &wfs);
+	if (retval)
+		return retval;
+	memset(wfs, 0, sizeof(struct struct_ext2_filsys));
+	wfs->magic = EXT2_ET_MAGIC_EXT2FS_FILSYS;
+	wfs->flags = fs->flags & ~EXT2_FLAG_RW;
+	wfs->blocksize = fs->blocksize;
+	wfs->fragsize = fs->fragsize;
+	wfs->group_desc_count = fs->group_desc_count;
+	wfs->inode_blocks_per_group = fs->inode_blocks_per_group;
+	retval = ext2fs_get_mem(SUPERBLOCK_SIZE, &wfs->super);
+	if (retval)
+		goto errout;
+	memcpy(wfs->super, fs->super, SUPERBLOCK_SIZE);
+	retval = fs->io->manager->open(ctx->filesystem_name, 0, &wfs->io);
+	if (retval)
+		goto errout;
+	if (ctx->io_options)
+		retval = io_channel_set_options(wfs->io, ctx->io_options);
+	if (!retval)
+		retval = io_channel_set_blksize(wfs->io, fs->blocksize);
+	if (retval)
+		goto errout;
+	*ret_fs = wfs;
+	return 0;
+errout:
+	if (wfs->io)
+		io_channel_close(wfs->io);
+	if (wfs->super)
+		ext2fs_free_mem(&wfs->super);
+	ext2fs_free_mem(&wfs);
+	return retval;
+}
+
+void e2fsck_close_worker_fs(ext2_filsys *fs)
+{
+	if (!*fs)
+		return;
+	io_channel_close((*fs)->io);
+	ext2fs_free_mem(&(*fs)->super);
+	ext2fs_free_mem(fs);
+}
+
 int fs_proc_check(const char *fs_name)
 {
 	FILE	*f;
@@ -21,9 +21,24 @@
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "bmap64.h"
+
+/*
+ * A demand-loaded bitmap which could not be read completely must not
+ * be allocated from: the groups which failed only look full.
+ */
+static errcode_t alloc_error(ext2fs_generic_bitmap map, errcode_t retval)
+{
+	errcode_t	load_error = ext2fs_bmap_load_error(map);
+
+	return load_error ? load_error : retval;
+}
 
 /*
  * Check for uninit block bitmaps and deal with them appropriately
@@ -103,8 +118,10 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 			   ext2fs_inode_bitmap map, ext2_ino_t *ret)
 {
 	ext2_ino_t	dir_group = 0;
-	ext2_ino_t	i;
+	ext2_ino_t	i, upto, first_zero;
 	ext2_ino_t	start_inode;
+	dgrp_t		group;
+	errcode_t	retval;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -112,6 +129,9 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 		map = fs->inode_map;
 	if (!map)
 		return EXT2_ET_NO_INODE_BITMAP;
+	retval = alloc_error(map, 0);
+	if (retval)
+		return retval;
 
 	if (dir > 0)
 		dir_group = (dir - 1) / EXT2_INODES_PER_GROUP(fs->super);
@@ -123,22 +143,36 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 		return EXT2_ET_INODE_ALLOC_FAIL;
 	i = start_inode;
 
+	/*
+	 * Search a group at a time, so that uninitialized groups are
+	 * dealt with before their part of the bitmap is looked at.
+	 */
 	do {
+		group = (i - 1) / EXT2_INODES_PER_GROUP(fs->super);
 		if (((i - 1) % EXT2_INODES_PER_GROUP(fs->super)) == 0)
-			check_inode_uninit(fs, map, (i - 1) /
-					   EXT2_INODES_PER_GROUP(fs->super));
+			check_inode_uninit(fs, map, group);
+
+		upto = (group + 1) * EXT2_INODES_PER_GROUP(fs->super);
+		if (upto > fs->super->s_inodes_count)
+			upto = fs->super->s_inodes_count;
+		if (i < start_inode && upto >= start_inode)
+			upto = start_inode - 1;
+
+		retval = ext2fs_find_first_zero_inode_bitmap(map, i, upto,
+							     &first_zero);
+		if (retval == 0) {
+			*ret = first_zero;
+			return alloc_error(map, 0);
+		}
+		if (retval != ENOENT)
+			return alloc_error(map, EXT2_ET_INODE_ALLOC_FAIL);
 
-		if (!ext2fs_fast_test_inode_bitmap(map, i))
-			break;
-		i++;
+		i = upto + 1;
 		if (i > fs->super->s_inodes_count)
 			i = EXT2_FIRST_INODE(fs->super);
 	} while (i != start_inode);
 
-	if (ext2fs_test_inode_bitmap(map, i))
-		return EXT2_ET_INODE_ALLOC_FAIL;
-	*ret = i;
-	return 0;
+	return alloc_error(map, EXT2_ET_INODE_ALLOC_FAIL);
 }
 
 /*
@@ -148,7 +182,9 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 errcode_t ext2fs_new_block(ext2_filsys fs, blk_t goal,
 			   ext2fs_block_bitmap map, blk_t *ret)
 {
-	blk_t	i;
+	blk_t	i, upto;
+	dgrp_t	group;
+	errcode_t	retval;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -156,28 +192,33 @@ errcode_t ext2fs_new_block(ext2_filsys fs, blk_t goal,
 		map = fs->block_map;
 	if (!map)
 		return EXT2_ET_NO_BLOCK_BITMAP;
+	retval = alloc_error(map, 0);
+	if (retval)
+		return retval;
 	if (!goal || (goal >= fs->super->s_blocks_count))
 		goal = fs->super->s_first_data_block;
 	i = goal;
-	check_block_uninit(fs, map,
-			   (i - fs->super->s_first_data_block) /
-			   EXT2_BLOCKS_PER_GROUP(fs->super));
 	do {
-		if (((i - fs->super->s_first_data_block) %
-		     EXT2_BLOCKS_PER_GROUP(fs->super)) == 0)
-			check_block_uninit(fs, map,
-					   (i - fs->super->s_first_data_block) /
-					   EXT2_BLOCKS_PER_GROUP(fs->super));
-
-		if (!ext2fs_fast_test_block_bitmap(map, i)) {
-			*ret = i;
-			return 0;
-		}
-		i++;
+		group = (i - fs->super->s_first_data_block) /
+			EXT2_BLOCKS_PER_GROUP(fs->super);
+		check_block_uninit(fs, map, group);
+
+		upto = fs->super->s_first_data_block +
+			(group + 1) * EXT2_BLOCKS_PER_GROUP(fs->super) - 1;
+		if (upto >= fs->super->s_blocks_count)
+			upto = fs->super->s_blocks_count - 1;
+		if (i < goal && upto >= goal)
+			upto = goal - 1;
+
+		if (ext2fs_find_first_zero_block_bitmap(map, i, upto,
+							ret) == 0)
+			return alloc_error(map, 0);
+
+		i = upto + 1;
 		if (i >= fs->super->s_blocks_count)
 			i = fs->super->s_first_data_block;
 	} while (i != goal);
-	return EXT2_ET_BLOCK_ALLOC_FAIL;
+	return alloc_error(map, EXT2_ET_BLOCK_ALLOC_FAIL);
 }
 
 /*
@@ -231,10 +272,35 @@ fail:
 	return retval;
 }
 
+/*
+ * Find the first run of num clear blocks which starts in [b, last];
+ * the run may extend past last.
+ */
+static int find_free_run(ext2fs_block_bitmap map, blk_t b, blk_t last,
+			 int num, blk_t *ret)
+{
+	blk_t	next;
+
+	while (b <= last) {
+		if (ext2fs_find_first_zero_block_bitmap(map, b, last, &b))
+			return 0;
+		if (ext2fs_find_first_set_block_bitmap(map, b, b + num - 1,
+						       &next)) {
+			*ret = b;
+			return 1;
+		}
+		b = next + 1;
+	}
+	return 0;
+}
+
 errcode_t ext2fs_get_free_blocks(ext2_filsys fs, blk_t start, blk_t finish,
 				 int num, ext2fs_block_bitmap map, blk_t *ret)
 {
 	blk_t	b = start;
+	blk_t	first = fs->super->s_first_data_block;
+	blk_t	last;
+	errcode_t	retval;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -242,22 +308,38 @@ errcode_t ext2fs_get_free_blocks(ext2_filsys fs, blk_t start, blk_t finish,
 		map = fs->block_map;
 	if (!map)
 		return EXT2_ET_NO_BLOCK_BITMAP;
+	retval = alloc_error(map, 0);
+	if (retval)
+		return retval;
 	if (!b)
-		b = fs->super->s_first_data_block;
+		b = first;
 	if (!finish)
 		finish = start;
 	if (!num)
 		num = 1;
-	do {
-		if (b+num-1 > fs->super->s_blocks_count)
-			b = fs->super->s_first_data_block;
-		if (ext2fs_fast_test_block_bitmap_range(map, b, num)) {
-			*ret = b;
-			return 0;
-		}
-		b++;
-	} while (b != finish);
-	return EXT2_ET_BLOCK_ALLOC_FAIL;
+	if ((blk_t) num > fs->super->s_blocks_count - first)
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+
+	/*
+	 * Candidate starting blocks run from b up to the last block at
+	 * which a run of num blocks still fits, then wrap around to
+	 * the first data block, stopping before finish.
+	 */
+	last = fs->super->s_blocks_count - num;
+	if (b > last)
+		b = first;
+	if (finish > b && finish - 1 <= last) {
+		if (find_free_run(map, b, finish - 1, num, ret))
+			return alloc_error(map, 0);
+		return alloc_error(map, EXT2_ET_BLOCK_ALLOC_FAIL);
+	}
+	if (find_free_run(map, b, last, num, ret))
+		return alloc_error(map, 0);
+	if (finish > b)
+		finish = b;
+	if (finish > first && find_free_run(map, first, finish - 1, num, ret))
+		return alloc_error(map, 0);
+	return alloc_error(map, EXT2_ET_BLOCK_ALLOC_FAIL);
 }
 
 void ext2fs_set_alloc_block_callback(ext2_filsys fs,
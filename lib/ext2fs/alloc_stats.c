@@ -101,3 +101,131 @@ void ext2fs_set_block_alloc_stats_callback(ext2_filsys fs,
 
 	fs->block_alloc_stats = func;
 }
+
+/*
+ * In a BLOCK_UNINIT group only the group's own metadata can be in use,
+ * so the used blocks are the marked blocks among those.  The metadata
+ * extents are sorted and merged first so no block is counted twice.
+ */
+static errcode_t count_uninit_used(ext2_filsys fs, dgrp_t group,
+				   blk_t first, blk_t last, blk_t *ret)
+{
+	blk_t		start[6], end[6], s, e, used, count = 0;
+	blk_t		super_blk, old_desc_blk, new_desc_blk;
+	int		old_desc_blocks, num = 0, i, j;
+	errcode_t	retval;
+
+	ext2fs_super_and_bgd_loc(fs, group, &super_blk, &old_desc_blk,
+				 &new_desc_blk, 0);
+	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+		old_desc_blocks = fs->super->s_first_meta_bg;
+	else
+		old_desc_blocks = fs->desc_blocks +
+			fs->super->s_reserved_gdt_blocks;
+
+	if (super_blk || group == 0) {
+		start[num] = super_blk;
+		end[num++] = super_blk;
+	}
+	if (old_desc_blk && old_desc_blocks) {
+		start[num] = old_desc_blk;
+		end[num++] = old_desc_blk + old_desc_blocks - 1;
+	}
+	if (new_desc_blk) {
+		start[num] = new_desc_blk;
+		end[num++] = new_desc_blk;
+	}
+	start[num] = end[num] = fs->group_desc[group].bg_block_bitmap;
+	num++;
+	start[num] = end[num] = fs->group_desc[group].bg_inode_bitmap;
+	num++;
+	if (fs->inode_blocks_per_group) {
+		start[num] = fs->group_desc[group].bg_inode_table;
+		end[num++] = fs->group_desc[group].bg_inode_table +
+			fs->inode_blocks_per_group - 1;
+	}
+
+	for (i = 1; i < num; i++) {
+		s = start[i];
+		e = end[i];
+		for (j = i; j > 0 && start[j - 1] > s; j--) {
+			start[j] = start[j - 1];
+			end[j] = end[j - 1];
+		}
+		start[j] = s;
+		end[j] = e;
+	}
+
+	for (i = 0; i < num; i = j) {
+		s = start[i];
+		e = end[i];
+		for (j = i + 1; j < num && start[j] <= e + 1; j++)
+			if (end[j] > e)
+				e = end[j];
+		if (s < first)
+			s = first;
+		if (e > last)
+			e = last;
+		if (s > e)
+			continue;
+		retval = ext2fs_count_used_range(fs->block_map, s, e, &used);
+		if (retval)
+			return retval;
+		count += used;
+	}
+	*ret = count;
+	return 0;
+}
+
+/*
+ * Recompute the free block and inode counts of every group, and of the
+ * filesystem, from the allocation bitmaps.
+ */
+errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
+{
+	blk_t		first, last, used, total_free_blocks = 0;
+	ext2_ino_t	first_ino, last_ino, used_ino, total_free_inodes = 0;
+	dgrp_t		group;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	for (group = 0; group < fs->group_desc_count; group++) {
+		first = ext2fs_group_first_block(fs, group);
+		last = ext2fs_group_last_block(fs, group);
+		if (fs->group_desc[group].bg_flags & EXT2_BG_BLOCK_UNINIT)
+			retval = count_uninit_used(fs, group, first, last,
+						   &used);
+		else
+			retval = ext2fs_count_used_range(fs->block_map,
+							 first, last, &used);
+		if (retval)
+			return retval;
+		fs->group_desc[group].bg_free_blocks_count =
+			last - first + 1 - used;
+		total_free_blocks += last - first + 1 - used;
+
+		first_ino = group * fs->super->s_inodes_per_group + 1;
+		last_ino = first_ino + fs->super->s_inodes_per_group - 1;
+		if (last_ino > fs->super->s_inodes_count)
+			last_ino = fs->super->s_inodes_count;
+		if (fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT)
+			used_ino = 0;
+		else {
+			retval = ext2fs_count_used_range(fs->inode_map,
+							 first_ino, last_ino,
+							 &used_ino);
+			if (retval)
+				return retval;
+		}
+		fs->group_desc[group].bg_free_inodes_count =
+			last_ino - first_ino + 1 - used_ino;
+		total_free_inodes += last_ino - first_ino + 1 - used_ino;
+
+		ext2fs_group_desc_csum_set(fs, group);
+	}
+	fs->super->s_free_blocks_count = total_free_blocks;
+	fs->super->s_free_inodes_count = total_free_inodes;
+	ext2fs_mark_super_dirty(fs);
+	return 0;
+}
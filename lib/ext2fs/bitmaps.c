@@ -181,3 +181,39 @@ errcode_t ext2fs_get_block_bitmap_range(ext2fs_block_bitmap bmap,
 						EXT2_ET_MAGIC_BLOCK_BITMAP,
 						start, num, out));
 }
+
+errcode_t ext2fs_find_first_zero_block_bitmap(ext2fs_block_bitmap bitmap,
+					      blk_t start, blk_t end,
+					      blk_t *out)
+{
+	return ext2fs_find_first_zero_generic_bitmap(bitmap,
+						     EXT2_ET_MAGIC_BLOCK_BITMAP,
+						     start, end, out);
+}
+
+errcode_t ext2fs_find_first_zero_inode_bitmap(ext2fs_inode_bitmap bitmap,
+					      ext2_ino_t start, ext2_ino_t end,
+					      ext2_ino_t *out)
+{
+	return ext2fs_find_first_zero_generic_bitmap(bitmap,
+						     EXT2_ET_MAGIC_INODE_BITMAP,
+						     start, end, out);
+}
+
+errcode_t ext2fs_find_first_set_block_bitmap(ext2fs_block_bitmap bitmap,
+					     blk_t start, blk_t end,
+					     blk_t *out)
+{
+	return ext2fs_find_first_set_generic_bitmap(bitmap,
+						    EXT2_ET_MAGIC_BLOCK_BITMAP,
+						    start, end, out);
+}
+
+errcode_t ext2fs_find_first_set_inode_bitmap(ext2fs_inode_bitmap bitmap,
+					     ext2_ino_t start, ext2_ino_t end,
+					     ext2_ino_t *out)
+{
+	return ext2fs_find_first_set_generic_bitmap(bitmap,
+						    EXT2_ET_MAGIC_INODE_BITMAP,
+						    start, end, out);
+}
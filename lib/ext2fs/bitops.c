@@ -66,6 +66,84 @@ int ext2fs_test_bit(unsigned int nr, const void * addr)
 
 #endif	/* !_EXT2_HAVE_ASM_BITOPS_ */
 
+/*
+ * 64-bit versions of the above, for bitmaps which may cover more than
+ * 2**32 bits.  These are only used by the bitarray bitmap backend, so
+ * there is no point in assembly versions.
+ */
+
+int ext2fs_set_bit64(__u64 nr, void * addr)
+{
+	int		mask, retval;
+	unsigned char	*ADDR = (unsigned char *) addr;
+
+	ADDR += nr >> 3;
+	mask = 1 << (nr & 0x07);
+	retval = mask & *ADDR;
+	*ADDR |= mask;
+	return retval;
+}
+
+int ext2fs_clear_bit64(__u64 nr, void * addr)
+{
+	int		mask, retval;
+	unsigned char	*ADDR = (unsigned char *) addr;
+
+	ADDR += nr >> 3;
+	mask = 1 << (nr & 0x07);
+	retval = mask & *ADDR;
+	*ADDR &= ~mask;
+	return retval;
+}
+
+int ext2fs_test_bit64(__u64 nr, const void * addr)
+{
+	int			mask;
+	const unsigned char	*ADDR = (const unsigned char *) addr;
+
+	ADDR += nr >> 3;
+	mask = 1 << (nr & 0x07);
+	return (mask & *ADDR);
+}
+
+#if (__GNUC__ > 3) || ((__GNUC__ == 3) && (__GNUC_MINOR__ >= 4))
+#define popcount8(x)	__builtin_popcount(x)
+#define popcount64(x)	__builtin_popcountll(x)
+#else
+static unsigned int popcount8(unsigned int w)
+{
+	w = w - ((w >> 1) & 0x55);
+	w = (w & 0x33) + ((w >> 2) & 0x33);
+	return (w + (w >> 4)) & 0x0f;
+}
+
+static unsigned int popcount64(__u64 w)
+{
+	w = w - ((w >> 1) & 0x5555555555555555ULL);
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (w * 0x0101010101010101ULL) >> 56;
+}
+#endif
+
+/*
+ * Count the bits which are set in nbytes bytes at addr, a 64-bit word
+ * at a time once addr is aligned.
+ */
+__u64 ext2fs_bitcount(const void *addr, unsigned int nbytes)
+{
+	const unsigned char	*cp = (const unsigned char *) addr;
+	__u64			count = 0;
+
+	for (; nbytes && ((unsigned long) cp & 7); nbytes--)
+		count += popcount8(*cp++);
+	for (; nbytes >= 8; nbytes -= 8, cp += 8)
+		count += popcount64(*((const __u64 *) cp));
+	for (; nbytes; nbytes--)
+		count += popcount8(*cp++);
+	return count;
+}
+
 void ext2fs_warn_bitmap(errcode_t errcode, unsigned long arg,
 			const char *description)
 {
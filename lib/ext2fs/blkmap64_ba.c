@@ -0,0 +1,451 @@
+/*
+ * blkmap64_ba.c --- Simple bitarray implementation for bitmaps
+ *
+ * This is the traditional representation: one bit per block or inode,
+ * in a flat array sized to the whole range of the bitmap.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "bmap64.h"
+
+struct ext2fs_ba_private_struct {
+	char		*bitarray;
+	size_t		size;
+};
+
+typedef struct ext2fs_ba_private_struct *ext2fs_ba_private;
+
+static size_t ba_size(__u64 start, __u64 real_end)
+{
+	size_t	size;
+
+	size = (size_t) (((real_end - start) / 8) + 1);
+	/* Round up to allow for the BT x86 instruction */
+	return (size + 7) & ~3;
+}
+
+static errcode_t ba_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
+			     ext2fs_generic_bitmap bitmap)
+{
+	ext2fs_ba_private	bp;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(sizeof(struct ext2fs_ba_private_struct), &bp);
+	if (retval)
+		return retval;
+
+	bp->size = ba_size(bitmap->start, bitmap->real_end);
+	retval = ext2fs_get_mem(bp->size, &bp->bitarray);
+	if (retval) {
+		ext2fs_free_mem(&bp);
+		return retval;
+	}
+	memset(bp->bitarray, 0, bp->size);
+	bitmap->private = bp;
+	return 0;
+}
+
+static void ba_free_bmap(ext2fs_generic_bitmap bitmap)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+
+	if (!bp)
+		return;
+	if (bp->bitarray)
+		ext2fs_free_mem(&bp->bitarray);
+	ext2fs_free_mem(&bp);
+	bitmap->private = NULL;
+}
+
+static errcode_t ba_copy_bmap(ext2fs_generic_bitmap src,
+			      ext2fs_generic_bitmap dest)
+{
+	ext2fs_ba_private src_bp = (ext2fs_ba_private) src->private;
+	ext2fs_ba_private dest_bp;
+	errcode_t retval;
+
+	retval = ba_new_bmap(src->fs, dest);
+	if (retval)
+		return retval;
+	dest_bp = (ext2fs_ba_private) dest->private;
+	memcpy(dest_bp->bitarray, src_bp->bitarray, src_bp->size);
+	return 0;
+}
+
+static errcode_t ba_resize_bmap(ext2fs_generic_bitmap bmap,
+				__u64 new_end, __u64 new_real_end)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bmap->private;
+	errcode_t	retval;
+	size_t		new_size;
+	__u64		bitno;
+
+	/*
+	 * Bits past the old real_end may be left over from before an
+	 * earlier shrink; make sure they come back clear.
+	 */
+	if (new_real_end > bmap->real_end)
+		for (bitno = bmap->real_end - bmap->start + 1;
+		     bitno < (__u64) bp->size * 8; bitno++)
+			ext2fs_clear_bit64(bitno, bp->bitarray);
+
+	new_size = ba_size(bmap->start, new_real_end);
+	if (new_size != bp->size) {
+		retval = ext2fs_resize_mem(bp->size, new_size, &bp->bitarray);
+		if (retval)
+			return retval;
+	}
+	if (new_size > bp->size)
+		memset(bp->bitarray + bp->size, 0, new_size - bp->size);
+	bp->size = new_size;
+	return 0;
+}
+
+static int ba_mark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+
+	return !!ext2fs_set_bit64(arg - bitmap->start, bp->bitarray);
+}
+
+static int ba_unmark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+
+	return !!ext2fs_clear_bit64(arg - bitmap->start, bp->bitarray);
+}
+
+static int ba_test_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+
+	return !!ext2fs_test_bit64(arg - bitmap->start, bp->bitarray);
+}
+
+/*
+ * Whole bytes in the middle of an extent are filled with memset; only
+ * the partial bytes at either end are done a bit at a time.
+ */
+static void ba_mark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				unsigned int num)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	__u64		end;
+
+	arg -= bitmap->start;
+	end = arg + num;
+	for (; arg < end && (arg & 7); arg++)
+		ext2fs_set_bit64(arg, bp->bitarray);
+	if (end - arg >= 8) {
+		memset(bp->bitarray + (arg >> 3), 0xff, (end - arg) >> 3);
+		arg += (end - arg) & ~7ULL;
+	}
+	for (; arg < end; arg++)
+		ext2fs_set_bit64(arg, bp->bitarray);
+}
+
+static void ba_unmark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				  unsigned int num)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	__u64		end;
+
+	arg -= bitmap->start;
+	end = arg + num;
+	for (; arg < end && (arg & 7); arg++)
+		ext2fs_clear_bit64(arg, bp->bitarray);
+	if (end - arg >= 8) {
+		memset(bp->bitarray + (arg >> 3), 0, (end - arg) >> 3);
+		arg += (end - arg) & ~7ULL;
+	}
+	for (; arg < end; arg++)
+		ext2fs_clear_bit64(arg, bp->bitarray);
+}
+
+/*
+ * Compare @mem to zero buffer by 256 bytes.
+ * Return 1 if @mem is zeroed memory, otherwise return 0.
+ */
+static int mem_is_zero(const char *mem, size_t len)
+{
+	static const char zero_buf[256];
+
+	while (len >= sizeof(zero_buf)) {
+		if (memcmp(mem, zero_buf, sizeof(zero_buf)))
+			return 0;
+		len -= sizeof(zero_buf);
+		mem += sizeof(zero_buf);
+	}
+	/* Deal with leftover bytes. */
+	if (len)
+		return !memcmp(mem, zero_buf, len);
+	return 1;
+}
+
+/*
+ * Return true if all of the bits in a specified range are clear
+ */
+static int ba_test_clear_bmap_extent(ext2fs_generic_bitmap bitmap,
+				     __u64 start, unsigned int len)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	size_t start_byte, len_byte = len >> 3;
+	unsigned int start_bit, len_bit = len % 8;
+	int first_bit = 0;
+	int last_bit  = 0;
+	int mark_count = 0;
+	int mark_bit = 0;
+	int i;
+	const char *ADDR = bp->bitarray;
+
+	start -= bitmap->start;
+	start_byte = start >> 3;
+	start_bit = start % 8;
+
+	if (start_bit != 0) {
+		/*
+		 * The compared start block number or start inode number
+		 * is not the first bit in a byte.
+		 */
+		mark_count = 8 - start_bit;
+		if (len < 8 - start_bit) {
+			mark_count = (int)len;
+			mark_bit = len + start_bit - 1;
+		} else
+			mark_bit = 7;
+
+		for (i = mark_count; i > 0; i--, mark_bit--)
+			first_bit |= 1 << mark_bit;
+
+		/*
+		 * Compare blocks or inodes in the first byte.
+		 * If there is any marked bit, this function returns 0.
+		 */
+		if (first_bit & ADDR[start_byte])
+			return 0;
+		else if (len <= 8 - start_bit)
+			return 1;
+
+		start_byte++;
+		len_bit = (len - mark_count) % 8;
+		len_byte = (len - mark_count) >> 3;
+	}
+
+	/*
+	 * The compared start block number or start inode number is
+	 * the first bit in a byte.
+	 */
+	if (len_bit != 0) {
+		/*
+		 * The compared end block number or end inode number is
+		 * not the last bit in a byte.
+		 */
+		for (mark_bit = len_bit - 1; mark_bit >= 0; mark_bit--)
+			last_bit |= 1 << mark_bit;
+
+		/*
+		 * Compare blocks or inodes in the last byte.
+		 * If there is any marked bit, this function returns 0.
+		 */
+		if (last_bit & ADDR[start_byte + len_byte])
+			return 0;
+		else if (len_byte == 0)
+			return 1;
+	}
+
+	/* Check whether all bytes are 0 */
+	return mem_is_zero(ADDR + start_byte, len_byte);
+}
+
+static void ba_set_bmap_range(ext2fs_generic_bitmap bitmap,
+			      __u64 start, size_t num, void *in)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	size_t	i;
+
+	start -= bitmap->start;
+	if ((start & 7) == 0) {
+		memcpy(bp->bitarray + (start >> 3), in, (num + 7) >> 3);
+		return;
+	}
+	for (i = 0; i < num; i++) {
+		if (ext2fs_test_bit(i, in))
+			ext2fs_set_bit64(start + i, bp->bitarray);
+		else
+			ext2fs_clear_bit64(start + i, bp->bitarray);
+	}
+}
+
+static void ba_get_bmap_range(ext2fs_generic_bitmap bitmap,
+			      __u64 start, size_t num, void *out)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	size_t	i;
+
+	start -= bitmap->start;
+	if ((start & 7) == 0) {
+		memcpy(out, bp->bitarray + (start >> 3), (num + 7) >> 3);
+		return;
+	}
+	memset(out, 0, (num + 7) >> 3);
+	for (i = 0; i < num; i++)
+		if (ext2fs_test_bit64(start + i, bp->bitarray))
+			ext2fs_fast_set_bit(i, out);
+}
+
+static void ba_clear_bmap(ext2fs_generic_bitmap bitmap)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+
+	memset(bp->bitarray, 0, bp->size);
+}
+
+/*
+ * Return the number of the lowest set bit in a non-zero byte
+ */
+static int ba_first_bit(unsigned int byte)
+{
+#if (__GNUC__ > 3) || ((__GNUC__ == 3) && (__GNUC_MINOR__ >= 4))
+	return __builtin_ctz(byte);
+#else
+	int	bit = 0;
+
+	while (!(byte & 1)) {
+		byte >>= 1;
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+/*
+ * Find the first bit in [start, end] whose value is want.  Bytes and
+ * aligned 64-bit words in which every bit is !want are skipped whole,
+ * so a scan over a nearly full or nearly empty range costs one compare
+ * per word rather than one test per bit.
+ */
+static errcode_t ba_find_first(ext2fs_generic_bitmap bitmap, int want,
+			       __u64 start, __u64 end, __u64 *out)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	const unsigned char *base = (const unsigned char *) bp->bitarray;
+	const unsigned char *pos;
+	unsigned char	skip_byte = want ? 0 : 0xff;
+	__u64		skip_word = want ? 0 : ~((__u64) 0);
+	__u64		bitpos = start - bitmap->start;
+	__u64		count = end - start + 1;
+
+	/* Bits up to the first byte boundary */
+	for (; (bitpos & 7) && count; bitpos++, count--)
+		if (!!ext2fs_test_bit64(bitpos, base) == want)
+			goto found;
+
+	pos = base + (bitpos >> 3);
+	for (; count >= 8 && ((unsigned long) pos & 7); pos++, count -= 8)
+		if (*pos != skip_byte)
+			goto found_byte;
+	for (; count >= 64; pos += 8, count -= 64)
+		if (*((const __u64 *) pos) != skip_word)
+			break;
+	for (; count >= 8; pos++, count -= 8)
+		if (*pos != skip_byte)
+			goto found_byte;
+
+	/* Bits after the last whole byte */
+	for (bitpos = (pos - base) << 3; count; bitpos++, count--)
+		if (!!ext2fs_test_bit64(bitpos, base) == want)
+			goto found;
+	return ENOENT;
+
+found_byte:
+	bitpos = ((pos - base) << 3) +
+		ba_first_bit(want ? *pos : (unsigned char) ~*pos);
+found:
+	*out = bitpos + bitmap->start;
+	return 0;
+}
+
+static errcode_t ba_find_first_zero(ext2fs_generic_bitmap bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	return ba_find_first(bitmap, 0, start, end, out);
+}
+
+static errcode_t ba_find_first_set(ext2fs_generic_bitmap bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	return ba_find_first(bitmap, 1, start, end, out);
+}
+
+static __u64 ba_count_used(ext2fs_generic_bitmap bitmap,
+			   __u64 start, __u64 end)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	__u64		count = 0;
+
+	start -= bitmap->start;
+	end -= bitmap->start;
+	for (; start <= end && (start & 7); start++)
+		if (ext2fs_test_bit64(start, bp->bitarray))
+			count++;
+	if (start <= end && end - start + 1 >= 8) {
+		count += ext2fs_bitcount(bp->bitarray + (start >> 3),
+					 (end - start + 1) >> 3);
+		start += (end - start + 1) & ~7ULL;
+	}
+	for (; start <= end; start++)
+		if (ext2fs_test_bit64(start, bp->bitarray))
+			count++;
+	return count;
+}
+
+static unsigned long long ba_memory_used(ext2fs_generic_bitmap bitmap)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+
+	return sizeof(struct ext2fs_ba_private_struct) + bp->size;
+}
+
+struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
+	EXT2FS_BMAP64_BITARRAY,
+	ba_new_bmap,
+	ba_free_bmap,
+	ba_copy_bmap,
+	ba_resize_bmap,
+	ba_mark_bmap,
+	ba_unmark_bmap,
+	ba_test_bmap,
+	ba_mark_bmap_extent,
+	ba_unmark_bmap_extent,
+	ba_test_clear_bmap_extent,
+	ba_set_bmap_range,
+	ba_get_bmap_range,
+	ba_clear_bmap,
+	ba_find_first_zero,
+	ba_find_first_set,
+	ba_count_used,
+	ba_memory_used,
+};
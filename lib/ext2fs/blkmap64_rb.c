@@ -0,0 +1,534 @@
+/*
+ * blkmap64_rb.c --- Red-black tree implementation for bitmaps
+ *
+ * The set bits are kept as a tree of disjoint, non-adjacent extents,
+ * so the memory used depends on how fragmented the bitmap is rather
+ * than on the size of the range it covers.  This is a good fit for
+ * maps which are mostly clear, such as the duplicate block map, and
+ * for maps which are mostly set in long runs, such as the in-use block
+ * map of a lightly fragmented filesystem.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "bmap64.h"
+#include "rbtree.h"
+
+struct bmap_rb_extent {
+	struct rb_node	node;
+	__u64		start;
+	__u64		count;
+};
+
+struct ext2fs_rb_private {
+	struct rb_root		root;
+	/* The extent last found or modified; most accesses are local */
+	struct bmap_rb_extent	*cursor;
+	unsigned long long	num_extents;
+};
+
+static struct bmap_rb_extent *node_to_extent(struct rb_node *node)
+{
+	return node ? ext2fs_rb_entry(node, struct bmap_rb_extent, node) : NULL;
+}
+
+static errcode_t rb_alloc_extent(struct ext2fs_rb_private *bp,
+				 __u64 start, __u64 count,
+				 struct bmap_rb_extent **ret)
+{
+	struct bmap_rb_extent	*ext;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(sizeof(struct bmap_rb_extent), &ext);
+	if (retval)
+		return retval;
+	ext->start = start;
+	ext->count = count;
+	bp->num_extents++;
+	*ret = ext;
+	return 0;
+}
+
+/*
+ * Allocate an extent for a bit which is being changed.  The bitmap is
+ * wrong without it, so a failure is reported against the bitmap.
+ */
+static struct bmap_rb_extent *rb_new_extent(ext2fs_generic_bitmap bitmap,
+					    __u64 start, __u64 count)
+{
+	struct bmap_rb_extent	*ext;
+	errcode_t		retval;
+
+	retval = rb_alloc_extent(bitmap->private, start, count, &ext);
+	if (retval) {
+		ext2fs_bmap_error(bitmap, retval);
+		return NULL;
+	}
+	return ext;
+}
+
+static void rb_free_extent(struct ext2fs_rb_private *bp,
+			   struct bmap_rb_extent *ext)
+{
+	if (bp->cursor == ext)
+		bp->cursor = NULL;
+	ext2fs_rb_erase(&ext->node, &bp->root);
+	bp->num_extents--;
+	ext2fs_free_mem(&ext);
+}
+
+/*
+ * Link a new extent into the tree; the caller guarantees that it does
+ * not overlap any existing extent.
+ */
+static void rb_link_extent(struct ext2fs_rb_private *bp,
+			   struct bmap_rb_extent *ext)
+{
+	struct rb_node		**n = &bp->root.rb_node;
+	struct rb_node		*parent = NULL;
+
+	while (*n) {
+		parent = *n;
+		if (ext->start < node_to_extent(parent)->start)
+			n = &parent->rb_left;
+		else
+			n = &parent->rb_right;
+	}
+	ext2fs_rb_link_node(&ext->node, parent, n);
+	ext2fs_rb_insert_color(&ext->node, &bp->root);
+}
+
+/*
+ * Return the first extent which ends after bit, that is, the extent
+ * containing bit if there is one, otherwise the next extent.
+ */
+static struct bmap_rb_extent *rb_find_ge(struct ext2fs_rb_private *bp,
+					 __u64 bit)
+{
+	struct rb_node		*n = bp->root.rb_node;
+	struct bmap_rb_extent	*ext, *best = NULL;
+
+	/*
+	 * Scans usually stay within the cursor extent or the gap which
+	 * follows it, so try those before walking the tree.
+	 */
+	ext = bp->cursor;
+	if (ext && bit >= ext->start) {
+		if (bit < ext->start + ext->count)
+			return ext;
+		ext = node_to_extent(ext2fs_rb_next(&ext->node));
+		if (!ext || bit < ext->start + ext->count)
+			return ext;
+	}
+
+	while (n) {
+		ext = node_to_extent(n);
+		if (bit < ext->start + ext->count) {
+			best = ext;
+			if (bit >= ext->start)
+				break;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	return best;
+}
+
+/*
+ * Set the bits [start, start + count).  Returns true if they were all
+ * set already.
+ */
+static int rb_insert_extent(ext2fs_generic_bitmap bitmap,
+			    __u64 start, __u64 count)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+	struct rb_node		**n = &bp->root.rb_node;
+	struct rb_node		*parent = NULL, *next;
+	struct bmap_rb_extent	*ext, *new_ext = NULL;
+	__u64			end;
+
+	/* Sequential marking extends the extent we touched last */
+	ext = bp->cursor;
+	if (ext && start >= ext->start && start <= ext->start + ext->count)
+		goto found;
+
+	while (*n) {
+		parent = *n;
+		ext = node_to_extent(parent);
+		if (start < ext->start)
+			n = &parent->rb_left;
+		else if (start > ext->start + ext->count)
+			n = &parent->rb_right;
+		else
+			goto found;
+	}
+
+	new_ext = rb_new_extent(bitmap, start, count);
+	if (!new_ext)
+		return 0;
+	ext2fs_rb_link_node(&new_ext->node, parent, n);
+	ext2fs_rb_insert_color(&new_ext->node, &bp->root);
+	goto merge;
+
+found:
+	/* ext contains start, or ends right before it */
+	if (start + count <= ext->start + ext->count) {
+		bp->cursor = ext;
+		return 1;
+	}
+	count += start - ext->start;
+	start = ext->start;
+	new_ext = ext;
+
+merge:
+	/* Swallow any following extents which now overlap or touch */
+	end = start + count;
+	next = ext2fs_rb_next(&new_ext->node);
+	while (next) {
+		ext = node_to_extent(next);
+		if (ext->start > end)
+			break;
+		if (ext->start + ext->count > end)
+			end = ext->start + ext->count;
+		next = ext2fs_rb_next(next);
+		rb_free_extent(bp, ext);
+	}
+	new_ext->start = start;
+	new_ext->count = end - start;
+	bp->cursor = new_ext;
+	return 0;
+}
+
+/*
+ * Clear the bits [start, start + count).  Returns true if any of them
+ * were set.
+ */
+static int rb_remove_extent(ext2fs_generic_bitmap bitmap,
+			    __u64 start, __u64 count)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+	struct bmap_rb_extent	*ext, *new_ext;
+	struct rb_node		*next;
+	__u64			end = start + count, ext_end;
+	int			retval = 0;
+
+	ext = rb_find_ge(bp, start);
+	while (ext && ext->start < end) {
+		retval = 1;
+		ext_end = ext->start + ext->count;
+		next = ext2fs_rb_next(&ext->node);
+		if (ext->start < start) {
+			if (ext_end > end) {
+				/* Punch a hole in the middle of ext */
+				new_ext = rb_new_extent(bitmap, end,
+							ext_end - end);
+				if (!new_ext)
+					break;
+				ext->count = start - ext->start;
+				rb_link_extent(bp, new_ext);
+				break;
+			}
+			ext->count = start - ext->start;
+		} else if (ext_end > end) {
+			ext->count = ext_end - end;
+			ext->start = end;
+			break;
+		} else
+			rb_free_extent(bp, ext);
+		ext = node_to_extent(next);
+	}
+	return retval;
+}
+
+static void rb_free_tree(struct rb_node *node)
+{
+	struct bmap_rb_extent	*ext;
+
+	while (node) {
+		rb_free_tree(node->rb_right);
+		ext = node_to_extent(node);
+		node = node->rb_left;
+		ext2fs_free_mem(&ext);
+	}
+}
+
+static errcode_t rb_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
+			     ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rb_private *bp;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(sizeof(struct ext2fs_rb_private), &bp);
+	if (retval)
+		return retval;
+	bp->root.rb_node = NULL;
+	bp->cursor = NULL;
+	bp->num_extents = 0;
+	bitmap->private = bp;
+	return 0;
+}
+
+static void rb_free_bmap(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+
+	if (!bp)
+		return;
+	rb_free_tree(bp->root.rb_node);
+	ext2fs_free_mem(&bp);
+	bitmap->private = NULL;
+}
+
+static errcode_t rb_copy_bmap(ext2fs_generic_bitmap src,
+			      ext2fs_generic_bitmap dest)
+{
+	struct ext2fs_rb_private *src_bp = src->private;
+	struct ext2fs_rb_private *dest_bp;
+	struct bmap_rb_extent	*ext, *new_ext;
+	struct rb_node		*n;
+	errcode_t		retval;
+
+	retval = rb_new_bmap(src->fs, dest);
+	if (retval)
+		return retval;
+	dest_bp = dest->private;
+
+	for (n = ext2fs_rb_first(&src_bp->root); n; n = ext2fs_rb_next(n)) {
+		ext = node_to_extent(n);
+		retval = rb_alloc_extent(dest_bp, ext->start, ext->count,
+					 &new_ext);
+		if (retval) {
+			rb_free_bmap(dest);
+			return retval;
+		}
+		rb_link_extent(dest_bp, new_ext);
+	}
+	return 0;
+}
+
+static errcode_t rb_resize_bmap(ext2fs_generic_bitmap bitmap,
+				__u64 new_end EXT2FS_ATTR((unused)),
+				__u64 new_real_end)
+{
+	if (new_real_end < bitmap->real_end)
+		rb_remove_extent(bitmap, new_real_end + 1,
+				 bitmap->real_end - new_real_end);
+	return 0;
+}
+
+static int rb_mark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	return rb_insert_extent(bitmap, arg, 1);
+}
+
+static int rb_unmark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	return rb_remove_extent(bitmap, arg, 1);
+}
+
+static int rb_test_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+	struct bmap_rb_extent	*ext;
+
+	ext = rb_find_ge(bp, arg);
+	if (ext && arg >= ext->start) {
+		bp->cursor = ext;
+		return 1;
+	}
+	return 0;
+}
+
+static void rb_mark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				unsigned int num)
+{
+	rb_insert_extent(bitmap, arg, num);
+}
+
+static void rb_unmark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				  unsigned int num)
+{
+	rb_remove_extent(bitmap, arg, num);
+}
+
+static int rb_test_clear_bmap_extent(ext2fs_generic_bitmap bitmap,
+				     __u64 start, unsigned int len)
+{
+	struct bmap_rb_extent	*ext;
+
+	ext = rb_find_ge(bitmap->private, start);
+	return !(ext && ext->start < start + len);
+}
+
+static void rb_set_bmap_range(ext2fs_generic_bitmap bitmap,
+			      __u64 start, size_t num, void *in)
+{
+	const unsigned char	*cp = in;
+	size_t			i = 0, first;
+
+	rb_remove_extent(bitmap, start, num);
+	while (i < num) {
+		/* Skip clear bytes a whole byte at a time */
+		if ((i & 7) == 0 && i + 8 <= num && cp[i >> 3] == 0) {
+			i += 8;
+			continue;
+		}
+		if (!ext2fs_test_bit64(i, in)) {
+			i++;
+			continue;
+		}
+		first = i;
+		while (i < num) {
+			if ((i & 7) == 0 && i + 8 <= num &&
+			    cp[i >> 3] == 0xff)
+				i += 8;
+			else if (ext2fs_test_bit64(i, in))
+				i++;
+			else
+				break;
+		}
+		rb_insert_extent(bitmap, start + first, i - first);
+	}
+}
+
+static void rb_get_bmap_range(ext2fs_generic_bitmap bitmap,
+			      __u64 start, size_t num, void *out)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+	struct bmap_rb_extent	*ext;
+	struct rb_node		*n;
+	unsigned char		*cp = out;
+	__u64			first, last, i;
+
+	memset(out, 0, (num + 7) >> 3);
+	ext = rb_find_ge(bp, start);
+	while (ext && ext->start < start + num) {
+		first = (ext->start > start) ? ext->start - start : 0;
+		last = ext->start + ext->count - start;
+		if (last > num)
+			last = num;
+		for (i = first; i < last && (i & 7); i++)
+			ext2fs_set_bit64(i, out);
+		if (i + 8 <= last) {
+			memset(cp + (i >> 3), 0xff, (last - i) >> 3);
+			i += (last - i) & ~7ULL;
+		}
+		for (; i < last; i++)
+			ext2fs_set_bit64(i, out);
+		n = ext2fs_rb_next(&ext->node);
+		ext = node_to_extent(n);
+	}
+}
+
+static void rb_clear_bmap(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+
+	rb_free_tree(bp->root.rb_node);
+	bp->root.rb_node = NULL;
+	bp->cursor = NULL;
+	bp->num_extents = 0;
+}
+
+/*
+ * Extents never touch, so the bit after an extent is always clear.
+ */
+static errcode_t rb_find_first_zero(ext2fs_generic_bitmap bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+	struct bmap_rb_extent	*ext;
+
+	ext = rb_find_ge(bp, start);
+	if (ext && start >= ext->start) {
+		bp->cursor = ext;
+		start = ext->start + ext->count;
+	}
+	if (start > end)
+		return ENOENT;
+	*out = start;
+	return 0;
+}
+
+static errcode_t rb_find_first_set(ext2fs_generic_bitmap bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+	struct bmap_rb_extent	*ext;
+
+	ext = rb_find_ge(bp, start);
+	if (!ext || ext->start > end)
+		return ENOENT;
+	bp->cursor = ext;
+	*out = (ext->start > start) ? ext->start : start;
+	return 0;
+}
+
+static __u64 rb_count_used(ext2fs_generic_bitmap bitmap,
+			   __u64 start, __u64 end)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+	struct bmap_rb_extent	*ext;
+	__u64			first, last, count = 0;
+
+	for (ext = rb_find_ge(bp, start); ext && ext->start <= end;
+	     ext = node_to_extent(ext2fs_rb_next(&ext->node))) {
+		first = (ext->start > start) ? ext->start : start;
+		last = ext->start + ext->count - 1;
+		if (last > end)
+			last = end;
+		count += last - first + 1;
+	}
+	return count;
+}
+
+static unsigned long long rb_memory_used(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rb_private *bp = bitmap->private;
+
+	return sizeof(struct ext2fs_rb_private) +
+		bp->num_extents * sizeof(struct bmap_rb_extent);
+}
+
+struct ext2_bitmap_ops ext2fs_blkmap64_rbtree = {
+	EXT2FS_BMAP64_RBTREE,
+	rb_new_bmap,
+	rb_free_bmap,
+	rb_copy_bmap,
+	rb_resize_bmap,
+	rb_mark_bmap,
+	rb_unmark_bmap,
+	rb_test_bmap,
+	rb_mark_bmap_extent,
+	rb_unmark_bmap_extent,
+	rb_test_clear_bmap_extent,
+	rb_set_bmap_range,
+	rb_get_bmap_range,
+	rb_clear_bmap,
+	rb_find_first_zero,
+	rb_find_first_set,
+	rb_count_used,
+	rb_memory_used,
+};
@@ -0,0 +1,1012 @@
+/*
+ * blkmap64_rr.c --- Compressed ("roaring") implementation for bitmaps
+ *
+ * The bitmap is split into chunks of 64K bits, and each chunk is
+ * stored in whichever form is smallest for its contents: a sorted
+ * array of the set bits, a plain bitmap, or a sorted list of runs.
+ * An empty chunk takes no memory beyond its header.  Finding a bit's
+ * chunk is a direct index, so a membership test is at worst a binary
+ * search of a few thousand entries.  This is a good fit for large
+ * maps which are sparse or clustered, such as most of e2fsck's inode
+ * maps on a filesystem with many inodes.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "bmap64.h"
+
+#define RR_CHUNK_BITS	16
+#define RR_CHUNK_SIZE	(1U << RR_CHUNK_BITS)
+#define RR_CHUNK_MASK	(RR_CHUNK_SIZE - 1)
+#define RR_BITMAP_BYTES	(RR_CHUNK_SIZE / 8)
+/* Past this many entries an array is larger than a bitmap */
+#define RR_ARRAY_MAX	(RR_BITMAP_BYTES / sizeof(__u16))
+/* Extents shorter than this are marked a bit at a time */
+#define RR_SMALL_EXTENT	64
+
+#define RR_EMPTY	0
+#define RR_ARRAY	1
+#define RR_BITMAP	2
+#define RR_RUN		3
+
+struct rr_run {
+	__u16		start;
+	__u16		last;
+};
+
+struct rr_chunk {
+	unsigned short	type;
+	unsigned int	num;	/* entries in an array, or runs */
+	unsigned int	alloc;	/* entries allocated */
+	unsigned int	card;	/* number of set bits */
+	void		*data;
+};
+
+struct ext2fs_rr_private {
+	__u64		nchunks;
+	struct rr_chunk	*chunks;
+};
+
+static void rr_set_bits(void *map, __u64 first, __u64 count)
+{
+	unsigned char	*cp = map;
+	__u64		i = first, end = first + count;
+
+	for (; i < end && (i & 7); i++)
+		ext2fs_set_bit64(i, map);
+	if (i + 8 <= end) {
+		memset(cp + (i >> 3), 0xff, (end - i) >> 3);
+		i += (end - i) & ~7ULL;
+	}
+	for (; i < end; i++)
+		ext2fs_set_bit64(i, map);
+}
+
+static void rr_clear_bits(void *map, __u64 first, __u64 count)
+{
+	unsigned char	*cp = map;
+	__u64		i = first, end = first + count;
+
+	for (; i < end && (i & 7); i++)
+		ext2fs_clear_bit64(i, map);
+	if (i + 8 <= end) {
+		memset(cp + (i >> 3), 0, (end - i) >> 3);
+		i += (end - i) & ~7ULL;
+	}
+	for (; i < end; i++)
+		ext2fs_clear_bit64(i, map);
+}
+
+/* Number of set bits in [first, last] of a chunk bitmap */
+static unsigned int rr_count_bits(const void *map, unsigned int first,
+				  unsigned int last)
+{
+	const unsigned char *cp = map;
+	unsigned int	i = first, count = 0;
+
+	for (; i <= last && (i & 7); i++)
+		count += ext2fs_test_bit(i, map) ? 1 : 0;
+	if (i + 8 <= last + 1) {
+		count += ext2fs_bitcount(cp + (i >> 3), (last + 1 - i) >> 3);
+		i += (last + 1 - i) & ~7U;
+	}
+	for (; i <= last; i++)
+		count += ext2fs_test_bit(i, map) ? 1 : 0;
+	return count;
+}
+
+/* Index of the first array entry which is >= val */
+static unsigned int rr_array_find(const __u16 *array, unsigned int num,
+				  unsigned int val)
+{
+	unsigned int	low = 0, high = num, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (array[mid] < val)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* Index of the first run which ends at or after val */
+static unsigned int rr_run_find(const struct rr_run *runs, unsigned int num,
+				unsigned int val)
+{
+	unsigned int	low = 0, high = num, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (runs[mid].last < val)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static void rr_chunk_free(struct rr_chunk *c)
+{
+	if (c->data)
+		ext2fs_free_mem(&c->data);
+	memset(c, 0, sizeof(struct rr_chunk));
+}
+
+/* Make room for at least want entries of the given size */
+static errcode_t rr_chunk_grow(struct rr_chunk *c, unsigned int want,
+			       unsigned int size)
+{
+	unsigned int	alloc;
+	errcode_t	retval;
+
+	if (want <= c->alloc)
+		return 0;
+	alloc = c->alloc ? c->alloc * 2 : 4;
+	if (alloc < want)
+		alloc = want;
+	retval = ext2fs_resize_mem(c->alloc * size, alloc * size, &c->data);
+	if (retval)
+		return retval;
+	c->alloc = alloc;
+	return 0;
+}
+
+static int rr_chunk_test(struct rr_chunk *c, unsigned int bit)
+{
+	__u16		*array;
+	struct rr_run	*runs;
+	unsigned int	i;
+
+	switch (c->type) {
+	case RR_ARRAY:
+		array = c->data;
+		i = rr_array_find(array, c->num, bit);
+		return i < c->num && array[i] == bit;
+	case RR_BITMAP:
+		return ext2fs_test_bit(bit, c->data) ? 1 : 0;
+	case RR_RUN:
+		runs = c->data;
+		i = rr_run_find(runs, c->num, bit);
+		return i < c->num && runs[i].start <= bit;
+	}
+	return 0;
+}
+
+static errcode_t rr_chunk_to_bitmap(struct rr_chunk *c)
+{
+	__u16		*array = c->data;
+	struct rr_run	*runs = c->data;
+	char		*map;
+	unsigned int	i;
+	errcode_t	retval;
+
+	if (c->type == RR_BITMAP)
+		return 0;
+	retval = ext2fs_get_mem(RR_BITMAP_BYTES, &map);
+	if (retval)
+		return retval;
+	memset(map, 0, RR_BITMAP_BYTES);
+	if (c->type == RR_ARRAY)
+		for (i = 0; i < c->num; i++)
+			ext2fs_set_bit(array[i], map);
+	else if (c->type == RR_RUN)
+		for (i = 0; i < c->num; i++)
+			rr_set_bits(map, runs[i].start,
+				    runs[i].last - runs[i].start + 1);
+	if (c->data)
+		ext2fs_free_mem(&c->data);
+	c->type = RR_BITMAP;
+	c->data = map;
+	c->num = c->alloc = 0;
+	return 0;
+}
+
+/*
+ * Convert a bitmap chunk to the smallest form for its contents.  If
+ * memory is short it is left as a bitmap, which is always correct.
+ */
+static void rr_chunk_optimize(struct rr_chunk *c)
+{
+	unsigned char	*map = c->data;
+	__u16		*array;
+	struct rr_run	*runs;
+	unsigned int	i, bit, card, nruns = 0, carry = 0, n;
+	unsigned char	starts;
+
+	card = ext2fs_bitcount(map, RR_BITMAP_BYTES);
+	c->card = card;
+	if (card == 0) {
+		rr_chunk_free(c);
+		return;
+	}
+	for (i = 0; i < RR_BITMAP_BYTES; i++) {
+		/* The bits which are set but whose predecessor is not */
+		starts = map[i] & ~((map[i] << 1) | carry);
+		if (starts)
+			nruns += ext2fs_bitcount(&starts, 1);
+		carry = map[i] >> 7;
+	}
+	/* n counts entries of the chosen form as it is filled in */
+	n = 0;
+	/*
+	 * Runs are only chosen over a bitmap if they take at most half
+	 * the space, so that a chunk near the limit is not converted back
+	 * and forth
+	 */
+	if (nruns * sizeof(struct rr_run) <= RR_BITMAP_BYTES / 2 &&
+	    nruns * sizeof(struct rr_run) <= card * sizeof(__u16)) {
+		if (ext2fs_get_array(nruns, sizeof(struct rr_run), &runs))
+			return;
+		for (bit = 0; bit < RR_CHUNK_SIZE; ) {
+			/* Skip whole bytes outside of runs, then within one */
+			while (bit < RR_CHUNK_SIZE && map[bit >> 3] == 0)
+				bit += 8;
+			while (bit < RR_CHUNK_SIZE && !ext2fs_test_bit(bit, map))
+				bit++;
+			if (bit >= RR_CHUNK_SIZE)
+				break;
+			runs[n].start = bit++;
+			while (bit < RR_CHUNK_SIZE) {
+				if ((bit & 7) == 0 && map[bit >> 3] == 0xff)
+					bit += 8;
+				else if (ext2fs_test_bit(bit, map))
+					bit++;
+				else
+					break;
+			}
+			runs[n++].last = bit - 1;
+		}
+		ext2fs_free_mem(&c->data);
+		c->type = RR_RUN;
+		c->data = runs;
+	} else if (card <= RR_ARRAY_MAX) {
+		if (ext2fs_get_array(card, sizeof(__u16), &array))
+			return;
+		for (i = 0; i < RR_BITMAP_BYTES; i++) {
+			if (!map[i])
+				continue;
+			for (bit = i * 8; bit < i * 8 + 8; bit++)
+				if (ext2fs_test_bit(bit, map))
+					array[n++] = bit;
+		}
+		ext2fs_free_mem(&c->data);
+		c->type = RR_ARRAY;
+		c->data = array;
+	} else
+		return;
+	c->num = c->alloc = n;
+}
+
+/*
+ * Set the bits [first, last] of a run list, merging any runs which
+ * they overlap or touch
+ */
+static errcode_t rr_run_mark(struct rr_chunk *c, unsigned int first,
+			     unsigned int last)
+{
+	struct rr_run	*runs = c->data;
+	unsigned int	i, j, s, e, removed = 0;
+	errcode_t	retval;
+
+	i = rr_run_find(runs, c->num, first ? first - 1 : 0);
+	for (j = i; j < c->num && runs[j].start <= last + 1; j++)
+		removed += runs[j].last - runs[j].start + 1;
+	if (i == j) {
+		retval = rr_chunk_grow(c, c->num + 1, sizeof(struct rr_run));
+		if (retval)
+			return retval;
+		runs = c->data;
+		memmove(runs + i + 1, runs + i,
+			(c->num - i) * sizeof(struct rr_run));
+		runs[i].start = first;
+		runs[i].last = last;
+		c->num++;
+		c->card += last - first + 1;
+		return 0;
+	}
+	s = (runs[i].start < first) ? runs[i].start : first;
+	e = (runs[j - 1].last > last) ? runs[j - 1].last : last;
+	runs[i].start = s;
+	runs[i].last = e;
+	memmove(runs + i + 1, runs + j, (c->num - j) * sizeof(struct rr_run));
+	c->num -= j - i - 1;
+	c->card += e - s + 1 - removed;
+	return 0;
+}
+
+/* Clear the bits [first, last] of a run list */
+static errcode_t rr_run_unmark(struct rr_chunk *c, unsigned int first,
+			       unsigned int last)
+{
+	struct rr_run	*runs = c->data;
+	unsigned int	i, j;
+	errcode_t	retval;
+
+	i = rr_run_find(runs, c->num, first);
+	if (i < c->num && runs[i].start < first && runs[i].last > last) {
+		/* Split the run in two */
+		retval = rr_chunk_grow(c, c->num + 1, sizeof(struct rr_run));
+		if (retval)
+			return retval;
+		runs = c->data;
+		memmove(runs + i + 1, runs + i,
+			(c->num - i) * sizeof(struct rr_run));
+		runs[i].last = first - 1;
+		runs[i + 1].start = last + 1;
+		c->num++;
+		c->card -= last - first + 1;
+		return 0;
+	}
+	if (i < c->num && runs[i].start < first) {
+		c->card -= runs[i].last - first + 1;
+		runs[i++].last = first - 1;
+	}
+	for (j = i; j < c->num && runs[j].last <= last; j++)
+		c->card -= runs[j].last - runs[j].start + 1;
+	if (j < c->num && runs[j].start <= last) {
+		c->card -= last - runs[j].start + 1;
+		runs[j].start = last + 1;
+	}
+	memmove(runs + i, runs + j, (c->num - j) * sizeof(struct rr_run));
+	c->num -= j - i;
+	if (c->card == 0)
+		rr_chunk_free(c);
+	return 0;
+}
+
+/*
+ * Apply a change to a chunk which is, or has just become, a run list.
+ * A list which has grown larger than a bitmap is converted to one if
+ * there is memory for it; either way the chunk is correct.  An error
+ * means that the change was not made.
+ */
+static errcode_t rr_run_change(struct rr_chunk *c, unsigned int first,
+			       unsigned int last, int set)
+{
+	errcode_t	retval;
+
+	if (c->type == RR_EMPTY) {
+		if (!set)
+			return 0;
+		c->type = RR_RUN;
+	}
+	retval = set ? rr_run_mark(c, first, last) :
+		rr_run_unmark(c, first, last);
+	if (retval)
+		return retval;
+	if (c->type == RR_RUN && c->num * sizeof(struct rr_run) >
+	    RR_BITMAP_BYTES)
+		rr_chunk_to_bitmap(c);
+	return 0;
+}
+
+/*
+ * A chunk must be changed but there is no memory to do so in its
+ * current form.  A bitmap can hold anything, so convert the chunk to
+ * one.  If even that fails, the change can't be made; the error is
+ * reported against the bitmap and nonzero is returned.
+ */
+static int rr_chunk_need_bitmap(ext2fs_generic_bitmap bitmap,
+				struct rr_chunk *c)
+{
+	errcode_t	retval;
+
+	retval = rr_chunk_to_bitmap(c);
+	if (retval)
+		ext2fs_bmap_error(bitmap, retval);
+	return retval != 0;
+}
+
+static int rr_chunk_mark(ext2fs_generic_bitmap bitmap, struct rr_chunk *c,
+			 unsigned int bit)
+{
+	__u16		*array;
+	unsigned int	i;
+
+	switch (c->type) {
+	case RR_EMPTY:
+	case RR_ARRAY:
+		array = c->data;
+		i = rr_array_find(array, c->num, bit);
+		if (i < c->num && array[i] == bit)
+			return 1;
+		if (c->num < RR_ARRAY_MAX &&
+		    rr_chunk_grow(c, c->num + 1, sizeof(__u16)) == 0) {
+			array = c->data;
+			memmove(array + i + 1, array + i,
+				(c->num - i) * sizeof(__u16));
+			array[i] = bit;
+			c->type = RR_ARRAY;
+			c->num++;
+			c->card++;
+			return 0;
+		}
+		/*
+		 * A full array may well be clustered enough for runs;
+		 * if it couldn't grow, it goes through a bitmap anyway
+		 */
+		if (rr_chunk_need_bitmap(bitmap, c))
+			return 0;
+		ext2fs_set_bit(bit, c->data);
+		c->card++;
+		rr_chunk_optimize(c);
+		return 0;
+	case RR_BITMAP:
+		if (ext2fs_set_bit(bit, c->data))
+			return 1;
+		c->card++;
+		return 0;
+	case RR_RUN:
+		if (rr_chunk_test(c, bit))
+			return 1;
+		if (rr_run_change(c, bit, bit, 1) == 0)
+			return 0;
+		/* No memory for another run; fall back to a bitmap */
+		if (rr_chunk_need_bitmap(bitmap, c))
+			return 0;
+		ext2fs_set_bit(bit, c->data);
+		c->card++;
+		return 0;
+	}
+	return 0;
+}
+
+static int rr_chunk_unmark(ext2fs_generic_bitmap bitmap, struct rr_chunk *c,
+			   unsigned int bit)
+{
+	__u16		*array;
+	unsigned int	i;
+
+	switch (c->type) {
+	case RR_ARRAY:
+		array = c->data;
+		i = rr_array_find(array, c->num, bit);
+		if (i >= c->num || array[i] != bit)
+			return 0;
+		memmove(array + i, array + i + 1,
+			(c->num - i - 1) * sizeof(__u16));
+		c->num--;
+		if (--c->card == 0)
+			rr_chunk_free(c);
+		return 1;
+	case RR_BITMAP:
+		if (!ext2fs_clear_bit(bit, c->data))
+			return 0;
+		c->card--;
+		/* Leave some slack, so that we don't flip back and forth */
+		if (c->card < RR_ARRAY_MAX / 2)
+			rr_chunk_optimize(c);
+		return 1;
+	case RR_RUN:
+		if (!rr_chunk_test(c, bit))
+			return 0;
+		if (rr_run_change(c, bit, bit, 0) == 0)
+			return 1;
+		/* No memory to split a run; fall back to a bitmap */
+		if (rr_chunk_need_bitmap(bitmap, c))
+			return 1;
+		ext2fs_clear_bit(bit, c->data);
+		c->card--;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Find the first set or clear bit in [first, last] of a chunk.
+ * Returns 1 and the bit in *out if there is one.
+ */
+static int rr_chunk_find(struct rr_chunk *c, int want, unsigned int first,
+			 unsigned int last, unsigned int *out)
+{
+	__u16		*array = c->data;
+	struct rr_run	*runs = c->data;
+	unsigned char	*map = c->data;
+	unsigned int	i, bit = first, skip = want ? 0 : 0xff;
+
+	switch (c->type) {
+	case RR_EMPTY:
+		if (want)
+			return 0;
+		break;
+	case RR_ARRAY:
+		i = rr_array_find(array, c->num, first);
+		if (want) {
+			if (i >= c->num)
+				return 0;
+			bit = array[i];
+		} else
+			while (i < c->num && array[i] == bit) {
+				bit++;
+				i++;
+			}
+		break;
+	case RR_BITMAP:
+		while (bit <= last) {
+			if ((bit & 7) == 0 && map[bit >> 3] == skip) {
+				bit += 8;
+				continue;
+			}
+			if (!ext2fs_test_bit(bit, map) == !want)
+				break;
+			bit++;
+		}
+		break;
+	case RR_RUN:
+		i = rr_run_find(runs, c->num, first);
+		if (want) {
+			if (i >= c->num)
+				return 0;
+			if (runs[i].start > bit)
+				bit = runs[i].start;
+		} else if (i < c->num && runs[i].start <= bit)
+			/* Runs never touch, so the next bit is clear */
+			bit = runs[i].last + 1;
+		break;
+	}
+	if (bit > last)
+		return 0;
+	*out = bit;
+	return 1;
+}
+
+static unsigned int rr_chunk_count(struct rr_chunk *c, unsigned int first,
+				   unsigned int last)
+{
+	__u16		*array = c->data;
+	struct rr_run	*runs = c->data;
+	unsigned int	i, s, e, count = 0;
+
+	if (first == 0 && last == RR_CHUNK_MASK)
+		return c->card;
+	switch (c->type) {
+	case RR_ARRAY:
+		return rr_array_find(array, c->num, last + 1) -
+			rr_array_find(array, c->num, first);
+	case RR_BITMAP:
+		return rr_count_bits(c->data, first, last);
+	case RR_RUN:
+		for (i = rr_run_find(runs, c->num, first);
+		     i < c->num && runs[i].start <= last; i++) {
+			s = (runs[i].start > first) ? runs[i].start : first;
+			e = (runs[i].last < last) ? runs[i].last : last;
+			count += e - s + 1;
+		}
+		return count;
+	}
+	return 0;
+}
+
+/*
+ * Set or clear [first, first + num) within a chunk.  Run lists and
+ * empty chunks are changed a run at a time, short extents in arrays a
+ * bit at a time; anything else goes through a bitmap.
+ */
+static void rr_chunk_mark_range(ext2fs_generic_bitmap bitmap,
+				struct rr_chunk *c, unsigned int first,
+				unsigned int num, int set)
+{
+	unsigned int	i, before;
+
+	if (num == RR_CHUNK_SIZE)
+		rr_chunk_free(c);
+	if (c->type == RR_RUN || (c->type == RR_EMPTY && num > 1)) {
+		if (rr_run_change(c, first, first + num - 1, set) == 0)
+			return;
+	} else if (num < RR_SMALL_EXTENT && c->type != RR_BITMAP) {
+		for (i = first; i < first + num; i++)
+			if (set)
+				rr_chunk_mark(bitmap, c, i);
+			else
+				rr_chunk_unmark(bitmap, c, i);
+		return;
+	}
+	if (!set && c->type == RR_EMPTY)
+		return;
+	if (c->type == RR_BITMAP) {
+		before = rr_count_bits(c->data, first, first + num - 1);
+		if (set) {
+			rr_set_bits(c->data, first, num);
+			c->card += num - before;
+		} else {
+			rr_clear_bits(c->data, first, num);
+			c->card -= before;
+			if (c->card < RR_ARRAY_MAX / 2)
+				rr_chunk_optimize(c);
+		}
+		return;
+	}
+	if (rr_chunk_need_bitmap(bitmap, c))
+		return;
+	if (set)
+		rr_set_bits(c->data, first, num);
+	else
+		rr_clear_bits(c->data, first, num);
+	rr_chunk_optimize(c);
+}
+
+static void rr_mark_range(ext2fs_generic_bitmap bitmap, __u64 arg,
+			  __u64 num, int set)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	__u64		rel = arg - bitmap->start;
+	unsigned int	first, n;
+
+	while (num) {
+		first = rel & RR_CHUNK_MASK;
+		n = RR_CHUNK_SIZE - first;
+		if (n > num)
+			n = num;
+		rr_chunk_mark_range(bitmap, &bp->chunks[rel >> RR_CHUNK_BITS],
+				    first, n, set);
+		rel += n;
+		num -= n;
+	}
+}
+
+static errcode_t rr_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
+			     ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rr_private *bp;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(sizeof(struct ext2fs_rr_private), &bp);
+	if (retval)
+		return retval;
+	bp->nchunks = ((bitmap->real_end - bitmap->start) >> RR_CHUNK_BITS) + 1;
+	retval = ext2fs_get_array(bp->nchunks, sizeof(struct rr_chunk),
+				  &bp->chunks);
+	if (retval) {
+		ext2fs_free_mem(&bp);
+		return retval;
+	}
+	memset(bp->chunks, 0, bp->nchunks * sizeof(struct rr_chunk));
+	bitmap->private = bp;
+	return 0;
+}
+
+static void rr_clear_bmap(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	__u64		i;
+
+	for (i = 0; i < bp->nchunks; i++)
+		rr_chunk_free(&bp->chunks[i]);
+}
+
+static void rr_free_bmap(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+
+	if (!bp)
+		return;
+	rr_clear_bmap(bitmap);
+	ext2fs_free_mem(&bp->chunks);
+	ext2fs_free_mem(&bp);
+	bitmap->private = NULL;
+}
+
+static errcode_t rr_copy_bmap(ext2fs_generic_bitmap src,
+			      ext2fs_generic_bitmap dest)
+{
+	struct ext2fs_rr_private *src_bp = src->private;
+	struct ext2fs_rr_private *dest_bp;
+	struct rr_chunk	*s, *d;
+	unsigned int	size;
+	errcode_t	retval;
+	__u64		i;
+
+	retval = rr_new_bmap(src->fs, dest);
+	if (retval)
+		return retval;
+	dest_bp = dest->private;
+
+	for (i = 0; i < src_bp->nchunks; i++) {
+		s = &src_bp->chunks[i];
+		d = &dest_bp->chunks[i];
+		if (s->type == RR_EMPTY)
+			continue;
+		if (s->type == RR_BITMAP)
+			size = RR_BITMAP_BYTES;
+		else if (s->type == RR_ARRAY)
+			size = s->num * sizeof(__u16);
+		else
+			size = s->num * sizeof(struct rr_run);
+		retval = ext2fs_get_mem(size, &d->data);
+		if (retval) {
+			rr_free_bmap(dest);
+			return retval;
+		}
+		memcpy(d->data, s->data, size);
+		d->type = s->type;
+		d->num = s->num;
+		d->alloc = (s->type == RR_BITMAP) ? 0 : s->num;
+		d->card = s->card;
+	}
+	return 0;
+}
+
+static errcode_t rr_resize_bmap(ext2fs_generic_bitmap bitmap,
+				__u64 new_end EXT2FS_ATTR((unused)),
+				__u64 new_real_end)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	__u64		nchunks;
+	errcode_t	retval;
+
+	if (new_real_end < bitmap->real_end)
+		rr_mark_range(bitmap, new_real_end + 1,
+			      bitmap->real_end - new_real_end, 0);
+	nchunks = ((new_real_end - bitmap->start) >> RR_CHUNK_BITS) + 1;
+	if (nchunks == bp->nchunks)
+		return 0;
+	retval = ext2fs_resize_mem(bp->nchunks * sizeof(struct rr_chunk),
+				   nchunks * sizeof(struct rr_chunk),
+				   &bp->chunks);
+	if (retval)
+		return retval;
+	if (nchunks > bp->nchunks)
+		memset(bp->chunks + bp->nchunks, 0,
+		       (nchunks - bp->nchunks) * sizeof(struct rr_chunk));
+	bp->nchunks = nchunks;
+	return 0;
+}
+
+static int rr_mark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	__u64		rel = arg - bitmap->start;
+
+	return rr_chunk_mark(bitmap, &bp->chunks[rel >> RR_CHUNK_BITS],
+			     rel & RR_CHUNK_MASK);
+}
+
+static int rr_unmark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	__u64		rel = arg - bitmap->start;
+
+	return rr_chunk_unmark(bitmap, &bp->chunks[rel >> RR_CHUNK_BITS],
+			       rel & RR_CHUNK_MASK);
+}
+
+static int rr_test_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	__u64		rel = arg - bitmap->start;
+
+	return rr_chunk_test(&bp->chunks[rel >> RR_CHUNK_BITS],
+			     rel & RR_CHUNK_MASK);
+}
+
+static void rr_mark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				unsigned int num)
+{
+	rr_mark_range(bitmap, arg, num, 1);
+}
+
+static void rr_unmark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				  unsigned int num)
+{
+	rr_mark_range(bitmap, arg, num, 0);
+}
+
+static errcode_t rr_find_first(ext2fs_generic_bitmap bitmap, int want,
+			       __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	__u64		rel = start - bitmap->start;
+	__u64		rel_end = end - bitmap->start;
+	unsigned int	first, last, bit;
+
+	while (rel <= rel_end) {
+		first = rel & RR_CHUNK_MASK;
+		last = RR_CHUNK_MASK;
+		if ((rel | RR_CHUNK_MASK) > rel_end)
+			last = rel_end & RR_CHUNK_MASK;
+		if (rr_chunk_find(&bp->chunks[rel >> RR_CHUNK_BITS], want,
+				  first, last, &bit)) {
+			*out = bitmap->start + (rel & ~(__u64) RR_CHUNK_MASK) +
+				bit;
+			return 0;
+		}
+		rel = (rel | RR_CHUNK_MASK) + 1;
+	}
+	return ENOENT;
+}
+
+static errcode_t rr_find_first_zero(ext2fs_generic_bitmap bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	return rr_find_first(bitmap, 0, start, end, out);
+}
+
+static errcode_t rr_find_first_set(ext2fs_generic_bitmap bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	return rr_find_first(bitmap, 1, start, end, out);
+}
+
+static int rr_test_clear_bmap_extent(ext2fs_generic_bitmap bitmap,
+				     __u64 start, unsigned int len)
+{
+	__u64		out;
+
+	return rr_find_first(bitmap, 1, start, start + len - 1, &out) != 0;
+}
+
+static void rr_set_bmap_range(ext2fs_generic_bitmap bitmap,
+			      __u64 start, size_t num, void *in)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	const unsigned char *cp = in;
+	struct rr_chunk	*c;
+	__u64		rel = start - bitmap->start;
+	size_t		i = 0, j;
+	unsigned int	first, n;
+
+	while (i < num) {
+		first = rel & RR_CHUNK_MASK;
+		n = RR_CHUNK_SIZE - first;
+		if (n > num - i)
+			n = num - i;
+		c = &bp->chunks[rel >> RR_CHUNK_BITS];
+		if (rr_chunk_need_bitmap(bitmap, c))
+			return;
+		if ((first & 7) == 0 && (i & 7) == 0) {
+			memcpy((char *) c->data + (first >> 3), cp + (i >> 3),
+			       n >> 3);
+			j = n & ~7U;
+		} else
+			j = 0;
+		for (; j < n; j++)
+			if (ext2fs_test_bit64(i + j, in))
+				ext2fs_set_bit(first + j, c->data);
+			else
+				ext2fs_clear_bit(first + j, c->data);
+		rr_chunk_optimize(c);
+		rel += n;
+		i += n;
+	}
+}
+
+static void rr_get_bmap_range(ext2fs_generic_bitmap bitmap,
+			      __u64 start, size_t num, void *out)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	unsigned char	*cp = out;
+	struct rr_chunk	*c;
+	__u16		*array;
+	struct rr_run	*runs;
+	__u64		rel = start - bitmap->start;
+	size_t		i = 0;
+	unsigned int	first, last, n, k, s, e;
+
+	memset(out, 0, (num + 7) >> 3);
+	while (i < num) {
+		first = rel & RR_CHUNK_MASK;
+		n = RR_CHUNK_SIZE - first;
+		if (n > num - i)
+			n = num - i;
+		last = first + n - 1;
+		c = &bp->chunks[rel >> RR_CHUNK_BITS];
+		switch (c->type) {
+		case RR_ARRAY:
+			array = c->data;
+			for (k = rr_array_find(array, c->num, first);
+			     k < c->num && array[k] <= last; k++)
+				ext2fs_set_bit64(i + array[k] - first, out);
+			break;
+		case RR_RUN:
+			runs = c->data;
+			for (k = rr_run_find(runs, c->num, first);
+			     k < c->num && runs[k].start <= last; k++) {
+				s = (runs[k].start > first) ?
+					runs[k].start : first;
+				e = (runs[k].last < last) ? runs[k].last : last;
+				rr_set_bits(out, i + s - first, e - s + 1);
+			}
+			break;
+		case RR_BITMAP:
+			if ((first & 7) == 0 && (i & 7) == 0) {
+				memcpy(cp + (i >> 3),
+				       (char *) c->data + (first >> 3), n >> 3);
+				k = n & ~7U;
+			} else
+				k = 0;
+			for (; k < n; k++)
+				if (ext2fs_test_bit(first + k, c->data))
+					ext2fs_set_bit64(i + k, out);
+			break;
+		}
+		rel += n;
+		i += n;
+	}
+}
+
+static __u64 rr_count_used(ext2fs_generic_bitmap bitmap,
+			   __u64 start, __u64 end)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	__u64		rel = start - bitmap->start;
+	__u64		rel_end = end - bitmap->start;
+	__u64		count = 0;
+	unsigned int	first, last;
+
+	while (rel <= rel_end) {
+		first = rel & RR_CHUNK_MASK;
+		last = RR_CHUNK_MASK;
+		if ((rel | RR_CHUNK_MASK) > rel_end)
+			last = rel_end & RR_CHUNK_MASK;
+		count += rr_chunk_count(&bp->chunks[rel >> RR_CHUNK_BITS],
+					first, last);
+		rel = (rel | RR_CHUNK_MASK) + 1;
+	}
+	return count;
+}
+
+static unsigned long long rr_memory_used(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rr_private *bp = bitmap->private;
+	struct rr_chunk	*c;
+	unsigned long long size;
+	__u64		i;
+
+	size = sizeof(struct ext2fs_rr_private) +
+		bp->nchunks * sizeof(struct rr_chunk);
+	for (i = 0; i < bp->nchunks; i++) {
+		c = &bp->chunks[i];
+		if (c->type == RR_BITMAP)
+			size += RR_BITMAP_BYTES;
+		else if (c->type == RR_ARRAY)
+			size += c->alloc * sizeof(__u16);
+		else if (c->type == RR_RUN)
+			size += c->alloc * sizeof(struct rr_run);
+	}
+	return size;
+}
+
+struct ext2_bitmap_ops ext2fs_blkmap64_roaring = {
+	EXT2FS_BMAP64_ROARING,
+	rr_new_bmap,
+	rr_free_bmap,
+	rr_copy_bmap,
+	rr_resize_bmap,
+	rr_mark_bmap,
+	rr_unmark_bmap,
+	rr_test_bmap,
+	rr_mark_bmap_extent,
+	rr_unmark_bmap_extent,
+	rr_test_clear_bmap_extent,
+	rr_set_bmap_range,
+	rr_get_bmap_range,
+	rr_clear_bmap,
+	rr_find_first_zero,
+	rr_find_first_set,
+	rr_count_used,
+	rr_memory_used,
+};
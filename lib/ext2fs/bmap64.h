@@ -0,0 +1,104 @@
+/*
+ * bmap64.h --- the internal representation of bitmaps
+ *
+ * A bitmap is a handle which holds the range it covers, and a set of
+ * operations provided by the backend which stores the bits.  The
+ * generic code in gen_bitmap.c checks the arguments and calls through
+ * bitmap_ops; a backend only ever sees bit numbers within
+ * [start, real_end].
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+struct ext2fs_struct_generic_bitmap {
+	errcode_t		magic;
+	ext2_filsys 		fs;
+	struct ext2_bitmap_ops	*bitmap_ops;
+	__u64			start, end;
+	__u64			real_end;
+	char			*description;
+	void			*private;
+	errcode_t		base_error_code;
+	struct ext2fs_bmap_lazy	*lazy;
+	errcode_t		error;	/* set once the bitmap is wrong */
+};
+
+/*
+ * A bitmap opened with EXT2_FLAG_LAZY_BITMAPS is read from disk a
+ * group at a time, the first time a bit in the group is used.  The
+ * generic code calls load_group for each group not yet loaded, and
+ * records which groups have been changed so that only those need to
+ * be written back.
+ */
+struct ext2fs_bmap_lazy {
+	__u64		first;		/* first bit of group 0 */
+	__u32		group_bits;	/* bits per group */
+	dgrp_t		ngroups;
+	char		*loaded;	/* one bit per group */
+	char		*dirty;		/* one bit per group */
+	blk_t		*locs;		/* where each group's bits are on disk */
+	char		*buf;		/* I/O buffer for load_group */
+	errcode_t	(*load_group)(ext2fs_generic_bitmap bitmap,
+				      dgrp_t group);
+};
+
+struct ext2_bitmap_ops {
+	int	type;
+	/* Allocate the private data for a new, all-clear bitmap */
+	errcode_t (*new_bmap)(ext2_filsys fs, ext2fs_generic_bitmap bmap);
+	void	(*free_bmap)(ext2fs_generic_bitmap bitmap);
+	errcode_t (*copy_bmap)(ext2fs_generic_bitmap src,
+			       ext2fs_generic_bitmap dest);
+	/* Bits past new_real_end are dropped, new bits are clear */
+	errcode_t (*resize_bmap)(ext2fs_generic_bitmap bitmap,
+				 __u64 new_end, __u64 new_real_end);
+	/*
+	 * These return the previous value of the bit as 0 or 1, so
+	 * that results from different backends can be compared
+	 */
+	int	(*mark_bmap)(ext2fs_generic_bitmap bitmap, __u64 arg);
+	int	(*unmark_bmap)(ext2fs_generic_bitmap bitmap, __u64 arg);
+	int	(*test_bmap)(ext2fs_generic_bitmap bitmap, __u64 arg);
+	void	(*mark_bmap_extent)(ext2fs_generic_bitmap bitmap, __u64 arg,
+				    unsigned int num);
+	void	(*unmark_bmap_extent)(ext2fs_generic_bitmap bitmap, __u64 arg,
+				      unsigned int num);
+	/* Returns true if all of the bits in the extent are clear */
+	int	(*test_clear_bmap_extent)(ext2fs_generic_bitmap bitmap,
+					  __u64 arg, unsigned int num);
+	/* Copy num bits in or out as a little-endian bit array */
+	void	(*set_bmap_range)(ext2fs_generic_bitmap bitmap,
+				  __u64 start, size_t num, void *in);
+	void	(*get_bmap_range)(ext2fs_generic_bitmap bitmap,
+				  __u64 start, size_t num, void *out);
+	void	(*clear_bmap)(ext2fs_generic_bitmap bitmap);
+	/*
+	 * Find the first clear or set bit in [start, end]; return
+	 * ENOENT if there is none
+	 */
+	errcode_t (*find_first_zero)(ext2fs_generic_bitmap bitmap,
+				     __u64 start, __u64 end, __u64 *out);
+	errcode_t (*find_first_set)(ext2fs_generic_bitmap bitmap,
+				    __u64 start, __u64 end, __u64 *out);
+	/* Number of set bits in [start, end] */
+	__u64	(*count_used)(ext2fs_generic_bitmap bitmap,
+			      __u64 start, __u64 end);
+	/* Bytes of memory used by the backend's private data */
+	unsigned long long (*memory_used)(ext2fs_generic_bitmap bitmap);
+};
+
+extern struct ext2_bitmap_ops ext2fs_blkmap64_bitarray;
+extern struct ext2_bitmap_ops ext2fs_blkmap64_rbtree;
+extern struct ext2_bitmap_ops ext2fs_blkmap64_roaring;
+
+/* A backend could not change a bit, so the bitmap is now wrong */
+extern void ext2fs_bmap_error(ext2fs_generic_bitmap bitmap, errcode_t error);
+
+/*
+ * The first error met loading or changing the bitmap, or 0.  A bitmap
+ * with an error must not be allocated from or written back.
+ */
+extern errcode_t ext2fs_bmap_load_error(ext2fs_generic_bitmap bitmap);
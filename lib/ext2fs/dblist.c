@@ -238,6 +238,48 @@ errcode_t ext2fs_dblist_iterate(ext2_dblist dblist,
 	return 0;
 }
 
+/*
+ * Ask the I/O channel to start reading the directory blocks of up to
+ * count entries of the list, starting with entry start, so that they
+ * are cached by the time an iterator gets to them.  Runs of adjacent
+ * blocks are merged into a single request.
+ */
+errcode_t ext2fs_dblist_readahead(ext2_dblist dblist, ext2_ino_t start,
+				  ext2_ino_t count)
+{
+	struct ext2_db_entry	*db;
+	blk_t			first = 0, num = 0;
+	errcode_t		retval;
+
+	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
+
+	if (start >= dblist->count)
+		return 0;
+	if (count > dblist->count - start)
+		count = dblist->count - start;
+	for (db = dblist->list + start; count > 0; count--, db++) {
+		if (!db->blk)
+			continue;
+		if (num && db->blk >= first && db->blk < first + num)
+			continue;
+		if (num && db->blk == first + num) {
+			num++;
+			continue;
+		}
+		if (num) {
+			retval = io_channel_cache_readahead(dblist->fs->io,
+							    first, num);
+			if (retval)
+				return retval;
+		}
+		first = db->blk;
+		num = 1;
+	}
+	if (num)
+		return io_channel_cache_readahead(dblist->fs->io, first, num);
+	return 0;
+}
+
 static EXT2_QSORT_TYPE dir_block_cmp(const void *a, const void *b)
 {
 	const struct ext2_db_entry *db_a =
@@ -272,6 +314,19 @@ errcode_t ext2fs_dblist_get_last(ext2_dblist dblist,
 	return 0;
 }
 
+errcode_t ext2fs_dblist_get_entry(ext2_dblist dblist, ext2_ino_t idx,
+				  struct ext2_db_entry **entry)
+{
+	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
+
+	if (idx >= dblist->count)
+		return EXT2_ET_DB_NOT_FOUND;
+
+	if (entry)
+		*entry = dblist->list + idx;
+	return 0;
+}
+
 errcode_t ext2fs_dblist_drop_last(ext2_dblist dblist)
 {
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
@@ -115,7 +115,7 @@ errcode_t ext2fs_dir_iterate2(ext2_filsys fs,
 	if (block_buf)
 		ctx.buf = block_buf;
 	else {
-		retval = ext2fs_get_mem(fs->blocksize, &ctx.buf);
+		retval = ext2fs_get_io_buffer(fs->io, fs->blocksize, &ctx.buf);
 		if (retval)
 			return retval;
 	}
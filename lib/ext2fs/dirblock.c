@@ -75,7 +75,7 @@ errcode_t ext2fs_write_dir_block2(ext2_filsys fs, blk_t block,
 	unsigned int	rec_len;
 	struct ext2_dir_entry *dirent;
 
-	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	retval = ext2fs_get_io_buffer(fs->io, fs->blocksize, &buf);
 	if (retval)
 		return retval;
 	memcpy(buf, inbuf, fs->blocksize);
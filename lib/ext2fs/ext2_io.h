@@ -51,16 +51,42 @@ struct struct_io_channel {
 				       errcode_t error);
 	int		refcount;
 	int		flags;
-	long		reserved[14];
+	int		align;		/* required buffer alignment, or 0 */
+	long		reserved[13];
 	void		*private_data;
 	void		*app_data;
 };
 
+/*
+ * Latency histograms are kept in log2 buckets of microseconds: bucket
+ * 0 counts requests which took less than 1us, bucket N (N > 0) counts
+ * requests which took [2^(N-1), 2^N) us, and the last bucket also
+ * absorbs everything slower than that.
+ */
+#define IO_STATS_LAT_BUCKETS	24
+
+/*
+ * num_fields is the number of 64-bit counters which follow the
+ * reserved field, so that callers can tell which of the fields below
+ * were filled in by an older I/O manager.
+ */
+#define IO_STATS_FIELDS_V1	2
+#define IO_STATS_FIELDS		(8 + 2 * IO_STATS_LAT_BUCKETS)
+
 struct struct_io_stats {
 	int			num_fields;
 	int			reserved;
 	unsigned long long	bytes_read;
 	unsigned long long	bytes_written;
+	/* Fields below are only valid if num_fields >= IO_STATS_FIELDS */
+	unsigned long long	reads;
+	unsigned long long	writes;
+	unsigned long long	cache_hits;
+	unsigned long long	cache_misses;
+	unsigned long long	seq_ios;
+	unsigned long long	random_ios;
+	unsigned long long	read_lat[IO_STATS_LAT_BUCKETS];
+	unsigned long long	write_lat[IO_STATS_LAT_BUCKETS];
 };
 
 struct struct_io_manager {
@@ -83,7 +109,11 @@ struct struct_io_manager {
 					int count, void *data);
 	errcode_t (*write_blk64)(io_channel channel, unsigned long long block,
 					int count, const void *data);
-	long	reserved[16];
+	/* Start reading blocks in the background; the data is not returned */
+	errcode_t (*cache_readahead)(io_channel channel,
+				     unsigned long long block,
+				     unsigned long long count);
+	long	reserved[15];
 };
 
 #define IO_FLAG_RW		0x0001
@@ -112,6 +142,16 @@ extern errcode_t io_channel_read_blk64(io_channel channel,
 extern errcode_t io_channel_write_blk64(io_channel channel,
 					unsigned long long block,
 					int count, const void *data);
+extern errcode_t io_channel_cache_readahead(io_channel channel,
+					    unsigned long long block,
+					    unsigned long long count);
+extern void io_stats_init(io_stats stats);
+extern unsigned long long io_stats_time(void);
+extern void io_stats_update(io_stats stats, ext2_loff_t *next_location,
+			    int is_write, ext2_loff_t location,
+			    unsigned long long size,
+			    unsigned long long start_time);
+extern void io_stats_copy(io_stats dest, io_stats src);
 
 /* unix_io.c */
 extern io_manager unix_io_manager;
@@ -120,6 +160,10 @@ extern io_manager unix_io_manager;
 extern io_manager undo_io_manager;
 extern errcode_t set_undo_io_backing_manager(io_manager manager);
 extern errcode_t set_undo_io_backup_file(char *file_name);
+extern errcode_t set_undo_io_backup_format(int format);
+
+#define UNDO_IO_FORMAT_LOG	0	/* append-only log, see undo_log.h */
+#define UNDO_IO_FORMAT_TDB	1	/* one tdb record per block */
 
 /* test_io.c */
 extern io_manager test_io_manager, test_io_backing_manager;
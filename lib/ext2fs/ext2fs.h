@@ -109,6 +109,14 @@ typedef struct ext2fs_struct_generic_bitmap *ext2fs_generic_bitmap;
 typedef struct ext2fs_struct_generic_bitmap *ext2fs_inode_bitmap;
 typedef struct ext2fs_struct_generic_bitmap *ext2fs_block_bitmap;
 
+/*
+ * Bitmap backends, chosen through fs->default_bitmap_type when a
+ * bitmap is allocated
+ */
+#define EXT2FS_BMAP64_BITARRAY	1
+#define EXT2FS_BMAP64_RBTREE	2
+#define EXT2FS_BMAP64_ROARING	3
+
 #define EXT2_FIRST_INODE(s)	EXT2_FIRST_INO(s)
 
 
@@ -185,6 +193,7 @@ typedef struct ext2_file *ext2_file_t;
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 #define EXT2_FLAG_EXCLUDE_DIRTY		0x100000
 #endif
+#define EXT2_FLAG_LAZY_BITMAPS		0x200000
 
 /*
  * Special flag in the ext2 inode i_flag field that means that this is
@@ -233,10 +242,11 @@ struct struct_ext2_filsys {
 	struct ext2_image_hdr *		image_header;
 	__u32				umask;
 	time_t				now;
+	int				default_bitmap_type;
 	/*
 	 * Reserved for future expansion
 	 */
-	__u32				reserved[7];
+	__u32				reserved[6];
 
 	/*
 	 * Reserved for the use of the calling application.
@@ -255,6 +265,14 @@ struct struct_ext2_filsys {
 	errcode_t (*get_alloc_block)(ext2_filsys fs, blk64_t goal,
 				     blk64_t *ret);
 	void (*block_alloc_stats)(ext2_filsys fs, blk64_t blk, int inuse);
+	/*
+	 * Called when a bit of one of the filesystem's bitmaps could
+	 * not be changed, e.g. for lack of memory.  If this is not set,
+	 * or returns, the library reports the error and keeps it in the
+	 * bitmap: allocating from it fails, and it is not written back.
+	 */
+	void (*bitmap_error)(ext2_filsys fs, errcode_t error,
+			     const char *description);
 };
 
 #if EXT2_FLAT_INCLUDES
@@ -424,6 +442,7 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
 #define EXT2_SF_BAD_EXTRA_BYTES	0x0004
 #define EXT2_SF_SKIP_MISSING_ITABLE	0x0008
 #define EXT2_SF_DO_LAZY		0x0010
+#define EXT2_SF_READAHEAD	0x0020
 
 /*
  * ext2fs_check_if_mounted flags
@@ -483,6 +502,7 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
  * ext2_icount_t abstraction
  */
 #define EXT2_ICOUNT_OPT_INCREMENT	0x01
+#define EXT2_ICOUNT_OPT_FULLMAP		0x02
 
 typedef struct ext2_icount *ext2_icount_t;
 
@@ -625,6 +645,7 @@ void ext2fs_inode_alloc_stats(ext2_filsys fs, ext2_ino_t ino, int inuse);
 void ext2fs_inode_alloc_stats2(ext2_filsys fs, ext2_ino_t ino,
 			       int inuse, int isdir);
 void ext2fs_block_alloc_stats(ext2_filsys fs, blk_t blk, int inuse);
+extern errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs);
 
 /* alloc_tables.c */
 extern errcode_t ext2fs_allocate_tables(ext2_filsys fs);
@@ -726,6 +747,20 @@ extern errcode_t ext2fs_set_block_bitmap_range(ext2fs_block_bitmap bmap,
 extern errcode_t ext2fs_get_block_bitmap_range(ext2fs_block_bitmap bmap,
 					blk_t start, unsigned int num,
 					void *out);
+extern errcode_t ext2fs_find_first_zero_block_bitmap(ext2fs_block_bitmap bitmap,
+						     blk_t start, blk_t end,
+						     blk_t *out);
+extern errcode_t ext2fs_find_first_zero_inode_bitmap(ext2fs_inode_bitmap bitmap,
+						     ext2_ino_t start,
+						     ext2_ino_t end,
+						     ext2_ino_t *out);
+extern errcode_t ext2fs_find_first_set_block_bitmap(ext2fs_block_bitmap bitmap,
+						    blk_t start, blk_t end,
+						    blk_t *out);
+extern errcode_t ext2fs_find_first_set_inode_bitmap(ext2fs_inode_bitmap bitmap,
+						    ext2_ino_t start,
+						    ext2_ino_t end,
+						    ext2_ino_t *out);
 
 
 /* block.c */
@@ -808,7 +843,11 @@ extern errcode_t ext2fs_copy_dblist(ext2_dblist src,
 extern int ext2fs_dblist_count(ext2_dblist dblist);
 extern errcode_t ext2fs_dblist_get_last(ext2_dblist dblist,
 					struct ext2_db_entry **entry);
+extern errcode_t ext2fs_dblist_get_entry(ext2_dblist dblist, ext2_ino_t idx,
+					 struct ext2_db_entry **entry);
 extern errcode_t ext2fs_dblist_drop_last(ext2_dblist dblist);
+extern errcode_t ext2fs_dblist_readahead(ext2_dblist dblist,
+					 ext2_ino_t start, ext2_ino_t count);
 
 /* dblist_dir.c */
 extern errcode_t
@@ -979,6 +1018,19 @@ extern errcode_t ext2fs_set_generic_bitmap_range(ext2fs_generic_bitmap bmap,
 						 errcode_t magic,
 						 __u32 start, __u32 num,
 						 void *in);
+extern errcode_t ext2fs_find_first_zero_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						       errcode_t magic,
+						       __u32 start, __u32 end,
+						       __u32 *out);
+extern errcode_t ext2fs_find_first_set_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						      errcode_t magic,
+						      __u32 start, __u32 end,
+						      __u32 *out);
+extern errcode_t ext2fs_count_used_range(ext2fs_generic_bitmap bitmap,
+					 __u32 start, __u32 end, __u32 *out);
+extern int ext2fs_get_generic_bitmap_type(ext2fs_generic_bitmap bitmap);
+extern unsigned long long
+	ext2fs_get_generic_bitmap_memory(ext2fs_generic_bitmap bitmap);
 
 /* getsize.c */
 extern errcode_t ext2fs_get_device_size(const char *file, int blocksize,
@@ -1018,6 +1070,8 @@ extern errcode_t ext2fs_initialize(const char *name, int flags,
 extern void ext2fs_free_icount(ext2_icount_t icount);
 extern errcode_t ext2fs_create_icount_tdb(ext2_filsys fs, char *tdb_dir,
 					  int flags, ext2_icount_t *ret);
+extern errcode_t ext2fs_create_icount_mmap(ext2_filsys fs, char *tmp_dir,
+					   int flags, ext2_icount_t *ret);
 extern errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags,
 				       unsigned int size,
 				       ext2_icount_t hint, ext2_icount_t *ret);
@@ -1046,6 +1100,12 @@ extern errcode_t ext2fs_open_inode_scan(ext2_filsys fs, int buffer_blocks,
 extern void ext2fs_close_inode_scan(ext2_inode_scan scan);
 extern errcode_t ext2fs_get_next_inode(ext2_inode_scan scan, ext2_ino_t *ino,
 			       struct ext2_inode *inode);
+extern errcode_t ext2fs_get_next_inode_ptr(ext2_inode_scan scan,
+					   ext2_ino_t *ino,
+					   const struct ext2_inode **inode);
+extern errcode_t ext2fs_get_next_inode_batch(ext2_inode_scan scan,
+					     ext2_ino_t *ino,
+					     const char **inodes, int *num);
 extern errcode_t ext2fs_inode_scan_goto_blockgroup(ext2_inode_scan scan,
 						   int	group);
 extern void ext2fs_set_inode_callback
@@ -1080,6 +1140,12 @@ extern errcode_t ext2fs_inode_io_intern2(ext2_filsys fs, ext2_ino_t ino,
 					 struct ext2_inode *inode,
 					 char **name);
 
+/* io_manager.c */
+extern errcode_t ext2fs_get_io_buffer(io_channel channel, unsigned long size,
+				      void *ptr);
+extern void io_stats_print(FILE *f, const char *prefix, io_stats stats,
+			   io_stats base, int histograms);
+
 /* ismounted.c */
 extern errcode_t ext2fs_check_if_mounted(const char *file, int *mount_flags);
 extern errcode_t ext2fs_check_mount_point(const char *device, int *mount_flags,
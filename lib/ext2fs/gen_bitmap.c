@@ -1,5 +1,8 @@
 /*
- * gen_bitmap.c --- Generic (32-bit) bitmap routines
+ * gen_bitmap.c --- Generic bitmap routines
+ *
+ * These check their arguments and then hand the work to the bitmap's
+ * backend; see bmap64.h.
  *
  * Copyright (C) 2001 Theodore Ts'o.
  *
@@ -23,20 +26,13 @@
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
-
-struct ext2fs_struct_generic_bitmap {
-	errcode_t	magic;
-	ext2_filsys 	fs;
-	__u32		start, end;
-	__u32		real_end;
-	char	*	description;
-	char	*	bitmap;
-	errcode_t	base_error_code;
-	__u32		reserved[7];
-};
+#include "bmap64.h"
 
 /*
  * Used by previously inlined function, so we have to export this and
@@ -54,6 +50,28 @@ void ext2fs_warn_bitmap2(ext2fs_generic_bitmap bitmap,
 #endif
 }
 
+/*
+ * The operations which change bits cannot return an error, so a
+ * backend which cannot change a bit, because it ran out of memory,
+ * calls this.  The filesystem's handler may stop the program;
+ * otherwise the error is kept, so that the allocators fail with it
+ * and the bitmap is not written back.
+ */
+void ext2fs_bmap_error(ext2fs_generic_bitmap bitmap, errcode_t error)
+{
+	const char	*descr = bitmap->description ? bitmap->description :
+		"bitmap";
+
+	if (bitmap->fs && bitmap->fs->bitmap_error)
+		(bitmap->fs->bitmap_error)(bitmap->fs, error, descr);
+	if (bitmap->error)
+		return;
+	bitmap->error = error;
+#ifndef OMIT_COM_ERR
+	com_err(0, error, "while updating %s", descr);
+#endif
+}
+
 static errcode_t check_magic(ext2fs_generic_bitmap bitmap)
 {
 	if (!bitmap || !((bitmap->magic == EXT2_ET_MAGIC_GENERIC_BITMAP) ||
@@ -63,6 +81,107 @@ static errcode_t check_magic(ext2fs_generic_bitmap bitmap)
 	return 0;
 }
 
+/*
+ * Before the backend sees any bits of a demand-loaded bitmap, the
+ * groups holding them are read in; if dirty is set, they are also
+ * noted as changed.  A group which cannot be read is marked as fully
+ * in use, so that nothing in it looks free, and the error is kept:
+ * the bitmap is not written back, and the allocators fail with it.
+ */
+static void lazy_load_failed(ext2fs_generic_bitmap bitmap, dgrp_t group,
+			     errcode_t error)
+{
+	struct ext2fs_bmap_lazy *lazy = bitmap->lazy;
+	__u64		start, end;
+
+	start = lazy->first + (__u64) group * lazy->group_bits;
+	end = start + lazy->group_bits - 1;
+	if (end > bitmap->real_end)
+		end = bitmap->real_end;
+	bitmap->bitmap_ops->mark_bmap_extent(bitmap, start, end - start + 1);
+	if (bitmap->error)
+		return;
+	bitmap->error = error;
+#ifndef OMIT_COM_ERR
+	com_err(0, error, "while reading group %u of %s", group,
+		bitmap->description ? bitmap->description : "bitmap");
+#endif
+}
+
+static void lazy_access(ext2fs_generic_bitmap bitmap, __u64 start,
+			__u64 end, int dirty)
+{
+	struct ext2fs_bmap_lazy *lazy = bitmap->lazy;
+	dgrp_t		group, last;
+	errcode_t	retval;
+
+	if (start < lazy->first)
+		start = lazy->first;
+	if (end < start)
+		return;
+	group = (start - lazy->first) / lazy->group_bits;
+	last = (end - lazy->first) / lazy->group_bits;
+	if (last >= lazy->ngroups)
+		last = lazy->ngroups - 1;
+	for (; group <= last; group++) {
+		if (!ext2fs_test_bit(group, lazy->loaded)) {
+			ext2fs_set_bit(group, lazy->loaded);
+			retval = (lazy->load_group)(bitmap, group);
+			if (retval)
+				lazy_load_failed(bitmap, group, retval);
+		}
+		if (dirty)
+			ext2fs_set_bit(group, lazy->dirty);
+	}
+}
+
+errcode_t ext2fs_bmap_load_error(ext2fs_generic_bitmap bitmap)
+{
+	return bitmap->error;
+}
+
+static void lazy_load_all(ext2fs_generic_bitmap bitmap)
+{
+	if (bitmap->lazy)
+		lazy_access(bitmap, bitmap->start, bitmap->real_end, 0);
+}
+
+static void lazy_free(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_bmap_lazy *lazy = bitmap->lazy;
+
+	if (!lazy)
+		return;
+	if (lazy->loaded)
+		ext2fs_free_mem(&lazy->loaded);
+	if (lazy->dirty)
+		ext2fs_free_mem(&lazy->dirty);
+	if (lazy->locs)
+		ext2fs_free_mem(&lazy->locs);
+	if (lazy->buf)
+		ext2fs_free_mem(&lazy->buf);
+	ext2fs_free_mem(&lazy);
+	bitmap->lazy = NULL;
+}
+
+static struct ext2_bitmap_ops *bitmap_ops_for_type(int type)
+{
+	switch (type) {
+	case EXT2FS_BMAP64_RBTREE:
+		return &ext2fs_blkmap64_rbtree;
+	case EXT2FS_BMAP64_ROARING:
+		return &ext2fs_blkmap64_roaring;
+	case EXT2FS_BMAP64_BITARRAY:
+	default:
+		return &ext2fs_blkmap64_bitarray;
+	}
+}
+
+/*
+ * Bitmaps belonging to a filesystem use its default_bitmap_type, so
+ * that an application can pick the backend for each bitmap it
+ * allocates; other bitmaps are plain bitarrays.
+ */
 errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 				     __u32 start, __u32 end, __u32 real_end,
 				     const char *descr, char *init_map,
@@ -70,7 +189,6 @@ errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 {
 	ext2fs_generic_bitmap	bitmap;
 	errcode_t		retval;
-	size_t			size;
 
 	retval = ext2fs_get_mem(sizeof(struct ext2fs_struct_generic_bitmap),
 				&bitmap);
@@ -82,6 +200,11 @@ errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 	bitmap->start = start;
 	bitmap->end = end;
 	bitmap->real_end = real_end;
+	bitmap->private = NULL;
+	bitmap->lazy = NULL;
+	bitmap->error = 0;
+	bitmap->bitmap_ops = bitmap_ops_for_type(fs ? fs->default_bitmap_type :
+						 EXT2FS_BMAP64_BITARRAY);
 	switch (magic) {
 	case EXT2_ET_MAGIC_INODE_BITMAP:
 		bitmap->base_error_code = EXT2_ET_BAD_INODE_MARK;
@@ -102,20 +225,18 @@ errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 	} else
 		bitmap->description = 0;
 
-	size = (size_t) (((bitmap->real_end - bitmap->start) / 8) + 1);
-	/* Round up to allow for the BT x86 instruction */
-	size = (size + 7) & ~3;
-	retval = ext2fs_get_mem(size, &bitmap->bitmap);
+	retval = bitmap->bitmap_ops->new_bmap(fs, bitmap);
 	if (retval) {
-		ext2fs_free_mem(&bitmap->description);
+		if (bitmap->description)
+			ext2fs_free_mem(&bitmap->description);
 		ext2fs_free_mem(&bitmap);
 		return retval;
 	}
 
 	if (init_map)
-		memcpy(bitmap->bitmap, init_map, size);
-	else
-		memset(bitmap->bitmap, 0, size);
+		bitmap->bitmap_ops->set_bmap_range(bitmap, start,
+						   real_end - start + 1,
+						   init_map);
 	*ret = bitmap;
 	return 0;
 }
@@ -130,14 +251,48 @@ errcode_t ext2fs_allocate_generic_bitmap(__u32 start,
 					  start, end, real_end, descr, 0, ret);
 }
 
+/*
+ * The copy uses the same backend as the original.
+ */
 errcode_t ext2fs_copy_generic_bitmap(ext2fs_generic_bitmap src,
 				     ext2fs_generic_bitmap *dest)
 {
-	return (ext2fs_make_generic_bitmap(src->magic, src->fs,
-					   src->start, src->end,
-					   src->real_end,
-					   src->description, src->bitmap,
-					   dest));
+	ext2fs_generic_bitmap	bitmap;
+	errcode_t		retval;
+
+	retval = check_magic(src);
+	if (retval)
+		return retval;
+
+	/* The copy is an ordinary bitmap holding all of src */
+	lazy_load_all(src);
+
+	retval = ext2fs_get_mem(sizeof(struct ext2fs_struct_generic_bitmap),
+				&bitmap);
+	if (retval)
+		return retval;
+	*bitmap = *src;
+	bitmap->private = NULL;
+	bitmap->lazy = NULL;
+	if (src->description) {
+		retval = ext2fs_get_mem(strlen(src->description)+1,
+					&bitmap->description);
+		if (retval) {
+			ext2fs_free_mem(&bitmap);
+			return retval;
+		}
+		strcpy(bitmap->description, src->description);
+	}
+
+	retval = src->bitmap_ops->copy_bmap(src, bitmap);
+	if (retval) {
+		if (bitmap->description)
+			ext2fs_free_mem(&bitmap->description);
+		ext2fs_free_mem(&bitmap);
+		return retval;
+	}
+	*dest = bitmap;
+	return 0;
 }
 
 void ext2fs_free_generic_bitmap(ext2fs_inode_bitmap bitmap)
@@ -145,15 +300,13 @@ void ext2fs_free_generic_bitmap(ext2fs_inode_bitmap bitmap)
 	if (check_magic(bitmap))
 		return;
 
+	bitmap->bitmap_ops->free_bmap(bitmap);
+	lazy_free(bitmap);
 	bitmap->magic = 0;
 	if (bitmap->description) {
 		ext2fs_free_mem(&bitmap->description);
 		bitmap->description = 0;
 	}
-	if (bitmap->bitmap) {
-		ext2fs_free_mem(&bitmap->bitmap);
-		bitmap->bitmap = 0;
-	}
 	ext2fs_free_mem(&bitmap);
 }
 
@@ -164,7 +317,9 @@ int ext2fs_test_generic_bitmap(ext2fs_generic_bitmap bitmap,
 		ext2fs_warn_bitmap2(bitmap, EXT2FS_TEST_ERROR, bitno);
 		return 0;
 	}
-	return ext2fs_test_bit(bitno - bitmap->start, bitmap->bitmap);
+	if (bitmap->lazy)
+		lazy_access(bitmap, bitno, bitno, 0);
+	return bitmap->bitmap_ops->test_bmap(bitmap, bitno);
 }
 
 int ext2fs_mark_generic_bitmap(ext2fs_generic_bitmap bitmap,
@@ -174,7 +329,9 @@ int ext2fs_mark_generic_bitmap(ext2fs_generic_bitmap bitmap,
 		ext2fs_warn_bitmap2(bitmap, EXT2FS_MARK_ERROR, bitno);
 		return 0;
 	}
-	return ext2fs_set_bit(bitno - bitmap->start, bitmap->bitmap);
+	if (bitmap->lazy)
+		lazy_access(bitmap, bitno, bitno, 1);
+	return bitmap->bitmap_ops->mark_bmap(bitmap, bitno);
 }
 
 int ext2fs_unmark_generic_bitmap(ext2fs_generic_bitmap bitmap,
@@ -184,7 +341,9 @@ int ext2fs_unmark_generic_bitmap(ext2fs_generic_bitmap bitmap,
 		ext2fs_warn_bitmap2(bitmap, EXT2FS_UNMARK_ERROR, bitno);
 		return 0;
 	}
-	return ext2fs_clear_bit(bitno - bitmap->start, bitmap->bitmap);
+	if (bitmap->lazy)
+		lazy_access(bitmap, bitno, bitno, 1);
+	return bitmap->bitmap_ops->unmark_bmap(bitmap, bitno);
 }
 
 __u32 ext2fs_get_generic_bitmap_start(ext2fs_generic_bitmap bitmap)
@@ -197,13 +356,38 @@ __u32 ext2fs_get_generic_bitmap_end(ext2fs_generic_bitmap bitmap)
 	return bitmap->end;
 }
 
+/*
+ * Return the backend of a bitmap, as an EXT2FS_BMAP64_* value, and
+ * the number of bytes of memory it currently uses.
+ */
+int ext2fs_get_generic_bitmap_type(ext2fs_generic_bitmap bitmap)
+{
+	if (check_magic(bitmap))
+		return 0;
+	return bitmap->bitmap_ops->type;
+}
+
+unsigned long long ext2fs_get_generic_bitmap_memory(ext2fs_generic_bitmap bitmap)
+{
+	if (check_magic(bitmap))
+		return 0;
+	return sizeof(struct ext2fs_struct_generic_bitmap) +
+		bitmap->bitmap_ops->memory_used(bitmap);
+}
+
 void ext2fs_clear_generic_bitmap(ext2fs_generic_bitmap bitmap)
 {
 	if (check_magic(bitmap))
 		return;
 
-	memset(bitmap->bitmap, 0,
-	       (size_t) (((bitmap->real_end - bitmap->start) / 8) + 1));
+	/* Nothing needs to be read, but every group must be written */
+	if (bitmap->lazy) {
+		memset(bitmap->lazy->loaded, 0xff,
+		       (bitmap->lazy->ngroups + 7) / 8);
+		memset(bitmap->lazy->dirty, 0xff,
+		       (bitmap->lazy->ngroups + 7) / 8);
+	}
+	bitmap->bitmap_ops->clear_bmap(bitmap);
 }
 
 errcode_t ext2fs_fudge_generic_bitmap_end(ext2fs_inode_bitmap bitmap,
@@ -225,49 +409,56 @@ errcode_t ext2fs_resize_generic_bitmap(errcode_t magic,
 				       ext2fs_generic_bitmap bmap)
 {
 	errcode_t	retval;
-	size_t		size, new_size;
-	__u32		bitno;
+	__u64		last;
 
 	if (!bmap || (bmap->magic != magic))
 		return magic;
 
+	/* A resized bitmap no longer matches the groups on disk */
+	if (bmap->lazy) {
+		lazy_load_all(bmap);
+		lazy_free(bmap);
+	}
+
 	/*
 	 * If we're expanding the bitmap, make sure all of the new
 	 * parts of the bitmap are zero.
 	 */
 	if (new_end > bmap->end) {
-		bitno = bmap->real_end;
-		if (bitno > new_end)
-			bitno = new_end;
-		for (; bitno > bmap->end; bitno--)
-			ext2fs_clear_bit(bitno - bmap->start, bmap->bitmap);
+		last = bmap->real_end;
+		if (last > new_end)
+			last = new_end;
+		if (last > bmap->end)
+			bmap->bitmap_ops->unmark_bmap_extent(bmap,
+						bmap->end + 1, last - bmap->end);
 	}
 	if (new_real_end == bmap->real_end) {
 		bmap->end = new_end;
 		return 0;
 	}
 
-	size = ((bmap->real_end - bmap->start) / 8) + 1;
-	new_size = ((new_real_end - bmap->start) / 8) + 1;
-
-	if (size != new_size) {
-		retval = ext2fs_resize_mem(size, new_size, &bmap->bitmap);
-		if (retval)
-			return retval;
-	}
-	if (new_size > size)
-		memset(bmap->bitmap + size, 0, new_size - size);
+	retval = bmap->bitmap_ops->resize_bmap(bmap, new_end, new_real_end);
+	if (retval)
+		return retval;
 
 	bmap->end = new_end;
 	bmap->real_end = new_real_end;
 	return 0;
 }
 
+/*
+ * Bitmaps are compared a chunk at a time through get_bmap_range, so
+ * that bitmaps with different backends can be compared.
+ */
+#define COMPARE_CHUNK_BITS	65536
+
 errcode_t ext2fs_compare_generic_bitmap(errcode_t magic, errcode_t neq,
 					ext2fs_generic_bitmap bm1,
 					ext2fs_generic_bitmap bm2)
 {
-	blk_t	i;
+	char		*buf1, *buf2;
+	__u64		bit, num, i;
+	errcode_t	retval;
 
 	if (!bm1 || bm1->magic != magic)
 		return magic;
@@ -275,28 +466,44 @@ errcode_t ext2fs_compare_generic_bitmap(errcode_t magic, errcode_t neq,
 		return magic;
 
 	if ((bm1->start != bm2->start) ||
-	    (bm1->end != bm2->end) ||
-	    (memcmp(bm1->bitmap, bm2->bitmap,
-		    (size_t) (bm1->end - bm1->start)/8)))
+	    (bm1->end != bm2->end))
 		return neq;
+	lazy_load_all(bm1);
+	lazy_load_all(bm2);
 
-	for (i = bm1->end - ((bm1->end - bm1->start) % 8); i <= bm1->end; i++)
-		if (ext2fs_fast_test_block_bitmap(bm1, i) !=
-		    ext2fs_fast_test_block_bitmap(bm2, i))
-			return neq;
-
-	return 0;
+	retval = ext2fs_get_mem(COMPARE_CHUNK_BITS / 4, &buf1);
+	if (retval)
+		return retval;
+	buf2 = buf1 + COMPARE_CHUNK_BITS / 8;
+
+	for (bit = bm1->start; bit <= bm1->end; bit += num) {
+		num = bm1->end - bit + 1;
+		if (num > COMPARE_CHUNK_BITS)
+			num = COMPARE_CHUNK_BITS;
+		bm1->bitmap_ops->get_bmap_range(bm1, bit, num, buf1);
+		bm2->bitmap_ops->get_bmap_range(bm2, bit, num, buf2);
+		if (memcmp(buf1, buf2, num >> 3))
+			break;
+		for (i = num & ~7ULL; i < num; i++)
+			if (!ext2fs_test_bit64(i, buf1) !=
+			    !ext2fs_test_bit64(i, buf2))
+				break;
+		if (i < num)
+			break;
+	}
+	ext2fs_free_mem(&buf1);
+	return (bit <= bm1->end) ? neq : 0;
 }
 
 void ext2fs_set_generic_bitmap_padding(ext2fs_generic_bitmap map)
 {
-	__u32	i, j;
-
-	/* Protect loop from wrap-around if map->real_end is maxed */
-	for (i=map->end+1, j = i - map->start;
-	     i <= map->real_end && i > map->end;
-	     i++, j++)
-		ext2fs_set_bit(j, map->bitmap);
+	/* Protect from wrap-around if map->real_end is maxed */
+	if (map->end < map->real_end) {
+		if (map->lazy)
+			lazy_access(map, map->end + 1, map->real_end, 1);
+		map->bitmap_ops->mark_bmap_extent(map, map->end + 1,
+						  map->real_end - map->end);
+	}
 }
 
 errcode_t ext2fs_get_generic_bitmap_range(ext2fs_generic_bitmap bmap,
@@ -310,7 +517,9 @@ errcode_t ext2fs_get_generic_bitmap_range(ext2fs_generic_bitmap bmap,
 	if ((start < bmap->start) || (start+num-1 > bmap->real_end))
 		return EXT2_ET_INVALID_ARGUMENT;
 
-	memcpy(out, bmap->bitmap + (start >> 3), (num+7) >> 3);
+	if (bmap->lazy)
+		lazy_access(bmap, start, start + num - 1, 0);
+	bmap->bitmap_ops->get_bmap_range(bmap, start, num, out);
 	return 0;
 }
 
@@ -325,103 +534,81 @@ errcode_t ext2fs_set_generic_bitmap_range(ext2fs_generic_bitmap bmap,
 	if ((start < bmap->start) || (start+num-1 > bmap->real_end))
 		return EXT2_ET_INVALID_ARGUMENT;
 
-	memcpy(bmap->bitmap + (start >> 3), in, (num+7) >> 3);
+	if (bmap->lazy)
+		lazy_access(bmap, start, start + num - 1, 1);
+	bmap->bitmap_ops->set_bmap_range(bmap, start, num, in);
 	return 0;
 }
 
 /*
- * Compare @mem to zero buffer by 256 bytes.
- * Return 1 if @mem is zeroed memory, otherwise return 0.
+ * Find the first clear (or set) bit in [start, end].  Returns ENOENT
+ * if every bit in the range is set (or clear).
  */
-static int mem_is_zero(const char *mem, size_t len)
+errcode_t ext2fs_find_first_zero_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						errcode_t magic,
+						__u32 start, __u32 end,
+						__u32 *out)
+{
+	errcode_t	retval;
+	__u64		found;
+
+	if (!bitmap || (bitmap->magic != magic))
+		return magic;
+	if (start < bitmap->start || end > bitmap->end || start > end) {
+		ext2fs_warn_bitmap2(bitmap, EXT2FS_TEST_ERROR, start);
+		return EINVAL;
+	}
+	if (bitmap->lazy)
+		lazy_access(bitmap, start, end, 0);
+	retval = bitmap->bitmap_ops->find_first_zero(bitmap, start, end,
+						     &found);
+	if (!retval)
+		*out = found;
+	return retval;
+}
+
+errcode_t ext2fs_find_first_set_generic_bitmap(ext2fs_generic_bitmap bitmap,
+					       errcode_t magic,
+					       __u32 start, __u32 end,
+					       __u32 *out)
 {
-	static const char zero_buf[256];
+	errcode_t	retval;
+	__u64		found;
 
-	while (len >= sizeof(zero_buf)) {
-		if (memcmp(mem, zero_buf, sizeof(zero_buf)))
-			return 0;
-		len -= sizeof(zero_buf);
-		mem += sizeof(zero_buf);
+	if (!bitmap || (bitmap->magic != magic))
+		return magic;
+	if (start < bitmap->start || end > bitmap->end || start > end) {
+		ext2fs_warn_bitmap2(bitmap, EXT2FS_TEST_ERROR, start);
+		return EINVAL;
 	}
-	/* Deal with leftover bytes. */
-	if (len)
-		return !memcmp(mem, zero_buf, len);
-	return 1;
+	if (bitmap->lazy)
+		lazy_access(bitmap, start, end, 0);
+	retval = bitmap->bitmap_ops->find_first_set(bitmap, start, end,
+						    &found);
+	if (!retval)
+		*out = found;
+	return retval;
 }
 
 /*
- * Return true if all of the bits in a specified range are clear
+ * Count the set bits in [start, end] of a block or inode bitmap.
  */
-static int ext2fs_test_clear_generic_bitmap_range(ext2fs_generic_bitmap bitmap,
-						  unsigned int start,
-						  unsigned int len)
-{
-	size_t start_byte, len_byte = len >> 3;
-	unsigned int start_bit, len_bit = len % 8;
-	int first_bit = 0;
-	int last_bit  = 0;
-	int mark_count = 0;
-	int mark_bit = 0;
-	int i;
-	const char *ADDR = bitmap->bitmap;
-
-	start -= bitmap->start;
-	start_byte = start >> 3;
-	start_bit = start % 8;
-
-	if (start_bit != 0) {
-		/*
-		 * The compared start block number or start inode number
-		 * is not the first bit in a byte.
-		 */
-		mark_count = 8 - start_bit;
-		if (len < 8 - start_bit) {
-			mark_count = (int)len;
-			mark_bit = len + start_bit - 1;
-		} else
-			mark_bit = 7;
-
-		for (i = mark_count; i > 0; i--, mark_bit--)
-			first_bit |= 1 << mark_bit;
-
-		/*
-		 * Compare blocks or inodes in the first byte.
-		 * If there is any marked bit, this function returns 0.
-		 */
-		if (first_bit & ADDR[start_byte])
-			return 0;
-		else if (len <= 8 - start_bit)
-			return 1;
-
-		start_byte++;
-		len_bit = (len - mark_count) % 8;
-		len_byte = (len - mark_count) >> 3;
-	}
+errcode_t ext2fs_count_used_range(ext2fs_generic_bitmap bitmap,
+				  __u32 start, __u32 end, __u32 *out)
+{
+	errcode_t	retval;
 
-	/*
-	 * The compared start block number or start inode number is
-	 * the first bit in a byte.
-	 */
-	if (len_bit != 0) {
-		/*
-		 * The compared end block number or end inode number is
-		 * not the last bit in a byte.
-		 */
-		for (mark_bit = len_bit - 1; mark_bit >= 0; mark_bit--)
-			last_bit |= 1 << mark_bit;
-
-		/*
-		 * Compare blocks or inodes in the last byte.
-		 * If there is any marked bit, this function returns 0.
-		 */
-		if (last_bit & ADDR[start_byte + len_byte])
-			return 0;
-		else if (len_byte == 0)
-			return 1;
+	retval = check_magic(bitmap);
+	if (retval)
+		return retval;
+	if (start < bitmap->start || end > bitmap->end || start > end) {
+		ext2fs_warn_bitmap2(bitmap, EXT2FS_TEST_ERROR, start);
+		return EINVAL;
 	}
-
-	/* Check whether all bytes are 0 */
-	return mem_is_zero(ADDR + start_byte, len_byte);
+	if (bitmap->lazy)
+		lazy_access(bitmap, start, end, 0);
+	*out = bitmap->bitmap_ops->count_used(bitmap, start, end);
+	return 0;
 }
 
 int ext2fs_test_block_bitmap_range(ext2fs_block_bitmap bitmap,
@@ -433,8 +620,9 @@ int ext2fs_test_block_bitmap_range(ext2fs_block_bitmap bitmap,
 				   block, bitmap->description);
 		return 0;
 	}
-	return ext2fs_test_clear_generic_bitmap_range((ext2fs_generic_bitmap)
-						      bitmap, block, num);
+	if (bitmap->lazy)
+		lazy_access(bitmap, block, block + num - 1, 0);
+	return bitmap->bitmap_ops->test_clear_bmap_extent(bitmap, block, num);
 }
 
 int ext2fs_test_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
@@ -446,35 +634,37 @@ int ext2fs_test_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
 				   inode, bitmap->description);
 		return 0;
 	}
-	return ext2fs_test_clear_generic_bitmap_range((ext2fs_generic_bitmap)
-						      bitmap, inode, num);
+	if (bitmap->lazy)
+		lazy_access(bitmap, inode, inode + num - 1, 0);
+	return bitmap->bitmap_ops->test_clear_bmap_extent(bitmap, inode, num);
 }
 
 void ext2fs_mark_block_bitmap_range(ext2fs_block_bitmap bitmap,
 				    blk_t block, int num)
 {
-	int	i;
-
 	if ((block < bitmap->start) || (block+num-1 > bitmap->end)) {
 		ext2fs_warn_bitmap(EXT2_ET_BAD_BLOCK_MARK, block,
 				   bitmap->description);
 		return;
 	}
-	for (i=0; i < num; i++)
-		ext2fs_fast_set_bit(block + i - bitmap->start, bitmap->bitmap);
+	if (num <= 0)
+		return;
+	if (bitmap->lazy)
+		lazy_access(bitmap, block, block + num - 1, 1);
+	bitmap->bitmap_ops->mark_bmap_extent(bitmap, block, num);
 }
 
 void ext2fs_unmark_block_bitmap_range(ext2fs_block_bitmap bitmap,
 					       blk_t block, int num)
 {
-	int	i;
-
 	if ((block < bitmap->start) || (block+num-1 > bitmap->end)) {
 		ext2fs_warn_bitmap(EXT2_ET_BAD_BLOCK_UNMARK, block,
 				   bitmap->description);
 		return;
 	}
-	for (i=0; i < num; i++)
-		ext2fs_fast_clear_bit(block + i - bitmap->start,
-				      bitmap->bitmap);
+	if (num <= 0)
+		return;
+	if (bitmap->lazy)
+		lazy_access(bitmap, block, block + num - 1, 1);
+	bitmap->bitmap_ops->unmark_bmap_extent(bitmap, block, num);
 }
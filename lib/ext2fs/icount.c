@@ -17,6 +17,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
@@ -39,8 +42,27 @@
  * e2fsck's pass 2.  Pass 2 increments inode counts as it finds them,
  * so this extra bitmap avoids searching the sorted list to see if a
  * particular inode is on the sorted list already.
+ *
+ * Pass 2 finds inodes in directory order, which is close to random
+ * with respect to inode number, so inserting into the sorted list
+ * means shifting a large part of it each time.  With
+ * EXT2_ICOUNT_OPT_FULLMAP the counts of two or more are instead kept
+ * in a two-level radix array: a table indexed by the high bits of the
+ * inode number points to leaves of ICOUNT_LEAF_INODES 16-bit counts,
+ * allocated the first time a count in them is set.  A count too large
+ * for a leaf is stored as ICOUNT_FULLMAP_OVERFLOW and kept exactly in
+ * the sorted list.
+ *
+ * ext2fs_create_icount_mmap() builds the same full map, but with all
+ * of its leaves in one dense array in a sparse scratch file which is
+ * mapped into memory, so that the kernel pages it in and out as
+ * needed.
  */
 
+#define ICOUNT_LEAF_BITS	10
+#define ICOUNT_LEAF_INODES	(1 << ICOUNT_LEAF_BITS)
+#define ICOUNT_FULLMAP_OVERFLOW	0xFFFF
+
 struct ext2_icount_el {
 	ext2_ino_t	ino;
 	__u32		count;
@@ -58,6 +80,10 @@ struct ext2_icount {
 	struct ext2_icount_el	*last_lookup;
 	char			*tdb_fn;
 	TDB_CONTEXT		*tdb;
+	__u16			**fullmap;
+	ext2_ino_t		fullmap_leaves;
+	void			*map;
+	size_t			map_size;
 };
 
 /*
@@ -71,10 +97,23 @@ struct ext2_icount {
 
 void ext2fs_free_icount(ext2_icount_t icount)
 {
+	ext2_ino_t	i;
+
 	if (!icount)
 		return;
 
 	icount->magic = 0;
+	if (icount->fullmap) {
+		for (i = 0; !icount->map &&
+			    i <= icount->num_inodes >> ICOUNT_LEAF_BITS; i++)
+			if (icount->fullmap[i])
+				ext2fs_free_mem(&icount->fullmap[i]);
+		ext2fs_free_mem(&icount->fullmap);
+	}
+#ifdef HAVE_MMAP
+	if (icount->map)
+		munmap(icount->map, icount->map_size);
+#endif
 	if (icount->list)
 		ext2fs_free_mem(&icount->list);
 	if (icount->single)
@@ -209,6 +248,83 @@ errout:
 	return(retval);
 }
 
+static errcode_t alloc_fullmap(ext2_icount_t icount)
+{
+	ext2_ino_t	leaves = (icount->num_inodes >> ICOUNT_LEAF_BITS) + 1;
+	errcode_t	retval;
+
+	retval = ext2fs_get_array(leaves, sizeof(__u16 *), &icount->fullmap);
+	if (retval)
+		return retval;
+	memset(icount->fullmap, 0, leaves * sizeof(__u16 *));
+	return 0;
+}
+
+errcode_t ext2fs_create_icount_mmap(ext2_filsys fs, char *tmp_dir,
+				    int flags, ext2_icount_t *ret)
+{
+#ifdef HAVE_MMAP
+	ext2_icount_t	icount;
+	errcode_t	retval;
+	char 		*fn, uuid[40];
+	ext2_ino_t	i, leaves;
+	int		fd;
+
+	retval = ext2fs_create_icount2(fs, flags | EXT2_ICOUNT_OPT_FULLMAP,
+				       0, 0, &icount);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_get_mem(strlen(tmp_dir) + 64, &fn);
+	if (retval)
+		goto errout;
+	uuid_unparse(fs->super->s_uuid, uuid);
+	sprintf(fn, "%s/%s-icount-XXXXXX", tmp_dir, uuid);
+	fd = mkstemp(fn);
+	if (fd < 0) {
+		retval = errno;
+		ext2fs_free_mem(&fn);
+		goto errout;
+	}
+	/*
+	 * Nothing else needs the file by name, so remove it now; the
+	 * space is freed when the mapping goes away, even if we crash.
+	 */
+	unlink(fn);
+	ext2fs_free_mem(&fn);
+
+	leaves = (icount->num_inodes >> ICOUNT_LEAF_BITS) + 1;
+	icount->map_size = (size_t) leaves * ICOUNT_LEAF_INODES *
+		sizeof(__u16);
+	if (ftruncate(fd, icount->map_size) < 0) {
+		retval = errno;
+		close(fd);
+		goto errout;
+	}
+	icount->map = mmap(NULL, icount->map_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+	close(fd);
+	if (icount->map == MAP_FAILED) {
+		retval = errno;
+		icount->map = 0;
+		goto errout;
+	}
+	for (i = 0; i < leaves; i++)
+		icount->fullmap[i] = (__u16 *) icount->map +
+			(size_t) i * ICOUNT_LEAF_INODES;
+	icount->fullmap_leaves = leaves;
+
+	*ret = icount;
+	return 0;
+
+errout:
+	ext2fs_free_icount(icount);
+	return retval;
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
 errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags, unsigned int size,
 				ext2_icount_t hint, ext2_icount_t *ret)
 {
@@ -227,6 +343,19 @@ errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags, unsigned int size,
 	if (retval)
 		return retval;
 
+	if (flags & EXT2_ICOUNT_OPT_FULLMAP) {
+		retval = alloc_fullmap(icount);
+		if (retval)
+			goto errout;
+		/*
+		 * The sorted list only holds overflowed counts, so the
+		 * hint is of no use.
+		 */
+		hint = 0;
+		if (!size)
+			size = 16;
+	}
+
 	if (size) {
 		icount->size = size;
 	} else {
@@ -406,6 +535,49 @@ static struct ext2_icount_el *get_icount_el(ext2_icount_t icount,
 	return 0;
 }
 
+static errcode_t set_fullmap_count(ext2_icount_t icount, ext2_ino_t ino,
+				   __u32 count)
+{
+	__u16			**leaf;
+	struct ext2_icount_el 	*el;
+	errcode_t		retval;
+
+	leaf = &icount->fullmap[ino >> ICOUNT_LEAF_BITS];
+	if (!*leaf) {
+		if (!count)
+			return 0;
+		retval = ext2fs_get_array(ICOUNT_LEAF_INODES, sizeof(__u16),
+					  leaf);
+		if (retval)
+			return retval;
+		memset(*leaf, 0, ICOUNT_LEAF_INODES * sizeof(__u16));
+		icount->fullmap_leaves++;
+	}
+	if (count >= ICOUNT_FULLMAP_OVERFLOW) {
+		el = get_icount_el(icount, ino, 1);
+		if (!el)
+			return EXT2_ET_NO_MEMORY;
+		el->count = count;
+		count = ICOUNT_FULLMAP_OVERFLOW;
+	}
+	(*leaf)[ino & (ICOUNT_LEAF_INODES - 1)] = count;
+	return 0;
+}
+
+static __u32 get_fullmap_count(ext2_icount_t icount, ext2_ino_t ino)
+{
+	__u16			*leaf;
+	struct ext2_icount_el 	*el;
+
+	leaf = icount->fullmap[ino >> ICOUNT_LEAF_BITS];
+	if (!leaf)
+		return 0;
+	if (leaf[ino & (ICOUNT_LEAF_INODES - 1)] != ICOUNT_FULLMAP_OVERFLOW)
+		return leaf[ino & (ICOUNT_LEAF_INODES - 1)];
+	el = get_icount_el(icount, ino, 0);
+	return el ? el->count : 0;
+}
+
 static errcode_t set_inode_count(ext2_icount_t icount, ext2_ino_t ino,
 				 __u32 count)
 {
@@ -428,6 +600,8 @@ static errcode_t set_inode_count(ext2_icount_t icount, ext2_ino_t ino,
 		}
 		return 0;
 	}
+	if (icount->fullmap)
+		return set_fullmap_count(icount, ino, count);
 
 	el = get_icount_el(icount, ino, 1);
 	if (!el)
@@ -457,6 +631,10 @@ static errcode_t get_inode_count(ext2_icount_t icount, ext2_ino_t ino,
 		free(data.dptr);
 		return 0;
 	}
+	if (icount->fullmap) {
+		*count = get_fullmap_count(icount, ino);
+		return 0;
+	}
 	el = get_icount_el(icount, ino, 0);
 	if (!el) {
 		*count = 0;
@@ -652,11 +830,16 @@ ext2_ino_t ext2fs_get_icount_size(ext2_icount_t icount)
 	if (!icount || icount->magic != EXT2_ET_MAGIC_ICOUNT)
 		return 0;
 
+	if (icount->fullmap)
+		return icount->fullmap_leaves * ICOUNT_LEAF_INODES;
 	return icount->size;
 }
 
 #ifdef DEBUG
 
+#include <stdlib.h>
+#include <time.h>
+
 ext2_filsys	test_fs;
 ext2_icount_t	icount;
 
@@ -769,7 +952,15 @@ int run_test(int flags, int size, char *dir, struct test_program *prog)
 	__u16		result;
 	int		problem = 0;
 
-	if (dir) {
+	if (dir && (flags & EXT2_ICOUNT_OPT_FULLMAP)) {
+		retval = ext2fs_create_icount_mmap(test_fs, dir,
+						   flags, &icount);
+		if (retval) {
+			com_err("run_test", retval,
+				"while creating icount using mmap");
+			exit(1);
+		}
+	} else if (dir) {
 		retval = ext2fs_create_icount_tdb(test_fs, dir,
 						  flags, &icount);
 		if (retval) {
@@ -840,21 +1031,137 @@ int run_test(int flags, int size, char *dir, struct test_program *prog)
 }
 
 
+/*
+ * Apply the same pass 2 style workload --- a run of increments on
+ * inodes in random order, followed by some decrements and stores ---
+ * to a sorted list icount, a full map icount and an mmap icount, and
+ * check that they agree.  With a time argument, report how long each one took.
+ */
+static int run_random(ext2_filsys fs, int nents, int timed)
+{
+	ext2_icount_t	icount[3];
+	ext2_ino_t	ino, *inos;
+	__u16		result[3];
+	errcode_t	retval;
+	clock_t		start;
+	const char	*name[3] = { "sorted list", "full map", "mmap" };
+	int		i, j, problem = 0;
+
+	retval = ext2fs_get_array(nents, sizeof(ext2_ino_t), &inos);
+	if (retval) {
+		com_err("run_random", retval, "while allocating inode list");
+		exit(1);
+	}
+	for (i = 0; i < nents; i++)
+		inos[i] = 1 + random() % fs->super->s_inodes_count;
+	/* A few inodes with counts too large for a 16-bit counter */
+	for (i = 0; i < nents; i += nents / 4)
+		inos[i] = inos[0];
+
+	for (j = 0; j < 3; j++) {
+		if (j == 2)
+			retval = ext2fs_create_icount_mmap(fs, ".",
+						EXT2_ICOUNT_OPT_INCREMENT,
+						&icount[j]);
+		else
+			retval = ext2fs_create_icount2(fs,
+				EXT2_ICOUNT_OPT_INCREMENT |
+				(j ? EXT2_ICOUNT_OPT_FULLMAP : 0),
+				0, 0, &icount[j]);
+		if (retval) {
+			com_err("run_random", retval, "while creating icount");
+			exit(1);
+		}
+		start = clock();
+		for (i = 0; i < nents; i++) {
+			ext2fs_icount_increment(icount[j], inos[i], 0);
+			ext2fs_icount_increment(icount[j], inos[i], 0);
+			if (inos[i] == inos[0])
+				ext2fs_icount_store(icount[j], inos[i], 65534);
+		}
+		for (i = 0; i < nents; i += 3)
+			ext2fs_icount_decrement(icount[j], inos[i], 0);
+		for (i = 1; i < nents; i += 7)
+			ext2fs_icount_store(icount[j], inos[i], i % 4);
+		if (timed)
+			printf("%s: %d entries in %.2f seconds, size %u\n",
+			       name[j], nents,
+			       (double) (clock() - start) / CLOCKS_PER_SEC,
+			       ext2fs_get_icount_size(icount[j]));
+	}
+	for (ino = 1; ino <= fs->super->s_inodes_count; ino++) {
+		ext2fs_icount_fetch(icount[0], ino, &result[0]);
+		ext2fs_icount_fetch(icount[1], ino, &result[1]);
+		ext2fs_icount_fetch(icount[2], ino, &result[2]);
+		if (result[0] != result[1] || result[0] != result[2]) {
+			printf("icount_fetch(%u): %u, %u and %u differ\n", ino,
+			       result[0], result[1], result[2]);
+			problem++;
+			break;
+		}
+	}
+	if (!timed)
+		printf("Random icount run with %d entries: %s\n", nents,
+		       problem ? "NOT OK" : "OK");
+	for (j = 0; j < 3; j++)
+		ext2fs_free_icount(icount[j]);
+	ext2fs_free_mem(&inos);
+	return problem;
+}
+
+/*
+ * tst_icount -b entries times the sorted list against the full maps on
+ * a filesystem with a million inodes
+ */
+static int run_benchmark(int nents)
+{
+	ext2_filsys	fs;
+	errcode_t	retval;
+	struct ext2_super_block param;
+	int		problem;
+
+	memset(&param, 0, sizeof(param));
+	param.s_blocks_count = 4000000;
+	param.s_inodes_count = 1000000;
+	retval = ext2fs_initialize("bench fs", 0, &param,
+				   test_io_manager, &fs);
+	if (retval) {
+		com_err("run_benchmark", retval,
+			"while initializing filesystem");
+		exit(1);
+	}
+	problem = run_random(fs, nents, 1);
+	ext2fs_close(fs);
+	return problem;
+}
+
 int main(int argc, char **argv)
 {
 	int failed = 0;
 
 	setup();
+	if (argc == 3 && !strcmp(argv[1], "-b"))
+		return run_benchmark(atoi(argv[2]));
 	printf("Standard icount run:\n");
 	failed += run_test(0, 0, 0, prog);
 	printf("\nMultiple bitmap test:\n");
 	failed += run_test(EXT2_ICOUNT_OPT_INCREMENT, 0, 0, prog);
 	printf("\nResizing icount:\n");
 	failed += run_test(0, 3, 0, extended);
+	printf("\nFull map icount run:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_FULLMAP, 0, 0, prog);
+	printf("\nFull map with multiple bitmap test:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_INCREMENT |
+			   EXT2_ICOUNT_OPT_FULLMAP, 3, 0, extended);
+	printf("\n");
+	failed += run_random(test_fs, 2000, 0);
 	printf("\nStandard icount run with tdb:\n");
 	failed += run_test(0, 0, ".", prog);
 	printf("\nMultiple bitmap test with tdb:\n");
 	failed += run_test(EXT2_ICOUNT_OPT_INCREMENT, 0, ".", prog);
+	printf("\nFull map icount run with mmap:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_INCREMENT |
+			   EXT2_ICOUNT_OPT_FULLMAP, 0, ".", prog);
 	if (failed)
 		printf("FAILED!\n");
 	return failed;
@@ -44,6 +44,9 @@ struct ext2_struct_inode_scan {
 	char *			ptr;
 	int			bytes_left;
 	char			*temp_buffer;
+#ifdef WORDS_BIGENDIAN
+	char			*swap_buffer;	/* for the pointer interfaces */
+#endif
 	errcode_t		(*done_group)(ext2_filsys fs,
 					      ext2_inode_scan scan,
 					      dgrp_t group,
@@ -171,6 +174,15 @@ errcode_t ext2fs_open_inode_scan(ext2_filsys fs, int buffer_blocks,
 		ext2fs_free_mem(&scan);
 		return retval;
 	}
+#ifdef WORDS_BIGENDIAN
+	retval = ext2fs_get_mem(fs->blocksize, &scan->swap_buffer);
+	if (retval) {
+		ext2fs_free_mem(&scan->temp_buffer);
+		ext2fs_free_mem(&scan->inode_buffer);
+		ext2fs_free_mem(&scan);
+		return retval;
+	}
+#endif
 	if (scan->fs->badblocks && scan->fs->badblocks->num)
 		scan->scan_flags |= EXT2_SF_CHK_BADBLOCKS;
 	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
@@ -189,6 +201,9 @@ void ext2fs_close_inode_scan(ext2_inode_scan scan)
 	scan->inode_buffer = NULL;
 	ext2fs_free_mem(&scan->temp_buffer);
 	scan->temp_buffer = NULL;
+#ifdef WORDS_BIGENDIAN
+	ext2fs_free_mem(&scan->swap_buffer);
+#endif
 	ext2fs_free_mem(&scan);
 	return;
 }
@@ -322,6 +337,44 @@ static errcode_t check_for_inode_bad_blocks(ext2_inode_scan scan,
 	return 0;
 }
 
+/*
+ * With EXT2_SF_READAHEAD, ask the I/O channel to start reading the
+ * part of the inode table which the next call to get_next_blocks()
+ * will want --- the rest of this group's table, or the start of the
+ * next group's --- so that the read overlaps with the caller's
+ * processing of the inodes already in the buffer.
+ */
+static void inode_scan_readahead(ext2_inode_scan scan)
+{
+	ext2_filsys	fs = scan->fs;
+	dgrp_t		group = scan->current_group;
+	blk_t		blk = scan->current_block;
+	blk_t		num = scan->blocks_left;
+	__u32		inodes;
+
+	while (num == 0) {
+		if (++group >= fs->group_desc_count)
+			return;
+		if ((scan->scan_flags & EXT2_SF_DO_LAZY) &&
+		    (fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT))
+			continue;
+		blk = fs->group_desc[group].bg_inode_table;
+		num = fs->inode_blocks_per_group;
+		if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
+			inodes = EXT2_INODES_PER_GROUP(fs->super) -
+				fs->group_desc[group].bg_itable_unused;
+			num = (inodes + (fs->blocksize / scan->inode_size - 1)) *
+				scan->inode_size / fs->blocksize;
+		}
+	}
+	if (blk == 0)
+		return;
+	if (num > scan->inode_buffer_blocks)
+		num = scan->inode_buffer_blocks;
+	io_channel_cache_readahead(fs->io, blk, num);
+}
+
 /*
  * This function is called by ext2fs_get_next_inode when it needs to
  * read in more blocks from the current blockgroup's inode table.
@@ -377,6 +430,8 @@ static errcode_t get_next_blocks(ext2_inode_scan scan)
 	scan->blocks_left -= num_blocks;
 	if (scan->current_block)
 		scan->current_block += num_blocks;
+	if (scan->scan_flags & EXT2_SF_READAHEAD)
+		inode_scan_readahead(scan);
 	return 0;
 }
 
@@ -401,13 +456,19 @@ static inline int is_empty_scan(ext2_inode_scan scan)
 }
 #endif
 
-errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
-				     struct ext2_inode *inode, int bufsize)
+/*
+ * Advance the scan by one inode, and return a pointer to it, still in
+ * disk byte order: normally into the inode buffer, but into the
+ * temporary buffer if it straddles two reads.  *raw is set to NULL if
+ * there are no more inodes or an error occurs before one is found.
+ */
+static errcode_t get_next_inode_raw(ext2_inode_scan scan, ext2_ino_t *ino,
+				    char **raw)
 {
 	errcode_t	retval;
 	int		extra_bytes = 0;
 
-	EXT2_CHECK_MAGIC(scan, EXT2_ET_MAGIC_INODE_SCAN);
+	*raw = 0;
 
 	/*
 	 * Do we need to start reading a new block group?
@@ -474,29 +535,12 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 		       scan->inode_size - extra_bytes);
 		scan->ptr += scan->inode_size - extra_bytes;
 		scan->bytes_left -= scan->inode_size - extra_bytes;
-
-#ifdef WORDS_BIGENDIAN
-		memset(inode, 0, bufsize);
-		ext2fs_swap_inode_full(scan->fs,
-			       (struct ext2_inode_large *) inode,
-			       (struct ext2_inode_large *) scan->temp_buffer,
-			       0, bufsize);
-#else
-		*inode = *((struct ext2_inode *) scan->temp_buffer);
-#endif
+		*raw = scan->temp_buffer;
 		if (scan->scan_flags & EXT2_SF_BAD_EXTRA_BYTES)
 			retval = EXT2_ET_BAD_BLOCK_IN_INODE_TABLE;
 		scan->scan_flags &= ~EXT2_SF_BAD_EXTRA_BYTES;
 	} else {
-#ifdef WORDS_BIGENDIAN
-		memset(inode, 0, bufsize);
-		ext2fs_swap_inode_full(scan->fs,
-				(struct ext2_inode_large *) inode,
-				(struct ext2_inode_large *) scan->ptr,
-				0, bufsize);
-#else
-		memcpy(inode, scan->ptr, bufsize);
-#endif
+		*raw = scan->ptr;
 		scan->ptr += scan->inode_size;
 		scan->bytes_left -= scan->inode_size;
 		if (scan->scan_flags & EXT2_SF_BAD_INODE_BLK)
@@ -509,6 +553,119 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 	return retval;
 }
 
+errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
+				     struct ext2_inode *inode, int bufsize)
+{
+	errcode_t	retval;
+	char		*raw;
+
+	EXT2_CHECK_MAGIC(scan, EXT2_ET_MAGIC_INODE_SCAN);
+
+	retval = get_next_inode_raw(scan, ino, &raw);
+	if (!raw)
+		return retval;
+
+#ifdef WORDS_BIGENDIAN
+	memset(inode, 0, bufsize);
+	ext2fs_swap_inode_full(scan->fs,
+			       (struct ext2_inode_large *) inode,
+			       (struct ext2_inode_large *) raw,
+			       0, bufsize);
+#else
+	if (raw == scan->temp_buffer)
+		*inode = *((struct ext2_inode *) raw);
+	else
+		memcpy(inode, raw, bufsize);
+#endif
+	return retval;
+}
+
+/*
+ * Like ext2fs_get_next_inode_full(), but instead of copying the inode
+ * out, return a pointer to it in the scan's own buffer.  The inode is
+ * EXT2_INODE_SIZE() bytes long, and the pointer is only valid until
+ * the next call on the scan.
+ */
+errcode_t ext2fs_get_next_inode_ptr(ext2_inode_scan scan, ext2_ino_t *ino,
+				    const struct ext2_inode **inode)
+{
+	errcode_t	retval;
+	char		*raw;
+
+	EXT2_CHECK_MAGIC(scan, EXT2_ET_MAGIC_INODE_SCAN);
+
+	retval = get_next_inode_raw(scan, ino, &raw);
+	*inode = 0;
+	if (!raw)
+		return retval;
+
+#ifdef WORDS_BIGENDIAN
+	memset(scan->swap_buffer, 0, scan->inode_size);
+	ext2fs_swap_inode_full(scan->fs,
+			       (struct ext2_inode_large *) scan->swap_buffer,
+			       (struct ext2_inode_large *) raw,
+			       0, scan->inode_size);
+	raw = scan->swap_buffer;
+#endif
+	*inode = (const struct ext2_inode *) raw;
+	return retval;
+}
+
+/*
+ * Return the rest of the inodes in the current inode table block in
+ * one call.  The first inode's number is returned in *ino, and *num
+ * inodes follow each other in *inodes, EXT2_INODE_SIZE() bytes apart.
+ * Only the initialized part of each group's inode table is returned,
+ * as with the other scan functions.  *num is 0 at the end of the scan,
+ * and the inodes are only valid until the next call on the scan.
+ */
+errcode_t ext2fs_get_next_inode_batch(ext2_inode_scan scan, ext2_ino_t *ino,
+				      const char **inodes, int *num)
+{
+	errcode_t	retval;
+	char		*raw;
+	int		n;
+
+	EXT2_CHECK_MAGIC(scan, EXT2_ET_MAGIC_INODE_SCAN);
+
+	*inodes = 0;
+	*num = 0;
+	retval = get_next_inode_raw(scan, ino, &raw);
+	if (!raw)
+		return retval;
+
+	n = 1;
+	if (raw != scan->temp_buffer) {
+		n += (scan->bytes_left % scan->fs->blocksize) /
+			scan->inode_size;
+		if ((ext2_ino_t) n - 1 > scan->inodes_left)
+			n = scan->inodes_left + 1;
+		scan->ptr += (n - 1) * scan->inode_size;
+		scan->bytes_left -= (n - 1) * scan->inode_size;
+		scan->inodes_left -= n - 1;
+		scan->current_inode += n - 1;
+	}
+
+#ifdef WORDS_BIGENDIAN
+	{
+		int	i;
+
+		memset(scan->swap_buffer, 0, n * scan->inode_size);
+		for (i = 0; i < n; i++)
+			ext2fs_swap_inode_full(scan->fs,
+				(struct ext2_inode_large *)
+				(scan->swap_buffer + i * scan->inode_size),
+				(struct ext2_inode_large *)
+				(raw + i * scan->inode_size),
+				0, scan->inode_size);
+		raw = scan->swap_buffer;
+	}
+#endif
+	*inodes = raw;
+	*num = n;
+	return retval;
+}
+
 errcode_t ext2fs_get_next_inode(ext2_inode_scan scan, ext2_ino_t *ino,
 				struct ext2_inode *inode)
 {
@@ -15,6 +15,9 @@
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
@@ -99,3 +102,183 @@ errcode_t io_channel_write_blk64(io_channel channel, unsigned long long block,
 	return (channel->manager->write_blk)(channel, (unsigned long) block,
 					     count, data);
 }
+
+/*
+ * Ask the I/O channel to start reading blocks which will be needed
+ * soon, without waiting for them.  This is only a hint; callers
+ * should not treat an error as fatal.
+ */
+errcode_t io_channel_cache_readahead(io_channel channel,
+				     unsigned long long block,
+				     unsigned long long count)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->cache_readahead)
+		return (channel->manager->cache_readahead)(channel, block,
+							   count);
+
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+/*
+ * Allocate a buffer which can be passed to the I/O channel without
+ * being bounced, e.g. when the channel was opened with O_DIRECT.
+ * The buffer should be released with ext2fs_free_mem().
+ */
+errcode_t ext2fs_get_io_buffer(io_channel channel, unsigned long size,
+			       void *ptr)
+{
+	unsigned long align = 0;
+
+	if (channel) {
+		EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+		align = channel->align;
+	}
+	return ext2fs_get_memalign(size, align, ptr);
+}
+
+/*
+ * Helper functions used by the I/O managers to maintain their
+ * struct_io_stats, and by the applications to report them.
+ */
+void io_stats_init(io_stats stats)
+{
+	memset(stats, 0, sizeof(struct struct_io_stats));
+	stats->num_fields = IO_STATS_FIELDS;
+}
+
+/*
+ * Return a timestamp in microseconds, suitable for passing to
+ * io_stats_update() as the start time of a request.
+ */
+unsigned long long io_stats_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return ((unsigned long long) tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+static void add_latency(unsigned long long *hist, unsigned long long usec)
+{
+	int	bucket = 0;
+
+	while (usec && bucket < IO_STATS_LAT_BUCKETS - 1) {
+		usec >>= 1;
+		bucket++;
+	}
+	hist[bucket]++;
+}
+
+/*
+ * Account for a request of size bytes at location, which was started
+ * at start_time.  *next_location tracks where the previous request
+ * ended, so we can tell sequential requests from random ones.
+ */
+void io_stats_update(io_stats stats, ext2_loff_t *next_location,
+		     int is_write, ext2_loff_t location,
+		     unsigned long long size, unsigned long long start_time)
+{
+	unsigned long long now = io_stats_time();
+	unsigned long long usec = (now > start_time) ? now - start_time : 0;
+
+	if (is_write) {
+		stats->bytes_written += size;
+		stats->writes++;
+		add_latency(stats->write_lat, usec);
+	} else {
+		stats->bytes_read += size;
+		stats->reads++;
+		add_latency(stats->read_lat, usec);
+	}
+	if (location == *next_location)
+		stats->seq_ios++;
+	else
+		stats->random_ios++;
+	*next_location = location + size;
+}
+
+/*
+ * Copy an I/O statistics structure, taking care to copy only those
+ * fields which the I/O manager which filled in src knows about.
+ */
+void io_stats_copy(io_stats dest, io_stats src)
+{
+	int	num_fields;
+
+	memset(dest, 0, sizeof(struct struct_io_stats));
+	if (!src)
+		return;
+	num_fields = src->num_fields;
+	if (num_fields > IO_STATS_FIELDS)
+		num_fields = IO_STATS_FIELDS;
+	memcpy(dest, src, ((char *) &src->bytes_read - (char *) src) +
+	       num_fields * sizeof(unsigned long long));
+	dest->num_fields = num_fields;
+}
+
+static void print_latency(FILE *f, const char *prefix, const char *desc,
+			  unsigned long long *hist, unsigned long long *base)
+{
+	unsigned long long	count;
+	int			i, printed = 0;
+
+	for (i = 0; i < IO_STATS_LAT_BUCKETS; i++) {
+		count = hist[i] - (base ? base[i] : 0);
+		if (!count)
+			continue;
+		if (!printed++)
+			fprintf(f, "%s%s latency (us):", prefix, desc);
+		if (i == IO_STATS_LAT_BUCKETS - 1)
+			fprintf(f, " >=%lu:%llu", 1UL << (i - 1), count);
+		else
+			fprintf(f, " <%lu:%llu", 1UL << i, count);
+	}
+	if (printed)
+		fputc('\n', f);
+}
+
+/*
+ * Print the I/O statistics; if base is non-NULL, only the activity
+ * since base was copied is reported.
+ */
+void io_stats_print(FILE *f, const char *prefix, io_stats stats,
+		    io_stats base, int histograms)
+{
+	struct struct_io_stats	zero;
+	unsigned long long	reads, writes, hits, misses, seq, rnd;
+
+	if (!stats)
+		return;
+	if (!prefix)
+		prefix = "";
+	if (!base) {
+		memset(&zero, 0, sizeof(zero));
+		base = &zero;
+	}
+	fprintf(f, "%sI/O bytes read: %llu, written: %llu\n", prefix,
+		stats->bytes_read - base->bytes_read,
+		stats->bytes_written - base->bytes_written);
+	if (stats->num_fields < IO_STATS_FIELDS)
+		return;
+
+	reads = stats->reads - base->reads;
+	writes = stats->writes - base->writes;
+	hits = stats->cache_hits - base->cache_hits;
+	misses = stats->cache_misses - base->cache_misses;
+	seq = stats->seq_ios - base->seq_ios;
+	rnd = stats->random_ios - base->random_ios;
+	fprintf(f, "%sI/O requests read: %llu, written: %llu, "
+		"sequential: %llu, random: %llu\n", prefix,
+		reads, writes, seq, rnd);
+	fprintf(f, "%sCache hits: %llu, misses: %llu, hit rate: %.1f%%\n",
+		prefix, hits, misses,
+		(hits + misses) ? 100.0 * hits / (hits + misses) : 0.0);
+	if (!histograms)
+		return;
+	print_latency(f, prefix, "Read", stats->read_lat,
+		      base->num_fields >= IO_STATS_FIELDS ? base->read_lat : 0);
+	print_latency(f, prefix, "Write", stats->write_lat,
+		      base->num_fields >= IO_STATS_FIELDS ? base->write_lat : 0);
+}
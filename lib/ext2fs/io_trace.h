@@ -0,0 +1,48 @@
+/*
+ * io_trace.h --- header file describing the I/O trace format
+ *
+ * An I/O trace is written by the test I/O manager when TEST_IO_TRACE
+ * is set, one file per I/O channel, named "$TEST_IO_TRACE.<pid>.<n>"
+ * for the n'th channel opened by the process.  It consists of a header
+ * followed by one fixed-size record for every read, write and flush
+ * which was passed on to the backing I/O manager.  It records where
+ * the I/O went, never what data was transferred, so it can be shared
+ * without the filesystem.
+ *
+ * All fields are stored in host byte order, as in the e2image format.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#define IO_TRACE_MAGIC		"E2IOTRAC"
+#define IO_TRACE_MAGIC_LEN	8
+#define IO_TRACE_VERSION	1
+
+struct io_trace_header {
+	char	magic[IO_TRACE_MAGIC_LEN];	/* IO_TRACE_MAGIC */
+	__u32	version;	/* IO_TRACE_VERSION */
+	__u32	record_size;	/* sizeof(struct io_trace_record) */
+	__u64	start_time;	/* Wall clock time of open, in usec */
+	__u32	pid;		/* Process which opened the channel */
+	__u32	channel;	/* Channels it opened before this one */
+	__u32	reserved[8];
+};
+
+#define IO_TRACE_OP_READ	1
+#define IO_TRACE_OP_WRITE	2
+#define IO_TRACE_OP_FLUSH	3
+
+#define IO_TRACE_FL_ERROR	0x0001	/* The request returned an error */
+
+struct io_trace_record {
+	__u64	time;		/* Issue time, in usec since start_time */
+	__u64	offset;		/* Byte offset of the request */
+	__u32	length;		/* Length of the request in bytes */
+	__u32	latency;	/* Time taken by the backing manager, in usec */
+	__u16	op;		/* IO_TRACE_OP_* */
+	__u16	flags;		/* IO_TRACE_FL_* */
+	__u32	reserved;
+};
@@ -0,0 +1,51 @@
+/*
+ * rbtree.h --- intrusive red-black trees
+ *
+ * The interface follows the Linux kernel's rbtree: the caller embeds a
+ * struct rb_node in its own structure, walks the tree itself to find
+ * the insertion point, links the node in with ext2fs_rb_link_node()
+ * and then rebalances with ext2fs_rb_insert_color().
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#ifndef _EXT2FS_RBTREE_H
+#define _EXT2FS_RBTREE_H
+
+#include <stddef.h>
+
+#define RB_RED		0
+#define RB_BLACK	1
+
+struct rb_node {
+	struct rb_node	*rb_parent;
+	int		rb_color;
+	struct rb_node	*rb_right;
+	struct rb_node	*rb_left;
+};
+
+struct rb_root {
+	struct rb_node	*rb_node;
+};
+
+#define RB_ROOT	{ NULL }
+
+#define ext2fs_rb_entry(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define ext2fs_rb_empty_root(root)	((root)->rb_node == NULL)
+
+extern void ext2fs_rb_link_node(struct rb_node *node, struct rb_node *parent,
+				struct rb_node **rb_link);
+extern void ext2fs_rb_insert_color(struct rb_node *node, struct rb_root *root);
+extern void ext2fs_rb_erase(struct rb_node *node, struct rb_root *root);
+
+extern struct rb_node *ext2fs_rb_first(const struct rb_root *root);
+extern struct rb_node *ext2fs_rb_last(const struct rb_root *root);
+extern struct rb_node *ext2fs_rb_next(struct rb_node *node);
+extern struct rb_node *ext2fs_rb_prev(struct rb_node *node);
+
+#endif /* _EXT2FS_RBTREE_H */
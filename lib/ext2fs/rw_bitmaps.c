@@ -25,6 +25,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "bmap64.h"
 
 #define blk64_t blk_t
 #define __u64 __u32 
@@ -46,6 +47,261 @@
 #include "ext2fs.h"
 #include "e2image.h"
 
+#define BITMAP_BLOCK	0
+#define BITMAP_INODE	1
+#define BITMAP_EXCLUDE	2
+
+/*
+ * With flex_bg the bitmaps of consecutive groups are usually stored in
+ * adjacent blocks, so they are read and written a run of up to this
+ * many blocks at a time.
+ */
+#define BITMAP_RUN_MAX	64
+
+static blk_t bitmap_loc(ext2_filsys fs, int which, dgrp_t group)
+{
+	if (which == BITMAP_INODE)
+		return ext2fs_inode_bitmap_loc(fs, group);
+#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
+	if (which == BITMAP_EXCLUDE)
+		return ext2fs_exclude_bitmap_loc(fs, group);
+#endif
+	return ext2fs_block_bitmap_loc(fs, group);
+}
+
+/*
+ * Returns true if the group's bitmap is known to be clear, and so
+ * need not be read
+ */
+static int bitmap_uninit(ext2_filsys fs, int which, dgrp_t group,
+			 int csum_flag)
+{
+	int	flag = (which == BITMAP_INODE) ? EXT2_BG_INODE_UNINIT :
+		EXT2_BG_BLOCK_UNINIT;
+
+	if (!csum_flag || !(ext2fs_bg_flags_test(fs, group, flag)))
+		return 0;
+	return ext2fs_group_desc_csum_verify(fs, group);
+}
+
+static void bitmap_geometry(ext2_filsys fs, int which, blk_t *first,
+			    blk_t *nbits)
+{
+	if (which == BITMAP_INODE) {
+		*first = 1;
+		*nbits = (EXT2_INODES_PER_GROUP(fs->super) / 8) << 3;
+	} else {
+		*first = fs->super->s_first_data_block;
+		*nbits = (EXT2_BLOCKS_PER_GROUP(fs->super) / 8) << 3;
+	}
+}
+
+/*
+ * Groups marked BLOCK_UNINIT are not written.  Only the groups of a
+ * demand-loaded bitmap which have been changed, or whose bitmap has
+ * been moved, need to be written back.
+ */
+static int group_needs_write(ext2_filsys fs, ext2fs_generic_bitmap bmap,
+			     int which, dgrp_t group, int csum_flag)
+{
+	struct ext2fs_bmap_lazy *lazy = bmap->lazy;
+	blk_t	blk = bitmap_loc(fs, which, group);
+
+	if (!blk)
+		return 0;
+	if (csum_flag && ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT))
+		return 0;
+	return !lazy || ext2fs_test_bit(group, lazy->dirty) ||
+		lazy->locs[group] != blk;
+}
+
+/*
+ * Read one kind of bitmap for all of the groups.  A run may span
+ * uninitialized groups, whose blocks are read but ignored, so long as
+ * it ends with a group which has to be read.
+ */
+static errcode_t read_bitmap_runs(ext2_filsys fs, ext2fs_generic_bitmap bmap,
+				  int which, int csum_flag, char *buf)
+{
+	dgrp_t		i, j, n, end;
+	blk_t		blk, first, nbits;
+	errcode_t	retval;
+
+	bitmap_geometry(fs, which, &first, &nbits);
+	for (i = 0; i < fs->group_desc_count; i = end) {
+		end = i + 1;
+		blk = bitmap_loc(fs, which, i);
+		if (!blk || bitmap_uninit(fs, which, i, csum_flag))
+			continue;
+		for (n = i + 1; n < fs->group_desc_count &&
+			     n - i < BITMAP_RUN_MAX &&
+			     bitmap_loc(fs, which, n) == blk + (n - i); n++)
+			if (!bitmap_uninit(fs, which, n, csum_flag))
+				end = n + 1;
+
+		retval = io_channel_read_blk64(fs->io, blk, end - i, buf);
+		if (retval)
+			return (which == BITMAP_INODE) ?
+				EXT2_ET_INODE_BITMAP_READ :
+				EXT2_ET_BLOCK_BITMAP_READ;
+		for (j = i; j < end; j++) {
+			if (bitmap_uninit(fs, which, j, csum_flag))
+				continue;
+			retval = ext2fs_set_generic_bitmap_range(bmap,
+					bmap->magic, first + j * nbits, nbits,
+					buf + (j - i) * fs->blocksize);
+			if (retval)
+				return retval;
+		}
+	}
+	return 0;
+}
+
+static errcode_t write_bitmap_runs(ext2_filsys fs, ext2fs_generic_bitmap bmap,
+				   int which, int csum_flag, char *buf)
+{
+	dgrp_t		i, j, n;
+	blk_t		blk, first, nbits, k;
+	char		*group_buf;
+	errcode_t	retval;
+
+	bitmap_geometry(fs, which, &first, &nbits);
+	for (i = 0; i < fs->group_desc_count; i = n) {
+		n = i + 1;
+		if (!group_needs_write(fs, bmap, which, i, csum_flag))
+			continue;
+		blk = bitmap_loc(fs, which, i);
+		while (n < fs->group_desc_count && n - i < BITMAP_RUN_MAX &&
+		       bitmap_loc(fs, which, n) == blk + (n - i) &&
+		       group_needs_write(fs, bmap, which, n, csum_flag))
+			n++;
+
+		for (j = i; j < n; j++) {
+			group_buf = buf + (j - i) * fs->blocksize;
+			memset(group_buf, 0xff, fs->blocksize);
+			retval = ext2fs_get_generic_bitmap_range(bmap,
+					bmap->magic, first + j * nbits, nbits,
+					group_buf);
+			if (retval)
+				return retval;
+			if (which != BITMAP_BLOCK ||
+			    j != fs->group_desc_count - 1)
+				continue;
+			/* Force bitmap padding for the last group */
+			k = ((ext2fs_blocks_count(fs->super)
+			      - (__u64) fs->super->s_first_data_block)
+			     % (__u64) EXT2_BLOCKS_PER_GROUP(fs->super));
+			if (k)
+				for (; k < fs->blocksize * 8; k++)
+					ext2fs_set_bit(k, group_buf);
+		}
+		retval = io_channel_write_blk64(fs->io, blk, n - i, buf);
+		if (retval)
+			return (which == BITMAP_INODE) ?
+				EXT2_ET_INODE_BITMAP_WRITE :
+				EXT2_ET_BLOCK_BITMAP_WRITE;
+	}
+	return 0;
+}
+
+static void clear_lazy_dirty(ext2fs_generic_bitmap bmap)
+{
+	if (bmap->lazy)
+		memset(bmap->lazy->dirty, 0, (bmap->lazy->ngroups + 7) / 8);
+}
+
+static errcode_t read_lazy_group(ext2fs_generic_bitmap bmap, dgrp_t group)
+{
+	struct ext2fs_bmap_lazy *lazy = bmap->lazy;
+	int		nbytes = lazy->group_bits / 8;
+	errcode_t	retval;
+
+	if (!lazy->locs[group])
+		return 0;
+	retval = io_channel_read_blk64(bmap->fs->io, lazy->locs[group],
+				       -nbytes, lazy->buf);
+	if (retval)
+		return (bmap->magic == EXT2_ET_MAGIC_INODE_BITMAP) ?
+			EXT2_ET_INODE_BITMAP_READ : EXT2_ET_BLOCK_BITMAP_READ;
+	bmap->bitmap_ops->set_bmap_range(bmap, lazy->first +
+					 (blk_t) group * lazy->group_bits,
+					 lazy->group_bits, lazy->buf);
+	return 0;
+}
+
+/*
+ * Arrange for a newly allocated bitmap to be read a group at a time.
+ * Uninitialized groups are clear and need no reading; they start out
+ * dirty, so that they are written if the group is initialized before
+ * the bitmaps are flushed.  The bitmap locations are recorded now, in
+ * case the group descriptors change before a group is loaded.
+ */
+static errcode_t setup_lazy_bitmap(ext2_filsys fs,
+				   ext2fs_generic_bitmap bmap, int which)
+{
+	struct ext2fs_bmap_lazy *lazy;
+	errcode_t	retval;
+	int		csum_flag, nbytes;
+	dgrp_t		i;
+	blk_t		blk;
+
+	csum_flag = EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
+
+	retval = ext2fs_get_mem(sizeof(struct ext2fs_bmap_lazy), &lazy);
+	if (retval)
+		return retval;
+	memset(lazy, 0, sizeof(struct ext2fs_bmap_lazy));
+	lazy->ngroups = fs->group_desc_count;
+	if (which == BITMAP_INODE) {
+		lazy->first = 1;
+		lazy->group_bits = EXT2_INODES_PER_GROUP(fs->super);
+	} else {
+		lazy->first = fs->super->s_first_data_block;
+		lazy->group_bits = EXT2_BLOCKS_PER_GROUP(fs->super);
+	}
+	nbytes = (lazy->ngroups + 7) / 8;
+	retval = ext2fs_get_mem(nbytes, &lazy->loaded);
+	if (retval)
+		goto errout;
+	memset(lazy->loaded, 0, nbytes);
+	retval = ext2fs_get_mem(nbytes, &lazy->dirty);
+	if (retval)
+		goto errout;
+	memset(lazy->dirty, 0, nbytes);
+	retval = ext2fs_get_mem(lazy->ngroups * sizeof(blk_t), &lazy->locs);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_memalign(fs->blocksize, fs->blocksize,
+				     &lazy->buf);
+	if (retval)
+		goto errout;
+
+	for (i = 0; i < lazy->ngroups; i++) {
+		blk = bitmap_loc(fs, which, i);
+		if (bitmap_uninit(fs, which, i, csum_flag))
+			blk = 0;
+		lazy->locs[i] = blk;
+		if (!blk) {
+			ext2fs_set_bit(i, lazy->loaded);
+			ext2fs_set_bit(i, lazy->dirty);
+		}
+	}
+	lazy->load_group = read_lazy_group;
+	bmap->lazy = lazy;
+	return 0;
+
+errout:
+	if (lazy->loaded)
+		ext2fs_free_mem(&lazy->loaded);
+	if (lazy->dirty)
+		ext2fs_free_mem(&lazy->dirty);
+	if (lazy->locs)
+		ext2fs_free_mem(&lazy->locs);
+	ext2fs_free_mem(&lazy);
+	return retval;
+}
+
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block,
 		int do_exclude)
@@ -53,20 +309,9 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block,
 static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 #endif
 {
-	dgrp_t 		i;
-	unsigned int	j;
-	int		block_nbytes, inode_nbytes;
-	unsigned int	nbits;
 	errcode_t	retval;
-#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-	char 		*block_buf, *inode_buf, *exclude_buf;
-#else
-	char 		*block_buf, *inode_buf;
-#endif
+	char 		*buf;
 	int		csum_flag = 0;
-	blk64_t		blk;
-	blk64_t		blk_itr = fs->super->s_first_data_block;
-	ext2_ino_t	ino_itr = 1;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -83,133 +328,49 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
 		csum_flag = 1;
 
-	inode_nbytes = block_nbytes = 0;
+	/* Don't write back bitmaps which could not be read or kept right */
+	if (do_block && fs->block_map->error)
+		return fs->block_map->error;
+#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
+	if (do_exclude && fs->exclude_map->error)
+		return fs->exclude_map->error;
+#endif
+	if (do_inode && fs->inode_map->error)
+		return fs->inode_map->error;
+
+	retval = ext2fs_get_memalign(BITMAP_RUN_MAX * fs->blocksize,
+				     fs->blocksize, &buf);
+	if (retval)
+		return retval;
+
 	if (do_block) {
-		block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
-		retval = ext2fs_get_memalign(fs->blocksize, fs->blocksize,
-					     &block_buf);
+		retval = write_bitmap_runs(fs, fs->block_map, BITMAP_BLOCK,
+					   csum_flag, buf);
 		if (retval)
-			return retval;
-		memset(block_buf, 0xff, fs->blocksize);
+			goto errout;
+		fs->flags &= ~EXT2_FLAG_BB_DIRTY;
+		clear_lazy_dirty(fs->block_map);
 	}
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 	if (do_exclude) {
-		block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
-		retval = ext2fs_get_memalign(fs->blocksize, fs->blocksize,
-					     &exclude_buf);
+		retval = write_bitmap_runs(fs, fs->exclude_map, BITMAP_EXCLUDE,
+					   csum_flag, buf);
 		if (retval)
-			return retval;
-		memset(exclude_buf, 0xff, fs->blocksize);
+			goto errout;
+		clear_lazy_dirty(fs->exclude_map);
 	}
 #endif
 	if (do_inode) {
-		inode_nbytes = (size_t)
-			((EXT2_INODES_PER_GROUP(fs->super)+7) / 8);
-		retval = ext2fs_get_memalign(fs->blocksize, fs->blocksize,
-					     &inode_buf);
-		if (retval)
-			return retval;
-		memset(inode_buf, 0xff, fs->blocksize);
-	}
-
-	for (i = 0; i < fs->group_desc_count; i++) {
-#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		if (!do_block && !do_exclude)
-#else
-		if (!do_block)
-#endif
-			goto skip_block_bitmap;
-
-		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT)
-		    )
-			goto skip_this_block_bitmap;
-
-#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		if (do_block)
-			retval = ext2fs_get_block_bitmap_range2(fs->block_map,
-					blk_itr, block_nbytes << 3, block_buf);
-		if (retval)
-			return retval;
-
-		if (do_exclude)
-			retval = ext2fs_get_block_bitmap_range2(fs->exclude_map,
-					blk_itr, block_nbytes << 3, exclude_buf);
-#else
-		retval = ext2fs_get_block_bitmap_range2(fs->block_map,
-				blk_itr, block_nbytes << 3, block_buf);
-#endif
-		if (retval)
-			return retval;
-
-#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		if (do_block && i == fs->group_desc_count - 1) {
-#else
-		if (i == fs->group_desc_count - 1) {
-#endif
-			/* Force bitmap padding for the last group */
-			nbits = ((ext2fs_blocks_count(fs->super)
-				  - (__u64) fs->super->s_first_data_block)
-				 % (__u64) EXT2_BLOCKS_PER_GROUP(fs->super));
-			if (nbits)
-				for (j = nbits; j < fs->blocksize * 8; j++)
-					ext2fs_set_bit(j, block_buf);
-		}
-		blk = ext2fs_block_bitmap_loc(fs, i);
-#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		if (do_block && blk) {
-#else
-		if (blk) {
-#endif
-			retval = io_channel_write_blk64(fs->io, blk, 1,
-							block_buf);
-			if (retval)
-				return EXT2_ET_BLOCK_BITMAP_WRITE;
-		}
-#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		blk = ext2fs_exclude_bitmap_loc(fs, i);
-		if (do_exclude && blk) {
-			retval = io_channel_write_blk64(fs->io, blk, 1,
-						      exclude_buf);
-			if (retval)
-				return EXT2_ET_BLOCK_BITMAP_WRITE;
-		}
-#endif
-	skip_this_block_bitmap:
-		blk_itr += block_nbytes << 3;
-	skip_block_bitmap:
-
-		if (!do_inode)
-			continue;
-
-		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT)
-		    )
-			goto skip_this_inode_bitmap;
-
-		retval = ext2fs_get_inode_bitmap_range(fs->inode_map,
-				ino_itr, inode_nbytes << 3, inode_buf);
+		retval = write_bitmap_runs(fs, fs->inode_map, BITMAP_INODE,
+					   csum_flag, buf);
 		if (retval)
-			return retval;
-
-		blk = ext2fs_inode_bitmap_loc(fs, i);
-		if (blk) {
-			retval = io_channel_write_blk64(fs->io, blk, 1,
-						      inode_buf);
-			if (retval)
-				return EXT2_ET_INODE_BITMAP_WRITE;
-		}
-	skip_this_inode_bitmap:
-		ino_itr += inode_nbytes << 3;
-
-	}
-	if (do_block) {
-		fs->flags &= ~EXT2_FLAG_BB_DIRTY;
-		ext2fs_free_mem(&block_buf);
-	}
-	if (do_inode) {
+			goto errout;
 		fs->flags &= ~EXT2_FLAG_IB_DIRTY;
-		ext2fs_free_mem(&inode_buf);
+		clear_lazy_dirty(fs->inode_map);
 	}
-	return 0;
+errout:
+	ext2fs_free_mem(&buf);
+	return retval;
 }
 
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
@@ -219,13 +380,12 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block,
 static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 #endif
 {
-	dgrp_t i;
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 	char *block_bitmap = 0, *inode_bitmap = 0, *exclude_bitmap = 0;
 #else
 	char *block_bitmap = 0, *inode_bitmap = 0;
 #endif
-	char *buf;
+	char *buf, *run_buf = 0;
 	errcode_t retval;
 	int block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
 	int inode_nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
@@ -312,6 +472,30 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		inode_nbytes = 0;
 	ext2fs_free_mem(&buf);
 
+	if ((fs->flags & EXT2_FLAG_LAZY_BITMAPS) && !do_image) {
+		if (do_block) {
+			retval = setup_lazy_bitmap(fs, fs->block_map,
+						   BITMAP_BLOCK);
+			if (retval)
+				goto cleanup;
+		}
+#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
+		if (do_exclude) {
+			retval = setup_lazy_bitmap(fs, fs->exclude_map,
+						   BITMAP_EXCLUDE);
+			if (retval)
+				goto cleanup;
+		}
+#endif
+		if (do_inode) {
+			retval = setup_lazy_bitmap(fs, fs->inode_map,
+						   BITMAP_INODE);
+			if (retval)
+				goto cleanup;
+		}
+		goto success_cleanup;
+	}
+
 	if (fs->flags & EXT2_FLAG_IMAGE_FILE) {
 		blk = (fs->image_header->offset_inodemap / fs->blocksize);
 		ino_cnt = fs->super->s_inodes_count;
@@ -361,80 +545,33 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		goto success_cleanup;
 	}
 
-	for (i = 0; i < fs->group_desc_count; i++) {
-		if (block_bitmap) {
-			blk = ext2fs_block_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-					     -block_nbytes, block_bitmap);
-				if (retval) {
-					retval = EXT2_ET_BLOCK_BITMAP_READ;
-					goto cleanup;
-				}
-			} else
-				memset(block_bitmap, 0, block_nbytes);
-			cnt = block_nbytes << 3;
-			retval = ext2fs_set_block_bitmap_range2(fs->block_map,
-					       blk_itr, cnt, block_bitmap);
-			if (retval)
-				goto cleanup;
+	retval = ext2fs_get_memalign(BITMAP_RUN_MAX * fs->blocksize,
+				     fs->blocksize, &run_buf);
+	if (retval)
+		goto cleanup;
+	if (block_bitmap) {
+		retval = read_bitmap_runs(fs, fs->block_map, BITMAP_BLOCK,
+					  csum_flag, run_buf);
+		if (retval)
+			goto cleanup;
+	}
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		}
-		if (exclude_bitmap) {
-			blk = ext2fs_exclude_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-					     -block_nbytes, exclude_bitmap);
-				if (retval) {
-					retval = EXT2_ET_BLOCK_BITMAP_READ;
-					goto cleanup;
-				}
-			} else
-				memset(exclude_bitmap, 0, block_nbytes);
-			cnt = block_nbytes << 3;
-			retval = ext2fs_set_block_bitmap_range2(fs->exclude_map,
-					       blk_itr, cnt, exclude_bitmap);
-			if (retval)
-				goto cleanup;
-		}
-		if (block_nbytes)
-			blk_itr += block_nbytes << 3;
-#else
-			blk_itr += block_nbytes << 3;
-		}
+	if (exclude_bitmap) {
+		retval = read_bitmap_runs(fs, fs->exclude_map, BITMAP_EXCLUDE,
+					  csum_flag, run_buf);
+		if (retval)
+			goto cleanup;
+	}
 #endif
-		if (inode_bitmap) {
-			blk = ext2fs_inode_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-					     -inode_nbytes, inode_bitmap);
-				if (retval) {
-					retval = EXT2_ET_INODE_BITMAP_READ;
-					goto cleanup;
-				}
-			} else
-				memset(inode_bitmap, 0, inode_nbytes);
-			cnt = inode_nbytes << 3;
-			retval = ext2fs_set_inode_bitmap_range(fs->inode_map,
-					       ino_itr, cnt, inode_bitmap);
-			if (retval)
-				goto cleanup;
-			ino_itr += inode_nbytes << 3;
-		}
+	if (inode_bitmap) {
+		retval = read_bitmap_runs(fs, fs->inode_map, BITMAP_INODE,
+					  csum_flag, run_buf);
+		if (retval)
+			goto cleanup;
 	}
 success_cleanup:
+	if (run_buf)
+		ext2fs_free_mem(&run_buf);
 	if (inode_bitmap)
 		ext2fs_free_mem(&inode_bitmap);
 	if (block_bitmap)
@@ -454,6 +591,8 @@ cleanup:
 		ext2fs_free_mem(&fs->inode_map);
 		fs->inode_map = 0;
 	}
+	if (run_buf)
+		ext2fs_free_mem(&run_buf);
 	if (inode_bitmap)
 		ext2fs_free_mem(&inode_bitmap);
 	if (block_bitmap)
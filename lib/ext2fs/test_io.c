@@ -33,6 +33,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "io_trace.h"
 
 /*
  * For checking structure magic numbers...
@@ -54,6 +55,10 @@ struct test_private_data {
 	void (*write_byte)(unsigned long block, int count, errcode_t err);
 	void (*read_blk64)(unsigned long long block, int count, errcode_t err);
 	void (*write_blk64)(unsigned long long block, int count, errcode_t err);
+	struct struct_io_stats io_stats;
+	ext2_loff_t next_location;
+	FILE *trace;
+	unsigned long long trace_start;
 };
 
 static errcode_t test_open(const char *name, int flags, io_channel *channel);
@@ -73,6 +78,9 @@ static errcode_t test_write_byte(io_channel channel, unsigned long offset,
 static errcode_t test_set_option(io_channel channel, const char *option,
 				 const char *arg);
 static errcode_t test_get_stats(io_channel channel, io_stats *stats);
+static errcode_t test_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count);
 
 
 static struct struct_io_manager struct_test_manager = {
@@ -89,6 +97,7 @@ static struct struct_io_manager struct_test_manager = {
 	test_get_stats,
 	test_read_blk64,
 	test_write_blk64,
+	test_cache_readahead,
 };
 
 io_manager test_io_manager = &struct_test_manager;
@@ -176,6 +185,96 @@ static char *safe_getenv(const char *arg)
 #endif
 }
 
+/*
+ * Account for a request seen by the test I/O manager; these statistics
+ * are only reported if there is no backing manager which keeps its own.
+ */
+static void test_update_stats(io_channel channel,
+			      struct test_private_data *data, int is_write,
+			      unsigned long long block, int count,
+			      unsigned long long start_time)
+{
+	unsigned long long size;
+
+	size = (count < 0) ? -count : count * channel->block_size;
+	io_stats_update(&data->io_stats, &data->next_location, is_write,
+			block * channel->block_size, size, start_time);
+}
+
+/*
+ * Open the binary trace file for a channel.  Each channel gets its own
+ * file, named after TEST_IO_TRACE, the process ID and the number of
+ * channels the process opened before it, so that reopening a device,
+ * or opening an external journal, neither truncates an earlier trace
+ * nor mixes two devices' requests in one file.  Failing to open it is
+ * not fatal; the I/O simply goes untraced.
+ */
+static void test_trace_open(struct test_private_data *data, const char *name)
+{
+	static int		trace_channels;
+	struct io_trace_header	hdr;
+	char			*trace_name;
+
+	if (ext2fs_get_mem(strlen(name) + 32, &trace_name))
+		return;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.pid = getpid();
+	hdr.channel = trace_channels++;
+	sprintf(trace_name, "%s.%u.%u", name, hdr.pid, hdr.channel);
+	data->trace = fopen(trace_name, "w");
+	ext2fs_free_mem(&trace_name);
+	if (!data->trace)
+		return;
+	data->trace_start = io_stats_time();
+
+	memcpy(hdr.magic, IO_TRACE_MAGIC, IO_TRACE_MAGIC_LEN);
+	hdr.version = IO_TRACE_VERSION;
+	hdr.record_size = sizeof(struct io_trace_record);
+	hdr.start_time = data->trace_start;
+	if (fwrite(&hdr, sizeof(hdr), 1, data->trace) != 1) {
+		fclose(data->trace);
+		data->trace = NULL;
+	}
+}
+
+/*
+ * Append a record for a request which was started at start_time.
+ * The records are buffered by stdio so tracing stays cheap enough not
+ * to disturb the access pattern being recorded.
+ */
+static void test_trace(struct test_private_data *data, int op,
+		       unsigned long long offset, unsigned long long length,
+		       unsigned long long start_time, errcode_t retval)
+{
+	struct io_trace_record	rec;
+	unsigned long long	now;
+
+	if (!data->trace)
+		return;
+	now = io_stats_time();
+	memset(&rec, 0, sizeof(rec));
+	rec.time = (start_time > data->trace_start) ?
+		start_time - data->trace_start : 0;
+	rec.offset = offset;
+	rec.length = length;
+	rec.latency = (now > start_time) ? now - start_time : 0;
+	rec.op = op;
+	if (retval)
+		rec.flags |= IO_TRACE_FL_ERROR;
+	fwrite(&rec, sizeof(rec), 1, data->trace);
+}
+
+static void test_trace_blk(io_channel channel, struct test_private_data *data,
+			   int op, unsigned long long block, int count,
+			   unsigned long long start_time, errcode_t retval)
+{
+	unsigned long long size;
+
+	size = (count < 0) ? -count : count * channel->block_size;
+	test_trace(data, op, block * channel->block_size, size,
+		   start_time, retval);
+}
+
 static errcode_t test_open(const char *name, int flags, io_channel *channel)
 {
 	io_channel	io = NULL;
@@ -209,11 +308,13 @@ static errcode_t test_open(const char *name, int flags, io_channel *channel)
 
 	memset(data, 0, sizeof(struct test_private_data));
 	data->magic = EXT2_ET_MAGIC_TEST_IO_CHANNEL;
+	io_stats_init(&data->io_stats);
 	if (test_io_backing_manager) {
 		retval = test_io_backing_manager->open(name, flags,
 						       &data->real);
 		if (retval)
 			goto cleanup;
+		io->align = data->real->align;
 	} else
 		data->real = 0;
 	data->read_blk = 	test_io_cb_read_blk;
@@ -245,6 +346,10 @@ static errcode_t test_open(const char *name, int flags, io_channel *channel)
 	if ((value = safe_getenv("TEST_IO_WRITE_ABORT")) != NULL)
 		data->write_abort_count = strtoul(value, NULL, 0);
 
+	data->trace = NULL;
+	if ((value = safe_getenv("TEST_IO_TRACE")) != NULL)
+		test_trace_open(data, value);
+
 	*channel = io;
 	return 0;
 
@@ -273,6 +378,8 @@ static errcode_t test_close(io_channel channel)
 
 	if (data->outfile && data->outfile != stderr)
 		fclose(data->outfile);
+	if (data->trace)
+		fclose(data->trace);
 
 	ext2fs_free_mem(&channel->private_data);
 	if (channel->name)
@@ -308,13 +415,18 @@ static errcode_t test_read_blk(io_channel channel, unsigned long block,
 {
 	struct test_private_data *data;
 	errcode_t	retval = 0;
+	unsigned long long start_time;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct test_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
 
+	start_time = io_stats_time();
 	if (data->real)
 		retval = io_channel_read_blk(data->real, block, count, buf);
+	test_update_stats(channel, data, 0, block, count, start_time);
+	test_trace_blk(channel, data, IO_TRACE_OP_READ, block, count,
+		       start_time, retval);
 	if (data->read_blk)
 		data->read_blk(block, count, retval);
 	if (data->flags & TEST_FLAG_READ)
@@ -335,13 +447,18 @@ static errcode_t test_write_blk(io_channel channel, unsigned long block,
 {
 	struct test_private_data *data;
 	errcode_t	retval = 0;
+	unsigned long long start_time;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct test_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
 
+	start_time = io_stats_time();
 	if (data->real)
 		retval = io_channel_write_blk(data->real, block, count, buf);
+	test_update_stats(channel, data, 1, block, count, start_time);
+	test_trace_blk(channel, data, IO_TRACE_OP_WRITE, block, count,
+		       start_time, retval);
 	if (data->write_blk)
 		data->write_blk(block, count, retval);
 	if (data->flags & TEST_FLAG_WRITE)
@@ -362,13 +479,18 @@ static errcode_t test_read_blk64(io_channel channel, unsigned long long block,
 {
 	struct test_private_data *data;
 	errcode_t	retval = 0;
+	unsigned long long start_time;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct test_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
 
+	start_time = io_stats_time();
 	if (data->real)
 		retval = io_channel_read_blk64(data->real, block, count, buf);
+	test_update_stats(channel, data, 0, block, count, start_time);
+	test_trace_blk(channel, data, IO_TRACE_OP_READ, block, count,
+		       start_time, retval);
 	if (data->read_blk64)
 		data->read_blk64(block, count, retval);
 	if (data->flags & TEST_FLAG_READ)
@@ -389,13 +511,18 @@ static errcode_t test_write_blk64(io_channel channel, unsigned long long block,
 {
 	struct test_private_data *data;
 	errcode_t	retval = 0;
+	unsigned long long start_time;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct test_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
 
+	start_time = io_stats_time();
 	if (data->real)
 		retval = io_channel_write_blk64(data->real, block, count, buf);
+	test_update_stats(channel, data, 1, block, count, start_time);
+	test_trace_blk(channel, data, IO_TRACE_OP_WRITE, block, count,
+		       start_time, retval);
 	if (data->write_blk64)
 		data->write_blk64(block, count, retval);
 	if (data->flags & TEST_FLAG_WRITE)
@@ -416,13 +543,16 @@ static errcode_t test_write_byte(io_channel channel, unsigned long offset,
 {
 	struct test_private_data *data;
 	errcode_t	retval = 0;
+	unsigned long long start_time;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct test_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
 
+	start_time = io_stats_time();
 	if (data->real && data->real->manager->write_byte)
 		retval = io_channel_write_byte(data->real, offset, count, buf);
+	test_trace(data, IO_TRACE_OP_WRITE, offset, count, start_time, retval);
 	if (data->write_byte)
 		data->write_byte(offset, count, retval);
 	if (data->flags & TEST_FLAG_WRITE)
@@ -439,13 +569,18 @@ static errcode_t test_flush(io_channel channel)
 {
 	struct test_private_data *data;
 	errcode_t	retval = 0;
+	unsigned long long start_time;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct test_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
 
+	start_time = io_stats_time();
 	if (data->real)
 		retval = io_channel_flush(data->real);
+	test_trace(data, IO_TRACE_OP_FLUSH, 0, 0, start_time, retval);
+	if (data->trace)
+		fflush(data->trace);
 
 	if (data->flags & TEST_FLAG_FLUSH)
 		fprintf(data->outfile, "Test_io: flush() returned %s\n",
@@ -492,6 +627,22 @@ static errcode_t test_get_stats(io_channel channel, io_stats *stats)
 
 	if (data->real && data->real->manager->get_stats) {
 		retval = (data->real->manager->get_stats)(data->real, stats);
-	}
+	} else if (stats)
+		*stats = &data->io_stats;
 	return retval;
 }
+
+static errcode_t test_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count)
+{
+	struct test_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct test_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
+
+	if (data->real)
+		return io_channel_cache_readahead(data->real, block, count);
+	return 0;
+}
@@ -0,0 +1,291 @@
+/*
+ * This testing program checks the bitmap backends against each other
+ *
+ * The same random sequence of operations is applied to a bitarray
+ * bitmap, a red-black tree bitmap and a roaring bitmap, and after
+ * every batch they must compare equal.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define TEST_START	1
+#define TEST_END	100000
+#define TEST_REAL_END	(TEST_END + 31)
+#define NUM_BATCHES	200
+#define OPS_PER_BATCH	500
+
+static int test_fail;
+
+static errcode_t make_bitmap(ext2_filsys fs, int type, const char *descr,
+			     ext2fs_generic_bitmap *ret)
+{
+	fs->default_bitmap_type = type;
+	return ext2fs_make_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP, fs,
+					  TEST_START, TEST_END, TEST_REAL_END,
+					  descr, 0, ret);
+}
+
+static void check_equal(ext2fs_generic_bitmap ba, ext2fs_generic_bitmap rb,
+			const char *what)
+{
+	unsigned char	buf1[256], buf2[256];
+	blk_t		blk, count = 0, count1, count2;
+
+	if (ext2fs_compare_block_bitmap(ba, rb)) {
+		printf("Bitmaps differ after %s\n", what);
+		test_fail++;
+		return;
+	}
+	for (blk = TEST_START; blk <= TEST_END; blk++) {
+		if (!ext2fs_test_block_bitmap(ba, blk) !=
+		    !ext2fs_test_block_bitmap(rb, blk)) {
+			printf("Block %u differs after %s\n", blk, what);
+			test_fail++;
+			return;
+		}
+		if (blk >= TEST_START + 1003 && blk < TEST_END - 77 &&
+		    ext2fs_test_block_bitmap(ba, blk))
+			count++;
+	}
+	/* An unaligned range, so that both ends are partial bytes */
+	if (ext2fs_count_used_range(ba, TEST_START + 1003, TEST_END - 78,
+				    &count1) ||
+	    ext2fs_count_used_range(rb, TEST_START + 1003, TEST_END - 78,
+				    &count2) ||
+	    count1 != count || count2 != count) {
+		printf("Counts differ after %s: expected %u, got %u and %u\n",
+		       what, count, count1, count2);
+		test_fail++;
+	}
+	/* An unaligned range, to exercise the bit-by-bit paths */
+	ext2fs_get_block_bitmap_range(ba, TEST_START + 1003, 2000, buf1);
+	ext2fs_get_block_bitmap_range(rb, TEST_START + 1003, 2000, buf2);
+	if (memcmp(buf1, buf2, 250)) {
+		printf("Ranges differ after %s\n", what);
+		test_fail++;
+	}
+}
+
+/*
+ * Both backends must agree with a bit-by-bit search of the range
+ */
+static void check_find(ext2fs_generic_bitmap ba, ext2fs_generic_bitmap rb,
+		       blk_t blk, int num, int set)
+{
+	blk_t		expect, out1 = 0, out2 = 0;
+	errcode_t	ret1, ret2;
+
+	for (expect = blk; expect < blk + num; expect++)
+		if (!!ext2fs_test_block_bitmap(ba, expect) == set)
+			break;
+	if (set) {
+		ret1 = ext2fs_find_first_set_block_bitmap(ba, blk,
+							  blk + num - 1, &out1);
+		ret2 = ext2fs_find_first_set_block_bitmap(rb, blk,
+							  blk + num - 1, &out2);
+	} else {
+		ret1 = ext2fs_find_first_zero_block_bitmap(ba, blk,
+							   blk + num - 1, &out1);
+		ret2 = ext2fs_find_first_zero_block_bitmap(rb, blk,
+							   blk + num - 1, &out2);
+	}
+	if (expect == blk + num) {
+		if (ret1 == ENOENT && ret2 == ENOENT)
+			return;
+	} else if (!ret1 && !ret2 && out1 == expect && out2 == expect)
+		return;
+	printf("find_first_%s on %u (%d): expected %u, got %u (%ld) "
+	       "and %u (%ld)\n", set ? "set" : "zero", blk, num, expect,
+	       out1, (long) ret1, out2, (long) ret2);
+	test_fail++;
+}
+
+int main(int argc, char **argv)
+{
+	ext2fs_generic_bitmap	ba, rb, rr, copy;
+	struct struct_ext2_filsys fs_struct;
+	ext2_filsys		fs = &fs_struct;
+	unsigned char		buf[1024];
+	errcode_t		retval;
+	blk_t			blk;
+	int			i, j, num, op, r1, r2, r3;
+
+	memset(fs, 0, sizeof(struct struct_ext2_filsys));
+	fs->magic = EXT2_ET_MAGIC_EXT2FS_FILSYS;
+	srandom(1);
+
+	retval = make_bitmap(fs, EXT2FS_BMAP64_BITARRAY, "bitarray", &ba);
+	if (!retval)
+		retval = make_bitmap(fs, EXT2FS_BMAP64_RBTREE, "rbtree", &rb);
+	if (!retval)
+		retval = make_bitmap(fs, EXT2FS_BMAP64_ROARING, "roaring", &rr);
+	if (retval) {
+		com_err("tst_bitmaps", retval, "while allocating bitmaps");
+		exit(1);
+	}
+	if (ext2fs_get_generic_bitmap_type(rb) != EXT2FS_BMAP64_RBTREE) {
+		printf("rbtree backend was not selected\n");
+		exit(1);
+	}
+	if (ext2fs_get_generic_bitmap_type(rr) != EXT2FS_BMAP64_ROARING) {
+		printf("roaring backend was not selected\n");
+		exit(1);
+	}
+
+	for (i = 0; i < NUM_BATCHES; i++) {
+		for (j = 0; j < OPS_PER_BATCH; j++) {
+			op = random() % 8;
+			if (op < 3)
+				num = 1;
+			else if (op < 6)
+				num = 1 + random() % 300;
+			else
+				num = 1 + random() % 5000;
+			blk = TEST_START + random() % (TEST_END - TEST_START -
+						       num + 1);
+			switch (op) {
+			case 0:
+				r1 = ext2fs_mark_block_bitmap(ba, blk);
+				r2 = ext2fs_mark_block_bitmap(rb, blk);
+				r3 = ext2fs_mark_block_bitmap(rr, blk);
+				break;
+			case 1:
+				r1 = ext2fs_unmark_block_bitmap(ba, blk);
+				r2 = ext2fs_unmark_block_bitmap(rb, blk);
+				r3 = ext2fs_unmark_block_bitmap(rr, blk);
+				break;
+			case 2:
+			case 5:
+				r1 = ext2fs_test_block_bitmap_range(ba, blk,
+								    num);
+				r2 = ext2fs_test_block_bitmap_range(rb, blk,
+								    num);
+				r3 = ext2fs_test_block_bitmap_range(rr, blk,
+								    num);
+				break;
+			case 3:
+				ext2fs_mark_block_bitmap_range(ba, blk, num);
+				ext2fs_mark_block_bitmap_range(rb, blk, num);
+				ext2fs_mark_block_bitmap_range(rr, blk, num);
+				r1 = r2 = r3 = 0;
+				break;
+			case 4:
+				ext2fs_unmark_block_bitmap_range(ba, blk, num);
+				ext2fs_unmark_block_bitmap_range(rb, blk, num);
+				ext2fs_unmark_block_bitmap_range(rr, blk, num);
+				r1 = r2 = r3 = 0;
+				break;
+			default:
+				check_find(ba, rb, blk, num, op == 6);
+				check_find(ba, rr, blk, num, op == 6);
+				r1 = r2 = r3 = 0;
+				break;
+			}
+			if (!r1 != !r2 || !r1 != !r3) {
+				printf("Operation %d on %u (%d) returned "
+				       "%d, %d and %d\n", op, blk, num,
+				       r1, r2, r3);
+				test_fail++;
+			}
+		}
+		if ((i % 20) == 0) {
+			check_equal(ba, rb, "random operations");
+			check_equal(ba, rr, "random operations");
+		}
+	}
+	check_equal(ba, rb, "random operations");
+	check_equal(ba, rr, "random operations");
+
+	/* Load a random pattern through set_range, at an odd offset */
+	for (i = 0; i < (int) sizeof(buf); i++)
+		buf[i] = (i & 16) ? 0xff : random();
+	ext2fs_set_block_bitmap_range(ba, TEST_START + 5, sizeof(buf) * 8,
+				      buf);
+	ext2fs_set_block_bitmap_range(rb, TEST_START + 5, sizeof(buf) * 8,
+				      buf);
+	ext2fs_set_block_bitmap_range(rr, TEST_START + 5, sizeof(buf) * 8,
+				      buf);
+	check_equal(ba, rb, "set_range");
+	check_equal(ba, rr, "set_range");
+	for (blk = TEST_START; blk <= TEST_END; blk += 997) {
+		check_find(ba, rb, blk, TEST_END - blk + 1, 0);
+		check_find(ba, rb, blk, TEST_END - blk + 1, 1);
+		check_find(ba, rr, blk, TEST_END - blk + 1, 0);
+		check_find(ba, rr, blk, TEST_END - blk + 1, 1);
+	}
+
+	retval = ext2fs_copy_bitmap(rb, &copy);
+	if (retval) {
+		com_err("tst_bitmaps", retval, "while copying bitmap");
+		exit(1);
+	}
+	check_equal(ba, copy, "copy");
+	ext2fs_free_block_bitmap(copy);
+	retval = ext2fs_copy_bitmap(rr, &copy);
+	if (retval) {
+		com_err("tst_bitmaps", retval, "while copying bitmap");
+		exit(1);
+	}
+	check_equal(ba, copy, "copy");
+	ext2fs_free_block_bitmap(copy);
+
+	ext2fs_resize_block_bitmap(TEST_END - 5000, TEST_END - 4000, ba);
+	ext2fs_resize_block_bitmap(TEST_END - 5000, TEST_END - 4000, rb);
+	ext2fs_resize_block_bitmap(TEST_END - 5000, TEST_END - 4000, rr);
+	ext2fs_resize_block_bitmap(TEST_END, TEST_REAL_END, ba);
+	ext2fs_resize_block_bitmap(TEST_END, TEST_REAL_END, rb);
+	ext2fs_resize_block_bitmap(TEST_END, TEST_REAL_END, rr);
+	check_equal(ba, rb, "resize");
+	check_equal(ba, rr, "resize");
+
+	ext2fs_set_bitmap_padding(ba);
+	ext2fs_set_bitmap_padding(rb);
+	ext2fs_set_bitmap_padding(rr);
+	check_equal(ba, rb, "set_padding");
+	check_equal(ba, rr, "set_padding");
+
+	ext2fs_clear_block_bitmap(ba);
+	ext2fs_clear_block_bitmap(rb);
+	ext2fs_clear_block_bitmap(rr);
+	check_equal(ba, rb, "clear");
+	check_equal(ba, rr, "clear");
+	if (ext2fs_get_generic_bitmap_memory(rb) >=
+	    ext2fs_get_generic_bitmap_memory(ba)) {
+		printf("Empty rbtree bitmap uses %llu bytes\n",
+		       ext2fs_get_generic_bitmap_memory(rb));
+		test_fail++;
+	}
+	if (ext2fs_get_generic_bitmap_memory(rr) >=
+	    ext2fs_get_generic_bitmap_memory(ba)) {
+		printf("Empty roaring bitmap uses %llu bytes\n",
+		       ext2fs_get_generic_bitmap_memory(rr));
+		test_fail++;
+	}
+
+	ext2fs_free_block_bitmap(ba);
+	ext2fs_free_block_bitmap(rb);
+	ext2fs_free_block_bitmap(rr);
+
+	if (test_fail == 0)
+		printf("ext2fs bitmap backend tests succeeded.\n");
+	return test_fail;
+}
@@ -0,0 +1,137 @@
+/*
+ * This testing program checks the unix I/O manager's write-back cache
+ *
+ * A run of dirty cache blocks is written with a single request.  The
+ * file size limit makes that request fail partway through, and the
+ * blocks past the limit must then be reported to the write_error
+ * handler one at a time, and the flush must fail, even though the
+ * handler retries a failed multi-block write block by block as
+ * e2fsck's does.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define TEST_BLOCKSIZE	1024
+#define TEST_BLOCKS	8	/* one full cache */
+#define TEST_LIMIT	4	/* blocks which fit under RLIMIT_FSIZE */
+
+static int test_fail;
+static int failed[TEST_BLOCKS];
+static int multi_errors;
+
+static errcode_t write_error(io_channel channel, unsigned long block,
+			     int count, const void *data,
+			     size_t size EXT2FS_ATTR((unused)),
+			     int actual EXT2FS_ATTR((unused)),
+			     errcode_t error)
+{
+	const char	*p = data;
+	int		i;
+
+	if (count > 1) {
+		multi_errors++;
+		for (i = 0; i < count; i++, p += channel->block_size) {
+			error = io_channel_write_blk(channel, block + i, 1, p);
+			if (error)
+				return error;
+		}
+		return 0;
+	}
+	if (block < TEST_BLOCKS)
+		failed[block]++;
+	return error;
+}
+
+int main(int argc EXT2FS_ATTR((unused)), char **argv EXT2FS_ATTR((unused)))
+{
+	char		name[] = "/tmp/tst_unix_io.XXXXXX";
+	char		buf[TEST_BLOCKSIZE], disk[TEST_BLOCKSIZE];
+	struct rlimit	rlim, old_rlim;
+	io_channel	io;
+	errcode_t	retval;
+	int		fd, i;
+
+	fd = mkstemp(name);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	retval = unix_io_manager->open(name, IO_FLAG_RW, &io);
+	if (retval) {
+		com_err("tst_unix_io", retval, "while opening %s", name);
+		exit(1);
+	}
+	io_channel_set_blksize(io, TEST_BLOCKSIZE);
+	io->write_error = write_error;
+
+	for (i = 0; i < TEST_BLOCKS; i++) {
+		memset(buf, 'a' + i, sizeof(buf));
+		retval = io_channel_write_blk(io, i, 1, buf);
+		if (retval) {
+			com_err("tst_unix_io", retval,
+				"while writing block %d", i);
+			exit(1);
+		}
+	}
+
+	signal(SIGXFSZ, SIG_IGN);
+	getrlimit(RLIMIT_FSIZE, &old_rlim);
+	rlim = old_rlim;
+	rlim.rlim_cur = TEST_LIMIT * TEST_BLOCKSIZE;
+	if (setrlimit(RLIMIT_FSIZE, &rlim)) {
+		perror("setrlimit");
+		exit(1);
+	}
+	retval = io_channel_flush(io);
+	if (!retval) {
+		printf("Flush past the file size limit succeeded\n");
+		test_fail++;
+	}
+	if (multi_errors) {
+		printf("Merged write was reported to the handler\n");
+		test_fail++;
+	}
+	for (i = 0; i < TEST_BLOCKS; i++) {
+		if (!failed[i] != (i < TEST_LIMIT)) {
+			printf("Block %d was %sreported as failed\n", i,
+			       failed[i] ? "" : "not ");
+			test_fail++;
+		}
+	}
+	for (i = 0; i < TEST_LIMIT; i++) {
+		memset(buf, 'a' + i, sizeof(buf));
+		if (pread(fd, disk, sizeof(disk), i * TEST_BLOCKSIZE) !=
+		    sizeof(disk) || memcmp(buf, disk, sizeof(buf))) {
+			printf("Block %d was not written\n", i);
+			test_fail++;
+		}
+	}
+
+	setrlimit(RLIMIT_FSIZE, &old_rlim);
+	io_channel_close(io);
+	close(fd);
+	unlink(name);
+
+	if (test_fail == 0)
+		printf("unix_io write-back tests succeeded.\n");
+	return test_fail;
+}
@@ -1,6 +1,7 @@
 /*
  * undo_io.c --- This is the undo io manager that copies the old data that
- * copies the old data being overwritten into a tdb database
+ * copies the old data being overwritten into an undo log (see
+ * undo_log.h), or into a tdb database
  *
  * Copyright IBM Corporation, 2007
  * Author Aneesh Kumar K.V <aneesh.kumar@linux.vnet.ibm.com>
@@ -41,6 +42,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "undo_log.h"
 
 #ifdef __GNUC__
 #define ATTR(x) __attribute__(x)
@@ -55,6 +57,16 @@
 #define EXT2_CHECK_MAGIC(struct, code) \
 	  if ((struct)->magic != (code)) return (code)
 
+/*
+ * The undo blocks which are already in the log, as a sorted list of
+ * runs which neither overlap nor touch.  Writes are usually clustered,
+ * so this stays short even on a large device.
+ */
+struct undo_saved_run {
+	unsigned long	start;
+	unsigned long	count;
+};
+
 struct undo_private_data {
 	int	magic;
 	TDB_CONTEXT *tdb;
@@ -68,6 +80,19 @@ struct undo_private_data {
 
 	/* to support offset in unix I/O manager */
 	ext2_loff_t offset;
+
+	/* requests seen by this layer, used if the backing has no stats */
+	struct struct_io_stats io_stats;
+	ext2_loff_t next_location;
+
+	/* undo log state, for UNDO_IO_FORMAT_LOG */
+	int	format;
+	int	log_fd;
+	ext2_loff_t log_offset;		/* where the next record goes */
+	struct undo_log_index *index;
+	unsigned long index_count, index_size;
+	struct undo_saved_run *saved;	/* undo blocks already in the log */
+	unsigned long saved_count, saved_size;
 };
 
 static errcode_t undo_open(const char *name, int flags, io_channel *channel);
@@ -82,6 +107,7 @@ static errcode_t undo_write_byte(io_channel channel, unsigned long offset,
 				int size, const void *data);
 static errcode_t undo_set_option(io_channel channel, const char *option,
 				 const char *arg);
+static errcode_t undo_get_stats(io_channel channel, io_stats *stats);
 
 static struct struct_io_manager struct_undo_manager = {
 	EXT2_ET_MAGIC_IO_MANAGER,
@@ -93,12 +119,14 @@ static struct struct_io_manager struct_undo_manager = {
 	undo_write_blk,
 	undo_flush,
 	undo_write_byte,
-	undo_set_option
+	undo_set_option,
+	undo_get_stats,
 };
 
 io_manager undo_io_manager = &struct_undo_manager;
 static io_manager undo_io_backing_manager ;
 static char *tdb_file;
+static int undo_format = UNDO_IO_FORMAT_LOG;
 static int actual_size;
 
 static unsigned char mtime_key[] = "filesystem MTIME";
@@ -125,24 +153,42 @@ errcode_t set_undo_io_backup_file(char *file_name)
 	return 0;
 }
 
-static errcode_t write_file_system_identity(io_channel undo_channel,
-							TDB_CONTEXT *tdb)
+errcode_t set_undo_io_backup_format(int format)
+{
+	if (format != UNDO_IO_FORMAT_LOG && format != UNDO_IO_FORMAT_TDB)
+		return EXT2_ET_INVALID_ARGUMENT;
+	undo_format = format;
+	return 0;
+}
+
+static errcode_t read_super(io_channel undo_channel,
+			    struct ext2_super_block *super)
 {
 	errcode_t retval;
-	struct ext2_super_block super;
-	TDB_DATA tdb_key, tdb_data;
 	struct undo_private_data *data;
 	io_channel channel;
-	int block_size ;
+	int block_size;
 
 	data = (struct undo_private_data *) undo_channel->private_data;
 	channel = data->real;
 	block_size = channel->block_size;
 
 	io_channel_set_blksize(channel, SUPERBLOCK_OFFSET);
-	retval = io_channel_read_blk(channel, 1, -SUPERBLOCK_SIZE, &super);
+	retval = io_channel_read_blk(channel, 1, -SUPERBLOCK_SIZE, super);
+	io_channel_set_blksize(channel, block_size);
+	return retval;
+}
+
+static errcode_t write_file_system_identity(io_channel undo_channel,
+							TDB_CONTEXT *tdb)
+{
+	errcode_t retval;
+	struct ext2_super_block super;
+	TDB_DATA tdb_key, tdb_data;
+
+	retval = read_super(undo_channel, &super);
 	if (retval)
-		goto err_out;
+		return retval;
 
 	/* Write to tdb file in the file system byte order */
 	tdb_key.dptr = mtime_key;
@@ -151,10 +197,8 @@ static errcode_t write_file_system_identity(io_channel undo_channel,
 	tdb_data.dsize = sizeof(super.s_mtime);
 
 	retval = tdb_store(tdb, tdb_key, tdb_data, TDB_INSERT);
-	if (retval == -1) {
-		retval = EXT2_ET_TDB_SUCCESS + tdb_error(tdb);
-		goto err_out;
-	}
+	if (retval == -1)
+		return EXT2_ET_TDB_SUCCESS + tdb_error(tdb);
 
 	tdb_key.dptr = uuid_key;
 	tdb_key.dsize = sizeof(uuid_key);
@@ -166,11 +210,283 @@ static errcode_t write_file_system_identity(io_channel undo_channel,
 		retval = EXT2_ET_TDB_SUCCESS + tdb_error(tdb);
 	}
 
-err_out:
-	io_channel_set_blksize(channel, block_size);
 	return retval;
 }
 
+/*
+ * Write the whole buffer to the undo log at the given offset
+ */
+static errcode_t write_log(struct undo_private_data *data, ext2_loff_t offset,
+			   const void *buf, unsigned long size)
+{
+	ssize_t	actual;
+
+	if (ext2fs_llseek(data->log_fd, offset, SEEK_SET) != offset)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	actual = write(data->log_fd, buf, size);
+	if (actual < 0)
+		return errno;
+	if ((unsigned long) actual != size)
+		return EXT2_ET_SHORT_WRITE;
+	return 0;
+}
+
+/*
+ * Write the log header; if complete is set, the index is written
+ * out first, and the header records where to find it along with
+ * the identity of the filesystem.
+ */
+static errcode_t write_log_header(io_channel undo_channel, int complete)
+{
+	struct undo_private_data *data;
+	struct undo_log_header hdr;
+	struct ext2_super_block super;
+	errcode_t retval;
+
+	data = (struct undo_private_data *) undo_channel->private_data;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, UNDO_LOG_MAGIC, UNDO_LOG_MAGIC_LEN);
+	hdr.version = UNDO_LOG_VERSION;
+	hdr.block_size = data->tdb_data_size;
+	if (complete) {
+		retval = read_super(undo_channel, &super);
+		if (retval)
+			return retval;
+		hdr.fs_mtime = super.s_mtime;
+		memcpy(hdr.fs_uuid, super.s_uuid, sizeof(hdr.fs_uuid));
+		hdr.index_offset = data->log_offset;
+		hdr.index_count = data->index_count;
+		retval = write_log(data, data->log_offset, data->index,
+				   data->index_count *
+				   sizeof(struct undo_log_index));
+		if (retval)
+			return retval;
+		hdr.flags |= UNDO_LOG_FL_COMPLETE;
+	}
+	retval = write_log(data, 0, &hdr, sizeof(hdr));
+	if (retval)
+		return retval;
+	if (complete && fsync(data->log_fd) < 0)
+		return errno;
+	return 0;
+}
+
+/* Return the index of the first saved run which starts after block */
+static unsigned long find_saved(struct undo_private_data *data,
+				unsigned long block)
+{
+	unsigned long	low = 0, high = data->saved_count, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (data->saved[mid].start <= block)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static int test_saved(struct undo_private_data *data, unsigned long block)
+{
+	unsigned long	i = find_saved(data, block);
+
+	return i > 0 && block - data->saved[i - 1].start <
+		data->saved[i - 1].count;
+}
+
+static errcode_t mark_saved(struct undo_private_data *data,
+			    unsigned long block, unsigned long count)
+{
+	struct undo_saved_run *run;
+	unsigned long	i, j, end = block + count, size;
+	errcode_t	retval;
+
+	i = find_saved(data, block);
+	if (i > 0 && data->saved[i - 1].start + data->saved[i - 1].count >=
+	    block) {
+		/* Extend the run before */
+		run = data->saved + --i;
+		if (end < run->start + run->count)
+			end = run->start + run->count;
+	} else {
+		if (data->saved_count >= data->saved_size) {
+			size = data->saved_size ? data->saved_size * 2 : 256;
+			retval = ext2fs_resize_mem(data->saved_size *
+					sizeof(struct undo_saved_run),
+					size * sizeof(struct undo_saved_run),
+					&data->saved);
+			if (retval)
+				return retval;
+			data->saved_size = size;
+		}
+		run = data->saved + i;
+		memmove(run + 1, run, (data->saved_count - i) *
+			sizeof(struct undo_saved_run));
+		data->saved_count++;
+		run->start = block;
+	}
+	/* Absorb the runs which the new one reaches */
+	for (j = i + 1; j < data->saved_count &&
+		     data->saved[j].start <= end; j++)
+		if (end < data->saved[j].start + data->saved[j].count)
+			end = data->saved[j].start + data->saved[j].count;
+	memmove(run + 1, data->saved + j, (data->saved_count - j) *
+		sizeof(struct undo_saved_run));
+	data->saved_count -= j - i - 1;
+	run->count = end - run->start;
+	return 0;
+}
+
+/*
+ * Save the original contents of count undo blocks, none of which has
+ * been saved yet, as a single record at the end of the undo log.
+ */
+static errcode_t undo_log_run(io_channel channel,
+			      struct undo_private_data *data,
+			      unsigned long block_num, unsigned long count)
+{
+	struct undo_log_record	rec;
+	struct undo_log_index	*idx;
+	unsigned long		backing_blk_num, size, skew, length;
+	ext2_loff_t		offset;
+	unsigned char		*read_ptr;
+	errcode_t		retval;
+	int			sz;
+
+	/*
+	 * The backing I/O manager block size may be different from
+	 * the undo block size, so read from the start of the backing
+	 * block which contains the first undo block.
+	 */
+	offset = (ext2_loff_t) block_num * data->tdb_data_size;
+	backing_blk_num = (offset - data->offset) / channel->block_size;
+	skew = (offset - data->offset) % channel->block_size;
+	size = count * data->tdb_data_size + skew;
+	retval = ext2fs_get_mem(size, &read_ptr);
+	if (retval)
+		return retval;
+	memset(read_ptr, 0, size);
+
+	actual_size = 0;
+	if ((size % channel->block_size) == 0)
+		sz = size / channel->block_size;
+	else
+		sz = -size;
+	retval = io_channel_read_blk(data->real, backing_blk_num, sz,
+				     read_ptr);
+	if (retval) {
+		if (retval != EXT2_ET_SHORT_READ)
+			goto out;
+		/* Short read at the end of the device */
+		length = (actual_size > (int) skew) ? actual_size - skew : 0;
+	} else
+		length = count * data->tdb_data_size;
+
+	if (!data->tdb_written) {
+		data->tdb_written = 1;
+		retval = write_log_header(channel, 0);
+		if (retval)
+			goto out;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = UNDO_LOG_REC_MAGIC;
+	rec.count = count;
+	rec.block = block_num;
+	rec.length = length;
+	retval = write_log(data, data->log_offset, &rec, sizeof(rec));
+	if (retval)
+		goto out;
+	retval = write_log(data, data->log_offset + sizeof(rec),
+			   read_ptr + skew, length);
+	if (retval)
+		goto out;
+
+	if (data->index_count >= data->index_size) {
+		size = data->index_size ? data->index_size * 2 : 256;
+		retval = ext2fs_resize_mem(data->index_size *
+					   sizeof(struct undo_log_index),
+					   size * sizeof(struct undo_log_index),
+					   &data->index);
+		if (retval)
+			goto out;
+		data->index_size = size;
+	}
+	idx = data->index + data->index_count++;
+	idx->block = block_num;
+	idx->offset = data->log_offset + sizeof(rec);
+	idx->count = count;
+	idx->length = length;
+	data->log_offset += sizeof(rec) + length;
+
+	retval = mark_saved(data, block_num, count);
+out:
+	ext2fs_free_mem(&read_ptr);
+	return retval;
+}
+
+/*
+ * Append the original contents of the undo blocks touched by this
+ * write which haven't been saved yet, one record per run of unsaved
+ * blocks.
+ */
+static errcode_t undo_write_log(io_channel channel,
+				unsigned long block, int count)
+{
+	struct undo_private_data *data;
+	unsigned long	block_num, end_block, run_end;
+	ext2_loff_t	offset;
+	errcode_t	retval;
+	int		size, logged = 0;
+
+	data = (struct undo_private_data *) channel->private_data;
+	if (data->log_fd < 0)
+		return 0;
+
+	if (count < 0)
+		size = -count;
+	else
+		size = count * channel->block_size;
+	if (size == 0)
+		return 0;
+
+	offset = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	block_num = offset / data->tdb_data_size;
+	end_block = (offset + size - 1) / data->tdb_data_size;
+
+	while (block_num <= end_block) {
+		if (test_saved(data, block_num)) {
+			block_num++;
+			continue;
+		}
+		for (run_end = block_num + 1; run_end <= end_block; run_end++)
+			if (test_saved(data, run_end))
+				break;
+		retval = undo_log_run(channel, data, block_num,
+				      run_end - block_num);
+		if (retval)
+			return retval;
+		block_num = run_end;
+		logged++;
+	}
+
+	/*
+	 * The original contents must be on stable storage before the
+	 * new contents are written over them.
+	 */
+	if (logged) {
+#ifdef HAVE_FDATASYNC
+		if (fdatasync(data->log_fd) < 0)
+#else
+		if (fsync(data->log_fd) < 0)
+#endif
+			return errno;
+	}
+	return 0;
+}
+
 static errcode_t write_block_size(TDB_CONTEXT *tdb, int block_size)
 {
 	errcode_t retval;
@@ -204,6 +520,9 @@ static errcode_t undo_write_tdb(io_channel channel,
 
 	data = (struct undo_private_data *) channel->private_data;
 
+	if (data->format == UNDO_IO_FORMAT_LOG)
+		return undo_write_log(channel, block, count);
+
 	if (data->tdb == NULL) {
 		/*
 		 * Transaction database not initialized
@@ -370,22 +689,36 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 
 	memset(data, 0, sizeof(struct undo_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->log_fd = -1;
+	io_stats_init(&data->io_stats);
 
 	if (undo_io_backing_manager) {
 		retval = undo_io_backing_manager->open(name, flags,
 						       &data->real);
 		if (retval)
 			goto cleanup;
+		io->align = data->real->align;
 	} else {
 		data->real = 0;
 	}
 
-	/* setup the tdb file */
-	data->tdb = tdb_open(tdb_file, 0, TDB_CLEAR_IF_FIRST,
-			     O_RDWR | O_CREAT | O_TRUNC | O_EXCL, 0600);
-	if (!data->tdb) {
-		retval = errno;
-		goto cleanup;
+	data->format = undo_format;
+	if (data->format == UNDO_IO_FORMAT_LOG) {
+		data->log_fd = open(tdb_file,
+				    O_RDWR | O_CREAT | O_TRUNC | O_EXCL, 0600);
+		if (data->log_fd < 0) {
+			retval = errno;
+			goto cleanup;
+		}
+		data->log_offset = UNDO_LOG_DATA_START;
+	} else {
+		/* setup the tdb file */
+		data->tdb = tdb_open(tdb_file, 0, TDB_CLEAR_IF_FIRST,
+				     O_RDWR | O_CREAT | O_TRUNC | O_EXCL, 0600);
+		if (!data->tdb) {
+			retval = errno;
+			goto cleanup;
+		}
 	}
 
 	/*
@@ -419,13 +752,22 @@ static errcode_t undo_close(io_channel channel)
 	if (--channel->refcount > 0)
 		return 0;
 	/* Before closing write the file system identity */
-	retval = write_file_system_identity(channel, data->tdb);
+	if (data->format == UNDO_IO_FORMAT_LOG)
+		retval = write_log_header(channel, 1);
+	else
+		retval = write_file_system_identity(channel, data->tdb);
 	if (retval)
 		return retval;
 	if (data->real)
 		retval = io_channel_close(data->real);
 	if (data->tdb)
 		tdb_close(data->tdb);
+	if (data->log_fd >= 0)
+		close(data->log_fd);
+	if (data->index)
+		ext2fs_free_mem(&data->index);
+	if (data->saved)
+		ext2fs_free_mem(&data->saved);
 	ext2fs_free_mem(&channel->private_data);
 	if (channel->name)
 		ext2fs_free_mem(&channel->name);
@@ -460,13 +802,19 @@ static errcode_t undo_read_blk(io_channel channel, unsigned long block,
 {
 	errcode_t	retval = 0;
 	struct undo_private_data *data;
+	unsigned long long start_time;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct undo_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+	start_time = io_stats_time();
 	if (data->real)
 		retval = io_channel_read_blk(data->real, block, count, buf);
+	io_stats_update(&data->io_stats, &data->next_location, 0,
+			(ext2_loff_t) block * channel->block_size,
+			(count < 0) ? -count : count * channel->block_size,
+			start_time);
 
 	return retval;
 }
@@ -476,6 +824,7 @@ static errcode_t undo_write_blk(io_channel channel, unsigned long block,
 {
 	struct undo_private_data *data;
 	errcode_t	retval = 0;
+	unsigned long long start_time;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct undo_private_data *) channel->private_data;
@@ -483,11 +832,16 @@ static errcode_t undo_write_blk(io_channel channel, unsigned long block,
 	/*
 	 * First write the existing content into database
 	 */
+	start_time = io_stats_time();
 	retval = undo_write_tdb(channel, block, count);
 	if (retval)
 		 return retval;
 	if (data->real)
 		retval = io_channel_write_blk(data->real, block, count, buf);
+	io_stats_update(&data->io_stats, &data->next_location, 1,
+			(ext2_loff_t) block * channel->block_size,
+			(count < 0) ? -count : count * channel->block_size,
+			start_time);
 
 	return retval;
 }
@@ -535,6 +889,12 @@ static errcode_t undo_flush(io_channel channel)
 	data = (struct undo_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+	/*
+	 * Make sure the saved blocks are on disk before the new
+	 * contents are.
+	 */
+	if (data->log_fd >= 0)
+		fsync(data->log_fd);
 	if (data->real)
 		retval = io_channel_flush(data->real);
 
@@ -584,3 +944,23 @@ static errcode_t undo_set_option(io_channel channel, const char *option,
 	}
 	return retval;
 }
+
+static errcode_t undo_get_stats(io_channel channel, io_stats *stats)
+{
+	errcode_t	retval = 0;
+	struct undo_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct undo_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	/*
+	 * The backing manager sees both the application's I/O and
+	 * the reads we do to save the original contents of the blocks
+	 */
+	if (data->real && data->real->manager->get_stats)
+		retval = data->real->manager->get_stats(data->real, stats);
+	else if (stats)
+		*stats = &data->io_stats;
+	return retval;
+}
@@ -0,0 +1,57 @@
+/*
+ * undo_log.h --- header file describing the e2undo log format
+ *
+ * The undo log is an append-only file: a header, followed by runs of
+ * the original contents of the blocks which were overwritten, each
+ * preceded by a record header, followed by an index of all the runs.
+ * The index and the filesystem identity are only written when the
+ * undo I/O manager is closed; if that never happens, the runs can
+ * still be found by walking the record headers.
+ *
+ * All fields are stored in host byte order, as in the e2image format.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#define UNDO_LOG_MAGIC		"E2UNDOLG"
+#define UNDO_LOG_MAGIC_LEN	8
+#define UNDO_LOG_VERSION	1
+
+/* Offset of the first record; the header is padded out to this size */
+#define UNDO_LOG_DATA_START	1024
+
+struct undo_log_header {
+	char	magic[UNDO_LOG_MAGIC_LEN];	/* UNDO_LOG_MAGIC */
+	__u32	version;	/* UNDO_LOG_VERSION */
+	__u32	flags;		/* UNDO_LOG_FL_* */
+	__u32	block_size;	/* Size of an undo block */
+	__u32	fs_mtime;	/* s_mtime of the fs when the log was closed */
+	__u8	fs_uuid[16];	/* s_uuid of the fs */
+	__u64	index_offset;	/* Byte offset of the index */
+	__u32	index_count;	/* Number of entries in the index */
+	__u32	reserved[9];
+};
+
+#define UNDO_LOG_FL_COMPLETE	0x0001	/* Index and identity are valid */
+
+#define UNDO_LOG_REC_MAGIC	0xE2D0106E
+
+struct undo_log_record {
+	__u32	magic;		/* UNDO_LOG_REC_MAGIC */
+	__u32	count;		/* Number of undo blocks in the run */
+	__u64	block;		/* First undo block of the run */
+	__u32	length;		/* Bytes of data which follow; only less
+				   than count * block_size at end of device */
+	__u32	reserved;
+};
+
+/* The index is an array of these, one per record */
+struct undo_log_index {
+	__u64	block;		/* First undo block of the run */
+	__u64	offset;		/* Byte offset of the run's data */
+	__u32	count;		/* Number of undo blocks in the run */
+	__u32	length;		/* Bytes of data in the run */
+};
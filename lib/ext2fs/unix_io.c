@@ -80,6 +80,13 @@ struct unix_cache {
 #define WRITE_DIRECT_SIZE 4	/* Must be smaller than CACHE_SIZE */
 #define READ_DIRECT_SIZE 4	/* Should be smaller than CACHE_SIZE */
 
+/*
+ * Largest request which is bounced through an aligned buffer with a
+ * single system call when the caller's buffer isn't suitably aligned
+ * for O_DIRECT; bigger requests are done in chunks of this size.
+ */
+#define BOUNCE_MAX_SIZE	(4 * 1024 * 1024)
+
 struct unix_private_data {
 	int	magic;
 	int	dev;
@@ -89,7 +96,10 @@ struct unix_private_data {
 	ext2_loff_t offset;
 	struct unix_cache cache[CACHE_SIZE];
 	void	*bounce;
+	int	bounce_size;
+	void	*flush_buf;	/* used to merge adjacent dirty blocks */
 	struct struct_io_stats io_stats;
+	ext2_loff_t next_location;	/* for sequential I/O accounting */
 };
 
 #define IS_ALIGNED(n, align) ((((unsigned long) n) & \
@@ -115,6 +125,9 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			       int count, void *data);
 static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 				int count, const void *data);
+static errcode_t unix_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count);
 
 static struct struct_io_manager struct_unix_manager = {
 	EXT2_ET_MAGIC_IO_MANAGER,
@@ -130,6 +143,7 @@ static struct struct_io_manager struct_unix_manager = {
 	unix_get_stats,
 	unix_read_blk64,
 	unix_write_blk64,
+	unix_cache_readahead,
 };
 
 io_manager unix_io_manager = &struct_unix_manager;
@@ -150,6 +164,33 @@ static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
 	return retval;
 }
 
+/*
+ * Make sure the bounce buffer can hold size bytes, up to
+ * BOUNCE_MAX_SIZE, and return the number of bytes which can be
+ * transferred through it at once.  If the buffer can't be grown we
+ * simply keep using the smaller one.
+ */
+static int get_bounce_size(io_channel channel, struct unix_private_data *data,
+			   ssize_t size)
+{
+	void	*new_bounce;
+	ssize_t	want;
+
+	want = ((size + channel->block_size - 1) / channel->block_size) *
+		channel->block_size;
+	if (want > BOUNCE_MAX_SIZE)
+		want = (BOUNCE_MAX_SIZE / channel->block_size) *
+			channel->block_size;
+	if (want <= data->bounce_size)
+		return data->bounce_size;
+	if (ext2fs_get_memalign(want, data->align, &new_bounce) == 0) {
+		ext2fs_free_mem(&data->bounce);
+		data->bounce = new_bounce;
+		data->bounce_size = want;
+	}
+	return data->bounce_size;
+}
+
 /*
  * Here are the raw I/O functions
  */
@@ -162,9 +203,11 @@ static errcode_t raw_read_blk(io_channel channel,
 	ssize_t		size;
 	ext2_loff_t	location;
 	int		actual = 0;
+	ssize_t		chunk;
+	char		*cp = buf;
+	unsigned long long start_time = io_stats_time();
 
 	size = (count < 0) ? -count : count * channel->block_size;
-	data->io_stats.bytes_read += size;
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
@@ -174,12 +217,13 @@ static errcode_t raw_read_blk(io_channel channel,
 	    ((IS_ALIGNED(buf, data->align)) && IS_ALIGNED(size, data->align))) {
 		actual = read(data->dev, buf, size);
 		if (actual != size) {
-		short_read:
 			if (actual < 0)
 				actual = 0;
 			retval = EXT2_ET_SHORT_READ;
 			goto error_out;
 		}
+		io_stats_update(&data->io_stats, &data->next_location, 0,
+				location, size, start_time);
 		return 0;
 	}
 
@@ -193,19 +237,39 @@ static errcode_t raw_read_blk(io_channel channel,
 	 * to the O_DIRECT rules, so we need to do this the hard way...
 	 */
 	while (size > 0) {
-		actual = read(data->dev, data->bounce, channel->block_size);
-		if (actual != channel->block_size)
-			goto short_read;
+		chunk = get_bounce_size(channel, data, size);
+		if (chunk > size)
+			chunk = ((size + channel->block_size - 1) /
+				 channel->block_size) * channel->block_size;
+		actual = read(data->dev, data->bounce, chunk);
+		if (actual != chunk) {
+			if (actual < 0)
+				actual = 0;
+			if (actual > size)
+				actual = size;
+			memcpy(cp, data->bounce, actual);
+			/* Report the error against the caller's request */
+			actual += cp - (char *) buf;
+			size = (count < 0) ? -count :
+				count * channel->block_size;
+			retval = EXT2_ET_SHORT_READ;
+			goto error_out;
+		}
 		actual = size;
-		if (size > channel->block_size)
-			actual = channel->block_size;
-		memcpy(buf, data->bounce, actual);
+		if (size > chunk)
+			actual = chunk;
+		memcpy(cp, data->bounce, actual);
 		size -= actual;
-		buf += actual;
+		cp += actual;
 	}
+	size = (count < 0) ? -count : count * channel->block_size;
+	io_stats_update(&data->io_stats, &data->next_location, 0,
+			location, size, start_time);
 	return 0;
 
 error_out:
+	io_stats_update(&data->io_stats, &data->next_location, 0,
+			location, actual, start_time);
 	memset((char *) buf+actual, 0, size-actual);
 	if (channel->read_error)
 		retval = (channel->read_error)(channel, block, count, buf,
@@ -222,6 +286,10 @@ static errcode_t raw_write_blk(io_channel channel,
 	ext2_loff_t	location;
 	int		actual = 0;
 	errcode_t	retval;
+	ssize_t		chunk;
+	ext2_loff_t	pos;
+	const char	*cp = buf;
+	unsigned long long start_time = io_stats_time();
 
 	if (count == 1)
 		size = channel->block_size;
@@ -231,7 +299,6 @@ static errcode_t raw_write_blk(io_channel channel,
 		else
 			size = count * channel->block_size;
 	}
-	data->io_stats.bytes_written += size;
 
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
@@ -243,10 +310,11 @@ static errcode_t raw_write_blk(io_channel channel,
 	    ((IS_ALIGNED(buf, data->align)) && IS_ALIGNED(size, data->align))) {
 		actual = write(data->dev, buf, size);
 		if (actual != size) {
-		short_write:
 			retval = EXT2_ET_SHORT_WRITE;
 			goto error_out;
 		}
+		io_stats_update(&data->io_stats, &data->next_location, 1,
+				location, size, start_time);
 		return 0;
 	}
 
@@ -258,28 +326,59 @@ static errcode_t raw_write_blk(io_channel channel,
 	 * The buffer or size which we're trying to write isn't aligned
 	 * to the O_DIRECT rules, so we need to do this the hard way...
 	 */
+	pos = location;
 	while (size > 0) {
-		if (size < channel->block_size) {
-			actual = read(data->dev, data->bounce,
+		chunk = get_bounce_size(channel, data, size);
+		if (chunk > size)
+			chunk = ((size + channel->block_size - 1) /
+				 channel->block_size) * channel->block_size;
+		if (size < chunk) {
+			/*
+			 * The last block is only partially overwritten,
+			 * so fetch its current contents first.
+			 */
+			if (ext2fs_llseek(data->dev,
+					  pos + chunk - channel->block_size,
+					  SEEK_SET) < 0) {
+				retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
+				goto bounce_error;
+			}
+			actual = read(data->dev, (char *) data->bounce +
+				      chunk - channel->block_size,
 				      channel->block_size);
 			if (actual != channel->block_size) {
 				retval = EXT2_ET_SHORT_READ;
-				goto error_out;
+				goto bounce_error;
+			}
+			if (ext2fs_llseek(data->dev, pos, SEEK_SET) != pos) {
+				retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
+				goto bounce_error;
 			}
 		}
 		actual = size;
-		if (size > channel->block_size)
-			actual = channel->block_size;
-		memcpy(data->bounce, buf, actual);
-		actual = write(data->dev, data->bounce, channel->block_size);
-		if (actual != channel->block_size)
-			goto short_write;
+		if (size > chunk)
+			actual = chunk;
+		memcpy(data->bounce, cp, actual);
+		if (write(data->dev, data->bounce, chunk) != chunk) {
+			retval = EXT2_ET_SHORT_WRITE;
+			goto bounce_error;
+		}
+		pos += chunk;
 		size -= actual;
-		buf += actual;
+		cp += actual;
 	}
+	io_stats_update(&data->io_stats, &data->next_location, 1, location,
+			(count < 0) ? -count : count * channel->block_size,
+			start_time);
 	return 0;
 
+bounce_error:
+	/* Report the error against the caller's request */
+	actual = cp - (const char *) buf;
+	size = (count < 0) ? -count : count * channel->block_size;
 error_out:
+	io_stats_update(&data->io_stats, &data->next_location, 1,
+			location, (actual > 0) ? actual : 0, start_time);
 	if (channel->write_error)
 		retval = (channel->write_error)(channel, block, count, buf,
 						size, actual, retval);
@@ -312,11 +411,20 @@ static errcode_t alloc_cache(io_channel channel,
 		if (retval)
 			return retval;
 	}
+	if (data->flush_buf)
+		ext2fs_free_mem(&data->flush_buf);
+	retval = ext2fs_get_memalign(CACHE_SIZE * channel->block_size,
+				     data->align, &data->flush_buf);
+	if (retval)
+		return retval;
 	if (data->align) {
 		if (data->bounce)
 			ext2fs_free_mem(&data->bounce);
+		data->bounce_size = 0;
 		retval = ext2fs_get_memalign(channel->block_size, data->align,
 					     &data->bounce);
+		if (!retval)
+			data->bounce_size = channel->block_size;
 	}
 	return retval;
 }
@@ -338,6 +446,9 @@ static void free_cache(struct unix_private_data *data)
 	}
 	if (data->bounce)
 		ext2fs_free_mem(&data->bounce);
+	data->bounce_size = 0;
+	if (data->flush_buf)
+		ext2fs_free_mem(&data->flush_buf);
 }
 
 #ifndef NO_IO_CACHE
@@ -373,14 +484,106 @@ static struct unix_cache *find_cached_block(struct unix_private_data *data,
 	return 0;
 }
 
+static EXT2_QSORT_TYPE cache_block_cmp(const void *a, const void *b)
+{
+	const struct unix_cache *ca = *(const struct unix_cache * const *) a;
+	const struct unix_cache *cb = *(const struct unix_cache * const *) b;
+
+	if (ca->block < cb->block)
+		return -1;
+	return (ca->block > cb->block);
+}
+
+/*
+ * Collect the dirty cache entries, sorted by block number.  Returns
+ * the number of entries stored in dirty.
+ */
+static int sort_dirty_blocks(struct unix_private_data *data,
+			     struct unix_cache **dirty)
+{
+	struct unix_cache	*cache;
+	int			i, n = 0;
+
+	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++)
+		if (cache->in_use && cache->dirty)
+			dirty[n++] = cache;
+	if (n > 1)
+		qsort(dirty, n, sizeof(struct unix_cache *), cache_block_cmp);
+	return n;
+}
+
 /*
- * Reuse a particular cache entry for another block.
+ * Write out a run of dirty cache entries for consecutive blocks with
+ * a single request.  If that fails, fall back to writing the blocks
+ * one at a time so the write_error handler sees the failing block.
+ *
+ * The handler is not called for the merged request: a handler which
+ * retries each block with io_channel_write_blk() would only copy it
+ * back into its (still dirty) cache entry, and the run would then be
+ * marked clean without having reached the disk.
+ */
+static errcode_t write_cached_run(io_channel channel,
+				  struct unix_private_data *data,
+				  struct unix_cache **run, int count)
+{
+	errcode_t	retval, retval2 = 0;
+	char		*cp;
+	int		i;
+	errcode_t	(*write_error)(io_channel, unsigned long, int,
+				       const void *, size_t, int, errcode_t);
+
+	if (count > 1) {
+		for (i = 0, cp = data->flush_buf; i < count; i++) {
+			memcpy(cp, run[i]->buf, channel->block_size);
+			cp += channel->block_size;
+		}
+		write_error = channel->write_error;
+		channel->write_error = 0;
+		retval = raw_write_blk(channel, data, run[0]->block, count,
+				       data->flush_buf);
+		channel->write_error = write_error;
+		if (!retval) {
+			for (i = 0; i < count; i++)
+				run[i]->dirty = 0;
+			return 0;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		retval = raw_write_blk(channel, data, run[i]->block, 1,
+				       run[i]->buf);
+		if (retval)
+			retval2 = retval;
+		else
+			run[i]->dirty = 0;
+	}
+	return retval2;
+}
+
+/*
+ * Reuse a particular cache entry for another block.  If the entry is
+ * dirty, it is written out together with any dirty entries for the
+ * blocks adjacent to it.
  */
 static void reuse_cache(io_channel channel, struct unix_private_data *data,
 		 struct unix_cache *cache, unsigned long long block)
 {
-	if (cache->dirty && cache->in_use)
-		raw_write_blk(channel, data, cache->block, 1, cache->buf);
+	struct unix_cache	*dirty[CACHE_SIZE];
+	int			i, start, end, n;
+
+	if (cache->dirty && cache->in_use) {
+		n = sort_dirty_blocks(data, dirty);
+		for (i = 0; i < n && dirty[i] != cache; i++)
+			;
+		for (start = i; start > 0 &&
+			     dirty[start-1]->block + 1 == dirty[start]->block;
+		     start--)
+			;
+		for (end = i + 1; end < n &&
+			     dirty[end-1]->block + 1 == dirty[end]->block;
+		     end++)
+			;
+		write_cached_run(channel, data, dirty + start, end - start);
+	}
 
 	cache->in_use = 1;
 	cache->dirty = 0;
@@ -389,35 +592,32 @@ static void reuse_cache(io_channel channel, struct unix_private_data *data,
 }
 
 /*
- * Flush all of the blocks in the cache
+ * Flush all of the blocks in the cache.  The dirty blocks are written
+ * in block order, and runs of consecutive blocks are merged into a
+ * single write.
  */
 static errcode_t flush_cached_blocks(io_channel channel,
 				     struct unix_private_data *data,
 				     int invalidate)
 
 {
-	struct unix_cache	*cache;
+	struct unix_cache	*cache, *dirty[CACHE_SIZE];
 	errcode_t		retval, retval2;
-	int			i;
+	int			i, j, n;
 
 	retval2 = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		if (!cache->in_use)
-			continue;
-
-		if (invalidate)
-			cache->in_use = 0;
-
-		if (!cache->dirty)
-			continue;
-
-		retval = raw_write_blk(channel, data,
-				       cache->block, 1, cache->buf);
+	n = sort_dirty_blocks(data, dirty);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n; j++)
+			if (dirty[j-1]->block + 1 != dirty[j]->block)
+				break;
+		retval = write_cached_run(channel, data, dirty + i, j - i);
 		if (retval)
 			retval2 = retval;
-		else
-			cache->dirty = 0;
 	}
+	if (invalidate)
+		for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++)
+			cache->in_use = 0;
 	return retval2;
 }
 #endif /* NO_IO_CACHE */
@@ -458,7 +658,7 @@ static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 
 	memset(data, 0, sizeof(struct unix_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
-	data->io_stats.num_fields = 2;
+	io_stats_init(&data->io_stats);
 
 	open_flags = (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY;
 	if (flags & IO_FLAG_EXCLUSIVE)
@@ -491,6 +691,7 @@ static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 	 */
 	data->align = 512;
 #endif
+	io->align = data->align;
 
 
 	if ((retval = alloc_cache(io, data)))
@@ -642,6 +843,7 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 #ifdef DEBUG
 			printf("Using cached block %lu\n", block);
 #endif
+			data->io_stats.cache_hits++;
 			memcpy(cp, cache->buf, channel->block_size);
 			count--;
 			block++;
@@ -653,6 +855,7 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			 * Special case where we read directly into the
 			 * cache buffer; important in the O_DIRECT case
 			 */
+			data->io_stats.cache_misses++;
 			cache = reuse[0];
 			reuse_cache(channel, data, cache, block);
 			if ((retval = raw_read_blk(channel, data, block, 1,
@@ -674,6 +877,7 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 #ifdef DEBUG
 		printf("Reading %d blocks starting at %lu\n", i, block);
 #endif
+		data->io_stats.cache_misses += i;
 		if ((retval = raw_read_blk(channel, data, block, i, cp)))
 			return retval;
 
@@ -690,6 +894,36 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 #endif /* NO_IO_CACHE */
 }
 
+/*
+ * Let the kernel start reading blocks into the page cache, so that a
+ * later read of them does not have to wait.  This does nothing useful
+ * when the device was opened with O_DIRECT.
+ */
+static errcode_t unix_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count)
+{
+#ifdef HAVE_POSIX_FADVISE
+	struct unix_private_data *data;
+	int		retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (data->flags & IO_FLAG_DIRECT_IO)
+		return 0;
+	retval = posix_fadvise(data->dev,
+			       (ext2_loff_t) block * channel->block_size +
+			       data->offset,
+			       (ext2_loff_t) count * channel->block_size,
+			       POSIX_FADV_WILLNEED);
+	return retval;
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
 static errcode_t unix_read_blk(io_channel channel, unsigned long block,
 			       int count, void *buf)
 {
@@ -760,6 +994,7 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 	struct unix_private_data *data;
 	errcode_t	retval = 0;
 	ssize_t		actual;
+	unsigned long long start_time;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
@@ -783,7 +1018,11 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 	if (lseek(data->dev, offset + data->offset, SEEK_SET) < 0)
 		return errno;
 
+	start_time = io_stats_time();
 	actual = write(data->dev, buf, size);
+	io_stats_update(&data->io_stats, &data->next_location, 1,
+			offset + data->offset, (actual > 0) ? actual : 0,
+			start_time);
 	if (actual != size)
 		return EXT2_ET_SHORT_WRITE;
 
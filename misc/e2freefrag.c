@@ -89,54 +89,39 @@ void update_chunk_stats(struct chunk_info *info, unsigned long chunk_size)
 	info->real_free_chunks++;
 }
 
+/*
+ * Walk the free extents of the block bitmap, skipping over used and
+ * free runs a word at a time.  A chunk is counted as free when it lies
+ * entirely within one free extent.
+ */
 void scan_block_bitmap(ext2_filsys fs, struct chunk_info *info)
 {
-	unsigned long long blocks_count = fs->super->s_blocks_count;
-	unsigned long long chunks = (blocks_count + info->blks_in_chunk) >>
-				(info->chunkbits - info->blocksize_bits);
-	unsigned long long chunk_num;
-	unsigned long last_chunk_size = 0;
-	unsigned long long chunk_start_blk = 0;
-	int used;
-
-	for (chunk_num = 0; chunk_num < chunks; chunk_num++) {
-		unsigned long long blk, num_blks;
-		int chunk_free;
-
-		/* Last chunk may be smaller */
-		if (chunk_start_blk + info->blks_in_chunk > blocks_count)
-			num_blks = blocks_count - chunk_start_blk;
-		else
-			num_blks = info->blks_in_chunk;
-
-		chunk_free = 0;
-
-		/* Initialize starting block for first chunk correctly else
-		 * there is a segfault when blocksize = 1024 in which case
-		 * block_map->start = 1 */
-		for (blk = 0; blk < num_blks; blk++, chunk_start_blk++) {
-			if (chunk_num == 0 && blk == 0) {
-				blk = fs->super->s_first_data_block;
-				chunk_start_blk = blk;
-			}
-			used = ext2fs_fast_test_block_bitmap(fs->block_map,
-							     chunk_start_blk);
-			if (!used) {
-				last_chunk_size++;
-				chunk_free++;
-			}
-
-			if (used && last_chunk_size != 0) {
-				update_chunk_stats(info, last_chunk_size);
-				last_chunk_size = 0;
-			}
-		}
-
-		if (chunk_free == info->blks_in_chunk)
-			info->free_chunks++;
+	blk_t last = fs->super->s_blocks_count - 1;
+	blk_t blk = fs->super->s_first_data_block;
+	blk_t start, next;
+	unsigned long long chunk_start, chunk_end;
+
+	while (blk <= last) {
+		if (ext2fs_find_first_zero_block_bitmap(fs->block_map, blk,
+							last, &start))
+			break;
+		if (ext2fs_find_first_set_block_bitmap(fs->block_map, start,
+						       last, &next))
+			next = last + 1;
+		update_chunk_stats(info, next - start);
+
+		/* Chunks are aligned to their size, from block 0 */
+		chunk_start = ((unsigned long long) start +
+			       info->blks_in_chunk - 1) /
+			info->blks_in_chunk;
+		chunk_end = (unsigned long long) next / info->blks_in_chunk;
+		if (chunk_end > chunk_start)
+			info->free_chunks += chunk_end - chunk_start;
+
+		if (next > last)
+			break;
+		blk = next + 1;
 	}
-	if (last_chunk_size != 0)
-		update_chunk_stats(info, last_chunk_size);
 }
 
 errcode_t get_chunk_info(ext2_filsys fs, struct chunk_info *info)
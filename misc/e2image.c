@@ -410,9 +410,9 @@ static void output_meta_data_blocks(ext2_filsys fs, int fd)
 	char		*buf, *zero_buf;
 	int		sparse = 0;
 
-	buf = malloc(fs->blocksize);
-	if (!buf) {
-		com_err(program_name, ENOMEM, "while allocating buffer");
+	retval = ext2fs_get_io_buffer(fs->io, fs->blocksize, &buf);
+	if (retval) {
+		com_err(program_name, retval, "while allocating buffer");
 		exit(1);
 	}
 	zero_buf = malloc(fs->blocksize);
@@ -453,7 +453,7 @@ static void output_meta_data_blocks(ext2_filsys fs, int fd)
 	if (sparse)
 		write_block(fd, zero_buf, sparse-1, 1, -1);
 	free(zero_buf);
-	free(buf);
+	ext2fs_free_mem(&buf);
 }
 
 static void write_raw_image_file(ext2_filsys fs, int fd, int scramble_flag)
@@ -490,9 +490,9 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int scramble_flag)
 		exit(1);
 	}
 
-	block_buf = malloc(fs->blocksize * 3);
-	if (!block_buf) {
-		com_err(program_name, 0, "Can't allocate block buffer");
+	retval = ext2fs_get_io_buffer(fs->io, fs->blocksize * 3, &block_buf);
+	if (retval) {
+		com_err(program_name, retval, "while allocating block buffer");
 		exit(1);
 	}
 
@@ -555,7 +555,7 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int scramble_flag)
 	}
 	use_inode_shortcuts(fs, 0);
 	output_meta_data_blocks(fs, fd);
-	free(block_buf);
+	ext2fs_free_mem(&block_buf);
 }
 
 static void install_image(char *device, char *image_fn, int raw_flag)
@@ -573,7 +573,8 @@ static void install_image(char *device, char *image_fn, int raw_flag)
 	}
 
 #ifdef CONFIG_TESTIO_DEBUG
-	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
+	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK") ||
+	    getenv("TEST_IO_TRACE")) {
 		io_ptr = test_io_manager;
 		test_io_backing_manager = unix_io_manager;
 	} else
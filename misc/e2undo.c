@@ -12,17 +12,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
 #include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #if HAVE_ERRNO_H
 #include <errno.h>
 #endif
 #include "ext2fs/tdb.h"
 #include "ext2fs/ext2fs.h"
+#include "ext2fs/undo_log.h"
 #include "nls-enable.h"
 
+/* Largest write issued when replaying adjacent runs from an undo log */
+#define REPLAY_BATCH_SIZE	(4 * 1024 * 1024)
+
 unsigned char mtime_key[] = "filesystem MTIME";
 unsigned char uuid_key[] = "filesystem UUID";
 unsigned char blksize_key[] = "filesystem BLKSIZE";
@@ -118,6 +127,215 @@ static int set_blk_size(TDB_CONTEXT *tdb, io_channel channel)
 	return 0;
 }
 
+static int read_log(int fd, ext2_loff_t offset, void *buf,
+		    unsigned long size)
+{
+	ssize_t	actual;
+
+	if (ext2fs_llseek(fd, offset, SEEK_SET) != offset)
+		return -1;
+	actual = read(fd, buf, size);
+	if (actual < 0 || (unsigned long) actual != size)
+		return -1;
+	return 0;
+}
+
+static int check_log_filesystem(struct undo_log_header *hdr,
+				io_channel channel)
+{
+	errcode_t retval;
+	struct ext2_super_block super;
+
+	if (!(hdr->flags & UNDO_LOG_FL_COMPLETE)) {
+		com_err(prg_name, 0,
+			_("The undo log was not closed properly; "
+			  "use -f to replay it anyway\n"));
+		return -1;
+	}
+
+	io_channel_set_blksize(channel, SUPERBLOCK_OFFSET);
+	retval = io_channel_read_blk(channel, 1, -SUPERBLOCK_SIZE, &super);
+	if (retval) {
+		com_err(prg_name,
+			retval, _("Failed to read the file system data \n"));
+		return retval;
+	}
+
+	if (super.s_mtime != hdr->fs_mtime) {
+		com_err(prg_name, 0,
+			_("The file system Mount time didn't match %u\n"),
+			hdr->fs_mtime);
+		return -1;
+	}
+	if (memcmp(hdr->fs_uuid, super.s_uuid, sizeof(hdr->fs_uuid))) {
+		com_err(prg_name, 0,
+			_("The file system UUID didn't match \n"));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the index of the undo log.  If the log was never closed, the
+ * index wasn't written, so rebuild it by walking the record headers.
+ */
+static int load_log_index(int fd, struct undo_log_header *hdr,
+			  struct undo_log_index **ret_index,
+			  unsigned long *ret_count)
+{
+	struct undo_log_index	*index = 0;
+	struct undo_log_record	rec;
+	unsigned long		count = 0, size = 0;
+	ext2_loff_t		offset;
+	struct stat		st;
+
+	if (hdr->flags & UNDO_LOG_FL_COMPLETE) {
+		count = hdr->index_count;
+		if (ext2fs_get_array(count ? count : 1,
+				     sizeof(struct undo_log_index), &index))
+			return -1;
+		if (read_log(fd, hdr->index_offset, index,
+			     count * sizeof(struct undo_log_index))) {
+			com_err(prg_name, errno,
+				_("while reading the undo log index\n"));
+			ext2fs_free_mem(&index);
+			return -1;
+		}
+		*ret_index = index;
+		*ret_count = count;
+		return 0;
+	}
+
+	/*
+	 * The last record may have been cut short by a crash; stop at
+	 * the last one whose header and data are both in the file.
+	 */
+	if (fstat(fd, &st) < 0) {
+		com_err(prg_name, errno, _("while reading the undo log\n"));
+		return -1;
+	}
+	offset = UNDO_LOG_DATA_START;
+	while (offset + (ext2_loff_t) sizeof(rec) <= st.st_size &&
+	       read_log(fd, offset, &rec, sizeof(rec)) == 0 &&
+	       rec.magic == UNDO_LOG_REC_MAGIC && rec.count &&
+	       rec.length <= (__u64) rec.count * hdr->block_size &&
+	       offset + (ext2_loff_t) (sizeof(rec) + rec.length) <=
+	       st.st_size) {
+		if (count >= size) {
+			size = size ? size * 2 : 256;
+			if (ext2fs_resize_mem(count *
+					      sizeof(struct undo_log_index),
+					      size *
+					      sizeof(struct undo_log_index),
+					      &index)) {
+				if (index)
+					ext2fs_free_mem(&index);
+				return -1;
+			}
+		}
+		index[count].block = rec.block;
+		index[count].offset = offset + sizeof(rec);
+		index[count].count = rec.count;
+		index[count].length = rec.length;
+		count++;
+		offset += sizeof(rec) + rec.length;
+	}
+	if (offset < st.st_size)
+		com_err(prg_name, 0,
+			_("Ignoring %llu bytes of incomplete data at the end "
+			  "of the undo log\n"),
+			(unsigned long long) (st.st_size - offset));
+	*ret_index = index;
+	*ret_count = count;
+	return 0;
+}
+
+static EXT2_QSORT_TYPE index_block_cmp(const void *a, const void *b)
+{
+	const struct undo_log_index *ia = (const struct undo_log_index *) a;
+	const struct undo_log_index *ib = (const struct undo_log_index *) b;
+
+	if (ia->block < ib->block)
+		return -1;
+	return (ia->block > ib->block);
+}
+
+/*
+ * Replay the undo log in block order.  Runs which are adjacent on the
+ * device are written back with a single request.
+ */
+static int replay_undo_log(int fd, struct undo_log_header *hdr,
+			   io_channel channel, int force)
+{
+	struct undo_log_index	*index;
+	unsigned long		count, i, j, k, len, buf_size = 0;
+	char			*buf = 0;
+	errcode_t		retval;
+	int			ret = -1;
+
+	if (hdr->version != UNDO_LOG_VERSION) {
+		com_err(prg_name, 0,
+			_("Unsupported undo log version %u\n"), hdr->version);
+		return -1;
+	}
+	if (!force && check_log_filesystem(hdr, channel))
+		return -1;
+	if (!hdr->block_size)
+		return 0;
+	io_channel_set_blksize(channel, hdr->block_size);
+
+	if (load_log_index(fd, hdr, &index, &count))
+		return -1;
+	qsort(index, count, sizeof(struct undo_log_index), index_block_cmp);
+
+	for (i = 0; i < count; i = j) {
+		len = index[i].length;
+		for (j = i + 1; j < count; j++) {
+			if (index[j-1].length !=
+			    index[j-1].count * hdr->block_size ||
+			    index[j].block !=
+			    index[j-1].block + index[j-1].count ||
+			    len + index[j].length > REPLAY_BATCH_SIZE)
+				break;
+			len += index[j].length;
+		}
+		if (!len)
+			continue;
+		if (len > buf_size) {
+			if (ext2fs_resize_mem(buf_size, len, &buf)) {
+				com_err(prg_name, EXT2_ET_NO_MEMORY,
+					_("while allocating replay buffer\n"));
+				goto out;
+			}
+			buf_size = len;
+		}
+		for (len = 0, k = i; k < j; k++) {
+			if (read_log(fd, index[k].offset, buf + len,
+				     index[k].length)) {
+				com_err(prg_name, errno,
+					_("while reading the undo log\n"));
+				goto out;
+			}
+			len += index[k].length;
+		}
+		printf(_("Replayed transaction of size %zd at location %lu\n"),
+		       (ssize_t) len, (unsigned long) index[i].block);
+		retval = io_channel_write_blk64(channel, index[i].block, -len,
+						buf);
+		if (retval) {
+			com_err(prg_name, retval, _("Failed write %s\n"),
+				strerror(errno));
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	ext2fs_free_mem(&index);
+	if (buf)
+		ext2fs_free_mem(&buf);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	int c,force = 0;
@@ -129,6 +347,8 @@ int main(int argc, char *argv[])
 	unsigned long  blk_num;
 	char *device_name, *tdb_file;
 	io_manager manager = unix_io_manager;
+	struct undo_log_header log_hdr;
+	int log_fd;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -155,12 +375,23 @@ int main(int argc, char *argv[])
 	tdb_file = argv[optind];
 	device_name = argv[optind+1];
 
-	tdb = tdb_open(tdb_file, 0, 0, O_RDONLY, 0600);
-
-	if (!tdb) {
-		com_err(prg_name, errno,
-				_("Failed tdb_open %s\n"), tdb_file);
-		exit(1);
+	/* Undo logs are recognized by their magic; anything else is a tdb */
+	log_fd = open(tdb_file, O_RDONLY);
+	if (log_fd >= 0 &&
+	    read(log_fd, &log_hdr, sizeof(log_hdr)) == sizeof(log_hdr) &&
+	    !memcmp(log_hdr.magic, UNDO_LOG_MAGIC, UNDO_LOG_MAGIC_LEN)) {
+		tdb = 0;
+	} else {
+		if (log_fd >= 0)
+			close(log_fd);
+		log_fd = -1;
+		tdb = tdb_open(tdb_file, 0, 0, O_RDONLY, 0600);
+
+		if (!tdb) {
+			com_err(prg_name, errno,
+					_("Failed tdb_open %s\n"), tdb_file);
+			exit(1);
+		}
 	}
 
 	retval = ext2fs_check_if_mounted(device_name, &mount_flags);
@@ -184,6 +415,14 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (log_fd >= 0) {
+		if (replay_undo_log(log_fd, &log_hdr, channel, force))
+			exit(1);
+		io_channel_close(channel);
+		close(log_fd);
+		return 0;
+	}
+
 	if (!force && check_filesystem(tdb, channel)) {
 		exit(1);
 	}
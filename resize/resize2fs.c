@@ -51,7 +51,6 @@ static errcode_t fix_resize_inode(ext2_filsys fs);
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_INODE
 static errcode_t fix_exclude_inode(ext2_filsys fs);
 #endif
-static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs);
 static errcode_t fix_sb_journal_backup(ext2_filsys fs);
 
 /*
@@ -172,6 +171,17 @@ errcode_t resize_fs(ext2_filsys fs, blk_t *new_size, int flags,
 	if (retval)
 		goto errout;
 
+#ifdef RESIZE2FS_DEBUG
+	/* The I/O channel is still held open by the old fs handle */
+	if ((rfs->flags & RESIZE_DEBUG_IO) &&
+	    rfs->old_fs->io->manager->get_stats) {
+		io_stats stats = 0;
+
+		rfs->old_fs->io->manager->get_stats(rfs->old_fs->io, &stats);
+		io_stats_print(stdout, "", stats, NULL, 1);
+	}
+#endif
+
 	rfs->flags = flags;
 
 	ext2fs_free(rfs->old_fs);
@@ -1342,6 +1352,7 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 
 	retval = ext2fs_open_inode_scan(rfs->old_fs, 0, &scan);
 	if (retval) goto errout;
+	ext2fs_inode_scan_flags(scan, EXT2_SF_READAHEAD, 0);
 
 	retval = ext2fs_init_dblist(rfs->old_fs, 0);
 	if (retval) goto errout;
@@ -1784,111 +1795,6 @@ static errcode_t fix_exclude_inode(ext2_filsys fs)
 }
 
 #endif
-/*
- * Finally, recalculate the summary information
- */
-static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
-{
-	blk_t		blk;
-	ext2_ino_t	ino;
-	unsigned int	group = 0;
-	unsigned int	count = 0;
-	int		total_free = 0;
-	int		group_free = 0;
-	int		uninit = 0;
-	blk_t		super_blk, old_desc_blk, new_desc_blk;
-	int		old_desc_blocks;
-
-	/*
-	 * First calculate the block statistics
-	 */
-	uninit = fs->group_desc[group].bg_flags & EXT2_BG_BLOCK_UNINIT;
-	ext2fs_super_and_bgd_loc(fs, group, &super_blk, &old_desc_blk,
-				 &new_desc_blk, 0);
-	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
-		old_desc_blocks = fs->super->s_first_meta_bg;
-	else
-		old_desc_blocks = fs->desc_blocks +
-			fs->super->s_reserved_gdt_blocks;
-	for (blk = fs->super->s_first_data_block;
-	     blk < fs->super->s_blocks_count; blk++) {
-		if ((uninit &&
-		     !((blk == super_blk) ||
-		       ((old_desc_blk && old_desc_blocks &&
-			 (blk >= old_desc_blk) &&
-			 (blk < old_desc_blk + old_desc_blocks))) ||
-		       ((new_desc_blk && (blk == new_desc_blk))) ||
-		       (blk == fs->group_desc[group].bg_block_bitmap) ||
-		       (blk == fs->group_desc[group].bg_inode_bitmap) ||
-		       ((blk >= fs->group_desc[group].bg_inode_table &&
-			 (blk < fs->group_desc[group].bg_inode_table
-			  + fs->inode_blocks_per_group))))) ||
-		    (!ext2fs_fast_test_block_bitmap(fs->block_map, blk))) {
-			group_free++;
-			total_free++;
-		}
-		count++;
-		if ((count == fs->super->s_blocks_per_group) ||
-		    (blk == fs->super->s_blocks_count-1)) {
-			fs->group_desc[group].bg_free_blocks_count =
-				group_free;
-			ext2fs_group_desc_csum_set(fs, group);
-			group++;
-			if (group >= fs->group_desc_count)
-				break;
-			count = 0;
-			group_free = 0;
-			uninit = (fs->group_desc[group].bg_flags &
-				  EXT2_BG_BLOCK_UNINIT);
-			ext2fs_super_and_bgd_loc(fs, group, &super_blk,
-						 &old_desc_blk,
-						 &new_desc_blk, 0);
-			if (fs->super->s_feature_incompat &
-			    EXT2_FEATURE_INCOMPAT_META_BG)
-				old_desc_blocks = fs->super->s_first_meta_bg;
-			else
-				old_desc_blocks = fs->desc_blocks +
-					fs->super->s_reserved_gdt_blocks;
-		}
-	}
-	fs->super->s_free_blocks_count = total_free;
-
-	/*
-	 * Next, calculate the inode statistics
-	 */
-	group_free = 0;
-	total_free = 0;
-	count = 0;
-	group = 0;
-
-	/* Protect loop from wrap-around if s_inodes_count maxed */
-	uninit = fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT;
-	for (ino = 1; ino <= fs->super->s_inodes_count && ino > 0; ino++) {
-		if (uninit ||
-		    !ext2fs_fast_test_inode_bitmap(fs->inode_map, ino)) {
-			group_free++;
-			total_free++;
-		}
-		count++;
-		if ((count == fs->super->s_inodes_per_group) ||
-		    (ino == fs->super->s_inodes_count)) {
-			fs->group_desc[group].bg_free_inodes_count =
-				group_free;
-			ext2fs_group_desc_csum_set(fs, group);
-			group++;
-			if (group >= fs->group_desc_count)
-				break;
-			count = 0;
-			group_free = 0;
-			uninit = (fs->group_desc[group].bg_flags &
-				  EXT2_BG_INODE_UNINIT);
-		}
-	}
-	fs->super->s_free_inodes_count = total_free;
-	ext2fs_mark_super_dirty(fs);
-	return 0;
-}
-
 /*
  *  Journal may have been relocated; update the backup journal blocks
  *  in the superblock.
@@ -74,6 +74,10 @@ void do_create_icount(int argc, char **argv)
 		flags |= EXT2_ICOUNT_OPT_INCREMENT;
 		argv++; argc--;
 	}
+	if (argc && !strcmp("-f", *argv)) {
+		flags |= EXT2_ICOUNT_OPT_FULLMAP;
+		argv++; argc--;
+	}
 	if (argc) {
 		if (parse_inode(progname, "icount size", argv[0], &size))
 			return;